@@ -441,6 +441,12 @@ public class PpnOptions {
       builder.setDatapathProtocol(KryptonConfig.DatapathProtocol.BRIDGE);
     }
 
+    // IpSecManager only supports ChaCha20-Poly1305 from Android S.
+    if (builder.getDatapathProtocol() == KryptonConfig.DatapathProtocol.IPSEC
+        && Build.VERSION.SDK_INT < Build.VERSION_CODES.S) {
+      builder.setIpsecChacha20Poly1305Unsupported(true);
+    }
+
     if (getBridgeKeyLength().isPresent()) {
       builder.setCipherSuiteKeyLength(getBridgeKeyLength().get());
     }
@@ -22,9 +22,12 @@ import android.net.IpSecManager.SecurityParameterIndex;
 import android.net.IpSecManager.SpiUnavailableException;
 import android.net.IpSecTransform;
 import android.os.Build;
+import android.os.Handler;
+import android.os.Looper;
 import android.os.ParcelFileDescriptor;
 import android.util.Log;
 import androidx.annotation.Nullable;
+import androidx.annotation.VisibleForTesting;
 import com.google.android.libraries.privacy.ppn.internal.IpSecTransformParams;
 import com.google.android.libraries.privacy.ppn.internal.NetworkInfo.AddressFamily;
 import com.google.android.libraries.privacy.ppn.xenon.PpnNetwork;
@@ -34,39 +37,94 @@ import java.io.IOException;
 import java.net.DatagramSocket;
 import java.net.InetAddress;
 import java.net.UnknownHostException;
+import java.time.Duration;
+import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.List;
 
 /** Implementation of KryptonIpSecHelper. */
 public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
   private static final String TAG = "KryptonIpSecHelperImpl";
 
+  // How long the inbound SA replaced by a rekey keeps decrypting packets the server sent before it
+  // switched keys. Matches the grace period of the userspace IPsec datapath.
+  @VisibleForTesting static final Duration REKEY_GRACE_PERIOD = Duration.ofSeconds(30);
+
+  /** Builds transport mode transforms. Replaced in tests, where IpSecService isn't available. */
+  @VisibleForTesting
+  interface TransformBuilder {
+    IpSecTransform build(
+        InetAddress address,
+        SecurityParameterIndex spi,
+        IpSecAlgorithm algorithm,
+        @Nullable IpSecManager.UdpEncapsulationSocket encapsulationSocket,
+        int remotePort)
+        throws ResourceUnavailableException, SpiUnavailableException, IOException;
+  }
+
+  /** An inbound SA that was replaced by a rekey, but is kept until the grace period is over. */
+  private static final class RetiredInboundSa {
+    private final SecurityParameterIndex spi;
+    private final IpSecTransform transform;
+
+    RetiredInboundSa(SecurityParameterIndex spi, IpSecTransform transform) {
+      this.spi = spi;
+      this.transform = transform;
+    }
+
+    void close() {
+      transform.close();
+      spi.close();
+    }
+  }
+
   private final Context context;
   private final Xenon xenon;
 
   private final IpSecManager ipSecManager;
+  private final TransformBuilder transformBuilder;
+  private final Handler handler = new Handler(Looper.getMainLooper());
   @Nullable private SecurityParameterIndex uplinkSpi = null;
   @Nullable private SecurityParameterIndex downlinkSpi = null;
   @Nullable private IpSecTransform inTransform = null;
   @Nullable private IpSecTransform outTransform = null;
   @Nullable private IpSecManager.UdpEncapsulationSocket encapsulationSocket = null;
   @Nullable private KryptonKeepaliveHelper keepaliveHelper = null;
+  // The fd the current transforms are applied to, or -1 if there are none.
+  private int networkFd = -1;
+  private final List<RetiredInboundSa> retiredInboundSas = new ArrayList<>();
 
   // A lock guarding all of the mutable state of this class.
   private final Object lock = new Object();
 
   public KryptonIpSecHelperImpl(Context context, Xenon xenon) {
+    this(
+        context,
+        xenon,
+        (IpSecManager) context.getSystemService(Context.IPSEC_SERVICE),
+        (address, spi, algorithm, encapsulationSocket, remotePort) -> {
+          IpSecTransform.Builder builder =
+              new IpSecTransform.Builder(context).setAuthenticatedEncryption(algorithm);
+          if (encapsulationSocket != null) {
+            builder = builder.setIpv4Encapsulation(encapsulationSocket, remotePort);
+          }
+          return builder.buildTransportModeTransform(address, spi);
+        });
+  }
+
+  @VisibleForTesting
+  KryptonIpSecHelperImpl(
+      Context context, Xenon xenon, IpSecManager ipSecManager, TransformBuilder transformBuilder) {
     this.context = context;
-    this.ipSecManager = (IpSecManager) context.getSystemService(Context.IPSEC_SERVICE);
+    this.ipSecManager = ipSecManager;
     this.xenon = xenon;
+    this.transformBuilder = transformBuilder;
   }
 
   /** Closes any objects allocated for the IpSecManager. */
   private void close() {
     synchronized (lock) {
-      if (uplinkSpi != null) {
-        uplinkSpi.close();
-        uplinkSpi = null;
-      }
+      closeOutboundSa();
       if (downlinkSpi != null) {
         downlinkSpi.close();
         downlinkSpi = null;
@@ -75,10 +133,12 @@ public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
         inTransform.close();
         inTransform = null;
       }
-      if (outTransform != null) {
-        outTransform.close();
-        outTransform = null;
+      handler.removeCallbacksAndMessages(null);
+      for (RetiredInboundSa sa : retiredInboundSas) {
+        sa.close();
       }
+      retiredInboundSas.clear();
+      networkFd = -1;
       if (keepaliveHelper != null) {
         keepaliveHelper.stopKeepalive();
       }
@@ -93,6 +153,45 @@ public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
     }
   }
 
+  private void closeOutboundSa() {
+    synchronized (lock) {
+      if (outTransform != null) {
+        outTransform.close();
+        outTransform = null;
+      }
+      if (uplinkSpi != null) {
+        uplinkSpi.close();
+        uplinkSpi = null;
+      }
+    }
+  }
+
+  /**
+   * Keeps the current inbound SA in the kernel for the grace period, so that packets the server
+   * sent with the old keys can still be decrypted after a rekey.
+   */
+  private void retireInboundSa() {
+    synchronized (lock) {
+      if (inTransform == null || downlinkSpi == null) {
+        return;
+      }
+      RetiredInboundSa sa = new RetiredInboundSa(downlinkSpi, inTransform);
+      inTransform = null;
+      downlinkSpi = null;
+      retiredInboundSas.add(sa);
+      handler.postDelayed(
+          () -> {
+            synchronized (lock) {
+              if (retiredInboundSas.remove(sa)) {
+                Log.w(TAG, "Closing inbound SA retired by a rekey.");
+                sa.close();
+              }
+            }
+          },
+          REKEY_GRACE_PERIOD.toMillis());
+    }
+  }
+
   @Override
   public void transformFd(IpSecTransformParams params, Runnable keepaliveStartCallback)
       throws KryptonException {
@@ -119,8 +218,12 @@ public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
     }
 
     synchronized (lock) {
-      // If any of these members are already set, clear them.
-      close();
+      // A rekey applies new transforms to the socket that already has some. Otherwise, any members
+      // that are already set belong to an old socket, so clear them.
+      boolean isRekey = inTransform != null && networkFd == params.getNetworkFd();
+      if (!isRekey) {
+        close();
+      }
 
       // Temporarily give ownership of the fd to a ParcelFileDescriptor so that we can pass it to
       // the VpnService APIs.
@@ -131,40 +234,55 @@ public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
         if (params.getUplinkSpi() == 0) {
           throw new KryptonException("missing uplink spi");
         }
-        uplinkSpi =
-            ipSecManager.allocateSecurityParameterIndex(destinationAddress, params.getUplinkSpi());
-
         // downlink SPI is the local SPI.
         if (params.getDownlinkSpi() == 0) {
           throw new KryptonException("missing downlink spi");
         }
-        downlinkSpi =
-            ipSecManager.allocateSecurityParameterIndex(localAddress, params.getDownlinkSpi());
 
-        if (params.getDestinationAddressFamily() == AddressFamily.V4) {
+        // A rekey keeps the encapsulation socket, so the old inbound SA still matches the packets
+        // the server sends before it switches keys.
+        if (!isRekey && params.getDestinationAddressFamily() == AddressFamily.V4) {
           encapsulationSocket = ipSecManager.openUdpEncapsulationSocket();
         }
 
-        outTransform =
-            buildTransform(
-                localAddress,
-                uplinkSpi,
-                getKeyingMaterial(params.getUplinkKey(), params.getUplinkSalt()),
-                params.getDestinationPort());
-
+        // The new inbound SA is set up before the old one is retired, so that packets encrypted
+        // with either key are accepted during the rekey.
+        if (isRekey) {
+          retireInboundSa();
+        }
+        networkFd = params.getNetworkFd();
+        downlinkSpi =
+            ipSecManager.allocateSecurityParameterIndex(localAddress, params.getDownlinkSpi());
         inTransform =
             buildTransform(
                 destinationAddress,
                 downlinkSpi,
                 getKeyingMaterial(params.getDownlinkKey(), params.getDownlinkSalt()),
+                params.getCipherSuite(),
                 params.getDestinationPort());
-
         ipSecManager.applyTransportModeTransform(
             fd.getFileDescriptor(), IpSecManager.DIRECTION_IN, inTransform);
+
+        // The uplink SPI is the session ID, so it doesn't change across rekeys. The kernel can't
+        // hold two SAs with the same SPI and destination, so the old outbound SA has to be closed
+        // before the new one is allocated. The new one is applied right after.
+        closeOutboundSa();
+        uplinkSpi =
+            ipSecManager.allocateSecurityParameterIndex(destinationAddress, params.getUplinkSpi());
+        outTransform =
+            buildTransform(
+                localAddress,
+                uplinkSpi,
+                getKeyingMaterial(params.getUplinkKey(), params.getUplinkSalt()),
+                params.getCipherSuite(),
+                params.getDestinationPort());
         ipSecManager.applyTransportModeTransform(
             fd.getFileDescriptor(), IpSecManager.DIRECTION_OUT, outTransform);
 
-        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.Q && encapsulationSocket != null) {
+        // The keepalive is already running on the encapsulation socket after a rekey.
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.Q
+            && encapsulationSocket != null
+            && !isRekey) {
           if (keepaliveHelper == null) {
             keepaliveHelper = new KryptonKeepaliveHelperImpl(context);
           }
@@ -222,18 +340,30 @@ public final class KryptonIpSecHelperImpl implements KryptonIpSecHelper {
   }
 
   private IpSecTransform buildTransform(
-      InetAddress address, SecurityParameterIndex spi, byte[] keyMaterial, int remotePort)
-      throws ResourceUnavailableException, SpiUnavailableException, IOException {
+      InetAddress address,
+      SecurityParameterIndex spi,
+      byte[] keyMaterial,
+      IpSecTransformParams.CipherSuite cipherSuite,
+      int remotePort)
+      throws KryptonException,
+          ResourceUnavailableException,
+          SpiUnavailableException,
+          IOException {
     IpSecAlgorithm algorithm =
-        new IpSecAlgorithm(IpSecAlgorithm.AUTH_CRYPT_AES_GCM, keyMaterial, 128);
-    IpSecTransform.Builder builder =
-        new IpSecTransform.Builder(context).setAuthenticatedEncryption(algorithm);
+        new IpSecAlgorithm(getAlgorithmName(cipherSuite), keyMaterial, 128);
+    return transformBuilder.build(address, spi, algorithm, encapsulationSocket, remotePort);
+  }
 
-    if (encapsulationSocket != null) {
-      builder = builder.setIpv4Encapsulation(encapsulationSocket, remotePort);
+  private static String getAlgorithmName(IpSecTransformParams.CipherSuite cipherSuite)
+      throws KryptonException {
+    if (cipherSuite == IpSecTransformParams.CipherSuite.CHACHA20_POLY1305) {
+      if (Build.VERSION.SDK_INT < Build.VERSION_CODES.S) {
+        throw new KryptonException("ChaCha20-Poly1305 requires Android S or later.");
+      }
+      return IpSecAlgorithm.AUTH_CRYPT_CHACHA20_POLY1305;
     }
-
-    return builder.buildTransportModeTransform(address, spi);
+    // Both AES-GCM key lengths use the same algorithm, distinguished by key size.
+    return IpSecAlgorithm.AUTH_CRYPT_AES_GCM;
   }
 
   private static byte[] getKeyingMaterial(ByteString keyByteString, ByteString saltByteString) {
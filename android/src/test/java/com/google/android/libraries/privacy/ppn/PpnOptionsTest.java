@@ -18,12 +18,14 @@ import static com.google.common.truth.Truth.assertThat;
 import static com.google.common.truth.Truth8.assertThat;
 import static org.junit.Assert.assertThrows;
 
+import android.os.Build;
 import com.google.android.libraries.privacy.ppn.internal.KryptonConfig;
 import java.time.Duration;
 import java.util.Arrays;
 import org.junit.Test;
 import org.junit.runner.RunWith;
 import org.robolectric.RobolectricTestRunner;
+import org.robolectric.annotation.Config;
 
 /** Unit tests for {@link PpnOptions}. */
 @RunWith(RobolectricTestRunner.class)
@@ -765,6 +767,28 @@ public class PpnOptionsTest {
     assertThat(config.getDatapathProtocol()).isEqualTo(KryptonConfig.DatapathProtocol.IPSEC);
   }
 
+  @Test
+  @Config(sdk = Build.VERSION_CODES.R)
+  public void createKryptonConfig_ipsecBeforeS_marksChaChaUnsupported() {
+    PpnOptions options =
+        new PpnOptions.Builder().setDatapathProtocol(PpnOptions.DatapathProtocol.IPSEC).build();
+
+    KryptonConfig config = options.createKryptonConfigBuilder().build();
+
+    assertThat(config.getIpsecChacha20Poly1305Unsupported()).isTrue();
+  }
+
+  @Test
+  @Config(sdk = Build.VERSION_CODES.S)
+  public void createKryptonConfig_ipsecOnS_allowsChaCha() {
+    PpnOptions options =
+        new PpnOptions.Builder().setDatapathProtocol(PpnOptions.DatapathProtocol.IPSEC).build();
+
+    KryptonConfig config = options.createKryptonConfigBuilder().build();
+
+    assertThat(config.hasIpsecChacha20Poly1305Unsupported()).isFalse();
+  }
+
   @Test
   public void createKryptonConfig_bridgeProtocolInPpnOptions() {
     PpnOptions options =
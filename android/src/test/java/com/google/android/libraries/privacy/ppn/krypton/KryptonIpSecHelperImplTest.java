@@ -0,0 +1,159 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package com.google.android.libraries.privacy.ppn.krypton;
+
+import static org.mockito.ArgumentMatchers.any;
+import static org.mockito.ArgumentMatchers.anyInt;
+import static org.mockito.ArgumentMatchers.anyString;
+import static org.mockito.ArgumentMatchers.eq;
+import static org.mockito.Mockito.doReturn;
+import static org.mockito.Mockito.inOrder;
+import static org.mockito.Mockito.never;
+import static org.mockito.Mockito.verify;
+import static org.mockito.Mockito.when;
+import static org.robolectric.Shadows.shadowOf;
+
+import android.net.IpSecManager;
+import android.net.IpSecManager.SecurityParameterIndex;
+import android.net.IpSecTransform;
+import android.net.Network;
+import android.os.Looper;
+import androidx.test.core.app.ApplicationProvider;
+import androidx.test.ext.junit.runners.AndroidJUnit4;
+import com.google.android.libraries.privacy.ppn.internal.IpSecTransformParams;
+import com.google.android.libraries.privacy.ppn.internal.NetworkInfo.AddressFamily;
+import com.google.android.libraries.privacy.ppn.xenon.PpnNetwork;
+import com.google.android.libraries.privacy.ppn.xenon.Xenon;
+import com.google.protobuf.ByteString;
+import java.io.FileDescriptor;
+import java.net.InetAddress;
+import java.time.Duration;
+import org.junit.Before;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+import org.mockito.InOrder;
+import org.mockito.Mock;
+import org.mockito.junit.MockitoJUnit;
+import org.mockito.junit.MockitoRule;
+
+@RunWith(AndroidJUnit4.class)
+public final class KryptonIpSecHelperImplTest {
+  private static final long NETWORK_ID = 1;
+  private static final int NETWORK_FD = 42;
+  private static final int UPLINK_SPI = 100;
+
+  @Rule public final MockitoRule mocks = MockitoJUnit.rule();
+  @Mock private Xenon mockXenon;
+  @Mock private PpnNetwork mockPpnNetwork;
+  @Mock private Network mockNetwork;
+  @Mock private IpSecManager mockIpSecManager;
+  @Mock private KryptonIpSecHelperImpl.TransformBuilder mockTransformBuilder;
+  @Mock private SecurityParameterIndex oldUplinkSpi;
+  @Mock private SecurityParameterIndex oldDownlinkSpi;
+  @Mock private SecurityParameterIndex newUplinkSpi;
+  @Mock private SecurityParameterIndex newDownlinkSpi;
+  @Mock private IpSecTransform oldOutTransform;
+  @Mock private IpSecTransform oldInTransform;
+  @Mock private IpSecTransform newOutTransform;
+  @Mock private IpSecTransform newInTransform;
+
+  private KryptonIpSecHelperImpl ipSecHelper;
+
+  @Before
+  public void setUp() throws Exception {
+    InetAddress loopback = InetAddress.getLoopbackAddress();
+    when(mockXenon.getNetwork(NETWORK_ID)).thenReturn(mockPpnNetwork);
+    when(mockPpnNetwork.getNetwork()).thenReturn(mockNetwork);
+    when(mockNetwork.getByName(anyString())).thenReturn(loopback);
+
+    when(mockIpSecManager.allocateSecurityParameterIndex(any(), eq(UPLINK_SPI)))
+        .thenReturn(oldUplinkSpi, newUplinkSpi);
+    when(mockIpSecManager.allocateSecurityParameterIndex(any(), eq(1))).thenReturn(oldDownlinkSpi);
+    when(mockIpSecManager.allocateSecurityParameterIndex(any(), eq(2))).thenReturn(newDownlinkSpi);
+    doReturn(oldOutTransform)
+        .when(mockTransformBuilder)
+        .build(any(), eq(oldUplinkSpi), any(), any(), anyInt());
+    doReturn(oldInTransform)
+        .when(mockTransformBuilder)
+        .build(any(), eq(oldDownlinkSpi), any(), any(), anyInt());
+    doReturn(newOutTransform)
+        .when(mockTransformBuilder)
+        .build(any(), eq(newUplinkSpi), any(), any(), anyInt());
+    doReturn(newInTransform)
+        .when(mockTransformBuilder)
+        .build(any(), eq(newDownlinkSpi), any(), any(), anyInt());
+
+    ipSecHelper =
+        new KryptonIpSecHelperImpl(
+            ApplicationProvider.getApplicationContext(),
+            mockXenon,
+            mockIpSecManager,
+            mockTransformBuilder);
+  }
+
+  private static IpSecTransformParams createParams(int downlinkSpi) {
+    return IpSecTransformParams.newBuilder()
+        .setNetworkId(NETWORK_ID)
+        .setNetworkFd(NETWORK_FD)
+        .setUplinkSpi(UPLINK_SPI)
+        .setDownlinkSpi(downlinkSpi)
+        .setUplinkKey(ByteString.copyFrom(new byte[16]))
+        .setDownlinkKey(ByteString.copyFrom(new byte[16]))
+        .setUplinkSalt(ByteString.copyFrom(new byte[4]))
+        .setDownlinkSalt(ByteString.copyFrom(new byte[4]))
+        .setDestinationAddress("127.0.0.1")
+        .setDestinationAddressFamily(AddressFamily.V6)
+        .setDestinationPort(4500)
+        .setCipherSuite(IpSecTransformParams.CipherSuite.AES128_GCM)
+        .build();
+  }
+
+  @Test
+  public void transformFd_rekeyAppliesNewInboundSaBeforeRetiringOldOne() throws Exception {
+    ipSecHelper.transformFd(createParams(/* downlinkSpi= */ 1), () -> {});
+    ipSecHelper.transformFd(createParams(/* downlinkSpi= */ 2), () -> {});
+
+    // The new inbound SA is applied while the old one is still open. The outbound SA keeps the
+    // same SPI, so the old one is closed before the new one is allocated.
+    InOrder inOrder =
+        inOrder(mockIpSecManager, oldOutTransform, oldUplinkSpi, oldInTransform, oldDownlinkSpi);
+    inOrder
+        .verify(mockIpSecManager)
+        .applyTransportModeTransform(
+            any(FileDescriptor.class), eq(IpSecManager.DIRECTION_IN), eq(newInTransform));
+    inOrder.verify(oldOutTransform).close();
+    inOrder.verify(oldUplinkSpi).close();
+    inOrder.verify(mockIpSecManager).allocateSecurityParameterIndex(any(), eq(UPLINK_SPI));
+    inOrder
+        .verify(mockIpSecManager)
+        .applyTransportModeTransform(
+            any(FileDescriptor.class), eq(IpSecManager.DIRECTION_OUT), eq(newOutTransform));
+
+    // The old inbound SA stays open until the grace period is over.
+    shadowOf(Looper.getMainLooper())
+        .idleFor(KryptonIpSecHelperImpl.REKEY_GRACE_PERIOD.minus(Duration.ofSeconds(1)));
+    verify(oldInTransform, never()).close();
+    verify(oldDownlinkSpi, never()).close();
+
+    shadowOf(Looper.getMainLooper()).idleFor(Duration.ofSeconds(1));
+    verify(oldInTransform).close();
+    verify(oldDownlinkSpi).close();
+    verify(newInTransform, never()).close();
+    verify(newDownlinkSpi, never()).close();
+    verify(newOutTransform, never()).close();
+    verify(newUplinkSpi, never()).close();
+  }
+}
@@ -211,6 +211,12 @@ NSDictionary<NSString *, id> *PPNDatapathDebugInfoToNSDictionary(
   if (debugInfo.has_tunnel_write_errors()) {
     dictionary[@"tunnel_write_errors"] = @(debugInfo.tunnel_write_errors());
   }
+  if (debugInfo.has_downlink_packets_replayed()) {
+    dictionary[@"downlink_packets_replayed"] = @(debugInfo.downlink_packets_replayed());
+  }
+  if (debugInfo.has_downlink_packets_too_old()) {
+    dictionary[@"downlink_packets_too_old"] = @(debugInfo.downlink_packets_too_old());
+  }
   if (debugInfo.has_network_pipe()) {
     dictionary[@"network_pipe"] = PPNPacketPipeDebugInfoToNSDictionary(debugInfo.network_pipe());
   }
@@ -27,7 +27,9 @@
 
 #import "privacy/net/common/proto/ppn_options.proto.h"
 #import "privacy/net/krypton/krypton.h"
+#import "privacy/net/krypton/krypton_clock.h"
 #import "privacy/net/krypton/timer_manager.h"
+#import "privacy/net/krypton/timing_wheel_timer.h"
 
 @interface PPNKryptonService () <PPNKryptonNotificationDelegate>
 @end
@@ -35,6 +37,8 @@
 @implementation PPNKryptonService {
   privacy::krypton::PPNHttpFetcher _http_fetcher;
   std::unique_ptr<privacy::krypton::PPNTimer> _ppn_timer;
+  privacy::krypton::BootTimeClock _timer_clock;
+  std::unique_ptr<privacy::krypton::TimingWheelTimer> _timing_wheel_timer;
   std::unique_ptr<privacy::krypton::PPNKryptonNotification> _notification;
   std::unique_ptr<privacy::krypton::PPNOAuth> _oauth;
   std::unique_ptr<privacy::krypton::TimerManager> _timer_manager;
@@ -53,7 +57,10 @@
         ppnUDPSessionManager, virtualNetworkInterfaceManager);
     _oauth = std::make_unique<privacy::krypton::PPNOAuth>(OAuthManager);
     _ppn_timer = std::make_unique<privacy::krypton::PPNTimer>(timerQueue);
-    _timer_manager = std::make_unique<privacy::krypton::TimerManager>(_ppn_timer.get());
+    // All of Krypton's timers share a single dispatch timer.
+    _timing_wheel_timer =
+        std::make_unique<privacy::krypton::TimingWheelTimer>(_ppn_timer.get(), &_timer_clock);
+    _timer_manager = std::make_unique<privacy::krypton::TimerManager>(_timing_wheel_timer.get());
     _notification = std::make_unique<privacy::krypton::PPNKryptonNotification>(self);
   }
   return self;
@@ -41,11 +41,19 @@ IPProtocol IPProtocolFromFamily(sa_family_t family) {
   }
 }
 
+namespace {
+
+void ReleaseRetainedObject(void *object) { CFRelease(object); }
+
+}  // namespace
+
 Packet PacketFromNSData(NSData *data, IPProtocol protocol) {
-  // The cleanup lambda captures data by value, so that ARC will not release data until the cleanup
-  // lambda has been destroyed, which will happen when this Packet is destroyed (or when another
+  // The Packet takes its own retained reference to data, so that ARC will not release data until
+  // the reference is released, which will happen when this Packet is destroyed (or when another
   // Packet is assigned to this one using move semantics).
-  return Packet(static_cast<const char *>(data.bytes), data.length, protocol, [data] {});  // NOLINT
+  void *retained_data = const_cast<void *>(CFBridgingRetain(data));
+  return Packet(static_cast<const char *>(data.bytes), data.length, protocol,
+                PacketOwner::External(&ReleaseRetainedObject, retained_data));
 }
 
 Packet PacketFromNEPacket(NEPacket *packet) {
@@ -59,6 +59,8 @@
   datapathDebugInfo.set_downlink_packets_dropped(4);
   datapathDebugInfo.set_decryption_errors(5);
   datapathDebugInfo.set_tunnel_write_errors(6);
+  datapathDebugInfo.set_downlink_packets_replayed(7);
+  datapathDebugInfo.set_downlink_packets_too_old(8);
   *datapathDebugInfo.mutable_network_pipe() = pipeDebugInfo;
   *datapathDebugInfo.mutable_device_pipe() = pipeDebugInfo;
 
@@ -146,6 +148,8 @@
         @"downlink_packets_dropped" : @4,
         @"decryption_errors" : @5,
         @"tunnel_write_errors" : @6,
+        @"downlink_packets_replayed" : @7,
+        @"downlink_packets_too_old" : @8,
         @"network_pipe" : @{
           @"writes_started" : @1,
           @"writes_completed" : @1,
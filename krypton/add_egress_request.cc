@@ -93,6 +93,10 @@ nlohmann::json AddEgressRequest::BuildBodyJson(
   if (params.dynamic_mtu_enabled) {
     ppn[JsonKeys::kDynamicMtuEnabled] = params.dynamic_mtu_enabled;
   }
+  if (params.extended_sequence_numbers_enabled) {
+    ppn[JsonKeys::kExtendedSequenceNumbersEnabled] =
+        params.extended_sequence_numbers_enabled;
+  }
   ppn[JsonKeys::kDataplaneProtocol] =
       KryptonConfig::DatapathProtocol_Name(params.dataplane_protocol);
   ppn[JsonKeys::kSuite] =
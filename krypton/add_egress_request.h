@@ -60,6 +60,8 @@ class AddEgressRequest {
     std::string unblinded_token_signature;
     // Whether to enable dynamic mtu on the backend dataplane.
     bool dynamic_mtu_enabled = false;
+    // Whether IPsec packets use 64-bit extended sequence numbers.
+    bool extended_sequence_numbers_enabled = false;
     // This is the APN type from Zinc and used to decide APN in bridge-proxy.
     std::string apn_type;
     // This is the region overriding token and signature for sending to Brass.
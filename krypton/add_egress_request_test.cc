@@ -97,10 +97,31 @@ TEST_F(PpnAddEgressRequest, TestPpnRequestBrass) {
   EXPECT_EQ(actual["ppn"]["dataplane_protocol"], "BRIDGE");
   EXPECT_EQ(actual["ppn"]["rekey_verification_key"], verification_key_encoded);
   EXPECT_TRUE(actual["ppn"]["dynamic_mtu_enabled"].is_null());
+  EXPECT_TRUE(actual["ppn"]["extended_sequence_numbers_enabled"].is_null());
   EXPECT_TRUE(actual["ppn"]["public_metadata"].is_null());
   EXPECT_TRUE(actual["signing_key_version"].is_null());
 }
 
+TEST_F(PpnAddEgressRequest, TestPpnRequestWithExtendedSequenceNumbers) {
+  AddEgressRequest request(std::optional("apiKey"));
+  ASSERT_OK_AND_ASSIGN(auto crypto, crypto::SessionCrypto::Create(config_));
+
+  AddEgressRequest::PpnDataplaneRequestParams params;
+  params.crypto = crypto.get();
+  params.control_plane_sockaddr = kCopperControlPlaneAddress;
+  params.dataplane_protocol = KryptonConfig::IPSEC;
+  params.suite = ppn::PpnDataplaneRequest::AES256_GCM;
+  params.is_rekey = false;
+  params.extended_sequence_numbers_enabled = true;
+
+  auto http_request = request.EncodeToProtoForPpn(params);
+  ASSERT_OK_AND_ASSIGN(auto actual,
+                       utils::StringToJson(http_request.json_body()));
+
+  EXPECT_EQ(actual["ppn"]["dataplane_protocol"], "IPSEC");
+  EXPECT_TRUE(actual["ppn"]["extended_sequence_numbers_enabled"]);
+}
+
 TEST_F(PpnAddEgressRequest, TestPpnRequestBrassWithDynamicMtu) {
   AddEgressRequest request(std::optional("apiKey"));
 
@@ -0,0 +1,105 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/benchmark_util.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+
+LatencyRecorder::LatencyRecorder() : recorded_(0) {}
+
+void LatencyRecorder::Record(absl::Duration latency) {
+  int64_t sample = absl::ToInt64Nanoseconds(latency);
+  ++recorded_;
+  if (samples_ns_.size() < kMaxSamples) {
+    samples_ns_.push_back(sample);
+    return;
+  }
+  // Reservoir sampling: the nth sample replaces a random one with probability
+  // kMaxSamples / n.
+  std::uniform_int_distribution<int64_t> index(0, recorded_ - 1);
+  int64_t i = index(random_);
+  if (i < static_cast<int64_t>(kMaxSamples)) {
+    samples_ns_[i] = sample;
+  }
+}
+
+void LatencyRecorder::RecordBatch(absl::Duration batch_latency, int count) {
+  if (count <= 0) {
+    return;
+  }
+  absl::Duration latency = batch_latency / count;
+  for (int i = 0; i < count; ++i) {
+    Record(latency);
+  }
+}
+
+void LatencyRecorder::Report(benchmark::State& state) {
+  if (samples_ns_.empty()) {
+    return;
+  }
+  struct Percentile {
+    const char* name;
+    double fraction;
+  };
+  static constexpr Percentile kPercentiles[] = {
+      {"latency_p50", 0.5},
+      {"latency_p90", 0.9},
+      {"latency_p99", 0.99},
+      {"latency_p999", 0.999}};
+  for (const auto& percentile : kPercentiles) {
+    size_t n = std::min(
+        samples_ns_.size() - 1,
+        static_cast<size_t>(percentile.fraction * samples_ns_.size()));
+    std::nth_element(samples_ns_.begin(), samples_ns_.begin() + n,
+                     samples_ns_.end());
+    state.counters[percentile.name] = benchmark::Counter(
+        static_cast<double>(samples_ns_[n]) * 1e-9,
+        benchmark::Counter::kAvgThreads);
+  }
+}
+
+void ReportPacketRates(benchmark::State& state, int64_t packets,
+                       int64_t bytes) {
+  state.SetItemsProcessed(packets);
+  if (bytes > 0) {
+    state.SetBytesProcessed(bytes);
+  }
+  state.counters["time_per_packet"] = benchmark::Counter(
+      static_cast<double>(packets),
+      benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+TransformParams CreateBenchmarkTransformParams() {
+  TransformParams params;
+  auto ip_sec_transform_params = params.mutable_ipsec();
+  ip_sec_transform_params->set_uplink_key(std::string(32, 'z'));
+  ip_sec_transform_params->set_downlink_key(std::string(32, 'z'));
+  ip_sec_transform_params->set_uplink_salt(std::string(4, 'a'));
+  ip_sec_transform_params->set_downlink_salt(std::string(4, 'a'));
+  return params;
+}
+
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,72 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_BENCHMARK_UTIL_H_
+#define PRIVACY_NET_KRYPTON_BENCHMARK_UTIL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+
+// Collects per-packet latencies while a benchmark runs, and reports their
+// percentiles as counters. Once it holds kMaxSamples, it keeps a uniform
+// random sample of everything recorded, so long runs don't use unbounded
+// memory.
+class LatencyRecorder {
+ public:
+  static constexpr size_t kMaxSamples = 1 << 20;
+
+  LatencyRecorder();
+
+  void Record(absl::Duration latency);
+
+  // Records `batch_latency` spread evenly over the `count` packets of a batch,
+  // as `count` samples of `batch_latency / count`. Every packet then counts
+  // once in the percentiles, whatever the batch size.
+  void RecordBatch(absl::Duration batch_latency, int count);
+
+  // Adds latency_p50, latency_p90, latency_p99 and latency_p999 counters, in
+  // seconds, to `state`. When a benchmark runs on several threads, the
+  // counters are averaged over them.
+  void Report(benchmark::State& state);
+
+ private:
+  std::vector<int64_t> samples_ns_;
+  int64_t recorded_;
+  std::minstd_rand random_;
+};
+
+// Reports how many packets and bytes were processed per second, and the
+// average time spent on each packet, in seconds, as a "time_per_packet"
+// counter. Bytes aren't reported if `bytes` is zero.
+void ReportPacketRates(benchmark::State& state, int64_t packets,
+                       int64_t bytes);
+
+// Returns AES-256-GCM IPsec params with fixed keys and salts, the same in both
+// directions, so that one side's uplink can be decrypted as the other side's
+// downlink.
+TransformParams CreateBenchmarkTransformParams();
+
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_BENCHMARK_UTIL_H_
@@ -0,0 +1,84 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
+
+#include <cstddef>
+
+#include "privacy/net/krypton/proto/krypton_config.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "third_party/openssl/aead.h"
+
+namespace privacy {
+namespace krypton {
+namespace crypto {
+
+namespace {
+
+constexpr size_t kAes128KeyLength = 16;
+constexpr size_t kAes256KeyLength = 32;
+constexpr size_t kChaCha20KeyLength = 32;
+
+}  // namespace
+
+bool HasAesHardware() { return EVP_has_aes_hardware() != 0; }
+
+IpSecCipherSuite SelectIpSecCipherSuite(const KryptonConfig& config) {
+  return SelectIpSecCipherSuite(config, HasAesHardware());
+}
+
+IpSecCipherSuite SelectIpSecCipherSuite(const KryptonConfig& config,
+                                        bool has_aes_hardware) {
+  if (!config.ipsec_cipher_agility_enabled()) {
+    return IpSecTransformParams::AES256_GCM;
+  }
+  if (!has_aes_hardware) {
+    if (config.ipsec_chacha20_poly1305_unsupported()) {
+      return IpSecTransformParams::AES128_GCM;
+    }
+    return IpSecTransformParams::CHACHA20_POLY1305;
+  }
+  if (config.cipher_suite_key_length() == kAes128KeyLength * 8) {
+    return IpSecTransformParams::AES128_GCM;
+  }
+  return IpSecTransformParams::AES256_GCM;
+}
+
+size_t IpSecCipherSuiteKeyLength(IpSecCipherSuite suite) {
+  switch (suite) {
+    case IpSecTransformParams::AES128_GCM:
+      return kAes128KeyLength;
+    case IpSecTransformParams::CHACHA20_POLY1305:
+      return kChaCha20KeyLength;
+    case IpSecTransformParams::AES256_GCM:
+    default:
+      return kAes256KeyLength;
+  }
+}
+
+const EVP_AEAD* IpSecCipherSuiteAead(IpSecCipherSuite suite) {
+  switch (suite) {
+    case IpSecTransformParams::AES128_GCM:
+      return EVP_aead_aes_128_gcm();
+    case IpSecTransformParams::CHACHA20_POLY1305:
+      return EVP_aead_chacha20_poly1305();
+    case IpSecTransformParams::AES256_GCM:
+    default:
+      return EVP_aead_aes_256_gcm();
+  }
+}
+
+}  // namespace crypto
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,55 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_CRYPTO_IPSEC_CIPHER_SUITE_H_
+#define PRIVACY_NET_KRYPTON_CRYPTO_IPSEC_CIPHER_SUITE_H_
+
+#include <cstddef>
+
+#include "privacy/net/krypton/proto/krypton_config.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "third_party/openssl/aead.h"
+
+namespace privacy {
+namespace krypton {
+namespace crypto {
+
+using IpSecCipherSuite = IpSecTransformParams::CipherSuite;
+
+// Returns true if the CPU has instructions that make AES-GCM fast, i.e.
+// AES-NI and CLMUL on x86, or the ARMv8 AES and PMULL extensions.
+bool HasAesHardware();
+
+// Picks the cipher the client asks for when setting up an IPsec session.
+// Without cipher agility this is always AES-256-GCM. With it, devices that
+// have AES hardware use the key length from cipher_suite_key_length, and
+// devices without it use ChaCha20-Poly1305, which is much faster in software.
+// If the platform can't use ChaCha20-Poly1305, those devices use AES-128-GCM,
+// the cheaper of the two AES suites.
+IpSecCipherSuite SelectIpSecCipherSuite(const KryptonConfig& config);
+IpSecCipherSuite SelectIpSecCipherSuite(const KryptonConfig& config,
+                                        bool has_aes_hardware);
+
+// Returns the length in bytes of the keys used by the given cipher suite.
+// Every suite uses a 4 byte salt and an 8 byte IV, per RFC 4106 and RFC 7634.
+size_t IpSecCipherSuiteKeyLength(IpSecCipherSuite suite);
+
+// Returns the AEAD that implements the given cipher suite.
+const EVP_AEAD* IpSecCipherSuiteAead(IpSecCipherSuite suite);
+
+}  // namespace crypto
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_CRYPTO_IPSEC_CIPHER_SUITE_H_
@@ -0,0 +1,95 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
+
+#include "privacy/net/krypton/proto/krypton_config.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/openssl/aead.h"
+
+namespace privacy {
+namespace krypton {
+namespace crypto {
+namespace {
+
+TEST(IpSecCipherSuiteTest, DefaultsToAes256WithoutAgility) {
+  KryptonConfig config;
+  config.set_cipher_suite_key_length(128);
+
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/true),
+            IpSecTransformParams::AES256_GCM);
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/false),
+            IpSecTransformParams::AES256_GCM);
+}
+
+TEST(IpSecCipherSuiteTest, UsesKeyLengthWithAesHardware) {
+  KryptonConfig config;
+  config.set_ipsec_cipher_agility_enabled(true);
+
+  config.set_cipher_suite_key_length(128);
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/true),
+            IpSecTransformParams::AES128_GCM);
+
+  config.set_cipher_suite_key_length(256);
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/true),
+            IpSecTransformParams::AES256_GCM);
+
+  config.clear_cipher_suite_key_length();
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/true),
+            IpSecTransformParams::AES256_GCM);
+}
+
+TEST(IpSecCipherSuiteTest, PrefersChaChaWithoutAesHardware) {
+  KryptonConfig config;
+  config.set_ipsec_cipher_agility_enabled(true);
+  config.set_cipher_suite_key_length(128);
+
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/false),
+            IpSecTransformParams::CHACHA20_POLY1305);
+}
+
+TEST(IpSecCipherSuiteTest, FallsBackToAes128WhenChaChaIsUnsupported) {
+  KryptonConfig config;
+  config.set_ipsec_cipher_agility_enabled(true);
+  config.set_ipsec_chacha20_poly1305_unsupported(true);
+
+  config.set_cipher_suite_key_length(256);
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/false),
+            IpSecTransformParams::AES128_GCM);
+
+  // Devices with AES hardware are unaffected.
+  EXPECT_EQ(SelectIpSecCipherSuite(config, /*has_aes_hardware=*/true),
+            IpSecTransformParams::AES256_GCM);
+}
+
+TEST(IpSecCipherSuiteTest, KeyLengthMatchesAead) {
+  for (auto suite : {IpSecTransformParams::AES128_GCM,
+                     IpSecTransformParams::AES256_GCM,
+                     IpSecTransformParams::CHACHA20_POLY1305}) {
+    EXPECT_EQ(IpSecCipherSuiteKeyLength(suite),
+              EVP_AEAD_key_length(IpSecCipherSuiteAead(suite)))
+        << IpSecTransformParams::CipherSuite_Name(suite);
+  }
+  EXPECT_EQ(IpSecCipherSuiteKeyLength(IpSecTransformParams::AES128_GCM), 16);
+  EXPECT_EQ(IpSecCipherSuiteKeyLength(IpSecTransformParams::AES256_GCM), 32);
+  EXPECT_EQ(
+      IpSecCipherSuiteKeyLength(IpSecTransformParams::CHACHA20_POLY1305), 32);
+}
+
+}  // namespace
+}  // namespace crypto
+}  // namespace krypton
+}  // namespace privacy
@@ -14,9 +14,15 @@
 
 #include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
 
 #include "base/logging.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/openssl/rand.h"
 #include "third_party/tink/cc/subtle/random.h"
 
 namespace privacy {
@@ -25,12 +31,23 @@ namespace crypto {
 
 std::string CreateSecureRandomString(int desired_len) {
   CHECK_GE(desired_len, 0);
-  std::string result;
-  result.resize(desired_len);
-  for (char& it : result) {
-    it = ::crypto::tink::subtle::Random::GetRandomUInt8();
+  return ::crypto::tink::subtle::Random::GetRandomBytes(desired_len);
+}
+
+void BufferedSecureRandom::Generate(char* output, size_t length) {
+  absl::MutexLock lock(&mutex_);
+  while (length > 0) {
+    if (offset_ == kBufferSize) {
+      CHECK_EQ(RAND_bytes(reinterpret_cast<uint8_t*>(buffer_), kBufferSize), 1);
+      offset_ = 0;
+    }
+    const size_t chunk = std::min(length, kBufferSize - offset_);
+    memcpy(output, buffer_ + offset_, chunk);
+    memset(buffer_ + offset_, 0, chunk);
+    offset_ += chunk;
+    output += chunk;
+    length -= chunk;
   }
-  return result;
 }
 
 }  // namespace crypto
@@ -15,8 +15,12 @@
 #ifndef PRIVACY_NET_KRYPTON_CRYPTO_IPSEC_FORWARD_SECURE_RANDOM_H_
 #define PRIVACY_NET_KRYPTON_CRYPTO_IPSEC_FORWARD_SECURE_RANDOM_H_
 
+#include <cstddef>
 #include <string>
 
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/synchronization/mutex.h"
+
 namespace privacy {
 namespace krypton {
 namespace crypto {
@@ -26,6 +30,35 @@ namespace crypto {
 // This can be used to generate a string that will be served as IV.
 std::string CreateSecureRandomString(const int desired_len);
 
+// Hands out random bytes from a buffer that is refilled from the CSPRNG in
+// large chunks, so that taking a few bytes for every packet doesn't cost a
+// call into the CSPRNG and an allocation each time.
+//
+// Bytes are never handed out twice, and each one is wiped from the buffer as
+// it's handed out. Meant for values that are sent in the clear, like IVs.
+//
+// This class is thread safe.
+class BufferedSecureRandom {
+ public:
+  // How many random bytes are generated at a time.
+  static constexpr size_t kBufferSize = 4096;
+
+  BufferedSecureRandom() : offset_(kBufferSize) {}
+
+  // Disallow copy and assign.
+  BufferedSecureRandom(const BufferedSecureRandom& other) = delete;
+  BufferedSecureRandom& operator=(const BufferedSecureRandom& other) = delete;
+
+  // Writes `length` random bytes to `output`.
+  void Generate(char* output, size_t length) ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  absl::Mutex mutex_;
+  char buffer_[kBufferSize] ABSL_GUARDED_BY(mutex_);
+  // The index of the first byte in `buffer_` that hasn't been handed out.
+  size_t offset_ ABSL_GUARDED_BY(mutex_);
+};
+
 }  // namespace crypto
 }  // namespace krypton
 }  // namespace privacy
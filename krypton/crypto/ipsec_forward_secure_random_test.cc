@@ -14,6 +14,9 @@
 
 #include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
 
+#include <cstddef>
+#include <string>
+
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
 #include "third_party/absl/container/btree_set.h"
@@ -36,6 +39,33 @@ TEST_F(IpSecForwardSecureRandomTest, TestRandString) {
   ASSERT_GT(chars.size(), 1);
 }
 
+TEST_F(IpSecForwardSecureRandomTest, TestBufferedRandomAcrossRefills) {
+  BufferedSecureRandom random;
+  // Take more than a whole buffer, in pieces that don't line up with it.
+  std::string previous;
+  for (size_t taken = 0; taken < 3 * BufferedSecureRandom::kBufferSize;
+       taken += 24) {
+    std::string result(24, '\0');
+    random.Generate(result.data(), result.size());
+
+    absl::btree_set<char> chars(result.begin(), result.end());
+    ASSERT_GT(chars.size(), 1);
+    ASSERT_NE(result, previous);
+    previous = result;
+  }
+}
+
+TEST_F(IpSecForwardSecureRandomTest, TestBufferedRandomLargerThanBuffer) {
+  BufferedSecureRandom random;
+  std::string result(2 * BufferedSecureRandom::kBufferSize + 1, '\0');
+  random.Generate(result.data(), result.size());
+
+  // The two halves come from different refills.
+  EXPECT_NE(result.substr(0, BufferedSecureRandom::kBufferSize),
+            result.substr(BufferedSecureRandom::kBufferSize,
+                          BufferedSecureRandom::kBufferSize));
+}
+
 }  // namespace
 }  // namespace crypto
 }  // namespace krypton
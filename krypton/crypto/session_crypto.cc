@@ -21,6 +21,7 @@
 #include <string>
 #include <utility>
 
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/proto/krypton_config.proto.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
 #include "privacy/net/krypton/utils/status.h"
@@ -53,15 +54,7 @@ namespace {
 constexpr int kNonceLength = 16;
 constexpr char kInfo[] = "Google PPN";
 
-constexpr int kUplinkKeyPosition = 0;
-constexpr int kUplinkKeySize = 32;
-constexpr int kDownlinkKeyPosition = kUplinkKeyPosition + kUplinkKeySize;
-constexpr int kDownlinkKeySize = 32;
-constexpr int kUplinkSaltPosition = kDownlinkKeyPosition + kDownlinkKeySize;
-constexpr int kUplinkSaltSize = 4;
-constexpr int kDownlinkSaltPosition = kUplinkSaltPosition + kUplinkSaltSize;
-constexpr int kDownlinkSaltSize = 4;
-constexpr int kHkdfLength = kDownlinkSaltPosition + kDownlinkSaltSize;
+constexpr int kIpSecSaltSize = 4;
 
 constexpr int kBridgeUplinkKeyPosition = 0;
 constexpr int kAes128KeySize = 16;
@@ -91,7 +84,10 @@ absl::StatusOr<std::unique_ptr<SessionCrypto>> SessionCrypto::Create(
 }
 
 SessionCrypto::SessionCrypto(const KryptonConfig &config)
-    : downlink_spi_(0), bn_ctx_(BN_CTX_new()), config_(config) {}
+    : downlink_spi_(0),
+      bn_ctx_(BN_CTX_new()),
+      ipsec_cipher_suite_(SelectIpSecCipherSuite(config)),
+      config_(config) {}
 
 void SessionCrypto::SetLocalNonceTestOnly(absl::string_view client_nonce) {
   local_nonce_ = std::string(client_nonce);
@@ -194,6 +190,9 @@ absl::Status SessionCrypto::Init() {
 }
 
 absl::StatusOr<TransformParams> SessionCrypto::ComputeIpSecKeyMaterial() {
+  const size_t key_length = IpSecCipherSuiteKeyLength(ipsec_cipher_suite_);
+  const size_t hkdf_length = 2 * (key_length + kIpSecSaltSize);
+
   PPN_ASSIGN_OR_RETURN(auto shared_key, SharedKey());
 
   PPN_ASSIGN_OR_RETURN(
@@ -201,27 +200,33 @@ absl::StatusOr<TransformParams> SessionCrypto::ComputeIpSecKeyMaterial() {
       ::crypto::tink::subtle::Hkdf::ComputeHkdf(
           ::crypto::tink::subtle::SHA256,
           ::crypto::tink::util::SecretDataFromStringView(shared_key),
-          absl::StrCat(local_nonce_, remote_nonce_), kInfo, kHkdfLength));
+          absl::StrCat(local_nonce_, remote_nonce_), kInfo, hkdf_length));
 
   auto hkdf_string =
       ::crypto::tink::util::SecretDataAsStringView(hkdf_secret_data);
 
-  DCHECK_EQ(hkdf_string.size(), kHkdfLength);
-  // Key placements in the HKDF output of 72 bytes.
+  DCHECK_EQ(hkdf_string.size(), hkdf_length);
+  // Key placements in the HKDF output, which is 72 bytes for AES-256-GCM and
+  // ChaCha20-Poly1305 and 40 bytes for AES-128-GCM.
   //+--------------------------------------------------------------------+
   //|                        |                       |Uplink   |Downlink |
-  //| Uplink Key(32)         |Downlink Key (32)      |Salt(4)  |Salt(4)  |
+  //| Uplink Key(16/32)      |Downlink Key (16/32)   |Salt(4)  |Salt(4)  |
   //+--------------------------------------------------------------------+
+  const size_t downlink_key_position = key_length;
+  const size_t uplink_salt_position = downlink_key_position + key_length;
+  const size_t downlink_salt_position = uplink_salt_position + kIpSecSaltSize;
   TransformParams transform_params;
   auto ip_sec_transform_params = transform_params.mutable_ipsec();
-  ip_sec_transform_params->set_uplink_key(
-      hkdf_string.substr(kUplinkKeyPosition, kUplinkKeySize));
+  ip_sec_transform_params->set_uplink_key(hkdf_string.substr(0, key_length));
   ip_sec_transform_params->set_downlink_key(
-      hkdf_string.substr(kDownlinkKeyPosition, kDownlinkKeySize));
+      hkdf_string.substr(downlink_key_position, key_length));
   ip_sec_transform_params->set_uplink_salt(
-      hkdf_string.substr(kUplinkSaltPosition, kUplinkSaltSize));
+      hkdf_string.substr(uplink_salt_position, kIpSecSaltSize));
   ip_sec_transform_params->set_downlink_salt(
-      hkdf_string.substr(kDownlinkSaltPosition, kDownlinkSaltSize));
+      hkdf_string.substr(downlink_salt_position, kIpSecSaltSize));
+  ip_sec_transform_params->set_cipher_suite(ipsec_cipher_suite_);
+  ip_sec_transform_params->set_extended_sequence_numbers(
+      config_.ipsec_extended_sequence_numbers_enabled());
 
   ip_sec_transform_params->set_downlink_spi(downlink_spi());
 
@@ -20,6 +20,7 @@
 #include <optional>
 #include <string>
 
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/proto/krypton_config.proto.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
 #include "third_party/absl/status/status.h"
@@ -87,6 +88,14 @@ class SessionCrypto {
 
   uint32_t downlink_spi() const { return downlink_spi_; }
 
+  // The cipher suite to request for IPsec, and to derive IPsec keys for.
+  IpSecCipherSuite ipsec_cipher_suite() const { return ipsec_cipher_suite_; }
+
+  // Test Only: override the cipher suite picked from the config and the CPU.
+  void SetIpSecCipherSuiteTestOnly(IpSecCipherSuite suite) {
+    ipsec_cipher_suite_ = suite;
+  }
+
   std::optional<std::string> GetRekeySignature() const {
     return rekey_signature_;
   }
@@ -116,6 +125,7 @@ class SessionCrypto {
   std::unique_ptr<::crypto::tink::KeysetHandle> key_handle_ = nullptr;
   bssl::UniquePtr<BN_CTX> bn_ctx_ = nullptr;
   std::optional<std::string> rekey_signature_;
+  IpSecCipherSuite ipsec_cipher_suite_;
 
   KryptonConfig config_;  // not owned.
 };
@@ -16,7 +16,9 @@
 
 #include <string>
 
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/proto/krypton_config.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
 #include "third_party/absl/log/log.h"
@@ -177,6 +179,52 @@ TEST_F(SessionCryptoTest, TestIpSecTransformParams) {
   EXPECT_THAT(remote_ipsec_params, EqualsProto(local_ipsec_params));
 }
 
+TEST_F(SessionCryptoTest, TestIpSecTransformParamsDefaultToAes256) {
+  ASSERT_OK_AND_ASSIGN(auto local_crypto, SessionCrypto::Create(ipsec_config_));
+  EXPECT_EQ(local_crypto->ipsec_cipher_suite(),
+            IpSecTransformParams::AES256_GCM);
+}
+
+TEST_F(SessionCryptoTest, TestIpSecTransformParamsForEachCipherSuite) {
+  for (auto suite : {IpSecTransformParams::AES128_GCM,
+                     IpSecTransformParams::AES256_GCM,
+                     IpSecTransformParams::CHACHA20_POLY1305}) {
+    ASSERT_OK_AND_ASSIGN(auto local_crypto,
+                         SessionCrypto::Create(ipsec_config_));
+    ASSERT_OK_AND_ASSIGN(auto remote_crypto,
+                         SessionCrypto::Create(ipsec_config_));
+    local_crypto->SetIpSecCipherSuiteTestOnly(suite);
+    remote_crypto->SetIpSecCipherSuiteTestOnly(suite);
+
+    auto local_keys = local_crypto->GetMyKeyMaterial();
+    auto remote_keys = remote_crypto->GetMyKeyMaterial();
+    EXPECT_OK(local_crypto->SetRemoteKeyMaterial(remote_keys.public_value,
+                                                 remote_keys.nonce));
+    EXPECT_OK(remote_crypto->SetRemoteKeyMaterial(local_keys.public_value,
+                                                  local_keys.nonce));
+    remote_crypto->SetRemoteNonceTestOnly(remote_keys.nonce);
+    remote_crypto->SetLocalNonceTestOnly(local_keys.nonce);
+
+    ASSERT_OK_AND_ASSIGN(auto transform_params,
+                         local_crypto->GetTransformParams());
+    auto local_ipsec_params = transform_params.ipsec();
+
+    const size_t key_length = IpSecCipherSuiteKeyLength(suite);
+    EXPECT_EQ(local_ipsec_params.cipher_suite(), suite);
+    EXPECT_EQ(key_length, local_ipsec_params.uplink_key().length());
+    EXPECT_EQ(key_length, local_ipsec_params.downlink_key().length());
+    EXPECT_EQ(4, local_ipsec_params.uplink_salt().length());
+    EXPECT_EQ(4, local_ipsec_params.downlink_salt().length());
+
+    ASSERT_OK_AND_ASSIGN(auto remote_transform_params,
+                         remote_crypto->GetTransformParams());
+    auto remote_ipsec_params = remote_transform_params.ipsec();
+    remote_ipsec_params.clear_downlink_spi();
+    local_ipsec_params.clear_downlink_spi();
+    EXPECT_THAT(remote_ipsec_params, EqualsProto(local_ipsec_params));
+  }
+}
+
 TEST_F(SessionCryptoTest, TestBridgeTransformFailure) {
   ASSERT_OK_AND_ASSIGN(auto local_crypto,
                        SessionCrypto::Create(bridge_config_aes_128_));
@@ -14,6 +14,7 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/datagram_socket.h"
 
+#include <arpa/inet.h>
 #include <linux/errqueue.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -21,6 +22,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <cstdint>
@@ -33,6 +35,11 @@
 #include "privacy/net/krypton/datapath/android_ipsec/events_helper.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mss_mtu_detector_interface.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
+#include "privacy/net/krypton/datapath/android_ipsec/udp_offload.h"
+#include "privacy/net/krypton/datapath/utils/icmp.h"
+#include "privacy/net/krypton/datapath/utils/tcp_mss.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
@@ -45,6 +52,9 @@
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/substitute.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -53,6 +63,25 @@ namespace android {
 
 namespace {
 constexpr int kMaxPacketSize = 4096;
+
+// The most datagrams read or written with a single system call.
+constexpr size_t kMaxBatchSize = 32;
+
+// How many read buffers are kept around for reuse, once the packets they were
+// handed out in have been destroyed.
+constexpr size_t kMaxFreeBuffers = 8 * kMaxBatchSize;
+
+// With GRO, every buffer has to be large enough for a whole coalesced read, so
+// fewer of them are read into at once.
+constexpr size_t kGroBufferSize =
+    kPacketHeadroom + kMaxUdpPayloadSize + kPacketTailroom;
+constexpr size_t kMaxGroBatchSize = 4;
+constexpr size_t kMaxFreeGroBuffers = 2 * kMaxGroBatchSize;
+
+// Packet too big replies are limited to bursts of 10, and 10 a second after
+// that, which is plenty for the host to learn the new MTU for every flow.
+constexpr absl::Duration kPacketTooBigInterval = absl::Milliseconds(100);
+constexpr int kPacketTooBigBurst = 10;
 }  // namespace
 
 absl::StatusOr<std::unique_ptr<DatagramSocket>> DatagramSocket::Create(
@@ -76,12 +105,21 @@ DatagramSocket::DatagramSocket(int socket_fd)
     : socket_fd_(socket_fd),
       dynamic_mtu_enabled_(false),
       uplink_packets_dropped_(0),
+      tcp_mss_clamped_(0),
+      packet_too_big_sent_(0),
       kernel_mtu_(INT_MAX),
       looper_("DatagramSocket Looper"),
+      buffer_pool_(kMaxPacketSize, kMaxFreeBuffers),
+      gro_buffer_pool_(kGroBufferSize, kMaxFreeGroBuffers),
+      gso_enabled_(false),
+      gro_enabled_(false),
       uplink_mss_mtu_(0),
       downlink_mss_mtu_(0),
       mss_mtu_available_(false),
-      mtu_tracker_(nullptr) {}
+      mtu_tracker_(nullptr),
+      probe_identifier_(0),
+      path_mtu_probes_sent_(0),
+      too_big_limiter_(kPacketTooBigInterval, kPacketTooBigBurst) {}
 
 DatagramSocket::~DatagramSocket() {
   if (socket_fd_ >= 0) {
@@ -89,6 +127,7 @@ DatagramSocket::~DatagramSocket() {
   }
 
   PPN_LOG_IF_ERROR(events_helper_.RemoveFile(cancel_read_event_.fd()));
+  PPN_LOG_IF_ERROR(events_helper_.RemoveFile(too_big_event_.fd()));
 }
 
 absl::Status DatagramSocket::Close() {
@@ -129,6 +168,18 @@ absl::StatusOr<std::vector<Packet>> DatagramSocket::ReadPackets() {
       // Indicate clean exit with an empty vector
       return std::vector<Packet>();
     }
+    if (notified_fd == too_big_event_.fd()) {
+      PPN_RETURN_IF_ERROR(ClearEventFd(notified_fd));
+      std::vector<Packet> replies;
+      {
+        absl::MutexLock lock(&too_big_mutex_);
+        replies.swap(too_big_replies_);
+      }
+      if (replies.empty()) {
+        continue;
+      }
+      return replies;
+    }
     if (datapath::android::EventsHelper::FileHasError(event)) {
       // Process the socket error queue.
       absl::MutexLock lock(&mutex_);
@@ -139,26 +190,11 @@ absl::StatusOr<std::vector<Packet>> DatagramSocket::ReadPackets() {
       if (fd < 0) {
         return absl::InternalError("Attempted to read on a closed socket.");
       }
-      // TODO: Do reads in batches.
-
-      // TODO: Don't allocate new memory for every packet.
-      char* buffer = new char[kMaxPacketSize];
-
-      int read_bytes;
-      do {
-        read_bytes = read(fd, buffer, kMaxPacketSize);
-      } while (read_bytes == -1 && errno == EINTR);
-
-      if (read_bytes <= 0) {
-        delete[] buffer;
-        return absl::AbortedError(
-            absl::Substitute("Reading from FD $0: $1", fd, strerror(errno)));
+      PPN_ASSIGN_OR_RETURN(auto packets, ReadBatch(fd));
+      if (packets.empty()) {
+        // An empty vector would signal a clean exit, so keep waiting instead.
+        continue;
       }
-
-      std::vector<Packet> packets;
-      packets.emplace_back(buffer, read_bytes, IPProtocol::kUnknown,
-                           [buffer]() { delete[] buffer; });
-
       return packets;
     }
   }
@@ -176,19 +212,142 @@ absl::Status DatagramSocket::WritePackets(std::vector<Packet> packets) {
     mtu_tracker_->UpdateUplinkMtu(uplink_mss_mtu_);
     mtu_tracker_->UpdateDownlinkMtu(downlink_mss_mtu_);
   }
-  for (const auto& packet : packets) {
-    // Check if the packet is too large to be sent
-    if (dynamic_mtu_enabled_ &&
-        packet.data().size() > mtu_tracker_->GetTunnelMtu()) {
-      ++uplink_packets_dropped_;
+  if (path_mtu_prober_ != nullptr) {
+    ProbePathMtu(fd);
+  }
+  // Drop any packets that are too large to be sent, then send the rest in
+  // batches.
+  std::vector<Packet> sendable;
+  sendable.reserve(packets.size());
+  for (auto& packet : packets) {
+    if (dynamic_mtu_enabled_) {
+      int tunnel_mtu = mtu_tracker_->GetTunnelMtu();
+      if (packet.data().size() > tunnel_mtu) {
+        ++uplink_packets_dropped_;
+        ReplyPacketTooBig(packet, tunnel_mtu);
+        continue;
+      }
+      ClampTcpMss(&packet, tunnel_mtu);
+    }
+    sendable.push_back(std::move(packet));
+  }
+
+  for (size_t start = 0; start < sendable.size(); start += kMaxBatchSize) {
+    size_t count = std::min(kMaxBatchSize, sendable.size() - start);
+    PPN_RETURN_IF_ERROR(
+        WriteBatch(fd, absl::MakeConstSpan(sendable).subspan(start, count),
+                   gso_enabled_));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<Packet>> DatagramSocket::ReadBatch(int fd) {
+  // With GRO, each datagram read may hold several coalesced packets, so fewer
+  // but larger buffers are used.
+  PacketBufferPool& pool = gro_enabled_ ? gro_buffer_pool_ : buffer_pool_;
+  const size_t batch_size = gro_enabled_ ? kMaxGroBatchSize : kMaxBatchSize;
+  char* buffers[kMaxBatchSize];
+  pool.Acquire(absl::MakeSpan(buffers, batch_size));
+
+  // Leave room around each packet, so that it can be processed in place.
+  mmsghdr messages[kMaxBatchSize];
+  iovec iovecs[kMaxBatchSize];
+  GroControl controls[kMaxBatchSize];
+  memset(messages, 0, sizeof(messages));
+  for (size_t i = 0; i < batch_size; ++i) {
+    iovecs[i].iov_base = buffers[i] + kPacketHeadroom;
+    iovecs[i].iov_len = pool.buffer_size() - kPacketHeadroom - kPacketTailroom;
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+    if (gro_enabled_) {
+      messages[i].msg_hdr.msg_control = controls[i].buffer;
+      messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+    }
+  }
+
+  // The socket was reported readable, so this waits for the first datagram just
+  // like a plain read() would, and then takes whatever else is already queued.
+  int received;
+  do {
+    received = recvmmsg(fd, messages, batch_size, MSG_WAITFORONE, nullptr);
+  } while (received == -1 && errno == EINTR);
+
+  if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // Somebody else drained the socket first. Go back to waiting.
+    pool.Release(absl::MakeSpan(buffers, batch_size));
+    return std::vector<Packet>();
+  }
+  // A zero-length first datagram is what a shut down socket reads as, so it's
+  // treated the same way a failed read is.
+  if (received <= 0 || messages[0].msg_len == 0) {
+    pool.Release(absl::MakeSpan(buffers, batch_size));
+    return absl::AbortedError(
+        absl::Substitute("Reading from FD $0: $1", fd, strerror(errno)));
+  }
+
+  std::vector<Packet> packets;
+  packets.reserve(received);
+  for (int i = 0; i < received; ++i) {
+    const size_t length = messages[i].msg_len;
+    if (length == 0 || (messages[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+      pool.Release(absl::MakeSpan(&buffers[i], 1));
       continue;
     }
+    size_t segment_size =
+        gro_enabled_ ? GetGroSegmentSize(messages[i].msg_hdr) : 0;
+    if (segment_size == 0 || length <= segment_size) {
+      packets.push_back(pool.MakePacket(buffers[i], kPacketHeadroom, length,
+                                        IPProtocol::kUnknown));
+      continue;
+    }
+    SplitGroBuffer(buffers[i] + kPacketHeadroom, length, segment_size,
+                   pool.ReleaseAsOwner(buffers[i]), &packets);
+  }
+  pool.Release(absl::MakeSpan(buffers + received, batch_size - received));
+  if (path_mtu_prober_ != nullptr) {
+    ConsumeProbeReplies(&packets);
+  }
+  if (dynamic_mtu_enabled_) {
+    // SYN-ACKs are clamped too, so that the local end doesn't send segments
+    // that won't fit, even if the remote end doesn't clamp its MSS.
+    int tunnel_mtu = mtu_tracker_->GetTunnelMtu();
+    for (auto& packet : packets) {
+      ClampTcpMss(&packet, tunnel_mtu);
+    }
+  }
+  return packets;
+}
 
-    int write_bytes;
+absl::Status DatagramSocket::WriteBatch(int fd,
+                                        absl::Span<const Packet> packets,
+                                        bool use_gso) {
+  // Each message carries either a single packet, or with GSO, a run of equally
+  // sized packets that the kernel will split back up.
+  mmsghdr messages[kMaxBatchSize];
+  iovec iovecs[kMaxBatchSize];
+  GsoControl controls[kMaxBatchSize];
+  size_t first_packet[kMaxBatchSize];
+  size_t packet_count[kMaxBatchSize];
+  size_t num_messages = 0;
+  memset(messages, 0, sizeof(messages));
+  for (size_t i = 0; i < packets.size(); ++num_messages) {
+    size_t run = use_gso ? GsoRunLength(packets.subspan(i)) : 1;
+    PrepareGsoMessage(packets.subspan(i, run), &iovecs[i],
+                      &controls[num_messages], &messages[num_messages].msg_hdr);
+    first_packet[num_messages] = i;
+    packet_count[num_messages] = run;
+    i += run;
+  }
+
+  // sendmmsg stops at the first message that fails, so errors are handled one
+  // message at a time, exactly as if each message had been written on its own.
+  size_t next = 0;
+  while (next < num_messages) {
+    int sent;
     do {
-      write_bytes = write(fd, packet.data().data(), packet.data().size());
-    } while (write_bytes == -1 && errno == EINTR);
-    if (write_bytes == -1 || write_bytes != packet.data().size()) {
+      sent = sendmmsg(fd, messages + next, num_messages - next, 0);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1) {
       // The message being too large indicates an MTU update has occurred.
       if (dynamic_mtu_enabled_ && errno == EMSGSIZE) {
         // Process the socket error queue to search for MTU updates and then
@@ -196,12 +355,42 @@ absl::Status DatagramSocket::WritePackets(std::vector<Packet> packets) {
         absl::MutexLock lock(&mutex_);
         PPN_RETURN_IF_ERROR(ProcessSocketErrorQueue());
         mtu_tracker_->UpdateUplinkMtu(kernel_mtu_);
-        ++uplink_packets_dropped_;
+        uplink_packets_dropped_ += packet_count[next];
+        ++next;
         continue;
       }
+      if (packet_count[next] > 1 && errno == EINVAL) {
+        // The kernel rejects GSO sends whose segments don't fit the route's
+        // MTU, so send this run one by one to get per-packet MTU handling.
+        PPN_RETURN_IF_ERROR(WriteBatch(
+            fd, packets.subspan(first_packet[next], packet_count[next]),
+            /*use_gso=*/false));
+        ++next;
+        continue;
+      }
+      if (packet_count[next] > 1 && (errno == EIO || errno == EOPNOTSUPP)) {
+        // Some devices can't segment UDP after all, even though the socket
+        // accepted the option. Stop using GSO and send the rest one by one.
+        LOG(WARNING) << "Disabling UDP GSO on FD=" << fd << ": "
+                     << strerror(errno);
+        gso_enabled_ = false;
+        return WriteBatch(fd, packets.subspan(first_packet[next]),
+                          /*use_gso=*/false);
+      }
       return absl::InternalError(
           absl::StrCat("Error writing to FD=", fd, ": ", strerror(errno)));
     }
+    for (int i = 0; i < sent; ++i, ++next) {
+      size_t expected = 0;
+      for (size_t j = 0; j < packet_count[next]; ++j) {
+        expected += packets[first_packet[next] + j].data().size();
+      }
+      if (messages[next].msg_len != expected) {
+        return absl::InternalError(
+            absl::StrCat("Short write to FD=", fd, ": ", messages[next].msg_len,
+                         " of ", expected, " bytes"));
+      }
+    }
   }
   return absl::OkStatus();
 }
@@ -229,7 +418,9 @@ absl::Status DatagramSocket::Connect(Endpoint dest) {
 
   if (dynamic_mtu_enabled_) {
     PPN_RETURN_IF_ERROR(UpdateMtuFromKernel(dest.ip_protocol()));
-    mss_mtu_detector_->Start(this, &looper_);
+    if (mss_mtu_detector_ != nullptr) {
+      mss_mtu_detector_->Start(this, &looper_);
+    }
   }
 
   return absl::OkStatus();
@@ -239,6 +430,118 @@ int DatagramSocket::GetFd() { return socket_fd_; }
 
 void DatagramSocket::GetDebugInfo(DatapathDebugInfo* debug_info) {
   debug_info->set_uplink_packets_dropped(uplink_packets_dropped_);
+  if (dynamic_mtu_enabled_) {
+    debug_info->set_tcp_mss_clamped(tcp_mss_clamped_);
+    debug_info->set_packet_too_big_sent(packet_too_big_sent_);
+  }
+  if (path_mtu_prober_ != nullptr) {
+    debug_info->set_path_mtu_probes_sent(path_mtu_probes_sent_);
+  }
+}
+
+absl::Status DatagramSocket::EnablePathMtuProbing(
+    const PathMtuProber::Options& options, const std::string& source_address,
+    const std::string& destination_address) {
+  if (!dynamic_mtu_enabled_) {
+    return absl::FailedPreconditionError(
+        "Path MTU probing requires dynamic MTU");
+  }
+  int family =
+      source_address.find(':') == std::string::npos ? AF_INET : AF_INET6;
+  size_t address_size = family == AF_INET ? sizeof(in_addr) : sizeof(in6_addr);
+  std::string source(address_size, '\0');
+  std::string destination(address_size, '\0');
+  if (inet_pton(family, source_address.c_str(), source.data()) != 1 ||
+      inet_pton(family, destination_address.c_str(), destination.data()) !=
+          1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid path MTU probe addresses: ", source_address,
+                     " -> ", destination_address));
+  }
+  LOG(INFO) << "Enabling path MTU probing on FD=" << socket_fd_.load()
+            << " from " << source_address << " to " << destination_address;
+  probe_source_ = std::move(source);
+  probe_destination_ = std::move(destination);
+  // Replies are picked out of the downlink by identifier, so make collisions
+  // with anything else pinging the same destination unlikely.
+  probe_identifier_ = static_cast<uint16_t>(absl::ToUnixMicros(absl::Now()));
+  path_mtu_prober_ = std::make_unique<PathMtuProber>(options);
+  return absl::OkStatus();
+}
+
+void DatagramSocket::ProbePathMtu(int fd) {
+  auto action = path_mtu_prober_->Poll(mtu_tracker_->GetTunnelMtu(),
+                                       mtu_tracker_->GetMaxTunnelMtu(),
+                                       absl::Now());
+  if (action.confirmed_mtu) {
+    mtu_tracker_->RaiseTunnelMtu(*action.confirmed_mtu);
+  }
+  if (!action.probe_size) {
+    return;
+  }
+  auto probe = utils::BuildEchoRequest(
+      probe_source_, probe_destination_, probe_identifier_,
+      action.probe_sequence, *action.probe_size);
+  if (!probe.ok()) {
+    LOG(WARNING) << "Unable to build path MTU probe: " << probe.status();
+    return;
+  }
+  // A probe that can't be sent is as good as lost, which the prober notices
+  // on its own, so errors aren't reported any further.
+  ssize_t sent;
+  do {
+    sent = send(fd, probe->data(), probe->size(), 0);
+  } while (sent == -1 && errno == EINTR);
+  if (sent == -1) {
+    LOG(WARNING) << "Sending path MTU probe of " << probe->size()
+                 << " bytes failed: " << strerror(errno);
+    return;
+  }
+  ++path_mtu_probes_sent_;
+}
+
+void DatagramSocket::ClampTcpMss(Packet* packet, int tunnel_mtu) {
+  char* data = packet->mutable_data();
+  if (data != nullptr &&
+      utils::ClampTcpMss(data, packet->data().size(), tunnel_mtu)) {
+    ++tcp_mss_clamped_;
+  }
+}
+
+void DatagramSocket::ReplyPacketTooBig(const Packet& packet,
+                                       int tunnel_mtu) {
+  // The limiter goes first, so that a flood of oversize packets doesn't cost
+  // more than dropping them.
+  if (!too_big_limiter_.TryTake(absl::Now())) {
+    return;
+  }
+  auto reply = utils::BuildPacketTooBig(packet.data(), tunnel_mtu);
+  if (!reply.ok()) {
+    return;
+  }
+  char* buffer;
+  buffer_pool_.Acquire(absl::MakeSpan(&buffer, 1));
+  memcpy(buffer, reply->data(), reply->size());
+  {
+    absl::MutexLock lock(&too_big_mutex_);
+    too_big_replies_.push_back(buffer_pool_.MakePacket(
+        buffer, 0, reply->size(), packet.protocol()));
+  }
+  ++packet_too_big_sent_;
+  PPN_LOG_IF_ERROR(too_big_event_.Notify(1));
+}
+
+void DatagramSocket::ConsumeProbeReplies(std::vector<Packet>* packets) {
+  auto is_reply = [this](const Packet& packet) {
+    auto sequence = utils::ParseEchoReply(packet.data(), probe_identifier_);
+    if (!sequence) {
+      return false;
+    }
+    path_mtu_prober_->ProbeAcknowledged(*sequence);
+    return true;
+  };
+  packets->erase(std::remove_if(packets->begin(), packets->end(), is_reply),
+                 packets->end());
 }
 
 std::string DatagramSocket::DebugString() {
@@ -276,6 +579,22 @@ absl::Status DatagramSocket::Init() {
     return status;
   }
 
+  status = events_helper_.AddFile(too_big_event_.fd(),
+                                  EventsHelper::EventReadableFlags());
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to add packet too big event with fd " << fd
+               << " to EventsHelper: " << status;
+    PPN_LOG_IF_ERROR(Close());
+    return status;
+  }
+
+  // Use UDP segmentation and receive offload where the kernel supports them.
+  // Otherwise, datagrams are just sent and received one at a time.
+  gso_enabled_ = SupportsUdpGso(fd);
+  gro_enabled_ = EnableUdpGro(fd);
+  LOG(INFO) << "UDP offload on FD=" << fd << ": GSO=" << gso_enabled_
+            << ", GRO=" << gro_enabled_;
+
   return absl::OkStatus();
 }
 
@@ -357,11 +676,6 @@ absl::Status DatagramSocket::EnablePathMtuDiscovery(
         "Enabled Path MTU Discovery with a null MTU Tracker");
   }
   mtu_tracker_ = std::move(mtu_tracker);
-
-  if (mss_mtu_detector == nullptr) {
-    return absl::InternalError(
-        "Enabled Path MTU Discovery with a null MSS MTU Detector");
-  }
   mss_mtu_detector_ = std::move(mss_mtu_detector);
 
   dynamic_mtu_enabled_ = true;
@@ -16,6 +16,7 @@
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_DATAGRAM_SOCKET_H_
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -25,14 +26,18 @@
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_socket_interface.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mss_mtu_detector_interface.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
 #include "privacy/net/krypton/utils/looper.h"
+#include "privacy/net/krypton/utils/token_bucket.h"
 #include "third_party/absl/base/thread_annotations.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -47,7 +52,9 @@ class DatagramSocket : public IpSecSocketInterface,
 
   // Creates a DatagramSocket with path MTU discovery enabled. The provided
   // MtuTrackerInterface object will be used to keep track of the currently
-  // known path MTU information.
+  // known path MTU information. The MSS MTU detector may be null if the path
+  // MTU is already known, in which case the tracker's values are only changed
+  // by the kernel's path MTU updates and by probing.
   static absl::StatusOr<std::unique_ptr<DatagramSocket>> Create(
       int socket_fd, std::unique_ptr<MssMtuDetectorInterface> mss_mtu_detector,
       std::unique_ptr<MtuTrackerInterface> mtu_tracker);
@@ -72,6 +79,10 @@ class DatagramSocket : public IpSecSocketInterface,
 
   void GetDebugInfo(DatapathDebugInfo* debug_info) override;
 
+  absl::Status EnablePathMtuProbing(
+      const PathMtuProber::Options& options, const std::string& source_address,
+      const std::string& destination_address) override;
+
   std::string DebugString();
 
   void MssMtuSuccess(int uplink_mss_mtu, int downlink_mss_mtu) override;
@@ -85,12 +96,43 @@ class DatagramSocket : public IpSecSocketInterface,
 
   absl::Status ClearEventFd(int fd);
 
+  // Reads as many datagrams as are ready, up to a batch, with one recvmmsg.
+  // Returns an empty vector if none were ready after all, or if all of them
+  // had to be dropped.
+  absl::StatusOr<std::vector<Packet>> ReadBatch(int fd);
+
+  // Sends up to a batch of packets with sendmmsg, dropping any packet that is
+  // rejected for exceeding the path MTU. Runs of equally sized packets are sent
+  // as a single GSO message, if `use_gso` is set.
+  absl::Status WriteBatch(int fd, absl::Span<const Packet> packets,
+                          bool use_gso);
+
   absl::Status EnablePathMtuDiscovery(
       std::unique_ptr<MtuTrackerInterface> mtu_tracker,
       std::unique_ptr<MssMtuDetectorInterface> mss_mtu_detector);
 
   absl::Status UpdateMtuFromKernel(IPProtocol ip_protocol);
 
+  // Applies any tunnel MTU the prober has confirmed, and sends the next probe
+  // if it's time. Probes bypass the tunnel MTU check, since finding out
+  // whether a bigger packet makes it is their whole point.
+  void ProbePathMtu(int fd);
+
+  // Lowers the MSS of a TCP SYN or SYN-ACK to fit in the tunnel MTU, so that
+  // the connection never sends segments that would be dropped for being too
+  // big. Only writable packets can be changed.
+  void ClampTcpMss(Packet* packet, int tunnel_mtu);
+
+  // Queues an ICMP "fragmentation needed" or ICMPv6 "packet too big" for a
+  // packet dropped for exceeding the tunnel MTU, to be returned by the next
+  // ReadPackets() call. The host's stack then lowers its path MTU right away,
+  // rather than waiting for its own retransmits to time out.
+  void ReplyPacketTooBig(const Packet& packet, int tunnel_mtu);
+
+  // Removes the replies to path MTU probes from `packets`, and passes them to
+  // the prober.
+  void ConsumeProbeReplies(std::vector<Packet>* packets);
+
   absl::Status ProcessSocketErrorQueue() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
   absl::Mutex mutex_;  // Ensures kernel_mtu_ contains the most recent MTU read
@@ -99,20 +141,46 @@ class DatagramSocket : public IpSecSocketInterface,
   std::atomic_int socket_fd_;
 
   EventFd cancel_read_event_;
+  // Signalled when there are packet too big replies to be read.
+  EventFd too_big_event_;
   EventsHelper events_helper_;
 
   bool dynamic_mtu_enabled_;
   std::atomic_int uplink_packets_dropped_;
+  std::atomic_int tcp_mss_clamped_;
+  std::atomic_int packet_too_big_sent_;
   int kernel_mtu_ ABSL_GUARDED_BY(mutex_);
 
   utils::LooperThread looper_;
+  PacketBufferPool buffer_pool_;
+  PacketBufferPool gro_buffer_pool_;
+
+  // Whether UDP segmentation and receive offload are in use on this socket.
+  std::atomic_bool gso_enabled_;
+  bool gro_enabled_;
   std::unique_ptr<MssMtuDetectorInterface> mss_mtu_detector_;
   int uplink_mss_mtu_;
   int downlink_mss_mtu_;
   std::atomic_bool mss_mtu_available_;
 
-  // Only accessed from Connect and WritePackets functions
+  // Only accessed from Connect and WritePackets functions, except for
+  // GetTunnelMtu(), which ReadPackets also uses for MSS clamping.
   std::unique_ptr<MtuTrackerInterface> mtu_tracker_;
+
+  // Set up before any packets are read or written, and only used while path
+  // MTU probing is enabled. The addresses are in network byte order.
+  std::unique_ptr<PathMtuProber> path_mtu_prober_;
+  std::string probe_source_;
+  std::string probe_destination_;
+  uint16_t probe_identifier_;
+  std::atomic_int path_mtu_probes_sent_;
+
+  // Packet too big replies are written by WritePackets and read by
+  // ReadPackets, which run on different threads. The rate limiter is only
+  // used by WritePackets.
+  absl::Mutex too_big_mutex_;
+  std::vector<Packet> too_big_replies_ ABSL_GUARDED_BY(too_big_mutex_);
+  utils::TokenBucket too_big_limiter_;
 };
 
 }  // namespace android
@@ -26,7 +26,9 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/mss_mtu_detector_interface.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "privacy/net/krypton/datapath/android_ipsec/simple_udp_server.h"
+#include "privacy/net/krypton/datapath/utils/icmp.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
@@ -36,6 +38,7 @@
 #include "third_party/absl/log/log.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_format.h"
 #include "third_party/absl/synchronization/notification.h"
 #include "third_party/absl/time/time.h"
@@ -66,6 +69,8 @@ class MockMtuTracker : public MtuTrackerInterface {
   MOCK_METHOD(int, GetUplinkMtu, (), (const override));
   MOCK_METHOD(int, GetTunnelMtu, (), (const override));
   MOCK_METHOD(int, GetDownlinkMtu, (), (const override));
+  MOCK_METHOD(void, RaiseTunnelMtu, (int), (override));
+  MOCK_METHOD(int, GetMaxTunnelMtu, (), (const override));
 };
 
 absl::StatusOr<std::unique_ptr<DatagramSocket>> CreateSocket() {
@@ -124,6 +129,96 @@ TEST(DatagramSocketTest, BasicReadAndWrite) {
   ASSERT_THAT(sock->ReadPackets(), StatusIs(absl::StatusCode::kInternal));
 }
 
+TEST(DatagramSocketTest, BatchedReadAndWrite) {
+  testing::SimpleUdpServer server;
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket());
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  // More packets than fit in one batch, so they take several calls to send.
+  const int kNumPackets = 40;
+  std::vector<std::string> messages;
+  std::vector<Packet> packets;
+  for (int i = 0; i < kNumPackets; ++i) {
+    messages.push_back(absl::StrCat("packet ", i));
+  }
+  for (const auto& message : messages) {
+    packets.emplace_back(message.data(), message.size(), IPProtocol::kIPv6,
+                         []() {});
+  }
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  int port = 0;
+  for (const auto& message : messages) {
+    ASSERT_OK_AND_ASSIGN((auto [remote_port, data]), server.ReceivePacket());
+    EXPECT_EQ(message, data);
+    port = remote_port;
+  }
+
+  // Datagrams that are all waiting on the socket are read together.
+  server.SendSamplePacket(port, "foo");
+  server.SendSamplePacket(port, "bar");
+  server.SendSamplePacket(port, "baz");
+
+  std::vector<std::string> received;
+  while (received.size() < 3) {
+    ASSERT_OK_AND_ASSIGN(auto recv_packets, sock->ReadPackets());
+    ASSERT_FALSE(recv_packets.empty());
+    for (const auto& packet : recv_packets) {
+      EXPECT_TRUE(packet.is_writable());
+      EXPECT_GE(packet.headroom(), kPacketHeadroom);
+      EXPECT_GE(packet.tailroom(), kPacketTailroom);
+      received.emplace_back(packet.data());
+    }
+  }
+  EXPECT_THAT(received, ::testing::ElementsAre("foo", "bar", "baz"));
+
+  ASSERT_OK(sock->Close());
+}
+
+TEST(DatagramSocketTest, EquallySizedBurstsAreDelivered) {
+  testing::SimpleUdpServer server;
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket());
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  // These can be sent as a single GSO message, if the kernel supports it, but
+  // should arrive as separate datagrams either way.
+  std::vector<std::string> messages = {"aaaa", "bbbb", "cccc", "dd", "eeee"};
+  std::vector<Packet> packets;
+  for (const auto& message : messages) {
+    packets.emplace_back(message.data(), message.size(), IPProtocol::kIPv6,
+                         []() {});
+  }
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  int port = 0;
+  for (const auto& message : messages) {
+    ASSERT_OK_AND_ASSIGN((auto [remote_port, data]), server.ReceivePacket());
+    EXPECT_EQ(message, data);
+    port = remote_port;
+  }
+
+  // Likewise, these may be coalesced by GRO, but should be read as separate
+  // packets.
+  for (const auto& message : messages) {
+    server.SendSamplePacket(port, message);
+  }
+  std::vector<std::string> received;
+  while (received.size() < messages.size()) {
+    ASSERT_OK_AND_ASSIGN(auto recv_packets, sock->ReadPackets());
+    ASSERT_FALSE(recv_packets.empty());
+    for (const auto& packet : recv_packets) {
+      received.emplace_back(packet.data());
+    }
+  }
+  EXPECT_EQ(received, messages);
+
+  ASSERT_OK(sock->Close());
+}
+
 TEST(DatagramSocketTest, CloseBeforeRead) {
   testing::SimpleUdpServer server;
 
@@ -450,6 +545,196 @@ TEST(DatagramSocketTest, DynamicMtuMssMtuDetection) {
   ASSERT_OK(sock->Close());
 }
 
+TEST(DatagramSocketTest, DynamicMtuWriteFailureOnlyDropsOnePacketOfBatch) {
+  testing::SimpleUdpServer server;
+
+  auto mtu_tracker = std::make_unique<MockMtuTracker>();
+  MockMtuTracker* mtu_tracker_ptr = mtu_tracker.get();
+
+  auto mss_mtu_detector = std::make_unique<MockMssMtuDetector>();
+
+  EXPECT_CALL(*mtu_tracker_ptr, GetTunnelMtu()).WillRepeatedly(Return(70000));
+  EXPECT_CALL(*mtu_tracker_ptr, UpdateUplinkMtu(65536)).Times(2);
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket(std::move(mss_mtu_detector),
+                                               std::move(mtu_tracker)));
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  // The middle message is larger than the max MTU, so it can't be sent.
+  std::string msg1(3, 'a');
+  std::string msg2(65537, 'b');
+  std::string msg3(3, 'c');
+  std::vector<Packet> packets;
+  packets.emplace_back(msg1.c_str(), msg1.size(), IPProtocol::kIPv6, []() {});
+  packets.emplace_back(msg2.c_str(), msg2.size(), IPProtocol::kIPv6, []() {});
+  packets.emplace_back(msg3.c_str(), msg3.size(), IPProtocol::kIPv6, []() {});
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  DatapathDebugInfo debug_info;
+  sock->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.uplink_packets_dropped(), 1);
+
+  ASSERT_OK_AND_ASSIGN((auto [port1, data1]), server.ReceivePacket());
+  EXPECT_EQ(data1, msg1);
+  ASSERT_OK_AND_ASSIGN((auto [port3, data3]), server.ReceivePacket());
+  EXPECT_EQ(data3, msg3);
+
+  ASSERT_OK(sock->Close());
+}
+
+TEST(DatagramSocketTest, PathMtuProbeRaisesTunnelMtu) {
+  testing::SimpleUdpServer server;
+
+  auto mtu_tracker = std::make_unique<MockMtuTracker>();
+  MockMtuTracker* mtu_tracker_ptr = mtu_tracker.get();
+
+  auto mss_mtu_detector = std::make_unique<MockMssMtuDetector>();
+
+  EXPECT_CALL(*mtu_tracker_ptr, UpdateUplinkMtu(_));
+  EXPECT_CALL(*mtu_tracker_ptr, GetTunnelMtu()).WillRepeatedly(Return(1200));
+  EXPECT_CALL(*mtu_tracker_ptr, GetMaxTunnelMtu())
+      .WillRepeatedly(Return(1400));
+  EXPECT_CALL(*mtu_tracker_ptr, RaiseTunnelMtu(1400));
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket(std::move(mss_mtu_detector),
+                                               std::move(mtu_tracker)));
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  PathMtuProber::Options options;
+  options.raise_interval = absl::ZeroDuration();
+  ASSERT_OK(sock->EnablePathMtuProbing(options, "10.2.0.1", "10.2.0.2"));
+
+  // The first write notices the tunnel MTU is low, and the next one probes.
+  std::string msg(3, 'a');
+  for (int i = 0; i < 2; ++i) {
+    std::vector<Packet> packets;
+    packets.emplace_back(msg.c_str(), msg.size(), IPProtocol::kIPv4, []() {});
+    ASSERT_OK(sock->WritePackets(std::move(packets)));
+  }
+  ASSERT_OK_AND_ASSIGN((auto [port1, data1]), server.ReceivePacket());
+  EXPECT_EQ(data1, msg);
+  ASSERT_OK_AND_ASSIGN((auto [port2, probe]), server.ReceivePacket());
+  ASSERT_EQ(probe.size(), 1400);
+  EXPECT_EQ(probe[20], 8);  // Echo request
+  ASSERT_OK_AND_ASSIGN((auto [port3, data3]), server.ReceivePacket());
+  EXPECT_EQ(data3, msg);
+
+  DatapathDebugInfo debug_info;
+  sock->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.path_mtu_probes_sent(), 1);
+
+  // Echo the probe back, followed by a regular packet. The reply is consumed
+  // by the socket, and the next write raises the tunnel MTU.
+  std::string reply = probe;
+  reply[20] = 0;
+  server.SendSamplePacket(port2, reply);
+  server.SendSamplePacket(port2, "bar");
+  ASSERT_OK_AND_ASSIGN(auto recv_packets, sock->ReadPackets());
+  ASSERT_EQ(recv_packets.size(), 1);
+  EXPECT_EQ(recv_packets[0].data(), "bar");
+
+  std::vector<Packet> packets;
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  ASSERT_OK(sock->Close());
+}
+
+TEST(DatagramSocketTest, DynamicMtuClampsTcpMss) {
+  testing::SimpleUdpServer server;
+
+  auto mtu_tracker = std::make_unique<MockMtuTracker>();
+  MockMtuTracker* mtu_tracker_ptr = mtu_tracker.get();
+
+  auto mss_mtu_detector = std::make_unique<MockMssMtuDetector>();
+
+  EXPECT_CALL(*mtu_tracker_ptr, UpdateUplinkMtu(_));
+  EXPECT_CALL(*mtu_tracker_ptr, GetTunnelMtu()).WillRepeatedly(Return(1300));
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket(std::move(mss_mtu_detector),
+                                               std::move(mtu_tracker)));
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  // An IPv4 TCP SYN with an MSS of 1460.
+  std::string syn(44, '\0');
+  syn[0] = 0x45;
+  syn[3] = 44;
+  syn[9] = 6;
+  syn[32] = 0x60;  // Data offset
+  syn[33] = 0x02;  // SYN
+  syn[40] = 2;
+  syn[41] = 4;
+  syn[42] = 0x05;
+  syn[43] = static_cast<char>(0xb4);
+
+  std::vector<Packet> packets;
+  packets.emplace_back(syn.data(), syn.size(), 0, syn.size(),
+                       IPProtocol::kIPv4, PacketOwner());
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  // The MSS is lowered to 1300 - 40 = 1260.
+  ASSERT_OK_AND_ASSIGN((auto [port, data]), server.ReceivePacket());
+  ASSERT_EQ(data.size(), syn.size());
+  EXPECT_EQ(static_cast<uint8_t>(data[42]), 0x04);
+  EXPECT_EQ(static_cast<uint8_t>(data[43]), 0xec);
+
+  DatapathDebugInfo debug_info;
+  sock->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.tcp_mss_clamped(), 1);
+
+  ASSERT_OK(sock->Close());
+}
+
+TEST(DatagramSocketTest, DynamicMtuRepliesPacketTooBig) {
+  testing::SimpleUdpServer server;
+
+  auto mtu_tracker = std::make_unique<MockMtuTracker>();
+  MockMtuTracker* mtu_tracker_ptr = mtu_tracker.get();
+
+  auto mss_mtu_detector = std::make_unique<MockMssMtuDetector>();
+
+  EXPECT_CALL(*mtu_tracker_ptr, GetTunnelMtu()).WillRepeatedly(Return(1300));
+
+  ASSERT_OK_AND_ASSIGN(auto sock, CreateSocket(std::move(mss_mtu_detector),
+                                               std::move(mtu_tracker)));
+  ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server.port()));
+  ASSERT_OK(sock->Connect(localhost));
+
+  const std::string source("\x0a\x02\x00\x01", 4);
+  const std::string destination("\x08\x08\x08\x08", 4);
+  ASSERT_OK_AND_ASSIGN(auto oversize,
+                       utils::BuildEchoRequest(source, destination, 1, 1,
+                                               1400));
+
+  // Far more oversize packets than the rate limit allows replies for.
+  std::vector<Packet> packets;
+  for (int i = 0; i < 20; ++i) {
+    packets.emplace_back(oversize.data(), oversize.size(), IPProtocol::kIPv4,
+                         []() {});
+  }
+  ASSERT_OK(sock->WritePackets(std::move(packets)));
+
+  ASSERT_OK_AND_ASSIGN(auto replies, sock->ReadPackets());
+  ASSERT_EQ(replies.size(), 10);
+  auto reply = replies[0].data();
+  EXPECT_EQ(reply.substr(12, 4), destination);
+  EXPECT_EQ(reply.substr(16, 4), source);
+  EXPECT_EQ(reply[20], 3);
+  EXPECT_EQ(reply[21], 4);
+  EXPECT_EQ((static_cast<uint8_t>(reply[26]) << 8) |
+                static_cast<uint8_t>(reply[27]),
+            1300);
+
+  DatapathDebugInfo debug_info;
+  sock->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.uplink_packets_dropped(), 20);
+  EXPECT_EQ(debug_info.packet_too_big_sent(), 10);
+
+  ASSERT_OK(sock->Close());
+}
+
 }  // namespace
 }  // namespace android
 }  // namespace datapath
@@ -0,0 +1,644 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/functional/function_ref.h"
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/memory/memory.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+namespace {
+
+// Room for the reader's read and poll, along with a batch of buffers being
+// provided again.
+constexpr unsigned int kReaderEntries = 64;
+
+// The most writes submitted with a single system call.
+constexpr unsigned int kWriterEntries = 64;
+
+// How long a reader waits for packets to give their buffers back, once the
+// kernel has run out of them.
+constexpr absl::Duration kOutOfBuffersDelay = absl::Milliseconds(1);
+
+constexpr uint16_t kReadBufferGroup = 0;
+
+// Tells the reader's completions apart.
+constexpr uint64_t kReadTag = 1;
+constexpr uint64_t kCancelTag = 2;
+
+bool IsSocket(int fd) {
+  int type;
+  socklen_t length = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0;
+}
+
+// Waits until the fd can be written to, for when a write would have blocked.
+// Returns false if waiting failed.
+bool WaitUntilWritable(int fd) {
+  pollfd poll_fd;
+  poll_fd.fd = fd;
+  poll_fd.events = POLLOUT;
+  poll_fd.revents = 0;
+  int result;
+  do {
+    result = poll(&poll_fd, 1, -1);
+  } while (result == -1 && errno == EINTR);
+  return result > 0;
+}
+
+template <typename T>
+T* RingPointer(void* ring_memory, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(ring_memory) + offset);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<IoUring>> IoUring::Create(
+    unsigned int entries, unsigned int cq_entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = cq_entries;
+  int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    return absl::UnavailableError(
+        absl::StrCat("io_uring is not available: ", strerror(errno)));
+  }
+  auto ring = absl::WrapUnique(new IoUring(ring_fd));
+  PPN_RETURN_IF_ERROR(ring->Init(params));
+  PPN_RETURN_IF_ERROR(ring->Probe());
+  return ring;
+}
+
+IoUring::IoUring(int ring_fd) : ring_fd_(ring_fd) {}
+
+IoUring::~IoUring() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (ring_memory_ != nullptr) {
+    munmap(ring_memory_, ring_memory_size_);
+  }
+  close(ring_fd_);
+}
+
+absl::Status IoUring::Init(const io_uring_params& params) {
+  // Both features are older than the provided buffer rings we depend on, so
+  // this only fails on kernels that couldn't be used anyway.
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_NODROP) == 0) {
+    return absl::UnavailableError("io_uring is too old");
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  ring_memory_size_ = std::max(sq_size, cq_size);
+  void* ring_memory =
+      mmap(nullptr, ring_memory_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (ring_memory == MAP_FAILED) {
+    return absl::InternalError(
+        absl::StrCat("Unable to map io_uring: ", strerror(errno)));
+  }
+  ring_memory_ = ring_memory;
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return absl::InternalError(absl::StrCat(
+        "Unable to map io_uring submissions: ", strerror(errno)));
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = RingPointer<unsigned int>(ring_memory_, params.sq_off.head);
+  sq_tail_ = RingPointer<unsigned int>(ring_memory_, params.sq_off.tail);
+  sq_array_ = RingPointer<unsigned int>(ring_memory_, params.sq_off.array);
+  sq_mask_ = *RingPointer<unsigned int>(ring_memory_, params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = RingPointer<unsigned int>(ring_memory_, params.cq_off.head);
+  cq_tail_ = RingPointer<unsigned int>(ring_memory_, params.cq_off.tail);
+  cqes_ = RingPointer<io_uring_cqe>(ring_memory_, params.cq_off.cqes);
+  cq_mask_ = *RingPointer<unsigned int>(ring_memory_, params.cq_off.ring_mask);
+  sqe_tail_ = *sq_tail_;
+  sqe_submitted_ = sqe_tail_;
+  return absl::OkStatus();
+}
+
+absl::Status IoUring::Probe() {
+  constexpr size_t kMaxOps = 256;
+  std::vector<char> buffer(sizeof(io_uring_probe) +
+                           kMaxOps * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+  PPN_RETURN_IF_ERROR(Register(IORING_REGISTER_PROBE, probe, kMaxOps));
+  for (size_t i = 0; i < probe->ops_len && i < kMaxOps; ++i) {
+    if ((probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0) {
+      supported_ops_.set(probe->ops[i].op);
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status IoUring::Register(unsigned int opcode, const void* arg,
+                               unsigned int nr_args) {
+  if (syscall(__NR_io_uring_register, ring_fd_, opcode, arg, nr_args) < 0) {
+    return absl::InternalError(absl::StrCat("io_uring_register(", opcode,
+                                            ") failed: ", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status IoUring::RegisterFiles(absl::Span<const int> fds) {
+  return Register(IORING_REGISTER_FILES, fds.data(), fds.size());
+}
+
+absl::Status IoUring::UpdateFile(unsigned int index, int fd) {
+  int fds[] = {fd};
+  io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = index;
+  update.fds = reinterpret_cast<uint64_t>(fds);
+  return Register(IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+io_uring_sqe* IoUring::GetSqe() {
+  unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) {
+    return nullptr;
+  }
+  unsigned int index = sqe_tail_ & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  ++sqe_tail_;
+  return sqe;
+}
+
+absl::StatusOr<io_uring_sqe*> IoUring::NextSqe() {
+  io_uring_sqe* sqe = GetSqe();
+  if (sqe != nullptr) {
+    return sqe;
+  }
+  PPN_RETURN_IF_ERROR(Submit(0));
+  sqe = GetSqe();
+  if (sqe == nullptr) {
+    return absl::ResourceExhaustedError("io_uring submission queue is full");
+  }
+  return sqe;
+}
+
+absl::Status IoUring::Submit(unsigned int wait_for) {
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+  unsigned int to_submit = sqe_tail_ - sqe_submitted_;
+  while (true) {
+    unsigned int flags = 0;
+    unsigned int min_complete = 0;
+    if (wait_for > 0 && CompletionsReady() < wait_for) {
+      flags = IORING_ENTER_GETEVENTS;
+      min_complete = wait_for;
+    }
+    if (to_submit == 0 && flags == 0) {
+      return absl::OkStatus();
+    }
+    int submitted = syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                            min_complete, flags, nullptr, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return absl::InternalError(
+          absl::StrCat("io_uring_enter failed: ", strerror(errno)));
+    }
+    if (submitted == 0 && to_submit > 0 && flags == 0) {
+      return absl::InternalError("io_uring_enter didn't submit anything");
+    }
+    sqe_submitted_ += submitted;
+    to_submit -= submitted;
+  }
+}
+
+size_t IoUring::CompletionsReady() const {
+  return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+}
+
+size_t IoUring::ProcessCompletions(
+    absl::FunctionRef<void(const io_uring_cqe&)> handler) {
+  unsigned int head = *cq_head_;
+  unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+  for (; head != tail; ++head, ++count) {
+    handler(cqes_[head & cq_mask_]);
+  }
+  // Lets the kernel reuse the entries.
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+absl::StatusOr<std::unique_ptr<IoUringBufferGroup>> IoUringBufferGroup::Create(
+    uint16_t group_id, uint16_t buffer_count, size_t buffer_size) {
+  if (buffer_count == 0) {
+    return absl::InvalidArgumentError("Buffer count must not be zero");
+  }
+  if (buffer_size <= kPacketHeadroom + kPacketTailroom) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Buffer size is too small: ", buffer_size));
+  }
+  auto* shared = new Shared();
+  shared->buffers = std::make_unique<char[]>(buffer_count * buffer_size);
+  shared->buffer_size = buffer_size;
+  shared->buffer_count = buffer_count;
+  {
+    absl::MutexLock lock(&shared->mutex);
+    shared->returned.reserve(buffer_count);
+    for (uint16_t i = 0; i < buffer_count; ++i) {
+      shared->returned.push_back(i);
+    }
+  }
+  return absl::WrapUnique(new IoUringBufferGroup(group_id, shared));
+}
+
+IoUringBufferGroup::IoUringBufferGroup(uint16_t group_id, Shared* shared)
+    : group_id_(group_id), shared_(shared) {
+  to_provide_.reserve(shared->buffer_count);
+}
+
+IoUringBufferGroup::~IoUringBufferGroup() {
+  bool last;
+  {
+    absl::MutexLock lock(&shared_->mutex);
+    shared_->orphaned = true;
+    last = shared_->outstanding == 0;
+  }
+  // Otherwise, the last packet to be destroyed will clean up.
+  if (last) {
+    delete shared_;
+  }
+}
+
+absl::Status IoUringBufferGroup::ProvideBuffers(IoUring* ring) {
+  to_provide_.clear();
+  {
+    absl::MutexLock lock(&shared_->mutex);
+    to_provide_.swap(shared_->returned);
+  }
+  for (uint16_t buffer_id : to_provide_) {
+    io_uring_sqe* sqe = ring->GetSqe();
+    if (sqe == nullptr) {
+      PPN_RETURN_IF_ERROR(ring->Submit(0));
+      sqe = ring->GetSqe();
+
+      if (sqe == nullptr) {
+        return absl::InternalError("io_uring submission queue is full");
+      }
+    }
+    // The kernel writes between the headroom and the tailroom, so that the
+    // packets can be encrypted or decrypted in place.
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<uint64_t>(
+        shared_->buffers.get() + buffer_id * shared_->buffer_size +
+        kPacketHeadroom);
+    sqe->len = shared_->buffer_size - kPacketHeadroom - kPacketTailroom;
+    sqe->off = buffer_id;
+    sqe->buf_group = group_id_;
+    sqe->user_data = kProvideBuffersTag;
+  }
+  return absl::OkStatus();
+}
+
+Packet IoUringBufferGroup::MakePacket(uint16_t buffer_id, size_t length,
+                                      IPProtocol protocol) {
+  {
+    absl::MutexLock lock(&shared_->mutex);
+    ++shared_->outstanding;
+  }
+  char* buffer = shared_->buffers.get() + buffer_id * shared_->buffer_size;
+  return Packet(buffer, shared_->buffer_size, kPacketHeadroom, length,
+                protocol, PacketOwner::PoolReturn(&ReturnToShared, shared_,
+                                                  buffer));
+}
+
+void IoUringBufferGroup::Recycle(uint16_t buffer_id) {
+  absl::MutexLock lock(&shared_->mutex);
+  shared_->returned.push_back(buffer_id);
+}
+
+size_t IoUringBufferGroup::available_buffers() const {
+  absl::MutexLock lock(&shared_->mutex);
+  return shared_->buffer_count - shared_->outstanding;
+}
+
+void IoUringBufferGroup::ReturnToShared(void* shared_state, void* buffer) {
+  auto* shared = static_cast<Shared*>(shared_state);
+  const auto buffer_id = static_cast<uint16_t>(
+      (static_cast<char*>(buffer) - shared->buffers.get()) /
+      shared->buffer_size);
+  bool last;
+  {
+    absl::MutexLock lock(&shared->mutex);
+    if (!shared->orphaned) {
+      shared->returned.push_back(buffer_id);
+    }
+    --shared->outstanding;
+    last = shared->orphaned && shared->outstanding == 0;
+  }
+  if (last) {
+    delete shared;
+  }
+}
+
+absl::StatusOr<std::unique_ptr<IoUringReader>> IoUringReader::Create(
+    int fd, uint16_t buffer_count, size_t buffer_size) {
+  bool is_socket = IsSocket(fd);
+  // Every buffer may complete, or be provided again, before the reader gets
+  // around to the completions.
+  PPN_ASSIGN_OR_RETURN(
+      auto ring,
+      IoUring::Create(kReaderEntries, 2 * (buffer_count + kReaderEntries)));
+  if (!ring->IsSupported(is_socket ? IORING_OP_RECV
+                                   : kIoUringOpReadMultishot) ||
+      !ring->IsSupported(IORING_OP_PROVIDE_BUFFERS) ||
+      !ring->IsSupported(IORING_OP_POLL_ADD)) {
+    return absl::UnavailableError("io_uring doesn't support multishot reads");
+  }
+  int fds[] = {fd};
+  PPN_RETURN_IF_ERROR(ring->RegisterFiles(fds));
+  auto reader = absl::WrapUnique(new IoUringReader(is_socket, std::move(ring)));
+  PPN_ASSIGN_OR_RETURN(
+      reader->buffers_,
+      IoUringBufferGroup::Create(kReadBufferGroup, buffer_count, buffer_size));
+  return reader;
+}
+
+IoUringReader::IoUringReader(bool is_socket, std::unique_ptr<IoUring> ring)
+    : is_socket_(is_socket), ring_(std::move(ring)) {}
+
+// Closing the ring cancels anything still in flight, so the kernel can't
+// write to the buffers once they're gone.
+IoUringReader::~IoUringReader() {
+  ring_.reset();
+  buffers_.reset();
+}
+
+absl::StatusOr<std::vector<Packet>> IoUringReader::Read() {
+  std::vector<Packet> packets;
+  if (cancelled_) {
+    cancelled_ = false;
+    return packets;
+  }
+  while (!end_of_file_) {
+    PPN_RETURN_IF_ERROR(buffers_->ProvideBuffers(ring_.get()));
+    PPN_RETURN_IF_ERROR(Arm());
+    PPN_RETURN_IF_ERROR(ring_->Submit(1));
+    absl::Status status;
+    ring_->ProcessCompletions(
+        [this, &packets, &status](const io_uring_cqe& cqe) {
+          HandleCompletion(cqe, &packets, &status);
+        });
+    // A cancellation or failure is only reported once the packets that were
+    // read before it have been handed on. If a failure persists, the next
+    // read will hit it again.
+    if (!packets.empty()) {
+      if (!status.ok()) {
+        LOG(WARNING) << "Read failed after " << packets.size()
+                     << " packets: " << status;
+      }
+      return packets;
+    }
+    if (cancelled_) {
+      cancelled_ = false;
+      return packets;
+    }
+    PPN_RETURN_IF_ERROR(status);
+    if (out_of_buffers_) {
+      // Every buffer is held by a packet that hasn't been destroyed yet.
+      out_of_buffers_ = false;
+      absl::SleepFor(kOutOfBuffersDelay);
+    }
+  }
+  return absl::AbortedError("Reached end of file");
+}
+
+absl::Status IoUringReader::Arm() {
+  if (!read_armed_) {
+    PPN_ASSIGN_OR_RETURN(io_uring_sqe * sqe, ring_->NextSqe());
+    // The length is left at zero, so that whole buffers are read into.
+    sqe->opcode = is_socket_ ? IORING_OP_RECV : kIoUringOpReadMultishot;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers_->group_id();
+    if (is_socket_) {
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = kReadTag;
+    read_armed_ = true;
+  }
+  if (!cancel_armed_) {
+    PPN_ASSIGN_OR_RETURN(io_uring_sqe * sqe, ring_->NextSqe());
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = cancel_event_.fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = kCancelTag;
+    cancel_armed_ = true;
+  }
+  return absl::OkStatus();
+}
+
+void IoUringReader::HandleCompletion(const io_uring_cqe& cqe,
+                                     std::vector<Packet>* packets,
+                                     absl::Status* status) {
+  if (cqe.user_data == IoUringBufferGroup::kProvideBuffersTag) {
+    if (cqe.res < 0) {
+      LOG(ERROR) << "Unable to provide read buffer: " << strerror(-cqe.res);
+    }
+    return;
+  }
+  if (cqe.user_data == kCancelTag) {
+    cancel_armed_ = false;
+    uint64_t value;
+    if (read(cancel_event_.fd(), &value, sizeof(value)) < 0 &&
+        errno != EAGAIN) {
+      LOG(ERROR) << "Unable to clear cancel event: " << strerror(errno);
+    }
+    cancelled_ = true;
+    return;
+  }
+
+  // Multishot reads keep going until they fail, or the kernel stops them.
+  if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+    read_armed_ = false;
+  }
+  if ((cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+    auto buffer_id =
+        static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe.res > 0) {
+      packets->push_back(
+          buffers_->MakePacket(buffer_id, cqe.res, IPProtocol::kUnknown));
+      return;
+    }
+    buffers_->Recycle(buffer_id);
+  }
+  if (cqe.res == 0) {
+    // An empty datagram, or the end of anything that isn't a socket.
+    end_of_file_ = !is_socket_;
+    return;
+  }
+  if (cqe.res == -ENOBUFS) {
+    out_of_buffers_ = true;
+    return;
+  }
+  if (cqe.res < 0 && status->ok()) {
+    *status = absl::InternalError(
+        absl::StrCat("io_uring read failed: ", strerror(-cqe.res)));
+  }
+}
+
+absl::Status IoUringReader::Cancel() { return cancel_event_.Notify(1); }
+
+absl::Status IoUringReader::ReleaseFile() { return ring_->UpdateFile(0, -1); }
+
+absl::StatusOr<std::unique_ptr<IoUringWriter>> IoUringWriter::Create(int fd) {
+  bool is_socket = IsSocket(fd);
+  PPN_ASSIGN_OR_RETURN(auto ring,
+                       IoUring::Create(kWriterEntries, 2 * kWriterEntries));
+  if (!ring->IsSupported(is_socket ? IORING_OP_SEND : IORING_OP_WRITE)) {
+    return absl::UnavailableError("io_uring doesn't support writes");
+  }
+  int fds[] = {fd};
+  PPN_RETURN_IF_ERROR(ring->RegisterFiles(fds));
+  return absl::WrapUnique(new IoUringWriter(fd, is_socket, std::move(ring)));
+}
+
+IoUringWriter::IoUringWriter(int fd, bool is_socket,
+                             std::unique_ptr<IoUring> ring)
+    : fd_(fd), is_socket_(is_socket), ring_(std::move(ring)) {}
+
+absl::Status IoUringWriter::Write(absl::Span<const Packet> packets,
+                                  int* dropped) {
+  absl::MutexLock lock(&mutex_);
+  if (released_) {
+    return absl::InternalError("Attempted to write to a released fd");
+  }
+  absl::Status status;
+  while (!packets.empty()) {
+    size_t chunk = std::min<size_t>(packets.size(), ring_->sq_entries());
+    PPN_ASSIGN_OR_RETURN(size_t handled,
+                         WriteChunk(packets.first(chunk), dropped, &status));
+    packets.remove_prefix(handled);
+  }
+  return status;
+}
+
+absl::StatusOr<size_t> IoUringWriter::WriteChunk(
+    absl::Span<const Packet> packets, int* dropped, absl::Status* status) {
+  // The writes are linked, so that they happen in order. If one of them
+  // fails, the rest are cancelled, and submitted again.
+  for (size_t i = 0; i < packets.size(); ++i) {
+    io_uring_sqe* sqe = ring_->GetSqe();
+    if (sqe == nullptr) {
+      return absl::InternalError("io_uring submission queue is full");
+    }
+    sqe->opcode = is_socket_ ? IORING_OP_SEND : IORING_OP_WRITE;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    if (i + 1 < packets.size()) {
+      sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(packets[i].data().data());
+    sqe->len = packets[i].data().size();
+    if (!is_socket_) {
+      // Use the current position, for files that have one. For sends, this
+      // field would be the destination address instead.
+      sqe->off = static_cast<uint64_t>(-1);
+    }
+    sqe->user_data = i;
+  }
+  PPN_RETURN_IF_ERROR(ring_->Submit(packets.size()));
+
+  std::vector<int> results(packets.size(), -ECANCELED);
+  ring_->ProcessCompletions([&results](const io_uring_cqe& cqe) {
+    if (cqe.user_data < results.size()) {
+      results[cqe.user_data] = cqe.res;
+    }
+  });
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    int result = results[i];
+    if (result >= 0) {
+      continue;
+    }
+    if (result == -EMSGSIZE) {
+      // The packet is too large for the path MTU.
+      ++*dropped;
+      continue;
+    }
+    if (result == -ECANCELED || result == -EINTR) {
+      return i;
+    }
+    if (result == -EAGAIN) {
+      // Only fds in non-blocking mode make io_uring give up like this.
+      if (!WaitUntilWritable(fd_)) {
+        return absl::InternalError(
+            absl::StrCat("Error waiting for FD=", fd_, ": ", strerror(errno)));
+      }
+      return i;
+    }
+    if (status->ok()) {
+      *status = absl::InternalError(absl::StrCat(
+          "Error writing to FD=", fd_, ": ", strerror(-result)));
+    }
+  }
+  return packets.size();
+}
+
+absl::Status IoUringWriter::ReleaseFile() {
+  absl::MutexLock lock(&mutex_);
+  released_ = true;
+  return ring_->UpdateFile(0, -1);
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
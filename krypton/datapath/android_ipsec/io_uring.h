@@ -0,0 +1,298 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_H_
+
+#include <linux/io_uring.h>
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/event_fd.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/functional/function_ref.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Multishot read for non-socket fds, e.g. a TUN device. It's newer than the
+// uapi headers we build against, so it's not in the opcode enum there.
+inline constexpr uint8_t kIoUringOpReadMultishot = 49;
+
+// A thin wrapper around an io_uring instance, driven through the raw system
+// calls. It isn't thread-safe: each instance must only be used by one thread
+// at a time, apart from the register calls, which the kernel serializes.
+class IoUring {
+ public:
+  // Creates a ring with room for `entries` submissions and `cq_entries`
+  // completions. Fails if io_uring isn't available, e.g. because the kernel
+  // is too old or a seccomp filter blocks it, so that callers can fall back
+  // to the plain system calls.
+  static absl::StatusOr<std::unique_ptr<IoUring>> Create(
+      unsigned int entries, unsigned int cq_entries);
+
+  ~IoUring();
+
+  // Disallow copy and assign.
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Returns whether the kernel supports the given IORING_OP_* opcode.
+  bool IsSupported(uint8_t opcode) const { return supported_ops_[opcode]; }
+
+  // Registers `fds` as the fixed files of this ring, so that submissions can
+  // refer to them by index with IOSQE_FIXED_FILE.
+  absl::Status RegisterFiles(absl::Span<const int> fds);
+
+  // Replaces the fixed file at `index`, or removes it if `fd` is -1. Requests
+  // that are already in flight keep using the old file until they complete.
+  absl::Status UpdateFile(unsigned int index, int fd);
+
+  // Issues an io_uring_register call on this ring.
+  absl::Status Register(unsigned int opcode, const void* arg,
+                        unsigned int nr_args);
+
+  // Returns a zeroed submission entry to fill in, or nullptr if the
+  // submission queue is full. It's not seen by the kernel until Submit().
+  io_uring_sqe* GetSqe();
+
+  // Like GetSqe(), but if the submission queue is full, submits what's in it
+  // to make room.
+  absl::StatusOr<io_uring_sqe*> NextSqe();
+
+  // Submits everything that was added with GetSqe(), then waits until at
+  // least `wait_for` completions are ready.
+  absl::Status Submit(unsigned int wait_for);
+
+  // Passes every ready completion to `handler`, and returns how many there
+  // were. Completions must not be kept past the call.
+  size_t ProcessCompletions(
+      absl::FunctionRef<void(const io_uring_cqe&)> handler);
+
+  unsigned int sq_entries() const { return sq_entries_; }
+
+ private:
+  explicit IoUring(int ring_fd);
+
+  absl::Status Init(const io_uring_params& params);
+  absl::Status Probe();
+  size_t CompletionsReady() const;
+
+  const int ring_fd_;
+
+  void* ring_memory_ = nullptr;
+  size_t ring_memory_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // Pointers into the shared ring memory.
+  unsigned int* sq_head_ = nullptr;
+  unsigned int* sq_tail_ = nullptr;
+  unsigned int* sq_array_ = nullptr;
+  unsigned int* cq_head_ = nullptr;
+  unsigned int* cq_tail_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned int sq_mask_ = 0;
+  unsigned int sq_entries_ = 0;
+  unsigned int cq_mask_ = 0;
+
+  // The submissions added with GetSqe() so far, and how many of them have
+  // been handed to the kernel.
+  unsigned int sqe_tail_ = 0;
+  unsigned int sqe_submitted_ = 0;
+
+  std::bitset<256> supported_ops_;
+};
+
+// A group of buffers that the kernel picks from when a read or receive with
+// IOSQE_BUFFER_SELECT completes, so that a multishot request can keep going
+// without being given a buffer each time.
+//
+// The buffers are handed out wrapped in Packets. When those are destroyed,
+// the buffers are queued up to be provided to the kernel again by the thread
+// that drives the ring, since submissions can't be added from any other. If
+// the kernel runs out of buffers because the packets are held on to,
+// multishot requests stop with ENOBUFS. Packets may outlive the group.
+class IoUringBufferGroup {
+ public:
+  // The user_data of the submissions that provide buffers.
+  static constexpr uint64_t kProvideBuffersTag = ~uint64_t{0};
+
+  // Creates `buffer_count` buffers of `buffer_size` bytes for `group_id`,
+  // none of which have been provided yet. Every buffer keeps kPacketHeadroom
+  // and kPacketTailroom bytes free around what the kernel writes to it.
+  static absl::StatusOr<std::unique_ptr<IoUringBufferGroup>> Create(
+      uint16_t group_id, uint16_t buffer_count, size_t buffer_size);
+
+  ~IoUringBufferGroup();
+
+  // Disallow copy and assign.
+  IoUringBufferGroup(const IoUringBufferGroup&) = delete;
+  IoUringBufferGroup& operator=(const IoUringBufferGroup&) = delete;
+
+  uint16_t group_id() const { return group_id_; }
+
+  // Adds submissions to `ring` that provide every buffer that has been given
+  // back since the last call, submitting as needed to make room for them.
+  absl::Status ProvideBuffers(IoUring* ring);
+
+  // Wraps the buffer that the kernel picked for a completion in a writable
+  // Packet of `length` bytes.
+  Packet MakePacket(uint16_t buffer_id, size_t length, IPProtocol protocol);
+
+  // Gives a buffer straight back, for completions that don't turn into a
+  // packet.
+  void Recycle(uint16_t buffer_id);
+
+  // Returns the number of buffers that aren't held by packets.
+  size_t available_buffers() const;
+
+ private:
+  // The state shared with outstanding packets, which is only deleted once the
+  // group and all of its packets are gone.
+  struct Shared {
+    absl::Mutex mutex;
+    std::vector<uint16_t> returned ABSL_GUARDED_BY(mutex);
+    size_t outstanding ABSL_GUARDED_BY(mutex) = 0;
+    bool orphaned ABSL_GUARDED_BY(mutex) = false;
+    std::unique_ptr<char[]> buffers;
+    size_t buffer_size = 0;
+    uint16_t buffer_count = 0;
+  };
+
+  IoUringBufferGroup(uint16_t group_id, Shared* shared);
+
+  // Queues the buffer to be provided to the kernel again, as a PacketOwner
+  // pool return.
+  static void ReturnToShared(void* shared, void* buffer);
+
+  const uint16_t group_id_;
+  Shared* shared_;
+
+  // Reused by ProvideBuffers(), to avoid allocating.
+  std::vector<uint16_t> to_provide_;
+};
+
+// Keeps a multishot receive, or read for files other than sockets, armed on
+// an fd, and turns its completions into packets. The fd is used as a fixed
+// file, so the kernel doesn't have to look it up for every read.
+class IoUringReader {
+ public:
+  // Reads from `fd`, which isn't owned, into `buffer_count` buffers of
+  // `buffer_size` bytes. Multishot receives need Linux 6.0, and multishot
+  // reads of anything other than a socket need Linux 6.7; on older kernels,
+  // the first Read() fails.
+  static absl::StatusOr<std::unique_ptr<IoUringReader>> Create(
+      int fd, uint16_t buffer_count, size_t buffer_size);
+
+  ~IoUringReader();
+
+  // Disallow copy and assign.
+  IoUringReader(const IoUringReader&) = delete;
+  IoUringReader& operator=(const IoUringReader&) = delete;
+
+  // Blocks until packets have been read, and returns all of the ones that
+  // are ready. Returns an empty vector if Cancel() was called, and an Aborted
+  // error once the fd has reached end of file. Must only be called from one
+  // thread at a time.
+  absl::StatusOr<std::vector<Packet>> Read();
+
+  // Causes the current or next call to Read() to return. Can be called from
+  // any thread.
+  absl::Status Cancel();
+
+  // Drops the reader's reference to the fd, so that closing the fd actually
+  // releases it. Reads that are in flight hold on to it until they complete.
+  // Can be called from any thread.
+  absl::Status ReleaseFile();
+
+  size_t available_buffers() const { return buffers_->available_buffers(); }
+
+ private:
+  IoUringReader(bool is_socket, std::unique_ptr<IoUring> ring);
+
+  absl::Status Arm();
+  void HandleCompletion(const io_uring_cqe& cqe, std::vector<Packet>* packets,
+                        absl::Status* status);
+
+  const bool is_socket_;
+  std::unique_ptr<IoUring> ring_;
+  std::unique_ptr<IoUringBufferGroup> buffers_;
+  EventFd cancel_event_;
+
+  bool read_armed_ = false;
+  bool cancel_armed_ = false;
+  bool cancelled_ = false;
+  bool out_of_buffers_ = false;
+  bool end_of_file_ = false;
+};
+
+// Writes batches of packets to an fd with one system call per batch. The fd
+// is used as a fixed file. Thread-safe.
+class IoUringWriter {
+ public:
+  // Writes to `fd`, which isn't owned. Sockets are written to with send, so
+  // they must be connected.
+  static absl::StatusOr<std::unique_ptr<IoUringWriter>> Create(int fd);
+
+  // Disallow copy and assign.
+  IoUringWriter(const IoUringWriter&) = delete;
+  IoUringWriter& operator=(const IoUringWriter&) = delete;
+
+  // Writes all of `packets`, waiting for the fd to become writable where
+  // needed. Packets that are rejected with EMSGSIZE are dropped and counted
+  // in `dropped`, rather than failing the write. Returns the first other
+  // error, after attempting the whole batch.
+  absl::Status Write(absl::Span<const Packet> packets, int* dropped)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Drops the writer's reference to the fd. Further writes will fail.
+  absl::Status ReleaseFile() ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  IoUringWriter(int fd, bool is_socket, std::unique_ptr<IoUring> ring);
+
+  // Submits one write per packet, and waits for all of them to complete.
+  // Returns how many of the packets were dealt with, which is fewer than all
+  // of them if the rest have to be submitted again. Write errors are recorded
+  // in `status`, if it doesn't already hold one.
+  absl::StatusOr<size_t> WriteChunk(absl::Span<const Packet> packets,
+                                    int* dropped, absl::Status* status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const int fd_;
+  const bool is_socket_;
+
+  absl::Mutex mutex_;
+  std::unique_ptr<IoUring> ring_ ABSL_GUARDED_BY(mutex_);
+  bool released_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_H_
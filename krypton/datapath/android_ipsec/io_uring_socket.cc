@@ -0,0 +1,155 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring_socket.h"
+
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+#include "privacy/net/krypton/endpoint.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/debug_info.proto.h"
+#include "privacy/net/krypton/utils/fd_util.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/memory/memory.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+namespace {
+constexpr int kMaxPacketSize = 4096;
+
+// How many datagrams can be waiting to be read, or held on to by packets that
+// haven't been destroyed yet, before the kernel has to drop them.
+constexpr uint16_t kReadBufferCount = 256;
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<IoUringSocket>> IoUringSocket::Create(
+    int socket_fd) {
+  PPN_ASSIGN_OR_RETURN(
+      auto reader,
+      IoUringReader::Create(socket_fd, kReadBufferCount, kMaxPacketSize));
+  PPN_ASSIGN_OR_RETURN(auto writer, IoUringWriter::Create(socket_fd));
+  return absl::WrapUnique(
+      new IoUringSocket(socket_fd, std::move(reader), std::move(writer)));
+}
+
+IoUringSocket::IoUringSocket(int socket_fd,
+                             std::unique_ptr<IoUringReader> reader,
+                             std::unique_ptr<IoUringWriter> writer)
+    : socket_fd_(socket_fd),
+      reader_(std::move(reader)),
+      writer_(std::move(writer)),
+      uplink_packets_dropped_(0) {}
+
+IoUringSocket::~IoUringSocket() {
+  if (socket_fd_ >= 0) {
+    PPN_LOG_IF_ERROR(Close());
+  }
+}
+
+absl::Status IoUringSocket::Close() {
+  int fd = socket_fd_.exchange(-1);
+  if (fd < 0) {
+    LOG(WARNING) << "Attempted to close socket that was already closed.";
+    return absl::OkStatus();
+  }
+  LOG(INFO) << "Closing Socket FD=" << fd;
+  shutdown(fd, SHUT_RDWR);
+  // The rings hold their own references to the socket, which would keep it
+  // open past the close otherwise.
+  PPN_LOG_IF_ERROR(reader_->ReleaseFile());
+  PPN_LOG_IF_ERROR(writer_->ReleaseFile());
+  PPN_LOG_IF_ERROR(CloseFd(fd));
+  PPN_LOG_IF_ERROR(CancelReadPackets());
+  return absl::OkStatus();
+}
+
+absl::Status IoUringSocket::CancelReadPackets() { return reader_->Cancel(); }
+
+absl::StatusOr<std::vector<Packet>> IoUringSocket::ReadPackets() {
+  if (socket_fd_ < 0) {
+    return absl::InternalError("Attempted to read on a closed socket.");
+  }
+  return reader_->Read();
+}
+
+absl::Status IoUringSocket::WritePackets(std::vector<Packet> packets) {
+  if (socket_fd_ < 0) {
+    return absl::InternalError("Attempted to write to a closed socket.");
+  }
+  int dropped = 0;
+  auto status = writer_->Write(packets, &dropped);
+  uplink_packets_dropped_ += dropped;
+  return status;
+}
+
+absl::Status IoUringSocket::Connect(Endpoint dest) {
+  int fd = socket_fd_;
+  if (fd < 0) {
+    return absl::InternalError("Attempted to write to a closed socket.");
+  }
+
+  LOG(INFO) << "Connecting FD=" << fd << " to " << dest.ToString();
+
+  // Convert the address into a sockaddr so we can use it with connect().
+  PPN_ASSIGN_OR_RETURN(auto sockaddr_info, dest.GetSockAddr());
+
+  if (sockaddr_info.socklen == 0) {
+    return absl::InternalError("Got addr_size == 0.");
+  }
+
+  if (connect(fd, reinterpret_cast<sockaddr*>(&sockaddr_info.sockaddr),
+              sockaddr_info.socklen) != 0) {
+    return absl::InternalError(
+        absl::StrCat("Error connecting FD=", fd, ": ", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+int IoUringSocket::GetFd() { return socket_fd_; }
+
+void IoUringSocket::GetDebugInfo(DatapathDebugInfo* debug_info) {
+  debug_info->set_uplink_packets_dropped(uplink_packets_dropped_);
+}
+
+absl::Status IoUringSocket::EnablePathMtuProbing(
+    const PathMtuProber::Options& /*options*/,
+    const std::string& /*source_address*/,
+    const std::string& /*destination_address*/) {
+  return absl::UnimplementedError(
+      "Path MTU probing is not supported with io_uring");
+}
+
+std::string IoUringSocket::DebugString() {
+  return absl::StrCat("FD=", socket_fd_.load(), " (io_uring)");
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,88 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_SOCKET_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_SOCKET_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+#include "privacy/net/krypton/datapath/android_ipsec/ipsec_socket_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
+#include "privacy/net/krypton/endpoint.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/debug_info.proto.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// An IpSecSocketInterface that reads and writes a UDP socket through
+// io_uring. Datagrams are received by a multishot receive into a ring of
+// buffers owned by the kernel, and every batch of packets is sent with a
+// single system call. Path MTU discovery isn't supported.
+class IoUringSocket : public IpSecSocketInterface {
+ public:
+  // Fails if io_uring isn't available, in which case DatagramSocket should be
+  // used instead.
+  static absl::StatusOr<std::unique_ptr<IoUringSocket>> Create(int socket_fd);
+
+  ~IoUringSocket() override;
+  IoUringSocket(const IoUringSocket&) = delete;
+  IoUringSocket(IoUringSocket&&) = delete;
+
+  absl::Status Close() override;
+
+  absl::Status CancelReadPackets() override;
+
+  absl::StatusOr<std::vector<Packet>> ReadPackets() override;
+
+  absl::Status WritePackets(std::vector<Packet> packets) override;
+
+  // Connects the underlying socket fd to the given endpoint.
+  // This should be called before calling WritePackets.
+  absl::Status Connect(Endpoint dest) override;
+
+  int GetFd() override;
+
+  void GetDebugInfo(DatapathDebugInfo* debug_info) override;
+
+  absl::Status EnablePathMtuProbing(
+      const PathMtuProber::Options& options, const std::string& source_address,
+      const std::string& destination_address) override;
+
+  std::string DebugString();
+
+ private:
+  IoUringSocket(int socket_fd, std::unique_ptr<IoUringReader> reader,
+                std::unique_ptr<IoUringWriter> writer);
+
+  std::atomic_int socket_fd_;
+  std::unique_ptr<IoUringReader> reader_;
+  std::unique_ptr<IoUringWriter> writer_;
+  std::atomic_int uplink_packets_dropped_;
+};
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IO_URING_SOCKET_H_
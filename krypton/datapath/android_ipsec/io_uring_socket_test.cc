@@ -0,0 +1,154 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring_socket.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/simple_udp_server.h"
+#include "privacy/net/krypton/endpoint.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::status::StatusIs;
+
+absl::StatusOr<Endpoint> GetLocalhost(int port) {
+  return GetEndpointFromHostPort(absl::StrFormat("[::1]:%d", port));
+}
+
+class IoUringSocketTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    ASSERT_GE(fd, 0);
+    auto sock = IoUringSocket::Create(fd);
+    if (!sock.ok()) {
+      // io_uring may be disabled, e.g. by a seccomp filter.
+      close(fd);
+      GTEST_SKIP() << sock.status();
+    }
+    sock_ = *std::move(sock);
+    ASSERT_OK_AND_ASSIGN(auto localhost, GetLocalhost(server_.port()));
+    ASSERT_OK(sock_->Connect(localhost));
+  }
+
+  testing::SimpleUdpServer server_;
+  std::unique_ptr<IoUringSocket> sock_;
+};
+
+TEST_F(IoUringSocketTest, BasicReadAndWrite) {
+  // Send a packet to the server, to establish the client port.
+  std::vector<Packet> packets;
+  packets.emplace_back("foo", 3, IPProtocol::kIPv6, []() {});
+  ASSERT_OK(sock_->WritePackets(std::move(packets)));
+
+  ASSERT_OK_AND_ASSIGN((auto [port, data]), server_.ReceivePacket());
+  EXPECT_EQ("foo", data);
+
+  server_.SendSamplePacket(port, "bar");
+
+  ASSERT_OK_AND_ASSIGN(auto recv_packets, sock_->ReadPackets());
+  ASSERT_EQ(1, recv_packets.size());
+  EXPECT_EQ("bar", recv_packets[0].data());
+  EXPECT_TRUE(recv_packets[0].is_writable());
+  EXPECT_GE(recv_packets[0].headroom(), kPacketHeadroom);
+  EXPECT_GE(recv_packets[0].tailroom(), kPacketTailroom);
+
+  ASSERT_OK(sock_->Close());
+  ASSERT_THAT(sock_->ReadPackets(), StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(IoUringSocketTest, BatchedReadAndWrite) {
+  // More packets than fit in one submission queue.
+  const int kNumPackets = 100;
+  std::vector<std::string> messages;
+  for (int i = 0; i < kNumPackets; ++i) {
+    messages.push_back(absl::StrCat("packet ", i));
+  }
+  std::vector<Packet> packets;
+  for (const auto& message : messages) {
+    packets.emplace_back(message.data(), message.size(), IPProtocol::kIPv6,
+                         []() {});
+  }
+  ASSERT_OK(sock_->WritePackets(std::move(packets)));
+
+  int port = 0;
+  for (const auto& message : messages) {
+    ASSERT_OK_AND_ASSIGN((auto [remote_port, data]), server_.ReceivePacket());
+    EXPECT_EQ(message, data);
+    port = remote_port;
+  }
+
+  server_.SendSamplePacket(port, "foo");
+  server_.SendSamplePacket(port, "bar");
+  server_.SendSamplePacket(port, "baz");
+
+  std::vector<std::string> received;
+  while (received.size() < 3) {
+    ASSERT_OK_AND_ASSIGN(auto recv_packets, sock_->ReadPackets());
+    ASSERT_FALSE(recv_packets.empty());
+    for (const auto& packet : recv_packets) {
+      received.emplace_back(packet.data());
+    }
+  }
+  EXPECT_THAT(received, ::testing::ElementsAre("foo", "bar", "baz"));
+  ASSERT_OK(sock_->Close());
+}
+
+TEST_F(IoUringSocketTest, CancelReadPackets) {
+  std::thread cancel([this] {
+    absl::SleepFor(absl::Milliseconds(10));
+    ASSERT_OK(sock_->CancelReadPackets());
+  });
+  ASSERT_OK_AND_ASSIGN(auto packets, sock_->ReadPackets());
+  cancel.join();
+  EXPECT_TRUE(packets.empty());
+  ASSERT_OK(sock_->Close());
+}
+
+TEST_F(IoUringSocketTest, CloseInterruptsRead) {
+  std::thread close([this] {
+    absl::SleepFor(absl::Milliseconds(10));
+    ASSERT_OK(sock_->Close());
+  });
+  ASSERT_OK_AND_ASSIGN(auto packets, sock_->ReadPackets());
+  close.join();
+  EXPECT_TRUE(packets.empty());
+  EXPECT_EQ(sock_->GetFd(), -1);
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
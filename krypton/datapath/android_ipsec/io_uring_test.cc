@@ -0,0 +1,228 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::status::StatusIs;
+
+constexpr size_t kBufferSize = 256;
+
+class IoUringTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // io_uring may be disabled, e.g. by a seccomp filter.
+    auto ring = IoUring::Create(4, 8);
+    if (!ring.ok()) {
+      GTEST_SKIP() << ring.status();
+    }
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds_), 0);
+  }
+
+  void TearDown() override {
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  void Send(const std::string& data) {
+    ASSERT_EQ(send(fds_[1], data.data(), data.size(), 0), data.size());
+  }
+
+  int fds_[2] = {-1, -1};
+};
+
+TEST_F(IoUringTest, ReadsBurstIntoPacketsWithRoom) {
+  ASSERT_OK_AND_ASSIGN(auto reader,
+                       IoUringReader::Create(fds_[0], 8, kBufferSize));
+  Send("foo");
+  Send("barbaz");
+
+  std::vector<Packet> packets;
+  while (packets.size() < 2) {
+    ASSERT_OK_AND_ASSIGN(auto read, reader->Read());
+    for (auto& packet : read) {
+      packets.push_back(std::move(packet));
+    }
+  }
+  EXPECT_EQ(packets[0].data(), "foo");
+  EXPECT_EQ(packets[1].data(), "barbaz");
+  EXPECT_TRUE(packets[0].is_writable());
+  EXPECT_EQ(packets[0].headroom(), kPacketHeadroom);
+  EXPECT_EQ(packets[0].tailroom(), kBufferSize - kPacketHeadroom - 3);
+  EXPECT_EQ(reader->available_buffers(), 6);
+
+  packets.clear();
+  EXPECT_EQ(reader->available_buffers(), 8);
+}
+
+TEST_F(IoUringTest, ReadContinuesOnceBuffersAreReturned) {
+  ASSERT_OK_AND_ASSIGN(auto reader,
+                       IoUringReader::Create(fds_[0], 2, kBufferSize));
+  Send("one");
+  Send("two");
+  Send("three");
+
+  std::vector<Packet> held;
+  while (held.size() < 2) {
+    ASSERT_OK_AND_ASSIGN(auto read, reader->Read());
+    for (auto& packet : read) {
+      held.push_back(std::move(packet));
+    }
+  }
+  EXPECT_EQ(reader->available_buffers(), 0);
+
+  std::thread release([&held] {
+    absl::SleepFor(absl::Milliseconds(10));
+    held.clear();
+  });
+  ASSERT_OK_AND_ASSIGN(auto read, reader->Read());
+  release.join();
+  ASSERT_EQ(read.size(), 1);
+  EXPECT_EQ(read[0].data(), "three");
+}
+
+TEST_F(IoUringTest, CancelInterruptsRead) {
+  ASSERT_OK_AND_ASSIGN(auto reader,
+                       IoUringReader::Create(fds_[0], 4, kBufferSize));
+  std::thread cancel([&reader] {
+    absl::SleepFor(absl::Milliseconds(10));
+    ASSERT_OK(reader->Cancel());
+  });
+  ASSERT_OK_AND_ASSIGN(auto read, reader->Read());
+  cancel.join();
+  EXPECT_TRUE(read.empty());
+
+  // The read is still armed afterwards.
+  Send("foo");
+  ASSERT_OK_AND_ASSIGN(read, reader->Read());
+  ASSERT_EQ(read.size(), 1);
+  EXPECT_EQ(read[0].data(), "foo");
+}
+
+TEST_F(IoUringTest, PacketsCanOutliveTheReader) {
+  ASSERT_OK_AND_ASSIGN(auto reader,
+                       IoUringReader::Create(fds_[0], 4, kBufferSize));
+  Send("foo");
+  ASSERT_OK_AND_ASSIGN(auto read, reader->Read());
+  reader.reset();
+  ASSERT_EQ(read.size(), 1);
+  EXPECT_EQ(read[0].data(), "foo");
+}
+
+TEST_F(IoUringTest, ReadsPipeUntilEndOfFile) {
+  int pipe_fds[2];
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  auto reader = IoUringReader::Create(pipe_fds[0], 4, kBufferSize);
+  if (!reader.ok()) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    GTEST_SKIP() << reader.status();
+  }
+  ASSERT_EQ(write(pipe_fds[1], "foo", 3), 3);
+  ASSERT_OK_AND_ASSIGN(auto read, (*reader)->Read());
+  ASSERT_EQ(read.size(), 1);
+  EXPECT_EQ(read[0].data(), "foo");
+
+  close(pipe_fds[1]);
+  EXPECT_THAT((*reader)->Read(), StatusIs(absl::StatusCode::kAborted));
+  close(pipe_fds[0]);
+}
+
+TEST_F(IoUringTest, WritesBatchInOrder) {
+  ASSERT_OK_AND_ASSIGN(auto writer, IoUringWriter::Create(fds_[1]));
+  std::vector<std::string> messages;
+  for (int i = 0; i < 100; ++i) {
+    messages.push_back(absl::StrCat("packet", i));
+  }
+  std::vector<Packet> packets;
+  for (const auto& message : messages) {
+    packets.emplace_back(message.data(), message.size(), IPProtocol::kIPv4,
+                         [] {});
+  }
+  // More than fits in the socket buffer at once, so some of the writes
+  // have to wait for the reads below.
+  std::vector<std::string> received;
+  std::thread reader([this, &received] {
+    char buffer[64];
+    for (int i = 0; i < 100; ++i) {
+      ssize_t length = recv(fds_[0], buffer, sizeof(buffer), 0);
+      ASSERT_GT(length, 0);
+      received.emplace_back(buffer, length);
+    }
+  });
+  int dropped = 0;
+  ASSERT_OK(writer->Write(packets, &dropped));
+  reader.join();
+  EXPECT_EQ(dropped, 0);
+  ASSERT_EQ(received.size(), 100);
+  EXPECT_EQ(received, messages);
+}
+
+TEST_F(IoUringTest, WritesToPipe) {
+  int pipe_fds[2];
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  ASSERT_OK_AND_ASSIGN(auto writer, IoUringWriter::Create(pipe_fds[1]));
+  std::vector<Packet> packets;
+  packets.emplace_back("foo", 3, IPProtocol::kIPv4, [] {});
+  packets.emplace_back("bar", 3, IPProtocol::kIPv4, [] {});
+  int dropped = 0;
+  ASSERT_OK(writer->Write(packets, &dropped));
+
+  char buffer[16];
+  ASSERT_EQ(read(pipe_fds[0], buffer, sizeof(buffer)), 6);
+  EXPECT_EQ(std::string(buffer, 6), "foobar");
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+TEST_F(IoUringTest, WriteAfterReleaseFails) {
+  ASSERT_OK_AND_ASSIGN(auto writer, IoUringWriter::Create(fds_[1]));
+  ASSERT_OK(writer->ReleaseFile());
+  std::vector<Packet> packets;
+  packets.emplace_back("foo", 3, IPProtocol::kIPv4, [] {});
+  int dropped = 0;
+  EXPECT_THAT(writer->Write(packets, &dropped),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -14,9 +14,12 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_datapath.h"
 
+#include <sys/socket.h>
+
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <string>
 #include <utility>
 
 #include "google/protobuf/duration.proto.h"
@@ -24,17 +27,23 @@
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_packet_forwarder.h"
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_socket_interface.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "privacy/net/krypton/datapath_interface.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/utils/ip_range.h"
 #include "privacy/net/krypton/utils/status.h"
+#include "privacy/net/krypton/utils/time_util.h"
 #include "third_party/absl/log/check.h"
 #include "third_party/absl/log/log.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
 
 namespace privacy {
 namespace krypton {
@@ -70,6 +79,25 @@ absl::Status IpSecDatapath::Start(const AddEgressResponse& egress_response,
     }
   }
 
+  // The private addresses are only needed for path MTU probing, so a bad one
+  // just leaves probing off for that address family.
+  ipv4_private_address_.clear();
+  ipv6_private_address_.clear();
+  for (const auto& ip_range : ppn_dataplane.user_private_ip()) {
+    auto range = utils::IPRange::Parse(ip_range.has_ipv4_range()
+                                           ? ip_range.ipv4_range()
+                                           : ip_range.ipv6_range());
+    if (!range.ok()) {
+      LOG(WARNING) << "Invalid user private IP: " << range.status();
+      continue;
+    }
+    if (range->family() == AF_INET) {
+      ipv4_private_address_ = range->address();
+    } else {
+      ipv6_private_address_ = range->address();
+    }
+  }
+
   return absl::OkStatus();
 }
 
@@ -116,6 +144,9 @@ absl::Status IpSecDatapath::SwitchNetwork(uint32_t session_id,
     auto mss_mtu_detection_endpoint =
         endpoint.ip_protocol() == IPProtocol::kIPv4 ? ipv4_tcp_mss_endpoint_
                                                     : ipv6_tcp_mss_endpoint_;
+    // MSS MTU detection runs even if the path MTUs are cached, so that the
+    // path is revalidated and the cache refreshed when it finishes.
+    UsePathMtuCache(endpoint, network_info, mtu_tracker.get());
     network_socket = vpn_service_->CreateProtectedNetworkSocket(
         network_info, endpoint, mss_mtu_detection_endpoint,
         std::move(mtu_tracker));
@@ -167,6 +198,7 @@ absl::Status IpSecDatapath::SwitchNetwork(uint32_t session_id,
   LOG(INFO) << "Done configuring IpSecManager.";
 
   network_socket_ = *std::move(network_socket);
+  EnablePathMtuProbing(endpoint.ip_protocol());
 
   forwarder_ = std::make_unique<IpSecPacketForwarder>(
       *tunnel, network_socket_.get(), &looper_, this, ++curr_forwarder_id_);
@@ -221,13 +253,18 @@ absl::Status IpSecDatapath::SetKeyMaterials(const TransformParams& params) {
   key_material_->set_downlink_key(params.ipsec().downlink_key());
   key_material_->set_uplink_salt(params.ipsec().uplink_salt());
   key_material_->set_downlink_salt(params.ipsec().downlink_salt());
+  if (params.ipsec().has_cipher_suite()) {
+    key_material_->set_cipher_suite(params.ipsec().cipher_suite());
+  }
 
   LOG(INFO) << "SetKeyMaterial for IpSec with uplink_spi="
             << key_material_->uplink_spi()
             << " downlink_spi=" << key_material_->downlink_spi();
 
-  ShutDownIpSecPacketForwarder(/*close_network_socket=*/false);
-
+  // The transforms are applied to the same network socket the packet forwarder
+  // is using, so the forwarder keeps running across the rekey instead of
+  // being torn down and restarted. The platform applies the new inbound SA
+  // before the old one is retired, and keeps the old one for a grace period.
   LOG(INFO) << "Configuring IpSecManager with fd="
             << key_material_->network_fd()
             << " network=" << key_material_->network_id()
@@ -238,7 +275,9 @@ absl::Status IpSecDatapath::SetKeyMaterials(const TransformParams& params) {
   PPN_RETURN_IF_ERROR(vpn_service_->ConfigureIpSec(*key_material_));
   LOG(INFO) << "Done configuring IpSecManager.";
 
-  StartUpIpSecPacketForwarder();
+  if (forwarder_ == nullptr) {
+    StartUpIpSecPacketForwarder();
+  }
 
   return absl::OkStatus();
 }
@@ -311,6 +350,68 @@ void IpSecDatapath::NotifyDatapathPermanentFailure(const absl::Status& status) {
   });
 }
 
+void IpSecDatapath::EnablePathMtuProbing(IPProtocol ip_protocol) {
+  if (!config_.dynamic_mtu_enabled() || !config_.path_mtu_probing_enabled()) {
+    return;
+  }
+  bool ipv4 = ip_protocol == IPProtocol::kIPv4;
+  const std::string& source =
+      ipv4 ? ipv4_private_address_ : ipv6_private_address_;
+  // Probes are echoed off the MSS detection server, which the backend provides
+  // for measuring this same path.
+  const std::string& destination = ipv4 ? ipv4_tcp_mss_endpoint_.address()
+                                        : ipv6_tcp_mss_endpoint_.address();
+  if (source.empty() || destination.empty()) {
+    LOG(WARNING) << "Not probing path MTU without addresses to probe with.";
+    return;
+  }
+
+  PathMtuProber::Options options;
+  if (config_.has_path_mtu_probe_raise_interval()) {
+    auto raise_interval =
+        utils::DurationFromProto(config_.path_mtu_probe_raise_interval());
+    if (!raise_interval.ok()) {
+      LOG(ERROR) << "Failed to convert path MTU probe raise interval: "
+                 << raise_interval.status();
+      return;
+    }
+    options.raise_interval = *raise_interval;
+  }
+  auto status =
+      network_socket_->EnablePathMtuProbing(options, source, destination);
+  if (!status.ok()) {
+    LOG(WARNING) << "Unable to enable path MTU probing: " << status;
+  }
+}
+
+void IpSecDatapath::UsePathMtuCache(const Endpoint& endpoint,
+                                    const NetworkInfo& network_info,
+                                    MtuTracker* mtu_tracker) {
+  if (!config_.path_mtu_cache_enabled() || !network_info.has_network_id()) {
+    return;
+  }
+  PathMtuCache::Key key{network_info.network_id(), endpoint.ToString()};
+  auto entry = path_mtu_cache_.Lookup(key, absl::Now());
+  mtu_tracker->SetPathMtuCache(&path_mtu_cache_, std::move(key));
+  if (!entry) {
+    return;
+  }
+  LOG(INFO) << "Using cached path MTU for network "
+            << network_info.network_id() << " and " << endpoint.ToString();
+  mtu_tracker->RestorePathMtu(*entry);
+}
+
+absl::Duration IpSecDatapath::PathMtuCacheTtl(const KryptonConfig& config) {
+  if (config.has_path_mtu_cache_ttl()) {
+    auto ttl = utils::DurationFromProto(config.path_mtu_cache_ttl());
+    if (ttl.ok()) {
+      return *ttl;
+    }
+    LOG(ERROR) << "Failed to convert path MTU cache TTL: " << ttl.status();
+  }
+  return absl::Minutes(10);
+}
+
 void IpSecDatapath::IpSecPacketForwarderFailed(const absl::Status& status,
                                                int packet_forwarder_id) {
   absl::MutexLock l(&mutex_);
@@ -15,15 +15,19 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_DATAPATH_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_DATAPATH_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <string>
 
 #include "privacy/net/krypton/add_egress_response.h"
 #include "privacy/net/krypton/datapath/android_ipsec/health_check.h"
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_packet_forwarder.h"
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_socket_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
 #include "privacy/net/krypton/datapath/android_ipsec/tunnel_interface.h"
 #include "privacy/net/krypton/datapath_interface.h"
 #include "privacy/net/krypton/endpoint.h"
@@ -38,6 +42,7 @@
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
 
 namespace privacy {
 namespace krypton {
@@ -59,6 +64,9 @@ class IpSecDatapath : public DatapathInterface,
     CreateProtectedNetworkSocket(const NetworkInfo& network_info,
                                  const Endpoint& endpoint) = 0;
 
+    // Creates a socket with path MTU discovery, which measures the path MTU by
+    // connecting to `mss_mtu_detection_endpoint`, unless its protocol is
+    // kUnknown.
     virtual absl::StatusOr<std::unique_ptr<IpSecSocketInterface>>
     CreateProtectedNetworkSocket(
         const NetworkInfo& network_info, const Endpoint& endpoint,
@@ -81,6 +89,7 @@ class IpSecDatapath : public DatapathInterface,
         vpn_service_(vpn_service),
         ipv4_tcp_mss_endpoint_("", "", 0, IPProtocol::kUnknown),
         ipv6_tcp_mss_endpoint_("", "", 0, IPProtocol::kUnknown),
+        path_mtu_cache_(kPathMtuCacheCapacity, PathMtuCacheTtl(config)),
         rekey_needed_(false),
         datapath_established_(false),
         looper_("IpSecDatapath Looper"),
@@ -150,6 +159,22 @@ class IpSecDatapath : public DatapathInterface,
 
   void NotifyDatapathPermanentFailure(const absl::Status& status);
 
+  // Turns on path MTU probing on the current network socket, if it's enabled
+  // in the config and there are addresses to probe with.
+  void EnablePathMtuProbing(IPProtocol ip_protocol)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Hooks `mtu_tracker` up to the path MTU cache, if it's enabled, and starts
+  // it from the cached path MTU if there is one.
+  void UsePathMtuCache(const Endpoint& endpoint,
+                       const NetworkInfo& network_info,
+                       MtuTracker* mtu_tracker);
+
+  static absl::Duration PathMtuCacheTtl(const KryptonConfig& config);
+
+  // The number of paths whose MTUs are remembered.
+  static constexpr size_t kPathMtuCacheCapacity = 16;
+
   absl::Mutex mutex_;
 
   KryptonConfig config_;
@@ -160,6 +185,14 @@ class IpSecDatapath : public DatapathInterface,
   Endpoint ipv4_tcp_mss_endpoint_;
   Endpoint ipv6_tcp_mss_endpoint_;
 
+  // The client's addresses inside the tunnel, which path MTU probes are sent
+  // from. Empty if the egress response didn't include one.
+  std::string ipv4_private_address_;
+  std::string ipv6_private_address_;
+
+  // Must outlive network_socket_, whose MTU tracker stores into it.
+  PathMtuCache path_mtu_cache_;
+
   bool rekey_needed_ ABSL_GUARDED_BY(mutex_);
   bool datapath_established_ ABSL_GUARDED_BY(mutex_);
 
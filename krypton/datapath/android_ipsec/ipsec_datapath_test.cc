@@ -16,6 +16,7 @@
 
 #include <memory>
 #include <optional>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -25,6 +26,7 @@
 #include "privacy/net/krypton/datapath/android_ipsec/mock_ipsec_vpn_service.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mock_tunnel.h"
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "privacy/net/krypton/datapath_interface.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/mock_timer_interface.h"
@@ -50,6 +52,7 @@ namespace android {
 namespace {
 
 using ::testing::_;
+using ::testing::AnyNumber;
 using ::testing::Eq;
 using ::testing::HasSubstr;
 using ::testing::Return;
@@ -256,6 +259,149 @@ TEST_F(IpSecDatapathTest, SwitchNetworkHappyPath) {
   datapath_->Stop();
 }
 
+TEST_F(IpSecDatapathTest, SwitchNetworkEnablesPathMtuProbing) {
+  config_.set_path_mtu_probing_enabled(true);
+  config_.mutable_path_mtu_probe_raise_interval()->set_seconds(60);
+  datapath_ = std::make_unique<IpSecDatapath>(config_, &looper_,
+                                              &vpn_service_, &timer_manager_);
+  datapath_->RegisterNotificationHandler(&notification_);
+
+  auto socket_ptr = std::make_unique<MockIpSecSocket>();
+  MockIpSecSocket *socket = socket_ptr.get();
+  EXPECT_CALL(vpn_service_, CreateProtectedNetworkSocket(_, _, _, _))
+      .WillOnce([&socket_ptr](const NetworkInfo & /*network_info*/,
+                              const Endpoint & /*endpoint*/,
+                              const Endpoint & /*mss_mtu_detection_endpoint*/,
+                              std::unique_ptr<MtuTrackerInterface>
+                              /*mtu_tracker*/) {
+        return std::move(socket_ptr);
+      });
+  EXPECT_CALL(*socket, GetFd()).WillOnce(Return(1));
+  EXPECT_CALL(vpn_service_, ConfigureIpSec(_));
+
+  // Probes go from the private IPv4 address to the IPv4 MSS detection server.
+  EXPECT_CALL(*socket, EnablePathMtuProbing(_, "10.2.2.123", "192.168.0.1"))
+      .WillOnce([](const PathMtuProber::Options &options,
+                   const std::string & /*source_address*/,
+                   const std::string & /*destination_address*/) {
+        EXPECT_EQ(options.raise_interval, absl::Seconds(60));
+        return absl::OkStatus();
+      });
+
+  absl::Notification socket_closed;
+  absl::Notification tunnel_closed;
+  EXPECT_CALL(*socket, ReadPackets()).WillOnce([&socket_closed]() {
+    socket_closed.WaitForNotification();
+    return std::vector<Packet>();
+  });
+  EXPECT_CALL(*socket, CancelReadPackets()).WillOnce([&socket_closed]() {
+    socket_closed.Notify();
+    return absl::OkStatus();
+  });
+  EXPECT_CALL(*socket, Close()).WillOnce(Return(absl::OkStatus()));
+  EXPECT_CALL(tunnel_, ReadPackets()).WillOnce([&tunnel_closed]() {
+    tunnel_closed.WaitForNotification();
+    return std::vector<Packet>();
+  });
+  EXPECT_CALL(tunnel_, CancelReadPackets()).WillOnce([&tunnel_closed]() {
+    tunnel_closed.Notify();
+    return absl::OkStatus();
+  });
+  EXPECT_CALL(notification_, DoUplinkMtuUpdate(_, _)).Times(AnyNumber());
+  EXPECT_CALL(notification_, DoDownlinkMtuUpdate(_)).Times(AnyNumber());
+
+  EXPECT_OK(datapath_->Start(fake_add_egress_response_, params_));
+  EXPECT_CALL(vpn_service_, GetTunnel()).WillOnce(Return(&tunnel_));
+  EXPECT_OK(datapath_->SwitchNetwork(1234, endpoint_, network_info_, 1));
+
+  datapath_->Stop();
+}
+
+TEST_F(IpSecDatapathTest, SwitchNetworkReusesCachedPathMtu) {
+  config_.set_path_mtu_cache_enabled(true);
+  datapath_ = std::make_unique<IpSecDatapath>(config_, &looper_,
+                                              &vpn_service_, &timer_manager_);
+  datapath_->RegisterNotificationHandler(&notification_);
+
+  auto socket_ptr1 = std::make_unique<MockIpSecSocket>();
+  auto socket_ptr2 = std::make_unique<MockIpSecSocket>();
+  MockIpSecSocket *socket1 = socket_ptr1.get();
+  MockIpSecSocket *socket2 = socket_ptr2.get();
+  EXPECT_CALL(vpn_service_, CreateProtectedNetworkSocket(_, _, _, _))
+      .WillOnce([&socket_ptr1](const NetworkInfo & /*network_info*/,
+                               const Endpoint & /*endpoint*/,
+                               const Endpoint &mss_mtu_detection_endpoint,
+                               std::unique_ptr<MtuTrackerInterface>
+                                   mtu_tracker) {
+        // The first connection measures the path.
+        EXPECT_EQ(mss_mtu_detection_endpoint.ip_protocol(),
+                  IPProtocol::kIPv4);
+        mtu_tracker->UpdateUplinkMtu(1400);
+        mtu_tracker->UpdateDownlinkMtu(1420);
+        return std::move(socket_ptr1);
+      })
+      .WillOnce([&socket_ptr2](const NetworkInfo & /*network_info*/,
+                               const Endpoint & /*endpoint*/,
+                               const Endpoint &mss_mtu_detection_endpoint,
+                               std::unique_ptr<MtuTrackerInterface>
+                                   mtu_tracker) {
+        // The second one starts where the first left off, and still measures
+        // the path again in the background.
+        EXPECT_EQ(mss_mtu_detection_endpoint.ip_protocol(),
+                  IPProtocol::kIPv4);
+        EXPECT_EQ(mtu_tracker->GetTunnelMtu(), 1400 - 105);
+        return std::move(socket_ptr2);
+      });
+  EXPECT_CALL(vpn_service_, ConfigureIpSec(_)).Times(2);
+
+  absl::Notification socket_closed1;
+  absl::Notification socket_closed2;
+  for (auto [socket, closed] :
+       {std::pair(socket1, &socket_closed1),
+        std::pair(socket2, &socket_closed2)}) {
+    EXPECT_CALL(*socket, GetFd()).WillOnce(Return(1));
+    EXPECT_CALL(*socket, ReadPackets()).WillOnce([closed]() {
+      closed->WaitForNotification();
+      return std::vector<Packet>();
+    });
+    EXPECT_CALL(*socket, CancelReadPackets()).WillOnce([closed]() {
+      closed->Notify();
+      return absl::OkStatus();
+    });
+    EXPECT_CALL(*socket, Close()).WillOnce(Return(absl::OkStatus()));
+  }
+
+  absl::Notification tunnel_closed1;
+  absl::Notification tunnel_closed2;
+  EXPECT_CALL(tunnel_, ReadPackets())
+      .WillOnce([&tunnel_closed1]() {
+        tunnel_closed1.WaitForNotification();
+        return std::vector<Packet>();
+      })
+      .WillOnce([&tunnel_closed2]() {
+        tunnel_closed2.WaitForNotification();
+        return std::vector<Packet>();
+      });
+  EXPECT_CALL(tunnel_, CancelReadPackets())
+      .WillOnce([&tunnel_closed1]() {
+        tunnel_closed1.Notify();
+        return absl::OkStatus();
+      })
+      .WillOnce([&tunnel_closed2]() {
+        tunnel_closed2.Notify();
+        return absl::OkStatus();
+      });
+  EXPECT_CALL(notification_, DoUplinkMtuUpdate(_, _)).Times(AnyNumber());
+  EXPECT_CALL(notification_, DoDownlinkMtuUpdate(_)).Times(AnyNumber());
+
+  EXPECT_OK(datapath_->Start(fake_add_egress_response_, params_));
+  EXPECT_CALL(vpn_service_, GetTunnel()).WillRepeatedly(Return(&tunnel_));
+  EXPECT_OK(datapath_->SwitchNetwork(1234, endpoint_, network_info_, 1));
+  EXPECT_OK(datapath_->SwitchNetwork(1234, endpoint_, network_info_, 2));
+
+  datapath_->Stop();
+}
+
 TEST_F(IpSecDatapathTest, SecondSwitchNetworkRekeys) {
   auto socket_ptr1 = std::make_unique<MockIpSecSocket>();
   auto socket_ptr2 = std::make_unique<MockIpSecSocket>();
@@ -382,61 +528,42 @@ TEST_F(IpSecDatapathTest, SetKeyMaterials) {
   packets1.emplace_back("foo", 3, IPProtocol::kIPv6, [] {});
   packets2.emplace_back("foo", 3, IPProtocol::kIPv6, [] {});
 
-  absl::Notification socket_closed1;
-  absl::Notification socket_closed2;
+  absl::Notification rekeyed;
   absl::Notification last_read_done;
+  absl::Notification socket_closed;
 
-  // Simulate some network traffic, so that we know everything is running.
+  // The packet forwarder keeps running across the rekey, so the same reads
+  // carry on before and after it.
   EXPECT_CALL(*socket, ReadPackets())
       .WillOnce(Return(std::move(packets1)))
-      .WillOnce([&socket_closed1]() {
-        socket_closed1.WaitForNotification();
-        return std::vector<Packet>();
-      })
-      .WillOnce([&last_read_done, &packets2] {
+      .WillOnce([&rekeyed, &last_read_done, &packets2] {
+        rekeyed.WaitForNotification();
         last_read_done.Notify();
         return std::move(packets2);
       })
-      .WillOnce([&socket_closed2]() {
-        socket_closed2.WaitForNotification();
+      .WillOnce([&socket_closed]() {
+        socket_closed.WaitForNotification();
         return std::vector<Packet>();
       });
 
-  // Closed by both the packet forwarder and the datapath.
-  EXPECT_CALL(*socket, CancelReadPackets())
-      .WillOnce([&socket_closed1]() {
-        socket_closed1.Notify();
-        return absl::OkStatus();
-      })
-      .WillOnce([&socket_closed2]() {
-        socket_closed2.Notify();
-        return absl::OkStatus();
-      });
+  EXPECT_CALL(*socket, CancelReadPackets()).WillOnce([&socket_closed]() {
+    socket_closed.Notify();
+    return absl::OkStatus();
+  });
 
   EXPECT_CALL(*socket, Close()).WillOnce(Return(absl::OkStatus()));
 
-  absl::Notification tunnel_closed1;
-  absl::Notification tunnel_closed2;
+  absl::Notification tunnel_closed;
 
-  EXPECT_CALL(tunnel_, ReadPackets())
-      .WillOnce([&tunnel_closed1]() {
-        tunnel_closed1.WaitForNotification();
-        return std::vector<Packet>();
-      })
-      .WillOnce([&tunnel_closed2]() {
-        tunnel_closed2.WaitForNotification();
-        return std::vector<Packet>();
-      });
+  EXPECT_CALL(tunnel_, ReadPackets()).WillOnce([&tunnel_closed]() {
+    tunnel_closed.WaitForNotification();
+    return std::vector<Packet>();
+  });
 
-  EXPECT_CALL(tunnel_, CancelReadPackets())
-      .WillOnce([&tunnel_closed1]() {
-        tunnel_closed1.Notify();
-        return absl::OkStatus();
-      })
-      .WillOnce([&tunnel_closed2]() {
-        tunnel_closed2.Notify();
-        return absl::OkStatus();
-      });
+  EXPECT_CALL(tunnel_, CancelReadPackets()).WillOnce([&tunnel_closed]() {
+    tunnel_closed.Notify();
+    return absl::OkStatus();
+  });
 
   EXPECT_OK(datapath_->Start(fake_add_egress_response_, params_));
   EXPECT_CALL(vpn_service_, GetTunnel()).WillRepeatedly(Return(&tunnel_));
@@ -466,6 +593,7 @@ TEST_F(IpSecDatapathTest, SetKeyMaterials) {
               ConfigureIpSec(testing::EqualsProto(params_.ipsec())));
 
   EXPECT_OK(datapath_->SetKeyMaterials(rekey_params));
+  rekeyed.Notify();
 
   EXPECT_TRUE(
       last_read_done.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
@@ -0,0 +1,379 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An end-to-end benchmark of the datapath over loopback, which needs neither
+// root nor a network. Packets are written to one end of a socket pair, which
+// stands in for the TUN device, and go through a real IpSecTunnel,
+// IpSecPacketForwarder and DatagramSocket to a local UDP peer over [::1]. The
+// peer echoes them back the same way.
+//
+// On a device, the kernel applies the ESP transform to the socket, which
+// can't be done here without root. Instead, the peer seals and opens every
+// packet with the cryptors in both directions, so the round trip still pays
+// for all of the ESP work that it would on a device and on the server.
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "base/logging.h"
+#include "privacy/net/krypton/benchmark_util.h"
+#include "privacy/net/krypton/datapath/android_ipsec/datagram_socket.h"
+#include "privacy/net/krypton/datapath/android_ipsec/ipsec_packet_forwarder.h"
+#include "privacy/net/krypton/datapath/android_ipsec/ipsec_tunnel.h"
+#include "privacy/net/krypton/datapath/android_ipsec/simple_udp_server.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/endpoint.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+// How long to wait for an echo before counting the packets in flight as lost.
+constexpr absl::Duration kEchoTimeout = absl::Milliseconds(500);
+
+// How often the peer checks whether it should stop.
+constexpr absl::Duration kPeerPollInterval = absl::Milliseconds(100);
+
+constexpr size_t kIpv6HeaderSize = 40;
+constexpr size_t kUdpHeaderSize = 8;
+
+// Where the sequence number goes in each packet, just after the UDP header.
+constexpr size_t kSequenceOffset = kIpv6HeaderSize + kUdpHeaderSize;
+
+// The number of packets that can be told apart by their sequence numbers.
+// This has to be larger than any window, so that a late echo is never
+// mistaken for one that is still in flight.
+constexpr uint64_t kMaxInFlight = 1 << 16;
+
+// A local peer that echoes every datagram it receives back to its sender,
+// after sealing and opening it with ESP on the way in and on the way out.
+class EspEchoPeer {
+ public:
+  EspEchoPeer()
+      : encryptor_(ipsec::IpSecEncryptor::Create(
+                         2, CreateBenchmarkTransformParams())
+                         .value()),
+        decryptor_(
+            ipsec::IpSecDecryptor::Create(CreateBenchmarkTransformParams())
+                .value()),
+        sealed_(std::make_unique<ipsec::IpSecPacket>()),
+        opened_(std::make_unique<ipsec::IpSecPacket>()),
+        stopped_(false) {
+    timeval timeout = absl::ToTimeval(kPeerPollInterval);
+    if (setsockopt(server_.fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) != 0) {
+      LOG(FATAL) << "Unable to set receive timeout: " << strerror(errno);
+    }
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  ~EspEchoPeer() {
+    stopped_ = true;
+    thread_.join();
+  }
+
+  int port() { return server_.port(); }
+
+ private:
+  void Run() {
+    char buffer[4096];
+    while (!stopped_) {
+      sockaddr_in6 sender;
+      socklen_t sender_len = sizeof(sender);
+      ssize_t size = recvfrom(server_.fd(), buffer, sizeof(buffer), 0,
+                              reinterpret_cast<sockaddr*>(&sender),
+                              &sender_len);
+      if (size < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          LOG(ERROR) << "Peer failed to receive: " << strerror(errno);
+        }
+        continue;
+      }
+      absl::string_view packet(buffer, size);
+      // Once for the uplink, and once for the echo.
+      if (!SealAndOpen(packet).ok() || !SealAndOpen(packet).ok()) {
+        continue;
+      }
+      sendto(server_.fd(), opened_->data(), opened_->data_size(), 0,
+             reinterpret_cast<sockaddr*>(&sender), sender_len);
+    }
+  }
+
+  // Leaves a copy of `packet` in opened_.
+  absl::Status SealAndOpen(absl::string_view packet) {
+    auto status =
+        encryptor_->Encrypt(packet, IPProtocol::kIPv6, sealed_.get());
+    if (!status.ok()) {
+      LOG(ERROR) << "Peer failed to encrypt: " << status;
+      return status;
+    }
+    IPProtocol protocol;
+    status = decryptor_->Decrypt(
+        absl::string_view(sealed_->buffer(), sealed_->buffer_size()),
+        opened_.get(), &protocol);
+    if (!status.ok()) {
+      LOG(ERROR) << "Peer failed to decrypt: " << status;
+    }
+    return status;
+  }
+
+  testing::SimpleUdpServer server_;
+  std::unique_ptr<ipsec::IpSecEncryptor> encryptor_;
+  std::unique_ptr<ipsec::IpSecDecryptor> decryptor_;
+  std::unique_ptr<ipsec::IpSecPacket> sealed_;
+  std::unique_ptr<ipsec::IpSecPacket> opened_;
+  std::atomic_bool stopped_;
+  std::thread thread_;
+};
+
+class LogNotifications : public IpSecPacketForwarder::NotificationInterface {
+ public:
+  void IpSecPacketForwarderFailed(const absl::Status& status,
+                                  int /*forwarder_id*/) override {
+    LOG(ERROR) << "IpSecPacketForwarderFailed: " << status;
+  }
+  void IpSecPacketForwarderPermanentFailure(const absl::Status& status,
+                                            int /*forwarder_id*/) override {
+    LOG(ERROR) << "IpSecPacketForwarderPermanentFailure: " << status;
+  }
+  void IpSecPacketForwarderConnected(int /*forwarder_id*/) override {}
+};
+
+// The client side of the datapath, between one end of a socket pair and the
+// peer.
+class LoopbackDatapath {
+ public:
+  // Returns an error if any part of the datapath can't be set up.
+  absl::Status Start(int peer_port) {
+    int fds[2];
+    if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, fds) != 0) {
+      return absl::InternalError(
+          absl::StrCat("socketpair: ", strerror(errno)));
+    }
+    app_fd_ = fds[0];
+    PPN_ASSIGN_OR_RETURN(tunnel_, IpSecTunnel::Create(fds[1]));
+    tun_fd_ = fds[1];
+
+    int socket_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (socket_fd < 0) {
+      return absl::InternalError(absl::StrCat("socket: ", strerror(errno)));
+    }
+    PPN_ASSIGN_OR_RETURN(socket_, DatagramSocket::Create(socket_fd));
+    PPN_ASSIGN_OR_RETURN(
+        auto endpoint,
+        GetEndpointFromHostPort(absl::StrFormat("[::1]:%d", peer_port)));
+    PPN_RETURN_IF_ERROR(socket_->Connect(endpoint));
+
+    forwarder_ = std::make_unique<IpSecPacketForwarder>(
+        tunnel_.get(), socket_.get(), &looper_, &notification_,
+        /*forwarder_id=*/0);
+    forwarder_->Start();
+    return absl::OkStatus();
+  }
+
+  ~LoopbackDatapath() {
+    if (forwarder_ != nullptr) {
+      forwarder_->Stop();
+    }
+    looper_.Stop();
+    looper_.Join();
+    forwarder_.reset();
+    socket_.reset();
+    tunnel_.reset();
+    if (app_fd_ >= 0) {
+      close(app_fd_);
+    }
+    if (tun_fd_ >= 0) {
+      close(tun_fd_);
+    }
+  }
+
+  // The end of the socket pair that an app would use.
+  int app_fd() const { return app_fd_; }
+
+ private:
+  int app_fd_ = -1;
+  int tun_fd_ = -1;
+  krypton::utils::LooperThread looper_{"LoopbackDatapath"};
+  LogNotifications notification_;
+  std::unique_ptr<IpSecTunnel> tunnel_;
+  std::unique_ptr<DatagramSocket> socket_;
+  std::unique_ptr<IpSecPacketForwarder> forwarder_;
+};
+
+// Writes IPv6/UDP packets of a given size to the app end of the datapath,
+// and matches up their echoes to measure round trip times.
+class EchoClient {
+ public:
+  EchoClient(int fd, size_t size)
+      : fd_(fd),
+        packet_(size, 0),
+        sent_at_(kMaxInFlight, absl::InfinitePast()),
+        next_sequence_(0),
+        in_flight_(0),
+        lost_(0) {
+    // Just enough of a header for the datapath to treat it as IPv6.
+    packet_[0] = 0x60;
+    uint16_t payload_length = htons(size - kIpv6HeaderSize);
+    memcpy(&packet_[4], &payload_length, sizeof(payload_length));
+    packet_[6] = IPPROTO_UDP;
+    packet_[7] = 64;
+    packet_[kIpv6HeaderSize - 1] = 1;
+    packet_[kIpv6HeaderSize - 17] = 1;
+  }
+
+  // Sends one packet. Returns false if it couldn't be written.
+  bool Send() {
+    uint64_t sequence = next_sequence_++;
+    memcpy(&packet_[kSequenceOffset], &sequence, sizeof(sequence));
+    sent_at_[sequence % kMaxInFlight] = absl::Now();
+    if (write(fd_, packet_.data(), packet_.size()) < 0) {
+      LOG(ERROR) << "Unable to write to the tunnel: " << strerror(errno);
+      sent_at_[sequence % kMaxInFlight] = absl::InfinitePast();
+      return false;
+    }
+    ++in_flight_;
+    return true;
+  }
+
+  // Waits for the echo of any packet in flight, and records its round trip
+  // time. If none arrives in time, every packet in flight is counted as
+  // lost, and false is returned.
+  bool Receive(LatencyRecorder* latency) {
+    char buffer[4096];
+    while (in_flight_ > 0) {
+      pollfd fd = {fd_, POLLIN, 0};
+      if (poll(&fd, 1, absl::ToInt64Milliseconds(kEchoTimeout)) <= 0) {
+        ForgetInFlight();
+        return false;
+      }
+      ssize_t size = read(fd_, buffer, sizeof(buffer));
+      if (size < static_cast<ssize_t>(kSequenceOffset + sizeof(uint64_t))) {
+        continue;
+      }
+      uint64_t sequence;
+      memcpy(&sequence, buffer + kSequenceOffset, sizeof(sequence));
+      absl::Time& sent_at = sent_at_[sequence % kMaxInFlight];
+      if (sent_at == absl::InfinitePast()) {
+        // A late echo of a packet that was already counted as lost.
+        continue;
+      }
+      latency->Record(absl::Now() - sent_at);
+      sent_at = absl::InfinitePast();
+      --in_flight_;
+      return true;
+    }
+    return false;
+  }
+
+  // Waits for the echoes of every packet still in flight.
+  void Drain(LatencyRecorder* latency) {
+    while (in_flight_ > 0 && Receive(latency)) {
+    }
+  }
+
+  int in_flight() const { return in_flight_; }
+  int64_t lost() const { return lost_; }
+
+ private:
+  void ForgetInFlight() {
+    for (uint64_t i = 0; i < kMaxInFlight; ++i) {
+      sent_at_[i] = absl::InfinitePast();
+    }
+    lost_ += in_flight_;
+    in_flight_ = 0;
+  }
+
+  int fd_;
+  std::string packet_;
+  std::vector<absl::Time> sent_at_;
+  uint64_t next_sequence_;
+  int in_flight_;
+  int64_t lost_;
+};
+
+// Keeps state.range(1) packets of state.range(0) bytes in flight through the
+// datapath, sending a new one whenever an echo comes back. With a window of
+// one, this measures the unloaded round trip time.
+void BM_LoopbackEcho(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const int window = state.range(1);
+  EspEchoPeer peer;
+  LoopbackDatapath datapath;
+  auto status = datapath.Start(peer.port());
+  if (!status.ok()) {
+    state.SkipWithError(std::string(status.message()).c_str());
+    return;
+  }
+
+  EchoClient client(datapath.app_fd(), size);
+  LatencyRecorder latency;
+  int64_t echoed = 0;
+  for (auto _ : state) {
+    while (client.in_flight() < window) {
+      if (!client.Send()) {
+        state.SkipWithError("Unable to write to the tunnel");
+        return;
+      }
+    }
+    if (client.Receive(&latency)) {
+      ++echoed;
+    }
+  }
+  client.Drain(&latency);
+
+  ReportPacketRates(state, echoed, echoed * size);
+  latency.Report(state);
+  state.counters["lost"] = static_cast<double>(client.lost());
+}
+BENCHMARK(BM_LoopbackEcho)
+    ->ArgNames({"size", "window"})
+    ->Args({64, 1})
+    ->Args({1280, 1})
+    ->Args({64, 32})
+    ->Args({1280, 32})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
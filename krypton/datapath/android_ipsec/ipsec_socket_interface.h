@@ -15,8 +15,10 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_SOCKET_INTERFACE_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_SOCKET_INTERFACE_H_
 
+#include <string>
 #include <vector>
 
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
@@ -59,6 +61,14 @@ class IpSecSocketInterface {
 
   // Populate DatapathDebugInfo proto with relevant socket stats.
   virtual void GetDebugInfo(DatapathDebugInfo* debug_info) = 0;
+
+  // Starts probing for a bigger path MTU with ICMP echo requests sent through
+  // the tunnel from `source_address` to `destination_address`, which are IP
+  // addresses of the same family. Only works on sockets with dynamic MTU
+  // enabled, and must be called before any packets are written.
+  virtual absl::Status EnablePathMtuProbing(
+      const PathMtuProber::Options& options, const std::string& source_address,
+      const std::string& destination_address) = 0;
 };
 
 }  // namespace android
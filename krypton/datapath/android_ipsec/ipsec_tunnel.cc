@@ -14,14 +14,25 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_tunnel.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <memory>
 #include <vector>
 
 #include "base/logging.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/datapath/android_ipsec/socket_util.h"
+#include "privacy/net/krypton/datapath/android_ipsec/tun_offload.h"
+#include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/utils/status.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/strings/substitute.h"
 #include "third_party/absl/time/time.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -30,6 +41,14 @@ namespace android {
 
 namespace {
 constexpr int kMaxPacketSize = 4096;
+
+// The most packets read from the tunnel before they're handed on, unless
+// overridden with SetMaxReadBurst.
+constexpr size_t kDefaultMaxReadBurst = 32;
+
+// How many read buffers are kept around for reuse, once the packets they were
+// handed out in have been destroyed.
+constexpr size_t kMaxFreeBuffers = 8 * kDefaultMaxReadBurst;
 }  // namespace
 
 absl::StatusOr<std::unique_ptr<IpSecTunnel>> IpSecTunnel::Create(
@@ -43,7 +62,10 @@ absl::StatusOr<std::unique_ptr<IpSecTunnel>> IpSecTunnel::Create(
 }
 
 IpSecTunnel::IpSecTunnel(int tunnel_fd)
-    : tunnel_fd_(tunnel_fd), keepalive_interval_millis_(-1) {
+    : tunnel_fd_(tunnel_fd),
+      keepalive_interval_millis_(-1),
+      max_read_burst_(kDefaultMaxReadBurst),
+      buffer_pool_(kMaxPacketSize, kMaxFreeBuffers) {
   LOG(INFO) << "Creating IpSecTunnel[" << this << "] with FD=" << tunnel_fd_;
 }
 
@@ -62,62 +84,119 @@ absl::StatusOr<std::vector<Packet>> IpSecTunnel::ReadPackets() {
   if (tunnel_fd_ < 0) {
     return absl::InternalError("Attempted to read on a closed fd.");
   }
-  EventsHelper::Event event;
-  int num_events;
-  auto status =
-      events_helper_.Wait(&event, 1, keepalive_interval_millis_, &num_events);
-  int fd = tunnel_fd_;
-  if (!status.ok()) {
-    return absl::InternalError(absl::Substitute(
-        "Failed to listen for events on fd $0: $1", fd, strerror(errno)));
-  }
+  while (true) {
+    EventsHelper::Event event;
+    int num_events;
+    auto status =
+        events_helper_.Wait(&event, 1, keepalive_interval_millis_, &num_events);
+    int fd = tunnel_fd_;
+    if (!status.ok()) {
+      return absl::InternalError(absl::Substitute(
+          "Failed to listen for events on fd $0: $1", fd, strerror(errno)));
+    }
 
-  // Send a keepalive packet if we time out
-  if (num_events == 0) {
-    static const char* buffer = "\xFF";
-    std::vector<Packet> packets;
-    packets.emplace_back(buffer, 1, IPProtocol::kUnknown, []() {});
+    // Send a keepalive packet if we time out
+    if (num_events == 0) {
+      static const char* buffer = "\xFF";
+      std::vector<Packet> packets;
+      packets.emplace_back(buffer, 1, IPProtocol::kUnknown, PacketOwner());
 
-    return packets;
-  }
-  int notified_fd = datapath::android::EventsHelper::FileFromEvent(event);
-  if (notified_fd == close_event_.fd()) {
-    // An empty vector without an error status should be interpreted as a close
-    LOG(INFO) << "Close event received on tunnel FD=" << fd;
-    return std::vector<Packet>();
+      return packets;
+    }
+    int notified_fd = datapath::android::EventsHelper::FileFromEvent(event);
+    if (notified_fd == close_event_.fd()) {
+      // An empty vector without an error status should be interpreted as a
+      // close
+      LOG(INFO) << "Close event received on tunnel FD=" << fd;
+      return std::vector<Packet>();
+    }
+    if (datapath::android::EventsHelper::FileHasError(event)) {
+      return absl::InternalError(absl::Substitute("Read on fd $0 failed.", fd));
+    }
+    if (datapath::android::EventsHelper::FileCanRead(event)) {
+      if (fd < 0) {
+        return absl::InternalError("Attempted to read on a closed fd.");
+      }
+      PPN_ASSIGN_OR_RETURN(auto packets, ReadBurst(fd));
+      if (packets.empty()) {
+        if (datapath::android::EventsHelper::FileWasClosed(event)) {
+          return absl::AbortedError(
+              absl::Substitute("Reading from FD $0: hung up", fd));
+        }
+        // Somebody else drained the tunnel first. Go back to waiting.
+        continue;
+      }
+      return packets;
+    }
+
+    // Should never get here
+    return absl::InternalError("Unexpected event occurred.");
   }
-  if (datapath::android::EventsHelper::FileHasError(event)) {
-    return absl::InternalError(absl::Substitute("Read on fd $0 failed.", fd));
+}
+
+absl::StatusOr<std::vector<Packet>> IpSecTunnel::ReadBurst(int fd) {
+  if (offload_read_buffer_ != nullptr) {
+    return ReadOffloadBurst(fd);
   }
-  if (datapath::android::EventsHelper::FileCanRead(event)) {
-    if (fd < 0) {
-      return absl::InternalError("Attempted to read on a closed fd.");
-    }
-    // TODO: Do reads in batches.
 
-    // TODO: Don't allocate new memory for every packet.
-    char* buffer = new char[kMaxPacketSize];
+  // Leave room around each packet, so that it can be encrypted in place.
+  std::vector<char*> buffers(max_read_burst_);
+  buffer_pool_.Acquire(absl::MakeSpan(buffers));
 
+  std::vector<Packet> packets;
+  packets.reserve(buffers.size());
+  int read_errno = 0;
+  for (char* buffer : buffers) {
     int read_bytes;
     do {
-      read_bytes = read(fd, buffer, kMaxPacketSize);
+      read_bytes = read(fd, buffer + kPacketHeadroom,
+                        kMaxPacketSize - kPacketHeadroom - kPacketTailroom);
     } while (read_bytes == -1 && errno == EINTR);
-
     if (read_bytes <= 0) {
-      delete[] buffer;
-      return absl::AbortedError(
-          absl::Substitute("Reading from FD $0: $1", fd, strerror(errno)));
+      read_errno = read_bytes == 0 ? 0 : errno;
+      break;
     }
+    packets.push_back(buffer_pool_.MakePacket(
+        buffer, kPacketHeadroom, read_bytes, IPProtocol::kUnknown));
+  }
+  buffer_pool_.Release(absl::MakeSpan(buffers).subspan(packets.size()));
 
-    std::vector<Packet> packets;
-    packets.emplace_back(buffer, read_bytes, IPProtocol::kUnknown,
-                         [buffer]() { delete[] buffer; });
+  // A failed read is only reported once the packets that were read before it
+  // have been handed on. If the failure persists, the next read will hit it.
+  if (packets.empty() && read_errno != EAGAIN && read_errno != EWOULDBLOCK) {
+    return absl::AbortedError(
+        absl::Substitute("Reading from FD $0: $1", fd, strerror(read_errno)));
+  }
+  return packets;
+}
 
-    return packets;
+absl::StatusOr<std::vector<Packet>> IpSecTunnel::ReadOffloadBurst(int fd) {
+  std::vector<Packet> packets;
+  int read_errno = 0;
+  while (packets.size() < max_read_burst_) {
+    int read_bytes;
+    do {
+      read_bytes =
+          read(fd, offload_read_buffer_.get(), kMaxTunOffloadReadSize);
+    } while (read_bytes == -1 && errno == EINTR);
+    if (read_bytes <= 0) {
+      read_errno = read_bytes == 0 ? 0 : errno;
+      break;
+    }
+    // A malformed packet is dropped, rather than failing the whole tunnel.
+    auto status = SplitTunRead(offload_read_buffer_.get(), read_bytes,
+                               &buffer_pool_, &packets);
+    if (!status.ok()) {
+      LOG(WARNING) << "Dropping packet from tunnel FD=" << fd << ": "
+                   << status;
+    }
   }
 
-  // Should never get here
-  return absl::InternalError("Unexpected event occurred.");
+  if (packets.empty() && read_errno != EAGAIN && read_errno != EWOULDBLOCK) {
+    return absl::AbortedError(
+        absl::Substitute("Reading from FD $0: $1", fd, strerror(read_errno)));
+  }
+  return packets;
 }
 
 absl::Status IpSecTunnel::WritePackets(std::vector<Packet> packets) {
@@ -125,11 +204,17 @@ absl::Status IpSecTunnel::WritePackets(std::vector<Packet> packets) {
   if (fd < 0) {
     return absl::InternalError("Attempted to write to a closed fd.");
   }
+  if (offload_read_buffer_ != nullptr) {
+    return WriteTunPackets(fd, packets);
+  }
   for (const auto& packet : packets) {
     int write_bytes;
     do {
       write_bytes = write(fd, packet.data().data(), packet.data().size());
-    } while (write_bytes == -1 && errno == EINTR);
+    } while (write_bytes == -1 &&
+             (errno == EINTR ||
+              ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+               WaitUntilWritable(fd))));
     if (write_bytes != packet.data().size()) {
       return absl::InternalError(
           absl::StrCat("Error writing to FD=", fd, ": ", strerror(errno)));
@@ -155,9 +240,24 @@ bool IpSecTunnel::IsKeepaliveEnabled() {
   return (keepalive_interval_millis_ != -1);
 }
 
+void IpSecTunnel::SetMaxReadBurst(size_t max_read_burst) {
+  max_read_burst_ = std::max<size_t>(max_read_burst, 1);
+}
+
+absl::Status IpSecTunnel::EnableOffload() {
+  PPN_RETURN_IF_ERROR(EnableTunOffload(tunnel_fd_));
+  LOG(INFO) << "Enabled TUN offloads on FD=" << tunnel_fd_;
+  offload_read_buffer_ = std::make_unique<char[]>(kMaxTunOffloadReadSize);
+  return absl::OkStatus();
+}
+
 absl::Status IpSecTunnel::Init() {
   int fd = tunnel_fd_;
 
+  // Reads only happen once the tunnel is known to be readable, and then keep
+  // going until there's nothing left, so they must not block.
+  PPN_RETURN_IF_ERROR(SetSocketNonBlocking(fd));
+
   auto status = events_helper_.AddFile(fd, EventsHelper::EventReadableFlags());
   if (status.ok()) {
     status = events_helper_.AddFile(close_event_.fd(),
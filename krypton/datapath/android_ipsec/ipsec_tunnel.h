@@ -15,11 +15,13 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_TUNNEL_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_IPSEC_TUNNEL_H_
 
+#include <cstddef>
 #include <memory>
 #include <vector>
 
 #include "privacy/net/krypton/datapath/android_ipsec/event_fd.h"
 #include "privacy/net/krypton/datapath/android_ipsec/events_helper.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
 #include "privacy/net/krypton/datapath/android_ipsec/tunnel_interface.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "third_party/absl/status/statusor.h"
@@ -43,7 +45,9 @@ class IpSecTunnel : public TunnelInterface {
   // Stops all current reads on the tunnel, but does not close the fd.
   absl::Status CancelReadPackets() override;
 
-  // Reads packets from the tunnel interface.
+  // Reads packets from the tunnel interface. Once the tunnel is readable, it
+  // is drained until there's nothing left or the read burst limit is reached,
+  // and all of the packets are returned together.
   absl::StatusOr<std::vector<Packet>> ReadPackets() override;
 
   // Writes packets to the tunnel interface.
@@ -59,12 +63,31 @@ class IpSecTunnel : public TunnelInterface {
   // Test if the keepalive is enabled.
   bool IsKeepaliveEnabled();
 
+  // Sets the most packets returned by a single call to ReadPackets. This should
+  // not be called if there are any calls to ReadPackets currently blocking.
+  void SetMaxReadBurst(size_t max_read_burst);
+
+  // Turns on the TUN checksum and segmentation offloads, so that the kernel
+  // can hand over TCP and UDP super-packets, which are segmented here before
+  // being returned by ReadPackets. Consecutive TCP segments passed to
+  // WritePackets are coalesced in turn. The tunnel fd must be a TUN device that
+  // was created with IFF_VNET_HDR. This should not be called if there are any
+  // calls to ReadPackets currently blocking.
+  absl::Status EnableOffload();
+
+  bool IsOffloadEnabled() const { return offload_read_buffer_ != nullptr; }
+
  protected:
   explicit IpSecTunnel(int tunnel_fd);
 
   // Performs some one-time initialization.
   absl::Status Init();
 
+  // Reads up to max_read_burst_ packets without blocking. Returns an empty
+  // vector if there was nothing to read after all.
+  absl::StatusOr<std::vector<Packet>> ReadBurst(int fd);
+  absl::StatusOr<std::vector<Packet>> ReadOffloadBurst(int fd);
+
   int tunnel_fd_;
 
   EventFd close_event_;
@@ -72,6 +95,13 @@ class IpSecTunnel : public TunnelInterface {
   EventsHelper events_helper_;
 
   int keepalive_interval_millis_;
+
+  size_t max_read_burst_;
+  PacketBufferPool buffer_pool_;
+
+  // Where super-packets are read to before being segmented, if the offloads
+  // are enabled.
+  std::unique_ptr<char[]> offload_read_buffer_;
 };
 
 }  // namespace android
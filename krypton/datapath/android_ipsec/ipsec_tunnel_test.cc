@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 
 #include <memory>
+#include <thread>  // NOLINT
 #include <utility>
 #include <vector>
 
@@ -28,6 +29,7 @@
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/synchronization/notification.h"
+#include "third_party/absl/time/clock.h"
 #include "third_party/absl/time/time.h"
 
 namespace privacy {
@@ -139,6 +141,30 @@ TEST_F(IpSecTunnelTest, NormalWrite) {
   EXPECT_EQ("foo", std::string(msg, nread));
 }
 
+TEST_F(IpSecTunnelTest, WriteWaitsWhileTheFdIsFull) {
+  ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
+
+  // More packets than the socket pair will queue, so that some writes to the
+  // non-blocking tunnel fd would block until the other end reads.
+  constexpr int kPacketCount = 1000;
+  std::vector<Packet> send_packets;
+  for (int i = 0; i < kPacketCount; ++i) {
+    send_packets.emplace_back("foo", 3, IPProtocol::kIPv6, []() {});
+  }
+
+  int received = 0;
+  std::thread reader([this, &received] {
+    absl::SleepFor(absl::Milliseconds(50));
+    char msg[10];
+    while (received < kPacketCount && read(sock_fd_, msg, 10) == 3) {
+      ++received;
+    }
+  });
+  EXPECT_OK(tunnel->WritePackets(std::move(send_packets)));
+  reader.join();
+  EXPECT_EQ(received, kPacketCount);
+}
+
 TEST_F(IpSecTunnelTest, NormalRead) {
   ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
 
@@ -151,6 +177,49 @@ TEST_F(IpSecTunnelTest, NormalRead) {
   EXPECT_EQ(recv_packets[0].data(), "foo");
 }
 
+TEST_F(IpSecTunnelTest, ReadBurst) {
+  ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
+
+  write(sock_fd_, "foo", 3);
+  write(sock_fd_, "bar", 3);
+  write(sock_fd_, "baz", 3);
+
+  // Everything that's queued up is returned at once.
+  ASSERT_OK_AND_ASSIGN(auto recv_packets, tunnel->ReadPackets());
+  ASSERT_EQ(recv_packets.size(), 3);
+  EXPECT_EQ(recv_packets[0].data(), "foo");
+  EXPECT_EQ(recv_packets[1].data(), "bar");
+  EXPECT_EQ(recv_packets[2].data(), "baz");
+  EXPECT_TRUE(recv_packets[0].is_writable());
+  EXPECT_GE(recv_packets[0].headroom(), kPacketHeadroom);
+}
+
+TEST_F(IpSecTunnelTest, ReadBurstIsLimited) {
+  ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
+  tunnel->SetMaxReadBurst(2);
+
+  write(sock_fd_, "foo", 3);
+  write(sock_fd_, "bar", 3);
+  write(sock_fd_, "baz", 3);
+
+  ASSERT_OK_AND_ASSIGN(auto recv_packets, tunnel->ReadPackets());
+  ASSERT_EQ(recv_packets.size(), 2);
+  EXPECT_EQ(recv_packets[0].data(), "foo");
+  EXPECT_EQ(recv_packets[1].data(), "bar");
+
+  ASSERT_OK_AND_ASSIGN(recv_packets, tunnel->ReadPackets());
+  ASSERT_EQ(recv_packets.size(), 1);
+  EXPECT_EQ(recv_packets[0].data(), "baz");
+}
+
+TEST_F(IpSecTunnelTest, EnableOffloadRequiresVnetHeaderTun) {
+  ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
+
+  EXPECT_THAT(tunnel->EnableOffload(),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  EXPECT_FALSE(tunnel->IsOffloadEnabled());
+}
+
 TEST_F(IpSecTunnelTest, ReadAfterShutdown) {
   ASSERT_OK_AND_ASSIGN(auto tunnel, IpSecTunnel::Create(tun_fd_));
 
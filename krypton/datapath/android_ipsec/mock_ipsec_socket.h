@@ -15,7 +15,11 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_MOCK_IPSEC_SOCKET_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_MOCK_IPSEC_SOCKET_H_
 
+#include <string>
+#include <vector>
+
 #include "privacy/net/krypton/datapath/android_ipsec/ipsec_socket_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
 #include "testing/base/public/gmock.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
@@ -40,6 +44,11 @@ class MockIpSecSocket : public IpSecSocketInterface {
   MOCK_METHOD(int, GetFd, (), (override));
 
   MOCK_METHOD(void, GetDebugInfo, (DatapathDebugInfo*), (override));
+
+  MOCK_METHOD(absl::Status, EnablePathMtuProbing,
+              (const PathMtuProber::Options&, const std::string&,
+               const std::string&),
+              (override));
 };
 
 }  // namespace android
@@ -14,10 +14,15 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker.h"
 
+#include <algorithm>
+#include <utility>
+
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/utils/looper.h"
 #include "third_party/absl/log/die_if_null.h"
 #include "third_party/absl/log/log.h"
+#include "third_party/absl/time/clock.h"
 
 namespace privacy {
 namespace krypton {
@@ -51,22 +56,32 @@ MtuTracker::MtuTracker(IPProtocol dest_ip_protocol, int initial_path_mtu,
     : tunnel_overhead_(dest_ip_protocol == IPProtocol::kIPv6
                            ? kMaxIpv6Overhead
                            : kMaxIpv4Overhead),
+      max_tunnel_mtu_(initial_path_mtu - tunnel_overhead_),
       uplink_mtu_(initial_path_mtu),
-      tunnel_mtu_(uplink_mtu_ - tunnel_overhead_),
+      tunnel_mtu_(max_tunnel_mtu_),
       downlink_mtu_(initial_path_mtu),
+      path_mtu_cache_(nullptr),
+      path_mtu_measured_(false),
+      path_mtu_restored_(false),
       notification_(ABSL_DIE_IF_NULL(notification)),
       notification_thread_(ABSL_DIE_IF_NULL(notification_thread)) {
   // Send the current values to the new NotificationHandler
   notification_thread_->Post([notification, downlink_mtu = downlink_mtu_,
                               uplink_mtu = uplink_mtu_,
-                              tunnel_mtu = tunnel_mtu_] {
+                              tunnel_mtu = tunnel_mtu_.load()] {
     notification->DownlinkMtuUpdated(downlink_mtu);
     notification->UplinkMtuUpdated(uplink_mtu, tunnel_mtu);
   });
 }
 
 void MtuTracker::UpdateUplinkMtu(int uplink_mtu) {
-  if (uplink_mtu < uplink_mtu_) {
+  // Until the path has been measured again, restored values may be replaced
+  // by higher ones, up to the initial path MTU, in case the path got better.
+  if (path_mtu_restored_) {
+    uplink_mtu = std::min(uplink_mtu, max_tunnel_mtu_ + tunnel_overhead_);
+  }
+  if (uplink_mtu < uplink_mtu_ ||
+      (path_mtu_restored_ && uplink_mtu > uplink_mtu_)) {
     LOG(INFO) << "Updating Path MTU from " << uplink_mtu_ << " to "
               << uplink_mtu;
     uplink_mtu_ = uplink_mtu;
@@ -74,16 +89,18 @@ void MtuTracker::UpdateUplinkMtu(int uplink_mtu) {
     LOG(INFO) << "Updating Tunnel MTU from " << tunnel_mtu_ << " to "
               << tunnel_mtu;
     tunnel_mtu_ = tunnel_mtu;
-
-    auto notification = notification_;
-    notification_thread_->Post([notification, uplink_mtu, tunnel_mtu] {
-      notification->UplinkMtuUpdated(uplink_mtu, tunnel_mtu);
-    });
+    NotifyUplinkMtuUpdated();
+    StorePathMtu();
   }
 }
 
 void MtuTracker::UpdateDownlinkMtu(int downlink_mtu) {
-  if (downlink_mtu < downlink_mtu_) {
+  if (path_mtu_restored_) {
+    downlink_mtu = std::min(downlink_mtu, max_tunnel_mtu_ + tunnel_overhead_);
+  }
+  bool changed = downlink_mtu < downlink_mtu_ ||
+                 (path_mtu_restored_ && downlink_mtu > downlink_mtu_);
+  if (changed) {
     downlink_mtu_ = downlink_mtu;
 
     auto notification = notification_;
@@ -91,10 +108,75 @@ void MtuTracker::UpdateDownlinkMtu(int downlink_mtu) {
       notification->DownlinkMtuUpdated(downlink_mtu);
     });
   }
+  // Only MSS MTU detection measures the downlink MTU, and it updates the
+  // uplink MTU first, so this is when both have been measured.
+  if (changed || !path_mtu_measured_) {
+    path_mtu_measured_ = true;
+    path_mtu_restored_ = false;
+    StorePathMtu();
+  }
 }
 
 int MtuTracker::GetTunnelMtu() const { return tunnel_mtu_; }
 
+void MtuTracker::RaiseTunnelMtu(int tunnel_mtu) {
+  tunnel_mtu = std::min(tunnel_mtu, max_tunnel_mtu_);
+  if (tunnel_mtu <= tunnel_mtu_) {
+    return;
+  }
+  LOG(INFO) << "Raising Tunnel MTU from " << tunnel_mtu_ << " to "
+            << tunnel_mtu;
+  tunnel_mtu_ = tunnel_mtu;
+  uplink_mtu_ = tunnel_mtu + tunnel_overhead_;
+  NotifyUplinkMtuUpdated();
+  StorePathMtu();
+}
+
+int MtuTracker::GetMaxTunnelMtu() const { return max_tunnel_mtu_; }
+
+void MtuTracker::RestorePathMtu(const PathMtuCache::Entry& entry) {
+  LOG(INFO) << "Restoring Path MTU " << entry.uplink_mtu
+            << " and downlink MTU " << entry.downlink_mtu;
+  // The restored values aren't a measurement, so they aren't stored back, and
+  // the entry still expires when it would have. MSS MTU detection still runs,
+  // and its results replace these.
+  path_mtu_restored_ = true;
+  if (entry.uplink_mtu < uplink_mtu_) {
+    uplink_mtu_ = entry.uplink_mtu;
+    tunnel_mtu_ = uplink_mtu_ - tunnel_overhead_;
+    NotifyUplinkMtuUpdated();
+  }
+  if (entry.downlink_mtu < downlink_mtu_) {
+    downlink_mtu_ = entry.downlink_mtu;
+    auto notification = notification_;
+    notification_thread_->Post(
+        [notification, downlink_mtu = downlink_mtu_] {
+          notification->DownlinkMtuUpdated(downlink_mtu);
+        });
+  }
+}
+
+void MtuTracker::SetPathMtuCache(PathMtuCache* cache, PathMtuCache::Key key) {
+  path_mtu_cache_ = cache;
+  path_mtu_cache_key_ = std::move(key);
+}
+
+void MtuTracker::NotifyUplinkMtuUpdated() {
+  auto notification = notification_;
+  notification_thread_->Post([notification, uplink_mtu = uplink_mtu_,
+                              tunnel_mtu = tunnel_mtu_.load()] {
+    notification->UplinkMtuUpdated(uplink_mtu, tunnel_mtu);
+  });
+}
+
+void MtuTracker::StorePathMtu() {
+  if (path_mtu_cache_ == nullptr || !path_mtu_measured_) {
+    return;
+  }
+  path_mtu_cache_->Store(*path_mtu_cache_key_, {uplink_mtu_, downlink_mtu_},
+                         absl::Now());
+}
+
 }  // namespace android
 }  // namespace datapath
 }  // namespace krypton
@@ -15,7 +15,11 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_MTU_TRACKER_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_MTU_TRACKER_H_
 
+#include <atomic>
+#include <optional>
+
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/utils/looper.h"
 
@@ -39,12 +43,39 @@ class MtuTracker : public MtuTrackerInterface {
 
   int GetTunnelMtu() const override;
 
+  void RaiseTunnelMtu(int tunnel_mtu) override;
+
+  int GetMaxTunnelMtu() const override;
+
+  // Starts from path MTUs measured on an earlier connection over the same
+  // path, rather than the initial path MTU. Should be called before the
+  // tracker is handed to a socket. The next measurement replaces them, even if
+  // it's higher.
+  void RestorePathMtu(const PathMtuCache::Entry& entry);
+
+  // Stores the path MTUs in `cache` under `key` once they've been measured,
+  // which is when the downlink MTU is first updated, and again whenever they
+  // change after that. `cache` must outlive this tracker.
+  void SetPathMtuCache(PathMtuCache* cache, PathMtuCache::Key key);
+
  private:
+  void NotifyUplinkMtuUpdated();
+
+  void StorePathMtu();
+
   int tunnel_overhead_;
+  int max_tunnel_mtu_;
   int uplink_mtu_;
-  int tunnel_mtu_;
+  // Atomic so that GetTunnelMtu() can be called from any thread.
+  std::atomic_int tunnel_mtu_;
   int downlink_mtu_;
 
+  PathMtuCache* path_mtu_cache_;  // Not owned.
+  std::optional<PathMtuCache::Key> path_mtu_cache_key_;
+  bool path_mtu_measured_;
+  // Whether the path MTUs came from the cache and haven't been measured since.
+  bool path_mtu_restored_;
+
   NotificationInterface* notification_;  // Not owned.
 
   // This thread will be used to send notifications "up the stack" to listeners.
@@ -43,7 +43,18 @@ class MtuTrackerInterface {
 
   virtual void UpdateDownlinkMtu(int downlink_mtu) = 0;
 
+  // Returns the current tunnel MTU. Unlike the other methods, this may be
+  // called from any thread.
   virtual int GetTunnelMtu() const = 0;
+
+  // Raises the tunnel MTU, and the uplink MTU along with it, after a bigger
+  // tunnel MTU has been confirmed by probing. Values above GetMaxTunnelMtu()
+  // are capped, and values below the current tunnel MTU are ignored.
+  virtual void RaiseTunnelMtu(int tunnel_mtu) = 0;
+
+  // Returns the tunnel MTU the path started out with, which is as far as
+  // RaiseTunnelMtu() will go.
+  virtual int GetMaxTunnelMtu() const = 0;
 };
 
 }  // namespace android
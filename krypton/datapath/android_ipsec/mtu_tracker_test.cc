@@ -15,11 +15,13 @@
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker.h"
 
 #include "privacy/net/krypton/datapath/android_ipsec/mtu_tracker_interface.h"
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/utils/looper.h"
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
 #include "third_party/absl/synchronization/notification.h"
+#include "third_party/absl/time/clock.h"
 #include "third_party/absl/time/time.h"
 
 namespace privacy {
@@ -44,6 +46,13 @@ class MtuTrackerTest : public ::testing::Test {
   utils::LooperThread looper_;
 };
 
+// Waits for everything posted to `looper` so far to run.
+void Drain(utils::LooperThread* looper) {
+  absl::Notification done;
+  looper->Post([&done] { done.Notify(); });
+  done.WaitForNotification();
+}
+
 TEST_F(MtuTrackerTest, TestCreateMtuTrackerIPv4) {
   absl::Notification uplink_mtu_updated;
   absl::Notification downlink_mtu_updated;
@@ -201,6 +210,51 @@ TEST_F(MtuTrackerTest, TestSetHigherDownlinkMtu) {
   downlink_mtu_updated.WaitForNotification();
 }
 
+TEST_F(MtuTrackerTest, TestRaiseTunnelMtu) {
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1500, 1395));
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1300, 1195));
+
+  absl::Notification uplink_mtu_updated;
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1400, 1295))
+      .WillOnce([&uplink_mtu_updated] { uplink_mtu_updated.Notify(); });
+
+  MtuTracker mtu_tracker =
+      MtuTracker(IPProtocol::kIPv4, 1500, &notification_, &looper_);
+  EXPECT_EQ(mtu_tracker.GetMaxTunnelMtu(), 1395);
+  mtu_tracker.UpdateUplinkMtu(1300);
+  mtu_tracker.RaiseTunnelMtu(1295);
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1295);
+
+  uplink_mtu_updated.WaitForNotification();
+
+  // Later drops still apply after a raise.
+  absl::Notification dropped_again;
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1350, 1245))
+      .WillOnce([&dropped_again] { dropped_again.Notify(); });
+  mtu_tracker.UpdateUplinkMtu(1350);
+  dropped_again.WaitForNotification();
+}
+
+TEST_F(MtuTrackerTest, TestRaiseTunnelMtuIsCappedAtMax) {
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1500, 1395)).Times(2);
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1300, 1195));
+
+  MtuTracker mtu_tracker =
+      MtuTracker(IPProtocol::kIPv4, 1500, &notification_, &looper_);
+  mtu_tracker.UpdateUplinkMtu(1300);
+  mtu_tracker.RaiseTunnelMtu(1500);
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1395);
+
+  // Raising to the current MTU, or lower, does nothing.
+  mtu_tracker.RaiseTunnelMtu(1395);
+  mtu_tracker.RaiseTunnelMtu(1000);
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1395);
+
+  absl::Notification done;
+  looper_.Post([&done] { done.Notify(); });
+  done.WaitForNotification();
+}
+
 TEST_F(MtuTrackerTest, TestGetTunnelMtu) {
   absl::Notification uplink_mtu_updated;
   int notification_tunnel_mtu;
@@ -220,6 +274,92 @@ TEST_F(MtuTrackerTest, TestGetTunnelMtu) {
   EXPECT_EQ(mtu_tracker.GetTunnelMtu(), notification_tunnel_mtu);
 }
 
+TEST_F(MtuTrackerTest, TestStoresMeasuredPathMtu) {
+  EXPECT_CALL(notification_, UplinkMtuUpdated(_, _))
+      .Times(::testing::AnyNumber());
+  EXPECT_CALL(notification_, DownlinkMtuUpdated(_))
+      .Times(::testing::AnyNumber());
+
+  PathMtuCache cache(4, absl::Minutes(30));
+  PathMtuCache::Key key{1, "192.0.2.1:2153"};
+  MtuTracker mtu_tracker =
+      MtuTracker(IPProtocol::kIPv4, 1500, &notification_, &looper_);
+  mtu_tracker.SetPathMtuCache(&cache, key);
+
+  // Nothing is stored until MSS MTU detection has measured the path.
+  mtu_tracker.UpdateUplinkMtu(1450);
+  EXPECT_EQ(cache.Lookup(key, absl::Now()), std::nullopt);
+
+  // A measurement is stored even if it doesn't change anything.
+  mtu_tracker.UpdateDownlinkMtu(1500);
+  auto entry = cache.Lookup(key, absl::Now());
+  ASSERT_NE(entry, std::nullopt);
+  EXPECT_EQ(entry->uplink_mtu, 1450);
+  EXPECT_EQ(entry->downlink_mtu, 1500);
+
+  // Later changes are stored too.
+  mtu_tracker.UpdateUplinkMtu(1400);
+  mtu_tracker.UpdateDownlinkMtu(1420);
+  entry = cache.Lookup(key, absl::Now());
+  ASSERT_NE(entry, std::nullopt);
+  EXPECT_EQ(entry->uplink_mtu, 1400);
+  EXPECT_EQ(entry->downlink_mtu, 1420);
+
+  Drain(&looper_);
+}
+
+TEST_F(MtuTrackerTest, TestRestorePathMtu) {
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1500, 1395));
+  EXPECT_CALL(notification_, DownlinkMtuUpdated(1500));
+  EXPECT_CALL(notification_, UplinkMtuUpdated(1400, 1295));
+  EXPECT_CALL(notification_, DownlinkMtuUpdated(1420));
+
+  PathMtuCache cache(4, absl::Minutes(30));
+  PathMtuCache::Key key{1, "192.0.2.1:2153"};
+  MtuTracker mtu_tracker =
+      MtuTracker(IPProtocol::kIPv4, 1500, &notification_, &looper_);
+  mtu_tracker.SetPathMtuCache(&cache, key);
+  mtu_tracker.RestorePathMtu({1400, 1420});
+
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1295);
+  // Probing may still go back up to the initial path MTU.
+  EXPECT_EQ(mtu_tracker.GetMaxTunnelMtu(), 1395);
+  // Restored values aren't stored back.
+  EXPECT_EQ(cache.Lookup(key, absl::Now()), std::nullopt);
+
+  Drain(&looper_);
+}
+
+TEST_F(MtuTrackerTest, TestMeasurementReplacesRestoredPathMtu) {
+  EXPECT_CALL(notification_, UplinkMtuUpdated(_, _))
+      .Times(::testing::AnyNumber());
+  EXPECT_CALL(notification_, DownlinkMtuUpdated(_))
+      .Times(::testing::AnyNumber());
+
+  PathMtuCache cache(4, absl::Minutes(30));
+  PathMtuCache::Key key{1, "192.0.2.1:2153"};
+  MtuTracker mtu_tracker =
+      MtuTracker(IPProtocol::kIPv4, 1500, &notification_, &looper_);
+  mtu_tracker.SetPathMtuCache(&cache, key);
+  mtu_tracker.RestorePathMtu({1400, 1420});
+
+  // The path got better since it was cached, so the new measurement raises the
+  // MTUs, though not past the initial path MTU, and is stored.
+  mtu_tracker.UpdateUplinkMtu(1450);
+  mtu_tracker.UpdateDownlinkMtu(1600);
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1450 - 105);
+  auto entry = cache.Lookup(key, absl::Now());
+  ASSERT_NE(entry, std::nullopt);
+  EXPECT_EQ(entry->uplink_mtu, 1450);
+  EXPECT_EQ(entry->downlink_mtu, 1500);
+
+  // Once the path has been measured, the MTUs only go down again.
+  mtu_tracker.UpdateUplinkMtu(1480);
+  EXPECT_EQ(mtu_tracker.GetTunnelMtu(), 1450 - 105);
+
+  Drain(&looper_);
+}
+
 }  // namespace
 }  // namespace android
 }  // namespace datapath
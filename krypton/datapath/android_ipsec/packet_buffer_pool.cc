@@ -0,0 +1,115 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+
+#include <cstddef>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+PacketBufferPool::PacketBufferPool(size_t buffer_size, size_t max_free_buffers)
+    : buffer_size_(buffer_size), shared_(new Shared()) {
+  shared_->max_free_buffers = max_free_buffers;
+}
+
+PacketBufferPool::~PacketBufferPool() {
+  bool last;
+  {
+    absl::MutexLock lock(&shared_->mutex);
+    for (char* buffer : shared_->free) {
+      delete[] buffer;
+    }
+    shared_->free.clear();
+    shared_->orphaned = true;
+    last = shared_->outstanding == 0;
+  }
+  // Otherwise, the last packet to be destroyed will clean up.
+  if (last) {
+    delete shared_;
+  }
+}
+
+void PacketBufferPool::Acquire(absl::Span<char*> buffers) {
+  size_t reused = 0;
+  {
+    absl::MutexLock lock(&shared_->mutex);
+    while (reused < buffers.size() && !shared_->free.empty()) {
+      buffers[reused++] = shared_->free.back();
+      shared_->free.pop_back();
+    }
+    shared_->outstanding += buffers.size();
+  }
+  for (size_t i = reused; i < buffers.size(); ++i) {
+    buffers[i] = new char[buffer_size_];
+  }
+}
+
+void PacketBufferPool::Release(absl::Span<char* const> buffers) {
+  absl::MutexLock lock(&shared_->mutex);
+  for (char* buffer : buffers) {
+    if (shared_->free.size() < shared_->max_free_buffers) {
+      shared_->free.push_back(buffer);
+    } else {
+      delete[] buffer;
+    }
+  }
+  shared_->outstanding -= buffers.size();
+}
+
+Packet PacketBufferPool::MakePacket(char* buffer, size_t headroom,
+                                    size_t length, IPProtocol protocol) {
+  return Packet(buffer, buffer_size_, headroom, length, protocol,
+                ReleaseAsOwner(buffer));
+}
+
+PacketOwner PacketBufferPool::ReleaseAsOwner(char* buffer) {
+  return PacketOwner::PoolReturn(&ReturnToShared, shared_, buffer);
+}
+
+size_t PacketBufferPool::free_buffers() const {
+  absl::MutexLock lock(&shared_->mutex);
+  return shared_->free.size();
+}
+
+void PacketBufferPool::ReturnToShared(void* shared_state, void* released) {
+  auto* shared = static_cast<Shared*>(shared_state);
+  auto* buffer = static_cast<char*>(released);
+  bool last = false;
+  {
+    absl::MutexLock lock(&shared->mutex);
+    if (!shared->orphaned && shared->free.size() < shared->max_free_buffers) {
+      shared->free.push_back(buffer);
+      buffer = nullptr;
+    }
+    --shared->outstanding;
+    last = shared->orphaned && shared->outstanding == 0;
+  }
+  delete[] buffer;
+  if (last) {
+    delete shared;
+  }
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
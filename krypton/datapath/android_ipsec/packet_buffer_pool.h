@@ -0,0 +1,93 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PACKET_BUFFER_POOL_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PACKET_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Recycles the fixed-size buffers that packets are read into, so that the read
+// loops don't have to allocate a new buffer for every packet.
+//
+// Buffers are handed out with Acquire() and either given back with Release(),
+// or wrapped in a Packet with MakePacket(), in which case they go back to the
+// pool when the Packet is destroyed. Packets may outlive the pool.
+class PacketBufferPool {
+ public:
+  // Creates a pool of buffers of `buffer_size` bytes, which keeps at most
+  // `max_free_buffers` unused buffers around for reuse.
+  PacketBufferPool(size_t buffer_size, size_t max_free_buffers);
+  ~PacketBufferPool();
+
+  // Disallow copy and assign.
+  PacketBufferPool(const PacketBufferPool&) = delete;
+  PacketBufferPool& operator=(const PacketBufferPool&) = delete;
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  // Fills `buffers` with buffers of buffer_size() bytes, reusing free buffers
+  // where possible. Never fails.
+  void Acquire(absl::Span<char*> buffers);
+
+  // Gives back buffers that were acquired but not turned into packets.
+  void Release(absl::Span<char* const> buffers);
+
+  // Wraps an acquired buffer in a writable Packet whose data is the `length`
+  // bytes starting `headroom` bytes into the buffer. The buffer goes back to
+  // the pool when the packet is destroyed.
+  Packet MakePacket(char* buffer, size_t headroom, size_t length,
+                    IPProtocol protocol);
+
+  // Returns a PacketOwner that gives an acquired buffer back to the pool, for
+  // when the buffer is shared by several packets.
+  PacketOwner ReleaseAsOwner(char* buffer);
+
+  // Returns the number of buffers available for reuse.
+  size_t free_buffers() const;
+
+ private:
+  // The state shared with outstanding packets, which is only deleted once the
+  // pool and all of its packets are gone.
+  struct Shared {
+    absl::Mutex mutex;
+    std::vector<char*> free ABSL_GUARDED_BY(mutex);
+    size_t outstanding ABSL_GUARDED_BY(mutex) = 0;
+    bool orphaned ABSL_GUARDED_BY(mutex) = false;
+    size_t max_free_buffers;
+  };
+
+  // Gives `buffer` back to the Shared state, as a PacketOwner pool return.
+  static void ReturnToShared(void* shared, void* buffer);
+
+  const size_t buffer_size_;
+  Shared* shared_;
+};
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PACKET_BUFFER_POOL_H_
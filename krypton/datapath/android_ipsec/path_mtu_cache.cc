@@ -0,0 +1,75 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
+
+#include <cstddef>
+#include <optional>
+
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+PathMtuCache::PathMtuCache(size_t capacity, absl::Duration ttl)
+    : capacity_(capacity), ttl_(ttl) {}
+
+std::optional<PathMtuCache::Entry> PathMtuCache::Lookup(const Key& key,
+                                                        absl::Time now) {
+  absl::MutexLock l(&mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return std::nullopt;
+  }
+  if (now >= it->second->expiry) {
+    items_.erase(it->second);
+    index_.erase(it);
+    return std::nullopt;
+  }
+  items_.splice(items_.begin(), items_, it->second);
+  return it->second->entry;
+}
+
+void PathMtuCache::Store(const Key& key, Entry entry, absl::Time now) {
+  if (capacity_ == 0) {
+    return;
+  }
+  absl::MutexLock l(&mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    it->second->entry = entry;
+    it->second->expiry = now + ttl_;
+    items_.splice(items_.begin(), items_, it->second);
+    return;
+  }
+  if (items_.size() >= capacity_) {
+    index_.erase(items_.back().key);
+    items_.pop_back();
+  }
+  items_.push_front(Item{key, entry, now + ttl_});
+  index_.emplace(key, items_.begin());
+}
+
+size_t PathMtuCache::size() const {
+  absl::MutexLock l(&mutex_);
+  return items_.size();
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,110 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_CACHE_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Remembers the path MTUs measured on recently used networks, so that
+// reconnecting to one of them can start with the right tunnel MTU straight
+// away, instead of dropping oversize packets until MSS MTU detection finishes.
+//
+// Paths are identified by the network and the egress endpoint, since either
+// can change the path. Entries expire `ttl` after they were measured, so that
+// a path is measured again every so often, and the least recently used entry
+// is evicted once there are more than `capacity`.
+//
+// This class is thread-safe.
+class PathMtuCache {
+ public:
+  struct Key {
+    int64_t network_id;
+    // The egress endpoint, as host:port.
+    std::string endpoint;
+
+    bool operator==(const Key& other) const {
+      return network_id == other.network_id && endpoint == other.endpoint;
+    }
+
+    template <typename H>
+    friend H AbslHashValue(H h, const Key& key) {
+      return H::combine(std::move(h), key.network_id, key.endpoint);
+    }
+  };
+
+  struct Entry {
+    int uplink_mtu;
+    int downlink_mtu;
+  };
+
+  PathMtuCache(size_t capacity, absl::Duration ttl);
+
+  // Disallow copy and assign.
+  PathMtuCache(const PathMtuCache&) = delete;
+  PathMtuCache& operator=(const PathMtuCache&) = delete;
+
+  // Returns the path MTUs stored for `key`, unless there are none or they have
+  // expired.
+  std::optional<Entry> Lookup(const Key& key, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Stores path MTUs that were just measured for `key`, replacing any that
+  // were there before, and restarting the expiry.
+  void Store(const Key& key, Entry entry, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the number of entries, including expired ones that haven't been
+  // evicted yet.
+  size_t size() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  struct Item {
+    Key key;
+    Entry entry;
+    absl::Time expiry;
+  };
+
+  const size_t capacity_;
+  const absl::Duration ttl_;
+
+  mutable absl::Mutex mutex_;
+
+  // Most recently used first.
+  std::list<Item> items_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<Key, std::list<Item>::iterator> index_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_CACHE_H_
@@ -0,0 +1,96 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_cache.h"
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::AllOf;
+using ::testing::Field;
+using ::testing::Optional;
+
+constexpr absl::Time kStart = absl::FromUnixSeconds(1000);
+constexpr absl::Duration kTtl = absl::Minutes(30);
+
+auto HasMtus(int uplink_mtu, int downlink_mtu) {
+  return Optional(AllOf(Field(&PathMtuCache::Entry::uplink_mtu, uplink_mtu),
+                        Field(&PathMtuCache::Entry::downlink_mtu,
+                              downlink_mtu)));
+}
+
+TEST(PathMtuCacheTest, LooksUpStoredEntries) {
+  PathMtuCache cache(4, kTtl);
+  EXPECT_EQ(cache.Lookup({1, "192.0.2.1:2153"}, kStart), std::nullopt);
+
+  cache.Store({1, "192.0.2.1:2153"}, {1400, 1420}, kStart);
+  cache.Store({2, "192.0.2.1:2153"}, {1280, 1500}, kStart);
+  EXPECT_THAT(cache.Lookup({1, "192.0.2.1:2153"}, kStart),
+              HasMtus(1400, 1420));
+  EXPECT_THAT(cache.Lookup({2, "192.0.2.1:2153"}, kStart),
+              HasMtus(1280, 1500));
+  // Another endpoint on the same network is another path.
+  EXPECT_EQ(cache.Lookup({1, "[2001:db8::1]:2153"}, kStart), std::nullopt);
+}
+
+TEST(PathMtuCacheTest, StoreReplacesEntryAndRestartsExpiry) {
+  PathMtuCache cache(4, kTtl);
+  cache.Store({1, "a"}, {1400, 1420}, kStart);
+  cache.Store({1, "a"}, {1300, 1320}, kStart + absl::Minutes(20));
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_THAT(cache.Lookup({1, "a"}, kStart + absl::Minutes(40)),
+              HasMtus(1300, 1320));
+}
+
+TEST(PathMtuCacheTest, EntriesExpire) {
+  PathMtuCache cache(4, kTtl);
+  cache.Store({1, "a"}, {1400, 1420}, kStart);
+  EXPECT_THAT(cache.Lookup({1, "a"}, kStart + kTtl - absl::Seconds(1)),
+              HasMtus(1400, 1420));
+  EXPECT_EQ(cache.Lookup({1, "a"}, kStart + kTtl), std::nullopt);
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(PathMtuCacheTest, EvictsLeastRecentlyUsed) {
+  PathMtuCache cache(2, kTtl);
+  cache.Store({1, "a"}, {1400, 1400}, kStart);
+  cache.Store({2, "a"}, {1300, 1300}, kStart);
+  // Using the first entry makes the second one the least recently used.
+  EXPECT_NE(cache.Lookup({1, "a"}, kStart), std::nullopt);
+  cache.Store({3, "a"}, {1200, 1200}, kStart);
+
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_THAT(cache.Lookup({1, "a"}, kStart), HasMtus(1400, 1400));
+  EXPECT_EQ(cache.Lookup({2, "a"}, kStart), std::nullopt);
+  EXPECT_THAT(cache.Lookup({3, "a"}, kStart), HasMtus(1200, 1200));
+}
+
+TEST(PathMtuCacheTest, ZeroCapacityStoresNothing) {
+  PathMtuCache cache(0, kTtl);
+  cache.Store({1, "a"}, {1400, 1400}, kStart);
+  EXPECT_EQ(cache.Lookup({1, "a"}, kStart), std::nullopt);
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
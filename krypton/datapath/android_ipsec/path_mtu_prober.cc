@@ -0,0 +1,136 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
+
+#include <cstdint>
+
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+PathMtuProber::PathMtuProber(const Options& options)
+    : options_(options),
+      last_tunnel_mtu_(0),
+      next_search_(absl::InfiniteFuture()),
+      searching_(false),
+      low_(0),
+      high_(0),
+      probe_size_(0),
+      probes_lost_(0),
+      probe_sequence_(0),
+      probe_acknowledged_(false) {}
+
+PathMtuProber::Action PathMtuProber::Poll(int tunnel_mtu, int max_tunnel_mtu,
+                                          absl::Time now) {
+  absl::MutexLock l(&mutex_);
+  Action action;
+
+  // A drop means the path just got worse, so any search in progress is stale,
+  // and the path gets a while to settle before it's probed again.
+  bool dropped = tunnel_mtu < last_tunnel_mtu_;
+  last_tunnel_mtu_ = tunnel_mtu;
+  if (dropped || (!searching_ && tunnel_mtu < max_tunnel_mtu &&
+                  next_search_ == absl::InfiniteFuture())) {
+    if (searching_) {
+      LOG(INFO) << "Abandoning path MTU search after tunnel MTU dropped to "
+                << tunnel_mtu;
+    }
+    searching_ = false;
+    next_search_ = now + options_.raise_interval;
+    return action;
+  }
+
+  if (!searching_) {
+    if (now < next_search_) {
+      return action;
+    }
+    if (tunnel_mtu >= max_tunnel_mtu) {
+      next_search_ = absl::InfiniteFuture();
+      return action;
+    }
+    LOG(INFO) << "Searching for a path MTU between " << tunnel_mtu << " and "
+              << max_tunnel_mtu;
+    searching_ = true;
+    low_ = tunnel_mtu;
+    high_ = max_tunnel_mtu;
+    probe_size_ = max_tunnel_mtu;
+    probes_lost_ = 0;
+    SendProbe(now, &action);
+    return action;
+  }
+
+  if (probe_acknowledged_) {
+    low_ = probe_size_;
+    action.confirmed_mtu = low_;
+    NextProbe(now, &action);
+    return action;
+  }
+  if (now - probe_sent_ < options_.probe_timeout) {
+    return action;
+  }
+  if (++probes_lost_ < options_.max_probes) {
+    SendProbe(now, &action);
+    return action;
+  }
+  high_ = probe_size_ - 1;
+  NextProbe(now, &action);
+  return action;
+}
+
+void PathMtuProber::ProbeAcknowledged(uint16_t sequence) {
+  absl::MutexLock l(&mutex_);
+  if (searching_ && sequence == probe_sequence_) {
+    probe_acknowledged_ = true;
+  }
+}
+
+bool PathMtuProber::searching() const {
+  absl::MutexLock l(&mutex_);
+  return searching_;
+}
+
+void PathMtuProber::NextProbe(absl::Time now, Action* action) {
+  if (high_ - low_ < options_.granularity) {
+    EndSearch(now);
+    return;
+  }
+  probe_size_ = low_ + (high_ - low_ + 1) / 2;
+  probes_lost_ = 0;
+  SendProbe(now, action);
+}
+
+void PathMtuProber::SendProbe(absl::Time now, Action* action) {
+  ++probe_sequence_;
+  probe_sent_ = now;
+  probe_acknowledged_ = false;
+  action->probe_size = probe_size_;
+  action->probe_sequence = probe_sequence_;
+}
+
+void PathMtuProber::EndSearch(absl::Time now) {
+  LOG(INFO) << "Path MTU search confirmed a tunnel MTU of " << low_;
+  searching_ = false;
+  next_search_ = now + options_.raise_interval;
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
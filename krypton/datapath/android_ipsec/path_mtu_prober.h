@@ -0,0 +1,126 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_PROBER_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_PROBER_H_
+
+#include <cstdint>
+#include <optional>
+
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Decides when to send packetization layer path MTU probes (RFC 8899), and of
+// what size, so that a tunnel MTU that was lowered by a transient path can be
+// raised again.
+//
+// While the tunnel MTU is below its maximum, the prober waits `raise_interval`
+// and then searches between the current tunnel MTU and the maximum. The first
+// probe is the maximum, since the usual case is that the path has recovered
+// completely, and after that the search is binary. A size only counts as too
+// big once `max_probes` probes of that size have been lost in a row, so that a
+// single dropped probe doesn't shrink the search. Every acknowledged size is
+// reported straight away, so that the tunnel MTU goes up as the search goes.
+//
+// The prober doesn't send anything itself. Poll() is called from the thread
+// that writes packets, and ProbeAcknowledged() from the thread that reads them.
+class PathMtuProber {
+ public:
+  struct Options {
+    // How long to wait for a probe to be acknowledged before it's lost.
+    absl::Duration probe_timeout = absl::Seconds(2);
+
+    // How long to wait after the tunnel MTU drops, or after a search, before
+    // searching for a bigger MTU.
+    absl::Duration raise_interval = absl::Minutes(10);
+
+    // How many probes of a single size have to be lost before the size is
+    // considered too big.
+    int max_probes = 3;
+
+    // The search stops once the bounds are closer than this.
+    int granularity = 8;
+  };
+
+  // What the caller should do after a call to Poll().
+  struct Action {
+    // If set, a probe of this size was acknowledged, and the tunnel MTU can be
+    // raised to it.
+    std::optional<int> confirmed_mtu;
+
+    // If set, a probe of this size should be sent, with `probe_sequence`.
+    std::optional<int> probe_size;
+    uint16_t probe_sequence = 0;
+  };
+
+  PathMtuProber() : PathMtuProber(Options()) {}
+  explicit PathMtuProber(const Options& options);
+
+  // Advances the search. `tunnel_mtu` is the current tunnel MTU, which may
+  // have dropped since the last call, and `max_tunnel_mtu` is the largest
+  // tunnel MTU the search may confirm.
+  Action Poll(int tunnel_mtu, int max_tunnel_mtu, absl::Time now)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Records that the probe with `sequence` made it through. Acknowledgements
+  // for probes other than the one in flight are ignored.
+  void ProbeAcknowledged(uint16_t sequence) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns whether a search is in progress.
+  bool searching() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  // Picks the next size to probe, or ends the search if there's none left.
+  void NextProbe(absl::Time now, Action* action)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  void SendProbe(absl::Time now, Action* action)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  void EndSearch(absl::Time now) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Options options_;
+
+  mutable absl::Mutex mutex_;
+
+  // The tunnel MTU seen by the last call to Poll(), to detect drops.
+  int last_tunnel_mtu_ ABSL_GUARDED_BY(mutex_);
+  absl::Time next_search_ ABSL_GUARDED_BY(mutex_);
+
+  // The search bounds. `low_` is known to work, and `high_` is the largest
+  // size that hasn't been ruled out.
+  bool searching_ ABSL_GUARDED_BY(mutex_);
+  int low_ ABSL_GUARDED_BY(mutex_);
+  int high_ ABSL_GUARDED_BY(mutex_);
+
+  // The probe in flight, if searching.
+  int probe_size_ ABSL_GUARDED_BY(mutex_);
+  int probes_lost_ ABSL_GUARDED_BY(mutex_);
+  uint16_t probe_sequence_ ABSL_GUARDED_BY(mutex_);
+  absl::Time probe_sent_ ABSL_GUARDED_BY(mutex_);
+  bool probe_acknowledged_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_PATH_MTU_PROBER_H_
@@ -0,0 +1,186 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/path_mtu_prober.h"
+
+#include <optional>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Optional;
+
+constexpr int kMaxTunnelMtu = 1400;
+
+class PathMtuProberTest : public ::testing::Test {
+ public:
+  PathMtuProberTest()
+      : prober_(Options()), now_(absl::FromUnixSeconds(1000)) {}
+
+  static PathMtuProber::Options Options() {
+    PathMtuProber::Options options;
+    options.probe_timeout = absl::Seconds(1);
+    options.raise_interval = absl::Minutes(10);
+    options.max_probes = 2;
+    options.granularity = 8;
+    return options;
+  }
+
+  // Polls with the tunnel MTU that the caller would have after applying every
+  // confirmed MTU so far.
+  PathMtuProber::Action Poll() {
+    auto action = prober_.Poll(tunnel_mtu_, kMaxTunnelMtu, now_);
+    if (action.confirmed_mtu) {
+      tunnel_mtu_ = *action.confirmed_mtu;
+    }
+    return action;
+  }
+
+  // Loses every probe of the current size, and returns the next action.
+  PathMtuProber::Action LoseProbes() {
+    PathMtuProber::Action action;
+    for (int i = 0; i < Options().max_probes; ++i) {
+      now_ += Options().probe_timeout;
+      action = Poll();
+    }
+    return action;
+  }
+
+  PathMtuProber prober_;
+  absl::Time now_;
+  int tunnel_mtu_ = 1200;
+};
+
+TEST_F(PathMtuProberTest, DoesNothingAtMaxMtu) {
+  tunnel_mtu_ = kMaxTunnelMtu;
+  for (int i = 0; i < 3; ++i) {
+    auto action = Poll();
+    EXPECT_EQ(action.probe_size, std::nullopt);
+    EXPECT_EQ(action.confirmed_mtu, std::nullopt);
+    now_ += absl::Hours(1);
+  }
+}
+
+TEST_F(PathMtuProberTest, WaitsRaiseIntervalBeforeSearching) {
+  EXPECT_EQ(Poll().probe_size, std::nullopt);
+  now_ += Options().raise_interval - absl::Seconds(1);
+  EXPECT_EQ(Poll().probe_size, std::nullopt);
+  now_ += absl::Seconds(1);
+  EXPECT_THAT(Poll().probe_size, Optional(Eq(kMaxTunnelMtu)));
+}
+
+TEST_F(PathMtuProberTest, RaisesStraightToMaxWhenPathRecovered) {
+  Poll();
+  now_ += Options().raise_interval;
+  auto probe = Poll();
+  ASSERT_THAT(probe.probe_size, Optional(Eq(kMaxTunnelMtu)));
+
+  prober_.ProbeAcknowledged(probe.probe_sequence);
+  auto action = Poll();
+  EXPECT_THAT(action.confirmed_mtu, Optional(Eq(kMaxTunnelMtu)));
+  EXPECT_EQ(action.probe_size, std::nullopt);
+  EXPECT_FALSE(prober_.searching());
+}
+
+TEST_F(PathMtuProberTest, RetriesLostProbesBeforeGivingUpOnSize) {
+  Poll();
+  now_ += Options().raise_interval;
+  auto first = Poll();
+  ASSERT_THAT(first.probe_size, Optional(Eq(kMaxTunnelMtu)));
+
+  // Not timed out yet.
+  EXPECT_EQ(Poll().probe_size, std::nullopt);
+
+  // The first loss retries the same size with a new sequence number.
+  now_ += Options().probe_timeout;
+  auto retry = Poll();
+  EXPECT_THAT(retry.probe_size, Optional(Eq(kMaxTunnelMtu)));
+  EXPECT_NE(retry.probe_sequence, first.probe_sequence);
+
+  // A late acknowledgement of the first probe doesn't count.
+  prober_.ProbeAcknowledged(first.probe_sequence);
+  now_ += Options().probe_timeout;
+  auto next = Poll();
+  EXPECT_EQ(next.confirmed_mtu, std::nullopt);
+  EXPECT_THAT(next.probe_size, Optional(Eq(1300)));
+}
+
+TEST_F(PathMtuProberTest, BinarySearchConverges) {
+  // The path actually carries packets up to 1337 bytes.
+  constexpr int kPathMtu = 1337;
+  Poll();
+  now_ += Options().raise_interval;
+  auto action = Poll();
+  int probes = 0;
+  while (action.probe_size) {
+    ++probes;
+    ASSERT_LT(probes, 20);
+    if (*action.probe_size <= kPathMtu) {
+      prober_.ProbeAcknowledged(action.probe_sequence);
+      action = Poll();
+    } else {
+      action = LoseProbes();
+    }
+  }
+  EXPECT_FALSE(prober_.searching());
+  EXPECT_LE(tunnel_mtu_, kPathMtu);
+  EXPECT_GT(tunnel_mtu_, kPathMtu - Options().granularity);
+}
+
+TEST_F(PathMtuProberTest, GivesUpWhenNothingBiggerWorks) {
+  Poll();
+  now_ += Options().raise_interval;
+  auto action = Poll();
+  while (action.probe_size) {
+    action = LoseProbes();
+  }
+  EXPECT_EQ(tunnel_mtu_, 1200);
+
+  // The next search starts after another raise interval.
+  EXPECT_EQ(Poll().probe_size, std::nullopt);
+  now_ += Options().raise_interval;
+  EXPECT_THAT(Poll().probe_size, Optional(Eq(kMaxTunnelMtu)));
+}
+
+TEST_F(PathMtuProberTest, DropAbandonsSearch) {
+  Poll();
+  now_ += Options().raise_interval;
+  auto probe = Poll();
+  ASSERT_TRUE(probe.probe_size);
+
+  tunnel_mtu_ = 1100;
+  EXPECT_EQ(Poll().probe_size, std::nullopt);
+  EXPECT_FALSE(prober_.searching());
+
+  // The acknowledgement of the abandoned probe is ignored.
+  prober_.ProbeAcknowledged(probe.probe_sequence);
+  EXPECT_EQ(Poll().confirmed_mtu, std::nullopt);
+
+  now_ += Options().raise_interval;
+  EXPECT_THAT(Poll().probe_size, Optional(Eq(kMaxTunnelMtu)));
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
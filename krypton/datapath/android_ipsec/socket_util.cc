@@ -16,6 +16,7 @@
 
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -66,6 +67,18 @@ namespace {
   return SetSocketBlockingStatus(fd, /*is_blocking= */ false);
 }
 
+bool WaitUntilWritable(int fd) {
+  pollfd poll_fd;
+  poll_fd.fd = fd;
+  poll_fd.events = POLLOUT;
+  poll_fd.revents = 0;
+  int result;
+  do {
+    result = poll(&poll_fd, 1, -1);
+  } while (result == -1 && errno == EINTR);
+  return result > 0;
+}
+
 int FdError(int fd, std::string* msg) {
   int error = 0;
   socklen_t errlen = sizeof(error);
@@ -32,6 +32,10 @@ absl::Status SetSocketBlocking(int fd);
 // Sets the given socket fd in non-blocking mode.
 absl::Status SetSocketNonBlocking(int fd);
 
+// Waits until the fd can be written to, for when a write to a non-blocking fd
+// would have blocked. Returns false if waiting failed.
+bool WaitUntilWritable(int fd);
+
 // Tells the error of the socket, and a message describing the error. If failed
 // to retrieve the socket error, it returns -1 and the msg describes the failure
 // of retrieving error.
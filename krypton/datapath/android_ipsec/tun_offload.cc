@@ -0,0 +1,506 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/tun_offload.h"
+
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/datapath/android_ipsec/socket_util.h"
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/types/span.h"
+
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#endif
+#ifndef TUN_F_USO6
+#define TUN_F_USO6 0x40
+#endif
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+namespace {
+
+constexpr size_t kIpv4HeaderSize = 20;
+constexpr size_t kIpv6HeaderSize = 40;
+constexpr size_t kTcpHeaderSize = 20;
+constexpr size_t kUdpHeaderSize = 8;
+constexpr size_t kTcpChecksumOffset = 16;
+constexpr size_t kUdpChecksumOffset = 6;
+
+constexpr uint8_t kTcpFlagFin = 0x01;
+constexpr uint8_t kTcpFlagPsh = 0x08;
+constexpr uint8_t kTcpFlagAck = 0x10;
+constexpr uint8_t kTcpFlagCwr = 0x80;
+
+uint16_t Load16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+uint32_t Load32(const uint8_t* p) {
+  return (static_cast<uint32_t>(Load16(p)) << 16) | Load16(p + 2);
+}
+
+void Store16(uint8_t* p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+void Store32(uint8_t* p, uint32_t value) {
+  Store16(p, value >> 16);
+  Store16(p + 2, value & 0xffff);
+}
+
+// Where the headers of an IP packet carrying TCP or UDP are.
+struct Layout {
+  bool ipv6;
+  uint8_t protocol;
+  // The offset of the transport header.
+  size_t ip_header_size;
+  // The combined size of the IP and transport headers.
+  size_t header_size;
+};
+
+// Works out the layout of a super-packet read from the TUN device, using the
+// virtio-net header's checksum start as the offset of the transport header,
+// since that also accounts for any IPv6 extension headers.
+absl::Status ParseSuperPacketLayout(const uint8_t* data, size_t length,
+                                    const VirtioNetHeader& virtio,
+                                    Layout* layout) {
+  if (length < kIpv4HeaderSize) {
+    return absl::InvalidArgumentError("TUN packet is too short");
+  }
+  const int version = data[0] >> 4;
+  if (version != 4 && version != 6) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("TUN packet has unknown IP version ", version));
+  }
+  layout->ipv6 = version == 6;
+  layout->protocol = (virtio.gso_type & ~kVirtioNetGsoEcn) ==
+                             kVirtioNetGsoUdpL4
+                         ? IPPROTO_UDP
+                         : IPPROTO_TCP;
+  layout->ip_header_size = virtio.csum_start;
+  const size_t minimum_ip_header_size =
+      layout->ipv6 ? kIpv6HeaderSize : kIpv4HeaderSize;
+  if ((virtio.flags & kVirtioNetNeedsChecksum) == 0 ||
+      layout->ip_header_size < minimum_ip_header_size) {
+    return absl::InvalidArgumentError(
+        "TUN super-packet has no transport header offset");
+  }
+  if (layout->protocol == IPPROTO_TCP) {
+    if (length < layout->ip_header_size + kTcpHeaderSize) {
+      return absl::InvalidArgumentError("TUN TCP packet is too short");
+    }
+    layout->header_size =
+        layout->ip_header_size + (data[layout->ip_header_size + 12] >> 4) * 4;
+  } else {
+    layout->header_size = layout->ip_header_size + kUdpHeaderSize;
+  }
+  if (length < layout->header_size) {
+    return absl::InvalidArgumentError("TUN packet headers are truncated");
+  }
+  return absl::OkStatus();
+}
+
+// Updates the length fields and recomputes the checksums of a packet whose
+// headers were copied from a super-packet.
+void FinishSegment(uint8_t* data, size_t length, const Layout& layout) {
+  if (layout.ipv6) {
+    Store16(data + 4, length - kIpv6HeaderSize);
+  } else {
+    Store16(data + 2, length);
+    Store16(data + 10, 0);
+    Store16(data + 10, utils::ChecksumFinish(
+                           utils::ChecksumAdd(0, data, layout.ip_header_size)));
+  }
+
+  uint8_t* transport = data + layout.ip_header_size;
+  const size_t transport_length = length - layout.ip_header_size;
+  size_t checksum_offset = kTcpChecksumOffset;
+  if (layout.protocol == IPPROTO_UDP) {
+    Store16(transport + 4, transport_length);
+    checksum_offset = kUdpChecksumOffset;
+  }
+  Store16(transport + checksum_offset, 0);
+  uint32_t sum = utils::ChecksumAddPseudoHeader(
+      0, data + (layout.ipv6 ? 8 : 12), layout.ipv6 ? 16 : 4, layout.protocol,
+      transport_length);
+  uint16_t checksum = utils::ChecksumFinish(
+      utils::ChecksumAdd(sum, transport, transport_length));
+  if (layout.protocol == IPPROTO_UDP && checksum == 0) {
+    // A zero UDP checksum means there is no checksum.
+    checksum = 0xffff;
+  }
+  Store16(transport + checksum_offset, checksum);
+}
+
+// Works out the layout of a plain TCP packet that might be coalesced with
+// others. Only packets without IP options or extension headers, and with no
+// TCP flags besides ACK and PSH, are considered.
+bool ParseCoalescableLayout(const Packet& packet, Layout* layout) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(packet.data().data());
+  const size_t length = packet.data().size();
+  if (length < kIpv4HeaderSize) {
+    return false;
+  }
+  const int version = data[0] >> 4;
+  if (version == 4) {
+    if ((data[0] & 0x0f) * 4 != kIpv4HeaderSize || data[9] != IPPROTO_TCP ||
+        Load16(data + 2) != length || (Load16(data + 6) & 0x3fff) != 0) {
+      return false;
+    }
+    layout->ipv6 = false;
+    layout->ip_header_size = kIpv4HeaderSize;
+  } else if (version == 6) {
+    if (length < kIpv6HeaderSize || data[6] != IPPROTO_TCP ||
+        Load16(data + 4) + kIpv6HeaderSize != length) {
+      return false;
+    }
+    layout->ipv6 = true;
+    layout->ip_header_size = kIpv6HeaderSize;
+  } else {
+    return false;
+  }
+  layout->protocol = IPPROTO_TCP;
+  if (length < layout->ip_header_size + kTcpHeaderSize) {
+    return false;
+  }
+  const uint8_t* tcp = data + layout->ip_header_size;
+  const size_t tcp_header_size = (tcp[12] >> 4) * 4;
+  const uint8_t flags = tcp[13];
+  if (tcp_header_size < kTcpHeaderSize ||
+      layout->ip_header_size + tcp_header_size > length ||
+      (flags & kTcpFlagAck) == 0 ||
+      (flags & ~(kTcpFlagAck | kTcpFlagPsh)) != 0) {
+    return false;
+  }
+  layout->header_size = layout->ip_header_size + tcp_header_size;
+  return true;
+}
+
+// Returns whether two packets with the given layout belong to the same flow
+// and have the same headers, apart from the fields that differ between the
+// segments of a super-packet.
+bool HaveSameHeaders(const uint8_t* first, const uint8_t* other,
+                     const Layout& layout) {
+  if (layout.ipv6) {
+    // Version, traffic class, and flow label; next header and hop limit; and
+    // the addresses.
+    if (memcmp(first, other, 4) != 0 || memcmp(first + 6, other + 6, 34) != 0) {
+      return false;
+    }
+  } else {
+    // Version, header length, and TOS; flags, TTL, and protocol; and the
+    // addresses.
+    if (memcmp(first, other, 2) != 0 || memcmp(first + 6, other + 6, 4) != 0 ||
+        memcmp(first + 12, other + 12, 8) != 0) {
+      return false;
+    }
+  }
+  const uint8_t* first_tcp = first + layout.ip_header_size;
+  const uint8_t* other_tcp = other + layout.ip_header_size;
+  // Ports; acknowledgement number; data offset; flags, except for PSH; window;
+  // urgent pointer; and options.
+  return memcmp(first_tcp, other_tcp, 4) == 0 &&
+         memcmp(first_tcp + 8, other_tcp + 8, 5) == 0 &&
+         (first_tcp[13] & ~kTcpFlagPsh) == (other_tcp[13] & ~kTcpFlagPsh) &&
+         memcmp(first_tcp + 14, other_tcp + 14, 2) == 0 &&
+         memcmp(first_tcp + 18, other_tcp + 18,
+                layout.header_size - layout.ip_header_size - 18) == 0;
+}
+
+}  // namespace
+
+absl::Status EnableTunOffload(int fd) {
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  if (ioctl(fd, TUNGETIFF, &request) != 0) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "FD=", fd, " is not a TUN device: ", strerror(errno)));
+  }
+  if ((request.ifr_flags & IFF_VNET_HDR) == 0) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "TUN device on FD=", fd, " was created without IFF_VNET_HDR"));
+  }
+  int header_size = kVirtioNetHeaderSize;
+  if (ioctl(fd, TUNSETVNETHDRSZ, &header_size) != 0) {
+    return absl::InternalError(absl::StrCat(
+        "Unable to set virtio-net header size on FD=", fd, ": ",
+        strerror(errno)));
+  }
+  // UDP segmentation offload is newer, so fall back to just TCP if the kernel
+  // doesn't know about it.
+  const unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+  if (ioctl(fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0) {
+    return absl::OkStatus();
+  }
+  if (ioctl(fd, TUNSETOFFLOAD, offloads) != 0) {
+    return absl::InternalError(absl::StrCat(
+        "Unable to enable TUN offloads on FD=", fd, ": ", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status SplitTunRead(const char* data, size_t length,
+                          PacketBufferPool* pool,
+                          std::vector<Packet>* packets) {
+  if (length < kVirtioNetHeaderSize) {
+    return absl::InvalidArgumentError("TUN read is missing virtio-net header");
+  }
+  VirtioNetHeader virtio;
+  memcpy(&virtio, data, kVirtioNetHeaderSize);
+  const uint8_t* packet =
+      reinterpret_cast<const uint8_t*>(data + kVirtioNetHeaderSize);
+  length -= kVirtioNetHeaderSize;
+  const size_t max_packet_size =
+      pool->buffer_size() - kPacketHeadroom - kPacketTailroom;
+
+  const uint8_t gso_type = virtio.gso_type & ~kVirtioNetGsoEcn;
+  if (gso_type == kVirtioNetGsoNone) {
+    if (length > max_packet_size) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("TUN packet of ", length, " bytes is too large"));
+    }
+    const bool needs_checksum =
+        (virtio.flags & kVirtioNetNeedsChecksum) != 0;
+    if (needs_checksum &&
+        static_cast<size_t>(virtio.csum_start) + virtio.csum_offset + 2 >
+            length) {
+      return absl::InvalidArgumentError("TUN packet checksum is out of range");
+    }
+    char* buffer;
+    pool->Acquire(absl::MakeSpan(&buffer, 1));
+    uint8_t* copy = reinterpret_cast<uint8_t*>(buffer + kPacketHeadroom);
+    memcpy(copy, packet, length);
+    if (needs_checksum) {
+      // The checksum field already holds the pseudo-header sum, so the rest of
+      // the checksum just covers the data from the checksum start.
+      Store16(copy + virtio.csum_start + virtio.csum_offset,
+              utils::ChecksumFinish(utils::ChecksumAdd(
+                  0, copy + virtio.csum_start, length - virtio.csum_start)));
+    }
+    packets->push_back(pool->MakePacket(buffer, kPacketHeadroom, length,
+                                        IPProtocol::kUnknown));
+    return absl::OkStatus();
+  }
+
+  if (gso_type != kVirtioNetGsoTcpV4 &&
+      gso_type != kVirtioNetGsoTcpV6 &&
+      gso_type != kVirtioNetGsoUdpL4) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported TUN GSO type ", gso_type));
+  }
+  Layout layout;
+  PPN_RETURN_IF_ERROR(ParseSuperPacketLayout(packet, length, virtio, &layout));
+  const size_t segment_size = virtio.gso_size;
+  if (segment_size == 0 ||
+      layout.header_size + segment_size > max_packet_size) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported TUN GSO segment size ", segment_size));
+  }
+
+  const size_t payload_size = length - layout.header_size;
+  const size_t segment_count =
+      std::max<size_t>(1, (payload_size + segment_size - 1) / segment_size);
+  std::vector<char*> buffers(segment_count);
+  pool->Acquire(absl::MakeSpan(buffers));
+
+  const uint16_t ip_id = layout.ipv6 ? 0 : Load16(packet + 4);
+  const uint8_t* transport = packet + layout.ip_header_size;
+  const uint32_t tcp_sequence =
+      layout.protocol == IPPROTO_TCP ? Load32(transport + 4) : 0;
+  for (size_t i = 0; i < segment_count; ++i) {
+    const size_t offset = i * segment_size;
+    const size_t size = std::min(segment_size, payload_size - offset);
+    uint8_t* segment = reinterpret_cast<uint8_t*>(buffers[i] + kPacketHeadroom);
+    memcpy(segment, packet, layout.header_size);
+    memcpy(segment + layout.header_size, packet + layout.header_size + offset,
+           size);
+
+    if (!layout.ipv6) {
+      Store16(segment + 4, ip_id + i);
+    }
+    if (layout.protocol == IPPROTO_TCP) {
+      uint8_t* tcp = segment + layout.ip_header_size;
+      Store32(tcp + 4, tcp_sequence + offset);
+      // FIN and PSH only belong on the last segment, and CWR on the first.
+      if (i + 1 < segment_count) {
+        tcp[13] &= ~(kTcpFlagFin | kTcpFlagPsh);
+      }
+      if (i > 0) {
+        tcp[13] &= ~kTcpFlagCwr;
+      }
+    }
+    FinishSegment(segment, layout.header_size + size, layout);
+    packets->push_back(pool->MakePacket(buffers[i], kPacketHeadroom,
+                                        layout.header_size + size,
+                                        IPProtocol::kUnknown));
+  }
+  return absl::OkStatus();
+}
+
+size_t TunCoalesceRunLength(absl::Span<const Packet> packets) {
+  if (packets.empty()) {
+    return 0;
+  }
+  Layout layout;
+  if (!ParseCoalescableLayout(packets[0], &layout)) {
+    return 1;
+  }
+  const uint8_t* first =
+      reinterpret_cast<const uint8_t*>(packets[0].data().data());
+  const size_t segment_size = packets[0].data().size() - layout.header_size;
+  if (segment_size == 0 ||
+      (first[layout.ip_header_size + 13] & kTcpFlagPsh) != 0) {
+    return 1;
+  }
+
+  size_t total_size = packets[0].data().size();
+  uint32_t next_sequence =
+      Load32(first + layout.ip_header_size + 4) + segment_size;
+  size_t run = 1;
+  while (run < packets.size() && run < kMaxTunCoalescedSegments) {
+    const uint8_t* data =
+        reinterpret_cast<const uint8_t*>(packets[run].data().data());
+    const size_t length = packets[run].data().size();
+    Layout other_layout;
+    if (!ParseCoalescableLayout(packets[run], &other_layout) ||
+        other_layout.ipv6 != layout.ipv6 ||
+        other_layout.header_size != layout.header_size ||
+        !HaveSameHeaders(first, data, layout)) {
+      break;
+    }
+    const size_t size = length - layout.header_size;
+    if (size == 0 || size > segment_size ||
+        Load32(data + layout.ip_header_size + 4) != next_sequence ||
+        total_size + size > 65535) {
+      break;
+    }
+    ++run;
+    total_size += size;
+    next_sequence += size;
+    // A short segment or a PSH has to be the last one in a run.
+    if (size < segment_size ||
+        (data[layout.ip_header_size + 13] & kTcpFlagPsh) != 0) {
+      break;
+    }
+  }
+  return run;
+}
+
+int PrepareTunWrite(absl::Span<const Packet> run, TunWriteHeader* header,
+                    iovec* iovecs) {
+  memset(&header->virtio, 0, sizeof(header->virtio));
+  iovecs[0].iov_base = &header->virtio;
+  iovecs[0].iov_len = kVirtioNetHeaderSize;
+
+  Layout layout;
+  if (run.size() == 1 || !ParseCoalescableLayout(run[0], &layout)) {
+    iovecs[1].iov_base = const_cast<char*>(run[0].data().data());
+    iovecs[1].iov_len = run[0].data().size();
+    return 2;
+  }
+
+  // The first packet's headers are used for the whole run, with the lengths
+  // and flags adjusted to cover all of it.
+  size_t total_size = layout.header_size;
+  for (const auto& packet : run) {
+    total_size += packet.data().size() - layout.header_size;
+  }
+  uint8_t* headers = reinterpret_cast<uint8_t*>(header->headers);
+  memcpy(headers, run[0].data().data(), layout.header_size);
+  if (layout.ipv6) {
+    Store16(headers + 4, total_size - kIpv6HeaderSize);
+  } else {
+    Store16(headers + 2, total_size);
+    Store16(headers + 10, 0);
+    Store16(headers + 10, utils::ChecksumFinish(
+                              utils::ChecksumAdd(0, headers, kIpv4HeaderSize)));
+  }
+  uint8_t* tcp = headers + layout.ip_header_size;
+  const uint8_t* last =
+      reinterpret_cast<const uint8_t*>(run.back().data().data());
+  tcp[13] |= last[layout.ip_header_size + 13] & kTcpFlagPsh;
+  // With the checksum offload, the kernel expects just the pseudo-header sum
+  // in the checksum field, and treats the packet as already verified.
+  Store16(tcp + kTcpChecksumOffset,
+          utils::ChecksumFold(utils::ChecksumAddPseudoHeader(
+              0, headers + (layout.ipv6 ? 8 : 12), layout.ipv6 ? 16 : 4,
+              IPPROTO_TCP, total_size - layout.ip_header_size)));
+
+  header->virtio.flags = kVirtioNetNeedsChecksum;
+  header->virtio.gso_type =
+      layout.ipv6 ? kVirtioNetGsoTcpV6 : kVirtioNetGsoTcpV4;
+  header->virtio.gso_size = run[0].data().size() - layout.header_size;
+  header->virtio.hdr_len = layout.header_size;
+  header->virtio.csum_start = layout.ip_header_size;
+  header->virtio.csum_offset = kTcpChecksumOffset;
+
+  iovecs[1].iov_base = header->headers;
+  iovecs[1].iov_len = layout.header_size;
+  for (size_t i = 0; i < run.size(); ++i) {
+    iovecs[2 + i].iov_base =
+        const_cast<char*>(run[i].data().data()) + layout.header_size;
+    iovecs[2 + i].iov_len = run[i].data().size() - layout.header_size;
+  }
+  return 2 + run.size();
+}
+
+absl::Status WriteTunPackets(int fd, absl::Span<const Packet> packets) {
+  TunWriteHeader header;
+  iovec iovecs[2 + kMaxTunCoalescedSegments];
+  while (!packets.empty()) {
+    const size_t run = TunCoalesceRunLength(packets);
+    const int count = PrepareTunWrite(packets.first(run), &header, iovecs);
+    size_t expected = 0;
+    for (int i = 0; i < count; ++i) {
+      expected += iovecs[i].iov_len;
+    }
+    ssize_t write_bytes;
+    do {
+      write_bytes = writev(fd, iovecs, count);
+    } while (write_bytes == -1 &&
+             (errno == EINTR ||
+              ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+               WaitUntilWritable(fd))));
+    if (write_bytes != expected) {
+      return absl::InternalError(
+          absl::StrCat("Error writing to FD=", fd, ": ", strerror(errno)));
+    }
+    packets.remove_prefix(run);
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,113 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_OFFLOAD_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_OFFLOAD_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Helpers for TUN devices that were created with IFF_VNET_HDR. With the TSO
+// and USO offloads turned on, the kernel hands over TCP and UDP super-packets
+// of up to 64 KB, each preceded by a virtio-net header that describes how it
+// is to be segmented. In the other direction, consecutive segments of a TCP
+// flow can be coalesced into a single write.
+
+// Every read from and write to the TUN device starts with this header, in host
+// byte order. It's declared here, rather than taken from <linux/virtio_net.h>,
+// since that header doesn't compile as C++.
+struct VirtioNetHeader {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+constexpr size_t kVirtioNetHeaderSize = sizeof(VirtioNetHeader);
+static_assert(kVirtioNetHeaderSize == 10, "Unexpected virtio-net header size");
+
+// The checksum from csum_start to the end of the packet still has to be
+// completed, and stored at csum_start + csum_offset.
+constexpr uint8_t kVirtioNetNeedsChecksum = 1;
+
+// The kinds of segmentation a packet may need.
+constexpr uint8_t kVirtioNetGsoNone = 0;
+constexpr uint8_t kVirtioNetGsoTcpV4 = 1;
+constexpr uint8_t kVirtioNetGsoTcpV6 = 4;
+constexpr uint8_t kVirtioNetGsoUdpL4 = 5;
+constexpr uint8_t kVirtioNetGsoEcn = 0x80;
+
+// The largest read from the TUN device, including the virtio-net header.
+constexpr size_t kMaxTunOffloadReadSize = kVirtioNetHeaderSize + 65535;
+
+// The most segments that are coalesced into a single TUN write.
+constexpr size_t kMaxTunCoalescedSegments = 64;
+
+// The largest IP and TCP headers that a coalesced write may have.
+constexpr size_t kMaxTunHeaderSize = 60 + 60;
+
+// Turns on the checksum and segmentation offloads on a TUN fd. Fails, leaving
+// the fd unchanged, if it isn't a TUN device created with IFF_VNET_HDR.
+absl::Status EnableTunOffload(int fd);
+
+// Splits a read from an offload-enabled TUN device, which begins with a
+// virtio-net header, into plain IP packets that are appended to `packets`.
+// A TCP or UDP super-packet is segmented as described by the header, and any
+// checksum the kernel left to be filled in is completed. Each packet gets its
+// own buffer from `pool`, with room for encapsulation.
+absl::Status SplitTunRead(const char* data, size_t length,
+                          PacketBufferPool* pool, std::vector<Packet>* packets);
+
+// The headers written ahead of the packet data in a coalesced TUN write.
+struct TunWriteHeader {
+  VirtioNetHeader virtio;
+  char headers[kMaxTunHeaderSize];
+};
+
+// Returns how many of the leading packets can be coalesced into a single TUN
+// write: consecutive, in-order segments of the same TCP flow, all but the last
+// carrying the same amount of data. Always returns at least 1 for a non-empty
+// span.
+size_t TunCoalesceRunLength(absl::Span<const Packet> packets);
+
+// Prepares a single TUN write of the given run of packets. `iovecs` must have
+// room for 2 + run.size() entries, and the number filled in is returned. The
+// iovecs point into `header` and the packets, which must outlive the write.
+int PrepareTunWrite(absl::Span<const Packet> run, TunWriteHeader* header,
+                    iovec* iovecs);
+
+// Writes packets to an offload-enabled TUN fd, coalescing them where possible.
+absl::Status WriteTunPackets(int fd, absl::Span<const Packet> packets);
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_OFFLOAD_H_
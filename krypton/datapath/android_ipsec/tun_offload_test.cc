@@ -0,0 +1,340 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/tun_offload.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::status::StatusIs;
+
+constexpr size_t kBufferSize = 4096;
+constexpr uint8_t kTcpFlagPsh = 0x08;
+constexpr uint8_t kTcpFlagAck = 0x10;
+
+uint16_t Load16(const std::string& data, size_t offset) {
+  return (static_cast<uint8_t>(data[offset]) << 8) |
+         static_cast<uint8_t>(data[offset + 1]);
+}
+
+uint32_t Load32(const std::string& data, size_t offset) {
+  return (static_cast<uint32_t>(Load16(data, offset)) << 16) |
+         Load16(data, offset + 2);
+}
+
+// Builds an IPv4 TCP packet with the given sequence number, flags, and data.
+std::string Ipv4TcpPacket(uint32_t sequence, uint8_t flags,
+                          const std::string& payload) {
+  std::string packet(40, '\0');
+  const size_t length = packet.size() + payload.size();
+  packet[0] = 0x45;
+  packet[2] = length >> 8;
+  packet[3] = length & 0xff;
+  packet[8] = 64;
+  packet[9] = IPPROTO_TCP;
+  packet[12] = 10;
+  packet[15] = 1;
+  packet[16] = 10;
+  packet[19] = 2;
+  packet[20] = 0x12;  // Source port 0x1234.
+  packet[21] = 0x34;
+  packet[22] = 0x01;  // Destination port 443.
+  packet[23] = 0xbb;
+  packet[24] = sequence >> 24;
+  packet[25] = (sequence >> 16) & 0xff;
+  packet[26] = (sequence >> 8) & 0xff;
+  packet[27] = sequence & 0xff;
+  packet[31] = 1;      // Acknowledgement number.
+  packet[32] = 0x50;   // Data offset.
+  packet[33] = flags;
+  packet[34] = 0x10;   // Window.
+  return packet + payload;
+}
+
+// Builds an IPv6 UDP packet with the given data.
+std::string Ipv6UdpPacket(const std::string& payload) {
+  std::string packet(48, '\0');
+  const size_t udp_length = 8 + payload.size();
+  packet[0] = 0x60;
+  packet[4] = udp_length >> 8;
+  packet[5] = udp_length & 0xff;
+  packet[6] = IPPROTO_UDP;
+  packet[7] = 64;
+  packet[8] = 0x20;   // Source 2000::1.
+  packet[23] = 1;
+  packet[24] = 0x20;  // Destination 2000::2.
+  packet[39] = 2;
+  packet[40] = 0x12;
+  packet[41] = 0x34;
+  packet[42] = 0x00;
+  packet[43] = 53;
+  packet[44] = udp_length >> 8;
+  packet[45] = udp_length & 0xff;
+  return packet + payload;
+}
+
+std::string WithVirtioHeader(const VirtioNetHeader& virtio,
+                             const std::string& packet) {
+  return std::string(reinterpret_cast<const char*>(&virtio), sizeof(virtio)) +
+         packet;
+}
+
+// Returns whether the transport checksum of an IP packet is correct.
+bool HasValidTransportChecksum(const std::string& packet) {
+  const bool ipv6 = (static_cast<uint8_t>(packet[0]) >> 4) == 6;
+  const size_t ip_header_size = ipv6 ? 40 : (packet[0] & 0x0f) * 4;
+  const uint8_t protocol = packet[ipv6 ? 6 : 9];
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(packet.data());
+  uint32_t sum = utils::ChecksumAddPseudoHeader(
+      0, data + (ipv6 ? 8 : 12), ipv6 ? 16 : 4, protocol,
+      packet.size() - ip_header_size);
+  sum = utils::ChecksumAdd(sum, data + ip_header_size,
+                           packet.size() - ip_header_size);
+  return utils::ChecksumFinish(sum) == 0;
+}
+
+bool HasValidIpv4Checksum(const std::string& packet) {
+  return utils::ChecksumFinish(utils::ChecksumAdd(0, packet.data(), 20)) == 0;
+}
+
+TEST(TunOffloadTest, EnableFailsOnNonTunFd) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_LOCAL, SOCK_DGRAM, 0, fds), 0);
+  EXPECT_THAT(EnableTunOffload(fds[0]),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(TunOffloadTest, SplitPlainPacket) {
+  PacketBufferPool pool(kBufferSize, 4);
+  VirtioNetHeader virtio;
+  memset(&virtio, 0, sizeof(virtio));
+  std::string packet = Ipv4TcpPacket(1000, kTcpFlagAck, "hello");
+  std::string read = WithVirtioHeader(virtio, packet);
+
+  std::vector<Packet> packets;
+  ASSERT_OK(SplitTunRead(read.data(), read.size(), &pool, &packets));
+  ASSERT_EQ(packets.size(), 1);
+  EXPECT_EQ(packets[0].data(), packet);
+  EXPECT_TRUE(packets[0].is_writable());
+  EXPECT_GE(packets[0].headroom(), kPacketHeadroom);
+}
+
+TEST(TunOffloadTest, SplitCompletesChecksum) {
+  PacketBufferPool pool(kBufferSize, 4);
+  std::string packet = Ipv6UdpPacket("some data");
+  // Put just the pseudo-header sum in the checksum field, the way the kernel
+  // does when it leaves the checksum to be completed.
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(packet.data());
+  uint16_t partial = utils::ChecksumFold(utils::ChecksumAddPseudoHeader(
+      0, data + 8, 16, IPPROTO_UDP, packet.size() - 40));
+  packet[46] = partial >> 8;
+  packet[47] = partial & 0xff;
+
+  VirtioNetHeader virtio;
+  memset(&virtio, 0, sizeof(virtio));
+  virtio.flags = kVirtioNetNeedsChecksum;
+  virtio.csum_start = 40;
+  virtio.csum_offset = 6;
+  std::string read = WithVirtioHeader(virtio, packet);
+
+  std::vector<Packet> packets;
+  ASSERT_OK(SplitTunRead(read.data(), read.size(), &pool, &packets));
+  ASSERT_EQ(packets.size(), 1);
+  EXPECT_TRUE(HasValidTransportChecksum(std::string(packets[0].data())));
+}
+
+TEST(TunOffloadTest, SplitTcpSuperPacket) {
+  PacketBufferPool pool(kBufferSize, 4);
+  const std::string payload = std::string(1000, 'a') + std::string(1000, 'b') +
+                              std::string(500, 'c');
+  std::string packet = Ipv4TcpPacket(1000, kTcpFlagAck | kTcpFlagPsh, payload);
+  VirtioNetHeader virtio;
+  memset(&virtio, 0, sizeof(virtio));
+  virtio.flags = kVirtioNetNeedsChecksum;
+  virtio.gso_type = kVirtioNetGsoTcpV4;
+  virtio.gso_size = 1000;
+  virtio.hdr_len = 40;
+  virtio.csum_start = 20;
+  virtio.csum_offset = 16;
+  std::string read = WithVirtioHeader(virtio, packet);
+
+  std::vector<Packet> packets;
+  ASSERT_OK(SplitTunRead(read.data(), read.size(), &pool, &packets));
+  ASSERT_EQ(packets.size(), 3);
+  const size_t sizes[] = {1000, 1000, 500};
+  uint32_t sequence = 1000;
+  for (int i = 0; i < 3; ++i) {
+    std::string segment(packets[i].data());
+    ASSERT_EQ(segment.size(), 40 + sizes[i]);
+    EXPECT_EQ(Load16(segment, 2), segment.size());
+    EXPECT_EQ(Load16(segment, 4), i);
+    EXPECT_EQ(Load32(segment, 24), sequence);
+    EXPECT_EQ(segment.substr(40), payload.substr(sequence - 1000, sizes[i]));
+    // Only the last segment keeps the PSH flag.
+    EXPECT_EQ((segment[33] & kTcpFlagPsh) != 0, i == 2);
+    EXPECT_TRUE(HasValidIpv4Checksum(segment));
+    EXPECT_TRUE(HasValidTransportChecksum(segment));
+    sequence += sizes[i];
+  }
+}
+
+TEST(TunOffloadTest, SplitUdpSuperPacket) {
+  PacketBufferPool pool(kBufferSize, 4);
+  const std::string payload = std::string(600, 'x') + std::string(600, 'y');
+  std::string packet = Ipv6UdpPacket(payload);
+  VirtioNetHeader virtio;
+  memset(&virtio, 0, sizeof(virtio));
+  virtio.flags = kVirtioNetNeedsChecksum;
+  virtio.gso_type = kVirtioNetGsoUdpL4;
+  virtio.gso_size = 600;
+  virtio.hdr_len = 48;
+  virtio.csum_start = 40;
+  virtio.csum_offset = 6;
+  std::string read = WithVirtioHeader(virtio, packet);
+
+  std::vector<Packet> packets;
+  ASSERT_OK(SplitTunRead(read.data(), read.size(), &pool, &packets));
+  ASSERT_EQ(packets.size(), 2);
+  for (int i = 0; i < 2; ++i) {
+    std::string segment(packets[i].data());
+    ASSERT_EQ(segment.size(), 648);
+    EXPECT_EQ(Load16(segment, 4), 608);
+    EXPECT_EQ(Load16(segment, 44), 608);
+    EXPECT_EQ(segment.substr(48), payload.substr(600 * i, 600));
+    EXPECT_TRUE(HasValidTransportChecksum(segment));
+  }
+}
+
+TEST(TunOffloadTest, SplitRejectsOversizedSegments) {
+  PacketBufferPool pool(kBufferSize, 4);
+  std::string packet = Ipv4TcpPacket(0, kTcpFlagAck, std::string(10000, 'a'));
+  VirtioNetHeader virtio;
+  memset(&virtio, 0, sizeof(virtio));
+  virtio.flags = kVirtioNetNeedsChecksum;
+  virtio.gso_type = kVirtioNetGsoTcpV4;
+  virtio.gso_size = 5000;
+  virtio.csum_start = 20;
+  virtio.csum_offset = 16;
+  std::string read = WithVirtioHeader(virtio, packet);
+
+  std::vector<Packet> packets;
+  EXPECT_THAT(SplitTunRead(read.data(), read.size(), &pool, &packets),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_TRUE(packets.empty());
+}
+
+TEST(TunOffloadTest, CoalesceConsecutiveSegments) {
+  std::vector<std::string> data = {
+      Ipv4TcpPacket(1000, kTcpFlagAck, std::string(100, 'a')),
+      Ipv4TcpPacket(1100, kTcpFlagAck, std::string(100, 'b')),
+      Ipv4TcpPacket(1200, kTcpFlagAck | kTcpFlagPsh, std::string(50, 'c')),
+      Ipv4TcpPacket(1250, kTcpFlagAck, std::string(100, 'd')),
+  };
+  std::vector<Packet> packets;
+  for (const auto& packet : data) {
+    packets.emplace_back(packet.data(), packet.size(), IPProtocol::kIPv4,
+                         []() {});
+  }
+
+  // The PSH on the third segment ends the run.
+  ASSERT_EQ(TunCoalesceRunLength(packets), 3);
+
+  TunWriteHeader header;
+  iovec iovecs[5];
+  int count =
+      PrepareTunWrite(absl::MakeConstSpan(packets).first(3), &header, iovecs);
+  ASSERT_EQ(count, 5);
+  EXPECT_EQ(header.virtio.gso_type, kVirtioNetGsoTcpV4);
+  EXPECT_EQ(header.virtio.gso_size, 100);
+  EXPECT_EQ(header.virtio.hdr_len, 40);
+  EXPECT_EQ(header.virtio.csum_start, 20);
+  EXPECT_EQ(header.virtio.csum_offset, 16);
+
+  std::string written;
+  for (int i = 1; i < count; ++i) {
+    written.append(static_cast<const char*>(iovecs[i].iov_base),
+                   iovecs[i].iov_len);
+  }
+  EXPECT_EQ(written.size(), 40 + 250);
+  EXPECT_EQ(Load16(written, 2), written.size());
+  EXPECT_NE(written[33] & kTcpFlagPsh, 0);
+  EXPECT_TRUE(HasValidIpv4Checksum(written));
+  EXPECT_EQ(written.substr(40), std::string(100, 'a') + std::string(100, 'b') +
+                                    std::string(50, 'c'));
+
+  // Completing the checksum, as the kernel would, gives a valid packet.
+  uint16_t checksum = utils::ChecksumFinish(
+      utils::ChecksumAdd(0, written.data() + 20, written.size() - 20));
+  written[36] = checksum >> 8;
+  written[37] = checksum & 0xff;
+  EXPECT_TRUE(HasValidTransportChecksum(written));
+}
+
+TEST(TunOffloadTest, DoNotCoalesceOutOfOrderSegments) {
+  std::vector<std::string> data = {
+      Ipv4TcpPacket(1000, kTcpFlagAck, std::string(100, 'a')),
+      Ipv4TcpPacket(1200, kTcpFlagAck, std::string(100, 'b')),
+  };
+  std::vector<Packet> packets;
+  for (const auto& packet : data) {
+    packets.emplace_back(packet.data(), packet.size(), IPProtocol::kIPv4,
+                         []() {});
+  }
+  EXPECT_EQ(TunCoalesceRunLength(packets), 1);
+
+  TunWriteHeader header;
+  iovec iovecs[3];
+  ASSERT_EQ(
+      PrepareTunWrite(absl::MakeConstSpan(packets).first(1), &header, iovecs),
+      2);
+  EXPECT_EQ(header.virtio.gso_type, kVirtioNetGsoNone);
+  EXPECT_EQ(iovecs[1].iov_len, data[0].size());
+}
+
+TEST(TunOffloadTest, DoNotCoalesceOtherProtocols) {
+  std::string udp = Ipv6UdpPacket("foo");
+  std::vector<Packet> packets;
+  packets.emplace_back(udp.data(), udp.size(), IPProtocol::kIPv6, []() {});
+  packets.emplace_back(udp.data(), udp.size(), IPProtocol::kIPv6, []() {});
+  EXPECT_EQ(TunCoalesceRunLength(packets), 1);
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
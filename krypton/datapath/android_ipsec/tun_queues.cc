@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/tun_queues.h"
+
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "third_party/absl/cleanup/cleanup.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+namespace {
+
+constexpr char kTunDevicePath[] = "/dev/net/tun";
+
+// Opens another queue on the TUN device described by `request`.
+absl::StatusOr<int> OpenTunQueue(const ifreq& request) {
+  int fd = open(kTunDevicePath, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return absl::InternalError(
+        absl::StrCat("Unable to open ", kTunDevicePath, ": ", strerror(errno)));
+  }
+  ifreq queue_request = request;
+  if (ioctl(fd, TUNSETIFF, &queue_request) != 0) {
+    auto status = absl::InternalError(
+        absl::StrCat("Unable to attach a queue to TUN device ",
+                     request.ifr_name, ": ", strerror(errno)));
+    close(fd);
+    return status;
+  }
+  return fd;
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<int>> OpenTunQueues(int fd, int count) {
+  if (count < 0 || count >= kMaxTunQueues) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid number of TUN queues: ", count));
+  }
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  if (ioctl(fd, TUNGETIFF, &request) != 0) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "FD=", fd, " is not a TUN device: ", strerror(errno)));
+  }
+  if ((request.ifr_flags & IFF_MULTI_QUEUE) == 0) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "TUN device on FD=", fd, " was created without IFF_MULTI_QUEUE"));
+  }
+  // TUNGETIFF also reports state flags that TUNSETIFF doesn't accept.
+  request.ifr_flags &= IFF_TUN | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+
+  std::vector<int> queues;
+  queues.reserve(count);
+  absl::Cleanup close_queues = [&queues] {
+    for (int queue : queues) {
+      close(queue);
+    }
+  };
+  for (int i = 0; i < count; ++i) {
+    auto queue = OpenTunQueue(request);
+    if (!queue.ok()) {
+      return queue.status();
+    }
+    queues.push_back(*queue);
+  }
+  std::move(close_queues).Cancel();
+  return queues;
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,51 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_QUEUES_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_QUEUES_H_
+
+#include <vector>
+
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Helpers for TUN devices that were created with IFF_MULTI_QUEUE. Each queue
+// of such a device is a separate fd. The kernel picks the queue for every
+// packet it sends to the device by hashing the packet's flow, so all of the
+// packets of a flow are read from the same queue, in order. Packets may be
+// written to any queue.
+//
+// Opening a queue requires CAP_NET_ADMIN, so these are only usable where the
+// process created the TUN device itself, and not with a VpnService fd. For
+// that reason, nothing in the product calls them yet.
+
+// The most queues that a TUN device can have.
+constexpr int kMaxTunQueues = 256;
+
+// Opens `count` more queues on the multi-queue TUN device that `fd` is a queue
+// of, with the same flags as `fd`. The caller owns the returned fds. Fails,
+// without leaving any new queues open, if `fd` isn't a queue of a multi-queue
+// TUN device or if any queue can't be opened.
+absl::StatusOr<std::vector<int>> OpenTunQueues(int fd, int count);
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_TUN_QUEUES_H_
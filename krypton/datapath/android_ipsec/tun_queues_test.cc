@@ -0,0 +1,125 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/tun_queues.h"
+
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+using ::testing::status::StatusIs;
+
+// Creates a TUN device with the given flags, returning its first queue, or -1
+// if TUN devices can't be created here.
+int CreateTunDevice(short flags, std::string* name) {
+  int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  request.ifr_flags = flags;
+  if (ioctl(fd, TUNSETIFF, &request) != 0) {
+    close(fd);
+    return -1;
+  }
+  *name = request.ifr_name;
+  return fd;
+}
+
+std::string GetTunName(int fd) {
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  if (ioctl(fd, TUNGETIFF, &request) != 0) {
+    return "";
+  }
+  return request.ifr_name;
+}
+
+TEST(TunQueuesTest, OpensQueuesOnTheSameDevice) {
+  std::string name;
+  int fd = CreateTunDevice(IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE, &name);
+  if (fd < 0) {
+    GTEST_SKIP() << "Unable to create a TUN device";
+  }
+
+  ASSERT_OK_AND_ASSIGN(auto queues, OpenTunQueues(fd, 3));
+  ASSERT_EQ(queues.size(), 3);
+  for (int queue : queues) {
+    EXPECT_NE(queue, fd);
+    EXPECT_EQ(GetTunName(queue), name);
+    close(queue);
+  }
+  close(fd);
+}
+
+TEST(TunQueuesTest, OpensNoQueues) {
+  std::string name;
+  int fd = CreateTunDevice(IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE, &name);
+  if (fd < 0) {
+    GTEST_SKIP() << "Unable to create a TUN device";
+  }
+
+  ASSERT_OK_AND_ASSIGN(auto queues, OpenTunQueues(fd, 0));
+  EXPECT_TRUE(queues.empty());
+  close(fd);
+}
+
+TEST(TunQueuesTest, FailsOnSingleQueueDevice) {
+  std::string name;
+  int fd = CreateTunDevice(IFF_TUN | IFF_NO_PI, &name);
+  if (fd < 0) {
+    GTEST_SKIP() << "Unable to create a TUN device";
+  }
+
+  EXPECT_THAT(OpenTunQueues(fd, 1),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  close(fd);
+}
+
+TEST(TunQueuesTest, FailsOnNonTunFd) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(fd, 0);
+
+  EXPECT_THAT(OpenTunQueues(fd, 1),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  close(fd);
+}
+
+TEST(TunQueuesTest, FailsOnTooManyQueues) {
+  EXPECT_THAT(OpenTunQueues(-1, kMaxTunQueues),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,158 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/udp_offload.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/types/span.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+namespace {
+
+// An intrusively refcounted buffer shared by all of the packets split out of
+// one GRO receive. It's allocated once per receive rather than per packet.
+struct SharedGroBuffer {
+  std::atomic_int references;
+  PacketOwner owner;
+};
+
+void Unref(void* context) {
+  auto* shared = static_cast<SharedGroBuffer*>(context);
+  if (shared->references.fetch_sub(1) == 1) {
+    delete shared;
+  }
+}
+
+}  // namespace
+
+bool SupportsUdpGso(int fd) {
+  // A segment size of 0 turns GSO off, so this only succeeds if the option is
+  // known, without enabling anything.
+  int segment_size = 0;
+  return setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size,
+                    sizeof(segment_size)) == 0;
+}
+
+bool EnableUdpGro(int fd) {
+  int value = 1;
+  return setsockopt(fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+size_t GsoRunLength(absl::Span<const Packet> packets) {
+  if (packets.empty()) {
+    return 0;
+  }
+  const size_t segment_size = packets[0].data().size();
+  size_t total = segment_size;
+  size_t length = 1;
+  while (length < packets.size() && length < kMaxGsoSegments) {
+    size_t size = packets[length].data().size();
+    if (size > segment_size || size == 0 ||
+        total + size > kMaxUdpPayloadSize) {
+      break;
+    }
+    total += size;
+    ++length;
+    // Only the last segment may be short.
+    if (size < segment_size) {
+      break;
+    }
+  }
+  return length;
+}
+
+void PrepareGsoMessage(absl::Span<const Packet> run, iovec* iovecs,
+                       GsoControl* control, msghdr* message) {
+  memset(message, 0, sizeof(*message));
+  for (size_t i = 0; i < run.size(); ++i) {
+    iovecs[i].iov_base = const_cast<char*>(run[i].data().data());
+    iovecs[i].iov_len = run[i].data().size();
+  }
+  message->msg_iov = iovecs;
+  message->msg_iovlen = run.size();
+  if (run.size() < 2) {
+    return;
+  }
+
+  memset(control, 0, sizeof(*control));
+  message->msg_control = control->buffer;
+  message->msg_controllen = sizeof(control->buffer);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(message);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  uint16_t segment_size = run[0].data().size();
+  memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+}
+
+size_t GetGroSegmentSize(const msghdr& message) {
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&message), cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int segment_size;
+      memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+      return segment_size > 0 ? segment_size : 0;
+    }
+  }
+  return 0;
+}
+
+void SplitGroBuffer(char* buffer, size_t length, size_t segment_size,
+                    PacketOwner owner, std::vector<Packet>* packets) {
+  if (length == 0 || segment_size == 0) {
+    return;
+  }
+  const size_t count = (length + segment_size - 1) / segment_size;
+  auto* shared = new SharedGroBuffer{{static_cast<int>(count)},
+                                     std::move(owner)};
+  for (size_t offset = 0; offset < length; offset += segment_size) {
+    size_t size = std::min(segment_size, length - offset);
+    // Each segment is writable, but only within its own bounds, so that it can
+    // be decrypted in place without touching its neighbours.
+    packets->emplace_back(buffer + offset, size, 0, size, IPProtocol::kUnknown,
+                          PacketOwner::External(&Unref, shared));
+  }
+}
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
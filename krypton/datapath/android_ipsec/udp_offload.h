@@ -0,0 +1,91 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_UDP_OFFLOAD_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_UDP_OFFLOAD_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+
+// Helpers for UDP generic segmentation offload (GSO) and generic receive
+// offload (GRO) on Linux. With GSO, a run of equally sized datagrams is handed
+// to the kernel in a single send and split up by the kernel or the NIC. With
+// GRO, the kernel may hand back several datagrams from the same flow coalesced
+// into a single receive buffer, along with the size of each segment.
+
+// The most datagrams that the kernel accepts in a single GSO send.
+constexpr size_t kMaxGsoSegments = 64;
+
+// The largest UDP payload that can be sent or received at once, which bounds
+// the size of a GSO send and of a GRO receive buffer.
+constexpr size_t kMaxUdpPayloadSize = 65507;
+
+// Ancillary data buffers large enough for the GSO and GRO control messages.
+union GsoControl {
+  char buffer[CMSG_SPACE(sizeof(uint16_t))];
+  cmsghdr align;
+};
+union GroControl {
+  char buffer[CMSG_SPACE(sizeof(int))];
+  cmsghdr align;
+};
+
+// Returns whether the kernel supports UDP GSO on the given socket. This doesn't
+// change the socket's configuration.
+bool SupportsUdpGso(int fd);
+
+// Asks the kernel to coalesce received datagrams on the given socket. Returns
+// false, leaving the socket unchanged, if the kernel doesn't support it.
+bool EnableUdpGro(int fd);
+
+// Returns how many of the leading packets can be sent together as one GSO
+// buffer: every packet but the last must have the same size, the last may be
+// shorter, and the whole run must fit in a single UDP payload. Always returns
+// at least 1 for a non-empty span.
+size_t GsoRunLength(absl::Span<const Packet> packets);
+
+// Fills in `message` to send the given run of packets with a single sendmsg.
+// `iovecs` must have room for one entry per packet. If the run has more than
+// one packet, the segment size is attached using `control`.
+void PrepareGsoMessage(absl::Span<const Packet> run, iovec* iovecs,
+                       GsoControl* control, msghdr* message);
+
+// Returns the segment size from the GRO control message of a received message,
+// or 0 if the kernel didn't coalesce anything into it.
+size_t GetGroSegmentSize(const msghdr& message);
+
+// Splits `length` bytes of a GRO buffer into one writable packet per segment,
+// appending them to `packets`. The packets share the buffer, and `owner` is
+// released once the last of them has been destroyed.
+void SplitGroBuffer(char* buffer, size_t length, size_t segment_size,
+                    PacketOwner owner, std::vector<Packet>* packets);
+
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_ANDROID_IPSEC_UDP_OFFLOAD_H_
@@ -0,0 +1,154 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/android_ipsec/udp_offload.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/simple_udp_server.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace android {
+namespace {
+
+std::vector<Packet> CreatePackets(const std::vector<std::string>& payloads) {
+  std::vector<Packet> packets;
+  for (const auto& payload : payloads) {
+    packets.emplace_back(payload.data(), payload.size(), IPProtocol::kIPv4,
+                         [] {});
+  }
+  return packets;
+}
+
+TEST(UdpOffloadTest, GsoRunStopsAtDifferentSize) {
+  std::vector<std::string> payloads = {"aaaa", "bbbb", "cccc", "dd", "eeee"};
+  auto packets = CreatePackets(payloads);
+  // The short packet ends the run, but is still part of it.
+  EXPECT_EQ(GsoRunLength(packets), 4);
+  EXPECT_EQ(GsoRunLength(absl::MakeConstSpan(packets).subspan(4)), 1);
+  EXPECT_EQ(GsoRunLength({}), 0);
+}
+
+TEST(UdpOffloadTest, GsoRunStopsAtLargerPacket) {
+  std::vector<std::string> payloads = {"aa", "bbbb"};
+  auto packets = CreatePackets(payloads);
+  EXPECT_EQ(GsoRunLength(packets), 1);
+}
+
+TEST(UdpOffloadTest, GsoRunIsLimitedBySegmentCount) {
+  std::vector<std::string> payloads(kMaxGsoSegments + 10, "x");
+  auto packets = CreatePackets(payloads);
+  EXPECT_EQ(GsoRunLength(packets), kMaxGsoSegments);
+}
+
+TEST(UdpOffloadTest, GsoRunIsLimitedByPayloadSize) {
+  std::vector<std::string> payloads(10, std::string(10000, 'x'));
+  auto packets = CreatePackets(payloads);
+  EXPECT_EQ(GsoRunLength(packets), kMaxUdpPayloadSize / 10000);
+}
+
+TEST(UdpOffloadTest, PrepareGsoMessageOnlyAddsControlForRuns) {
+  std::vector<std::string> payloads = {"aaaa", "bbbb"};
+  auto packets = CreatePackets(payloads);
+  iovec iovecs[2];
+  GsoControl control;
+  msghdr message;
+
+  PrepareGsoMessage(absl::MakeConstSpan(packets).subspan(0, 1), iovecs,
+                    &control, &message);
+  EXPECT_EQ(message.msg_iovlen, 1);
+  EXPECT_EQ(message.msg_control, nullptr);
+
+  PrepareGsoMessage(packets, iovecs, &control, &message);
+  EXPECT_EQ(message.msg_iovlen, 2);
+  EXPECT_EQ(iovecs[1].iov_base, packets[1].data().data());
+  ASSERT_NE(message.msg_control, nullptr);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  ASSERT_NE(cmsg, nullptr);
+  uint16_t segment_size;
+  memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+  EXPECT_EQ(segment_size, 4);
+}
+
+TEST(UdpOffloadTest, SplitGroBufferSharesTheBuffer) {
+  char buffer[] = "aaaabbbbcc";
+  int released = 0;
+  std::vector<Packet> packets;
+  SplitGroBuffer(buffer, 10, 4,
+                 PacketOwner::FromCleanup([&released] { released++; }),
+                 &packets);
+
+  ASSERT_EQ(packets.size(), 3);
+  EXPECT_EQ(packets[0].data(), "aaaa");
+  EXPECT_EQ(packets[1].data(), "bbbb");
+  EXPECT_EQ(packets[2].data(), "cc");
+  EXPECT_TRUE(packets[1].is_writable());
+  EXPECT_EQ(packets[1].tailroom(), 0);
+
+  packets.erase(packets.begin());
+  EXPECT_EQ(released, 0);
+  packets.clear();
+  EXPECT_EQ(released, 1);
+}
+
+TEST(UdpOffloadTest, GsoSendIsReceivedAsSeparateDatagrams) {
+  testing::SimpleUdpServer server;
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  ASSERT_GE(fd, 0);
+  if (!SupportsUdpGso(fd)) {
+    close(fd);
+    GTEST_SKIP() << "UDP GSO is not supported by this kernel";
+  }
+
+  sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_loopback;
+  addr.sin6_port = htons(server.port());
+  ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+
+  std::vector<std::string> payloads = {"aaaa", "bbbb", "cc"};
+  auto packets = CreatePackets(payloads);
+  iovec iovecs[3];
+  GsoControl control;
+  msghdr message;
+  PrepareGsoMessage(packets, iovecs, &control, &message);
+  ASSERT_EQ(sendmsg(fd, &message, 0), 10);
+
+  for (const auto& payload : payloads) {
+    ASSERT_OK_AND_ASSIGN((auto [port, data]), server.ReceivePacket());
+    EXPECT_EQ(data, payload);
+  }
+  close(fd);
+}
+
+}  // namespace
+}  // namespace android
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,183 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for the throughput and per-packet latency of encrypting and
+// decrypting packets of various sizes, and for the cost of generating IVs.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "privacy/net/krypton/benchmark_util.h"
+#include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+// Payload sizes from a bare TCP ACK up to the IPv6 minimum MTU, which is about
+// as large as an ESP packet can carry.
+constexpr int kPacketSizes[] = {64, 256, 576, 1024, 1280};
+constexpr int kLargestPacketSize = 1280;
+
+// How many packets are encrypted up front for the decryption benchmark. The
+// replay window rejects a sequence number the second time it's seen, so
+// once they have all been decrypted, the decryptor is recreated.
+constexpr int kPreparedPackets = 4096;
+
+void PacketSizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgName("size");
+  for (int size : kPacketSizes) {
+    benchmark->Arg(size);
+  }
+}
+
+// Every packet size one at a time with random IVs, and the largest packets in
+// batches and with sequence number IVs.
+void EncryptArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"size", "iv_mode", "batch"});
+  for (int size : kPacketSizes) {
+    benchmark->Args({size, static_cast<int>(IvMode::kRandom), 1});
+  }
+  benchmark->Args({kLargestPacketSize, static_cast<int>(IvMode::kRandom), 32});
+  for (int batch : {1, 32}) {
+    benchmark->Args(
+        {kLargestPacketSize, static_cast<int>(IvMode::kSequenceNumber), batch});
+  }
+}
+
+void BM_CreateSecureRandomString(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crypto::CreateSecureRandomString(kIVLen));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CreateSecureRandomString);
+
+void BM_BufferedSecureRandom(benchmark::State& state) {
+  crypto::BufferedSecureRandom random;
+  char iv[kIVLen];
+  for (auto _ : state) {
+    random.Generate(iv, sizeof(iv));
+    benchmark::DoNotOptimize(iv);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BufferedSecureRandom);
+
+// Encrypts batches of state.range(2) packets of state.range(0) bytes in place,
+// with the IV mode given by state.range(1).
+void BM_EncryptInPlace(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const auto iv_mode = static_cast<IvMode>(state.range(1));
+  const size_t batch_size = state.range(2);
+  auto encryptor =
+      IpSecEncryptor::Create(2, CreateBenchmarkTransformParams(),
+                             std::make_shared<SequenceNumberAllocator>(),
+                             iv_mode)
+          .value();
+
+  const size_t capacity = kPacketHeadroom + size + kPacketTailroom;
+  std::vector<char> buffers(capacity * batch_size);
+  std::vector<Packet> packets;
+  std::vector<absl::Status> statuses(batch_size);
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    packets.clear();
+    for (size_t i = 0; i < batch_size; ++i) {
+      char* buffer = buffers.data() + i * capacity;
+      packets.emplace_back(buffer, capacity, kPacketHeadroom, size,
+                           IPProtocol::kIPv4, PacketOwner());
+    }
+    absl::Time start = absl::Now();
+    auto status = encryptor->EncryptBatchInPlace(absl::MakeSpan(packets),
+                                                 absl::MakeSpan(statuses));
+    latency.RecordBatch(absl::Now() - start, batch_size);
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      break;
+    }
+  }
+  const int64_t processed = state.iterations() * batch_size;
+  ReportPacketRates(state, processed, processed * size);
+  latency.Report(state);
+}
+BENCHMARK(BM_EncryptInPlace)->Apply(EncryptArgs);
+
+// Decrypts packets that carried state.range(0) bytes of payload, one at a
+// time.
+void BM_Decrypt(benchmark::State& state) {
+  const size_t size = state.range(0);
+  auto params = CreateBenchmarkTransformParams();
+  auto encryptor = IpSecEncryptor::Create(2, params).value();
+  const std::string input(size, 'x');
+  auto encrypted = std::make_unique<IpSecPacket>();
+  std::vector<std::string> packets;
+  packets.reserve(kPreparedPackets);
+  for (int i = 0; i < kPreparedPackets; ++i) {
+    auto status =
+        encryptor->Encrypt(input, IPProtocol::kIPv4, encrypted.get());
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      return;
+    }
+    packets.emplace_back(encrypted->buffer(), encrypted->buffer_size());
+  }
+
+  auto decryptor = IpSecDecryptor::Create(params).value();
+  auto output = std::make_unique<IpSecPacket>();
+  IPProtocol protocol;
+  LatencyRecorder latency;
+  int next = 0;
+  for (auto _ : state) {
+    if (next == kPreparedPackets) {
+      state.PauseTiming();
+      decryptor = IpSecDecryptor::Create(params).value();
+      next = 0;
+      state.ResumeTiming();
+    }
+    absl::Time start = absl::Now();
+    auto status = decryptor->Decrypt(packets[next++], output.get(), &protocol);
+    latency.Record(absl::Now() - start);
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      break;
+    }
+  }
+  ReportPacketRates(state, state.iterations(), state.iterations() * size);
+  latency.Report(state);
+}
+BENCHMARK(BM_Decrypt)->Apply(PacketSizes);
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -15,8 +15,14 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_CRYPTOR_INTERFACE_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_CRYPTOR_INTERFACE_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 #include "privacy/net/krypton/pal/packet.h"
 #include "third_party/absl/status/statusor.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -35,6 +41,50 @@ class CryptorInterface {
   // therefore it's unsafe to write the packet back to the same memory address.
   // After encryption, a new packet will be created and returned.
   virtual absl::StatusOr<Packet> Process(const Packet& packet) = 0;
+
+  // Encrypts/Decrypts a batch of packets.
+  //
+  // Returns exactly one result per input packet, in the same order, so that a
+  // failure on one packet doesn't affect the rest of the batch. Implementations
+  // can override this to amortize per-packet overhead across the batch. The
+  // default implementation just calls Process() on each packet.
+  virtual std::vector<absl::StatusOr<Packet>> ProcessBatch(
+      absl::Span<const Packet> packets) {
+    std::vector<absl::StatusOr<Packet>> results;
+    results.reserve(packets.size());
+    for (const auto& packet : packets) {
+      results.push_back(Process(packet));
+    }
+    return results;
+  }
+
+  // Encrypts/Decrypts a batch of packets, taking ownership of them.
+  //
+  // Implementations may reuse the buffers of the given packets for their
+  // results instead of copying the packet data, if the packets are writable
+  // and have enough headroom and tailroom. Returns exactly one result per input
+  // packet, in the same order. The default implementation just calls
+  // ProcessBatch().
+  virtual std::vector<absl::StatusOr<Packet>> ProcessBatchInPlace(
+      std::vector<Packet> packets) {
+    return ProcessBatch(packets);
+  }
+
+  // Reserves whatever a batch of `count` packets needs to be numbered, such as
+  // ESP sequence numbers, and returns a token for it. Together with
+  // ProcessReservedBatchInPlace(), this lets batches be processed on several
+  // threads while still being numbered in the order they were reserved. The
+  // default implementation has nothing to reserve.
+  virtual absl::StatusOr<uint64_t> ReserveBatch(size_t /*count*/) { return 0; }
+
+  // Like ProcessBatchInPlace(), but uses the reservation returned by a
+  // previous call to ReserveBatch() for the same number of packets. Each
+  // reservation must be used exactly once. This may be called on any thread.
+  // The default implementation ignores the reservation.
+  virtual std::vector<absl::StatusOr<Packet>> ProcessReservedBatchInPlace(
+      std::vector<Packet> packets, uint64_t /*reservation*/) {
+    return ProcessBatchInPlace(std::move(packets));
+  }
 };
 
 }  // namespace ipsec
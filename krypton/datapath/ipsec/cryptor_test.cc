@@ -12,11 +12,27 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/ipsec.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
+#include "third_party/absl/container/flat_hash_set.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/strings/string_view.h"
 
 namespace privacy {
 namespace krypton {
@@ -24,6 +40,10 @@ namespace datapath {
 namespace ipsec {
 namespace {
 
+using ::testing::Not;
+using ::testing::status::IsOk;
+using ::testing::status::StatusIs;
+
 class IpSecEncapDecapTest : public ::testing::Test {
  public:
   explicit IpSecEncapDecapTest() {
@@ -37,6 +57,16 @@ class IpSecEncapDecapTest : public ::testing::Test {
   TransformParams params_ = TransformParams();
 };
 
+// Copies `data` into a new buffer with room around it for encapsulation, the
+// way a packet pipe would read it.
+Packet CreateWritablePacket(absl::string_view data, IPProtocol protocol) {
+  const size_t capacity = kPacketHeadroom + data.size() + kPacketTailroom;
+  char* buffer = new char[capacity];
+  memcpy(buffer + kPacketHeadroom, data.data(), data.size());
+  return Packet(buffer, capacity, kPacketHeadroom, data.size(), protocol,
+                [buffer] { delete[] buffer; });
+}
+
 TEST_F(IpSecEncapDecapTest, TestPacketsWithPaddingAreHandledCorrectly) {
   const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
 
@@ -69,6 +99,399 @@ TEST_F(IpSecEncapDecapTest, TestPacketsWithoutPaddingAreHandledCorrectly) {
   EXPECT_EQ(decryptedPacket->protocol(), packet.protocol());
 }
 
+TEST_F(IpSecEncapDecapTest, TestBatchesAreHandledCorrectly) {
+  const std::vector<std::string> payloads = {"foo", "fooooooooooooo", "",
+                                             std::string(1000, 'x')};
+  std::vector<Packet> packets;
+  for (const auto& payload : payloads) {
+    packets.emplace_back(payload.data(), payload.size(), IPProtocol::kIPv6,
+                         [] {});
+  }
+
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  auto encrypted = encryptor->ProcessBatch(packets);
+  ASSERT_EQ(encrypted.size(), packets.size());
+
+  std::vector<Packet> encrypted_packets;
+  for (size_t i = 0; i < encrypted.size(); ++i) {
+    ASSERT_OK(encrypted[i]);
+    // Every packet in the batch gets its own consecutive sequence number.
+    auto* header =
+        reinterpret_cast<const EspHeader*>(encrypted[i]->data().data());
+    EXPECT_EQ(ntohl(header->client_spi), 2);
+    EXPECT_EQ(ntohl(header->sequence_number), i);
+    encrypted_packets.emplace_back(*std::move(encrypted[i]));
+  }
+
+  auto decrypted = decryptor->ProcessBatch(encrypted_packets);
+  ASSERT_EQ(decrypted.size(), packets.size());
+  for (size_t i = 0; i < decrypted.size(); ++i) {
+    ASSERT_OK(decrypted[i]);
+    EXPECT_EQ(decrypted[i]->data(), payloads[i]);
+    EXPECT_EQ(decrypted[i]->protocol(), IPProtocol::kIPv6);
+  }
+}
+
+TEST_F(IpSecEncapDecapTest, TestBatchContinuesSequenceNumbers) {
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+
+  ASSERT_OK(encryptor->Process(packet));
+  auto encrypted = encryptor->ProcessBatch(absl::MakeConstSpan(&packet, 1));
+  ASSERT_EQ(encrypted.size(), 1);
+  ASSERT_OK(encrypted[0]);
+  auto* header =
+      reinterpret_cast<const EspHeader*>(encrypted[0]->data().data());
+  EXPECT_EQ(ntohl(header->sequence_number), 1);
+}
+
+TEST_F(IpSecEncapDecapTest, TestBatchErrorsOnlyAffectFailedPackets) {
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  std::vector<Packet> packets;
+  packets.emplace_back("garbage", 7, IPProtocol::kUnknown, [] {});
+  std::string bogus(100, 'x');
+  packets.emplace_back(bogus.data(), bogus.size(), IPProtocol::kUnknown,
+                       [] {});
+
+  auto decrypted = decryptor->ProcessBatch(packets);
+  ASSERT_EQ(decrypted.size(), 2);
+  EXPECT_FALSE(decrypted[0].ok());
+  EXPECT_FALSE(decrypted[1].ok());
+}
+
+TEST_F(IpSecEncapDecapTest, TestInPlaceBatchesAreHandledCorrectly) {
+  const std::vector<std::string> payloads = {"foo", "fooooooooooooo",
+                                             std::string(1000, 'x')};
+  std::vector<Packet> packets;
+  std::vector<const char*> buffers;
+  for (const auto& payload : payloads) {
+    packets.push_back(CreateWritablePacket(payload, IPProtocol::kIPv6));
+    buffers.push_back(packets.back().data().data());
+  }
+
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  ASSERT_EQ(encrypted.size(), payloads.size());
+  std::vector<Packet> ciphertexts;
+  for (size_t i = 0; i < encrypted.size(); ++i) {
+    ASSERT_OK(encrypted[i]);
+    // The ESP header was written into the headroom, right before the payload.
+    EXPECT_EQ(encrypted[i]->data().data(), buffers[i] - sizeof(EspHeader));
+    auto header =
+        reinterpret_cast<const EspHeader*>(encrypted[i]->data().data());
+    EXPECT_EQ(ntohl(header->client_spi), 2);
+    EXPECT_EQ(ntohl(header->sequence_number), i);
+    ciphertexts.push_back(std::move(encrypted[i]).value());
+  }
+
+  auto decrypted = decryptor->ProcessBatchInPlace(std::move(ciphertexts));
+  ASSERT_EQ(decrypted.size(), payloads.size());
+  for (size_t i = 0; i < decrypted.size(); ++i) {
+    ASSERT_OK(decrypted[i]);
+    EXPECT_EQ(decrypted[i]->data().data(), buffers[i]);
+    EXPECT_EQ(decrypted[i]->data(), payloads[i]);
+    EXPECT_EQ(decrypted[i]->protocol(), IPProtocol::kIPv6);
+  }
+}
+
+TEST_F(IpSecEncapDecapTest, TestInPlaceAndCopiedPacketsInteroperate) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  std::vector<Packet> packets;
+  packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  ASSERT_EQ(encrypted.size(), 1);
+  ASSERT_OK(encrypted[0]);
+  auto decrypted = decryptor->Process(*encrypted[0]);
+  ASSERT_OK(decrypted);
+  EXPECT_EQ(decrypted->data(), "foo");
+
+  const Packet packet("bar", 3, IPProtocol::kIPv4, [] {});
+  auto copied = encryptor->Process(packet);
+  ASSERT_OK(copied);
+  packets.clear();
+  packets.push_back(CreateWritablePacket(copied->data(), IPProtocol::kUnknown));
+  auto results = decryptor->ProcessBatchInPlace(std::move(packets));
+  ASSERT_EQ(results.size(), 1);
+  ASSERT_OK(results[0]);
+  EXPECT_EQ(results[0]->data(), "bar");
+  EXPECT_EQ(results[0]->protocol(), IPProtocol::kIPv4);
+}
+
+TEST_F(IpSecEncapDecapTest, TestInPlaceFallsBackToCopyWithoutRoom) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  std::vector<Packet> packets;
+  packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+  packets.emplace_back("bar", 3, IPProtocol::kIPv4, [] {});
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  ASSERT_EQ(encrypted.size(), 2);
+
+  std::vector<Packet> ciphertexts;
+  for (auto& result : encrypted) {
+    ASSERT_OK(result);
+    ciphertexts.push_back(std::move(result).value());
+  }
+  // These come from the packet pool, so they aren't writable and have to be
+  // decrypted by copying too.
+  auto decrypted = decryptor->ProcessBatchInPlace(std::move(ciphertexts));
+  ASSERT_EQ(decrypted.size(), 2);
+  ASSERT_OK(decrypted[0]);
+  ASSERT_OK(decrypted[1]);
+  EXPECT_EQ(decrypted[0]->data(), "foo");
+  EXPECT_EQ(decrypted[1]->data(), "bar");
+}
+
+TEST_F(IpSecEncapDecapTest, TestEncryptorsShareSequenceNumbers) {
+  auto sequence_numbers = std::make_shared<SequenceNumberAllocator>();
+  ASSERT_OK_AND_ASSIGN(auto first,
+                       Encryptor::Create(2, params_, sequence_numbers));
+  ASSERT_OK_AND_ASSIGN(auto second,
+                       Encryptor::Create(2, params_, sequence_numbers));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  std::vector<uint32_t> sequence_numbers_seen;
+  for (auto* encryptor : {first.get(), second.get(), first.get()}) {
+    std::vector<Packet> packets;
+    packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+    packets.push_back(CreateWritablePacket("bar", IPProtocol::kIPv4));
+    auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+    ASSERT_EQ(encrypted.size(), 2);
+    for (auto& result : encrypted) {
+      ASSERT_OK(result);
+      EspHeader header;
+      memcpy(&header, result->data().data(), sizeof(header));
+      sequence_numbers_seen.push_back(ntohl(header.sequence_number));
+
+      auto decrypted = decryptor->Process(*result);
+      ASSERT_OK(decrypted);
+    }
+  }
+
+  EXPECT_THAT(sequence_numbers_seen, ::testing::ElementsAre(0, 1, 2, 3, 4, 5));
+  EXPECT_EQ(sequence_numbers->next(), 6);
+}
+
+TEST_F(IpSecEncapDecapTest, TestSequenceNumberIvs) {
+  auto sequence_numbers = std::make_shared<SequenceNumberAllocator>();
+  ASSERT_OK_AND_ASSIGN(
+      auto encryptor, Encryptor::Create(2, params_, sequence_numbers,
+                                        IvMode::kSequenceNumber));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  std::vector<Packet> packets;
+  for (int i = 0; i < 3; ++i) {
+    packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+  }
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  const Packet packet("bar", 3, IPProtocol::kIPv4, [] {});
+  encrypted.push_back(encryptor->Process(packet));
+  ASSERT_EQ(encrypted.size(), 4);
+
+  for (uint32_t i = 0; i < encrypted.size(); ++i) {
+    ASSERT_OK(encrypted[i]);
+    EspHeader header;
+    memcpy(&header, encrypted[i]->data().data(), sizeof(header));
+    EXPECT_EQ(ntohl(header.sequence_number), i);
+    uint64_t iv = 0;
+    for (char byte : header.initialization_vector) {
+      iv = (iv << 8) | static_cast<uint8_t>(byte);
+    }
+    EXPECT_EQ(iv, sequence_numbers->iv_mask() ^ i);
+
+    auto decrypted = decryptor->Process(*encrypted[i]);
+    ASSERT_OK(decrypted);
+    EXPECT_EQ(decrypted->data(), i < 3 ? "foo" : "bar");
+  }
+}
+
+TEST_F(IpSecEncapDecapTest, TestExtendedSequenceNumbersCrossTheLowBitsWrap) {
+  params_.mutable_ipsec()->set_extended_sequence_numbers(true);
+  auto sequence_numbers = std::make_shared<SequenceNumberAllocator>(true);
+  ASSERT_OK(sequence_numbers->Reserve(std::numeric_limits<uint32_t>::max()));
+  ASSERT_OK_AND_ASSIGN(auto encryptor,
+                       Encryptor::Create(2, params_, sequence_numbers));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, IpSecDecryptor::Create(params_));
+
+  std::vector<Packet> packets;
+  for (int i = 0; i < 3; ++i) {
+    packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+  }
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  ASSERT_EQ(encrypted.size(), 3);
+
+  const uint64_t first = std::numeric_limits<uint32_t>::max();
+  for (uint64_t i = 0; i < encrypted.size(); ++i) {
+    ASSERT_OK(encrypted[i]);
+    EspHeader header;
+    memcpy(&header, encrypted[i]->data().data(), sizeof(header));
+    // Only the low 32 bits are sent, and the IV follows the full number.
+    EXPECT_EQ(ntohl(header.sequence_number), static_cast<uint32_t>(first + i));
+    uint64_t iv = 0;
+    for (char byte : header.initialization_vector) {
+      iv = (iv << 8) | static_cast<uint8_t>(byte);
+    }
+    EXPECT_EQ(iv, sequence_numbers->iv_mask() ^ (first + i));
+
+    std::string output(encrypted[i]->data().size(), '\0');
+    size_t output_size;
+    IPProtocol protocol;
+    ASSERT_OK(decryptor->Decrypt(encrypted[i]->data(),
+                                 reinterpret_cast<uint8_t*>(output.data()),
+                                 output.size(), &output_size, &protocol));
+    EXPECT_EQ(output.substr(0, output_size), "foo");
+    EXPECT_EQ(decryptor->highest_sequence_number(), first + i);
+  }
+}
+
+TEST_F(IpSecEncapDecapTest, TestExtendedSequenceNumbersAreAuthenticated) {
+  TransformParams extended_params = params_;
+  extended_params.mutable_ipsec()->set_extended_sequence_numbers(true);
+  auto sequence_numbers = std::make_shared<SequenceNumberAllocator>(true);
+  ASSERT_OK(sequence_numbers->Reserve(std::numeric_limits<uint32_t>::max()));
+  ASSERT_OK(sequence_numbers->Reserve(1));
+  ASSERT_OK_AND_ASSIGN(
+      auto encryptor, Encryptor::Create(2, extended_params, sequence_numbers));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  // The high bits are 1, which a decryptor without extended sequence numbers
+  // doesn't know about.
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto encrypted, encryptor->Process(packet));
+  EXPECT_THAT(decryptor->Process(encrypted), Not(IsOk()));
+}
+
+TEST_F(IpSecEncapDecapTest, TestMismatchedSequenceNumberAllocatorFails) {
+  params_.mutable_ipsec()->set_extended_sequence_numbers(true);
+  EXPECT_THAT(Encryptor::Create(2, params_,
+                                std::make_shared<SequenceNumberAllocator>()),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(IpSecEncapDecapTest, TestReplayedPacketsAreRejected) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto first, encryptor->Process(packet));
+  ASSERT_OK_AND_ASSIGN(auto second, encryptor->Process(packet));
+
+  // Out of order is fine, but each packet is only accepted once.
+  EXPECT_OK(decryptor->Process(second));
+  EXPECT_OK(decryptor->Process(first));
+  EXPECT_THAT(decryptor->Process(first),
+              StatusIs(absl::StatusCode::kAlreadyExists));
+  EXPECT_THAT(decryptor->Process(second),
+              StatusIs(absl::StatusCode::kAlreadyExists));
+}
+
+TEST_F(IpSecEncapDecapTest, TestPacketsOlderThanTheReplayWindowAreRejected) {
+  auto sequence_numbers = std::make_shared<SequenceNumberAllocator>();
+  ASSERT_OK_AND_ASSIGN(auto encryptor,
+                       Encryptor::Create(2, params_, sequence_numbers));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto old_packet, encryptor->Process(packet));
+  ASSERT_OK(sequence_numbers->Reserve(ReplayWindow::kSize));
+  ASSERT_OK_AND_ASSIGN(auto new_packet, encryptor->Process(packet));
+
+  EXPECT_OK(decryptor->Process(new_packet));
+  EXPECT_THAT(decryptor->Process(old_packet),
+              StatusIs(absl::StatusCode::kOutOfRange));
+}
+
+TEST_F(IpSecEncapDecapTest, TestForgedPacketsDoNotAdvanceTheReplayWindow) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto encrypted, encryptor->Process(packet));
+
+  // Claim a much higher sequence number without being able to authenticate
+  // it.
+  std::string forged(encrypted.data());
+  EspHeader header;
+  memcpy(&header, forged.data(), sizeof(header));
+  header.sequence_number = htonl(1000000);
+  memcpy(forged.data(), &header, sizeof(header));
+  const Packet forged_packet(forged.data(), forged.size(), IPProtocol::kUnknown,
+                             [] {});
+  EXPECT_THAT(decryptor->Process(forged_packet), Not(IsOk()));
+
+  EXPECT_OK(decryptor->Process(encrypted));
+}
+
+TEST_F(IpSecEncapDecapTest, TestRandomIvsAreDistinct) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+
+  std::vector<Packet> packets;
+  for (int i = 0; i < 32; ++i) {
+    packets.push_back(CreateWritablePacket("foo", IPProtocol::kIPv4));
+  }
+  auto encrypted = encryptor->ProcessBatchInPlace(std::move(packets));
+  absl::flat_hash_set<std::string> ivs;
+  for (const auto& result : encrypted) {
+    ASSERT_OK(result);
+    EspHeader header;
+    memcpy(&header, result->data().data(), sizeof(header));
+    ivs.emplace(header.initialization_vector, kIVLen);
+  }
+  EXPECT_EQ(ivs.size(), encrypted.size());
+}
+
+TEST_F(IpSecEncapDecapTest, TestEachCipherSuiteRoundTrips) {
+  for (auto suite : {IpSecTransformParams::AES128_GCM,
+                     IpSecTransformParams::AES256_GCM,
+                     IpSecTransformParams::CHACHA20_POLY1305}) {
+    const size_t key_length =
+        suite == IpSecTransformParams::AES128_GCM ? 16 : 32;
+    auto ipsec_params = params_.mutable_ipsec();
+    ipsec_params->set_cipher_suite(suite);
+    ipsec_params->set_uplink_key(std::string(key_length, 'z'));
+    ipsec_params->set_downlink_key(std::string(key_length, 'z'));
+
+    ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+    ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+    const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+    auto encrypted = encryptor->Process(packet);
+    ASSERT_OK(encrypted);
+    auto decrypted = decryptor->Process(*encrypted);
+    ASSERT_OK(decrypted);
+    EXPECT_EQ(decrypted->data(), "foo");
+  }
+}
+
+TEST_F(IpSecEncapDecapTest, TestCipherSuitesDoNotInteroperate) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  params_.mutable_ipsec()->set_cipher_suite(
+      IpSecTransformParams::CHACHA20_POLY1305);
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  auto encrypted = encryptor->Process(packet);
+  ASSERT_OK(encrypted);
+  EXPECT_THAT(decryptor->Process(*encrypted), Not(IsOk()));
+}
+
+TEST_F(IpSecEncapDecapTest, TestKeyLengthMustMatchCipherSuite) {
+  params_.mutable_ipsec()->set_cipher_suite(IpSecTransformParams::AES128_GCM);
+
+  EXPECT_THAT(Encryptor::Create(2, params_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(Decryptor::Create(params_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 }  // namespace
 }  // namespace ipsec
 }  // namespace datapath
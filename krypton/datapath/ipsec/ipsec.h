@@ -32,15 +32,14 @@ namespace krypton {
 namespace datapath {
 namespace ipsec {
 
-constexpr size_t kKeyLen = 32;
 constexpr size_t kIVLen = 8;
 constexpr size_t kSaltLen = 4;
 constexpr size_t kAESBlockSize = 16;
 
 // Specified in RFC 4303, Sections 2.1 - 2.3.
 // We only ever send a 32-bit sequence number.
-// IKEv2 uses 64-bit ESN by default, so if we're doing that, we'll only send the
-// low-order bits as per Section 2.2.1.
+// With 64-bit Extended Sequence Numbers, we only send the low-order bits as per
+// Section 2.2.1, and the high-order bits are only part of the AAD.
 //
 // All fields are big-endian.
 struct EspHeader {
@@ -49,9 +48,17 @@ struct EspHeader {
   char initialization_vector[kIVLen];
 } ABSL_ATTRIBUTE_PACKED;
 
+// The AAD is the SPI and the sequence number, which is 64 bits wide with
+// extended sequence numbers (RFC 4106 Section 5).
+constexpr size_t kEspMaxAadLen = sizeof(uint32_t) + sizeof(uint64_t);
+
 // 128-bit trailer in the packet body, specified in RFC 4303, Section 2.8.
 constexpr size_t kEspTagLen = 16;
 
+// The most room an ESP trailer can take after the payload: padding to the next
+// block boundary, the pad length and next header bytes, and the ICV.
+constexpr size_t kEspTrailerMaxLen = kAESBlockSize - 1 + 2 + kEspTagLen;
+
 }  // namespace ipsec
 }  // namespace datapath
 }  // namespace krypton
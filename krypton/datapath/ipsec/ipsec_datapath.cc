@@ -18,11 +18,15 @@
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include "privacy/net/krypton/add_egress_response.h"
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
 #include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
+#include "privacy/net/krypton/datapath/ipsec/rekeyable_cryptor.h"
 #include "privacy/net/krypton/datapath_interface.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
@@ -47,6 +51,31 @@ namespace ipsec {
 constexpr int kMaxRetries = 1;
 constexpr int kInvalidTimerId = -1;
 constexpr absl::Duration kDatapathConnectingDuration = absl::Seconds(10);
+// How long downlink packets protected with the keys from before a rekey are
+// still accepted after it.
+constexpr absl::Duration kRekeyGracePeriod = absl::Seconds(30);
+// Ask for a rekey once 3/4 of the 32-bit sequence number space is used, which
+// leaves plenty of headroom to finish the rekey even at millions of packets per
+// second.
+constexpr uint64_t kDefaultRekeyPacketLimit = uint64_t{3} << 30;
+
+/* static */ SaVolumeLimits IpSecDatapath::GetRekeyLimits(
+    const KryptonConfig& config) {
+  SaVolumeLimits limits;
+  limits.packets = config.ipsec_rekey_packet_limit();
+  if (limits.packets == 0) {
+    limits.packets = kDefaultRekeyPacketLimit;
+  }
+  if (!config.ipsec_extended_sequence_numbers_enabled() &&
+      limits.packets > kDefaultRekeyPacketLimit) {
+    LOG(WARNING) << "Capping IPsec rekey packet limit at "
+                 << kDefaultRekeyPacketLimit
+                 << " without extended sequence numbers";
+    limits.packets = kDefaultRekeyPacketLimit;
+  }
+  limits.bytes = config.ipsec_rekey_byte_limit();
+  return limits;
+}
 
 absl::Status IpSecDatapath::Start(const AddEgressResponse& /*egress_response*/,
                                   const TransformParams& params) {
@@ -64,6 +93,7 @@ void IpSecDatapath::Stop() {
     }
     CancelDatapathConnectingTimerIfRunning();
     CancelHealthCheckTimer();
+    CancelRekeyGraceTimerIfRunning();
     datapath_connecting_count_ = 0;
     if (packet_forwarder_ != nullptr) {
       LOG(INFO) << "Stopping packet_forwarder_[" << packet_forwarder_ << "].";
@@ -109,9 +139,15 @@ absl::Status IpSecDatapath::SwitchNetwork(uint32_t session_id,
   // "privacy/net/krypton/session.cc"
   if (!uplink_spi_.has_value() || *uplink_spi_ != session_id) {
     uplink_spi_ = session_id;
-    PPN_ASSIGN_OR_RETURN(encryptor_,
+    PPN_ASSIGN_OR_RETURN(auto encryptor,
                          Encryptor::Create(*uplink_spi_, *key_material_));
-    PPN_ASSIGN_OR_RETURN(decryptor_, Decryptor::Create(*key_material_));
+    PPN_ASSIGN_OR_RETURN(auto decryptor, Decryptor::Create(*key_material_));
+    CancelRekeyGraceTimerIfRunning();
+    encryptor_ = std::make_unique<RekeyableEncryptor>(
+        std::move(encryptor), rekey_limits_,
+        absl::bind_front(&IpSecDatapath::HandleRekeyLimitReached, this));
+    decryptor_ = std::make_unique<RekeyableDecryptor>(
+        key_material_->ipsec().downlink_spi(), std::move(decryptor));
   }
 
   tunnel_ = tunnel;
@@ -130,9 +166,23 @@ absl::Status IpSecDatapath::SwitchNetwork(uint32_t session_id,
 
 absl::Status IpSecDatapath::SetKeyMaterials(const TransformParams& params) {
   absl::MutexLock l(&mutex_);
-  *key_material_ = params;
-  PPN_ASSIGN_OR_RETURN(encryptor_, Encryptor::Create(*uplink_spi_, params));
-  PPN_ASSIGN_OR_RETURN(decryptor_, Decryptor::Create(params));
+  key_material_ = params;
+  if (!uplink_spi_.has_value() || encryptor_ == nullptr ||
+      decryptor_ == nullptr) {
+    // There are no SAs to replace yet. SwitchNetwork will create them from the
+    // new key material.
+    return absl::OkStatus();
+  }
+  PPN_ASSIGN_OR_RETURN(auto encryptor, Encryptor::Create(*uplink_spi_, params));
+  PPN_ASSIGN_OR_RETURN(auto decryptor, Decryptor::Create(params));
+
+  // Make before break: the downlink accepts both SAs before the uplink
+  // switches, and the packet forwarder keeps running throughout.
+  decryptor_->Rekey(params.ipsec().downlink_spi(), std::move(decryptor));
+  encryptor_->Rekey(std::move(encryptor));
+  LOG(INFO) << "Switched to new SAs with downlink_spi="
+            << params.ipsec().downlink_spi();
+  StartRekeyGraceTimer();
   return absl::OkStatus();
 }
 
@@ -196,7 +246,7 @@ absl::Status IpSecDatapath::CreateNetworkPipeAndStartPacketForwarder() {
   LOG(INFO) << "Creating packet forwarder.";
   packet_forwarder_ = std::make_unique<PacketForwarder>(
       encryptor_.get(), decryptor_.get(), tunnel_, network_socket_.get(),
-      notification_thread_, this);
+      notification_thread_, this, uplink_workers_);
   LOG(INFO) << "Starting packet forwarder[" << packet_forwarder_ << "].";
   packet_forwarder_->Start();
   return absl::OkStatus();
@@ -285,6 +335,56 @@ void IpSecDatapath::CancelHealthCheckTimer() {
   health_check_timer_id_ = kInvalidTimerId;
 }
 
+void IpSecDatapath::StartRekeyGraceTimer() {
+  CancelRekeyGraceTimerIfRunning();
+  auto timer_id = timer_manager_->StartTimer(
+      kRekeyGracePeriod,
+      absl::bind_front(&IpSecDatapath::HandleRekeyGraceTimeout, this),
+      "RekeyGrace");
+  if (!timer_id.ok()) {
+    // Keep accepting the old SA until the next rekey replaces it.
+    LOG(ERROR) << "Cannot StartTimer for RekeyGrace";
+    return;
+  }
+  rekey_grace_timer_id_ = *timer_id;
+}
+
+void IpSecDatapath::CancelRekeyGraceTimerIfRunning() {
+  if (rekey_grace_timer_id_ != kInvalidTimerId) {
+    timer_manager_->CancelTimer(rekey_grace_timer_id_);
+  }
+  rekey_grace_timer_id_ = kInvalidTimerId;
+}
+
+void IpSecDatapath::HandleRekeyGraceTimeout() {
+  // Destroying an SA waits for its packets to come back, which may need the
+  // forwarder to make progress, so the retired SAs are dropped after mutex_ is
+  // released.
+  std::vector<std::shared_ptr<CryptorInterface>> retired_uplink;
+  std::vector<std::shared_ptr<CryptorInterface>> retired_downlink;
+  {
+    absl::MutexLock l(&mutex_);
+    rekey_grace_timer_id_ = kInvalidTimerId;
+    if (encryptor_ == nullptr || decryptor_ == nullptr) {
+      return;
+    }
+    LOG(INFO) << "Retiring the SA from before the last rekey.";
+    // Nothing has been encrypted with the old uplink SA for a whole grace
+    // period, so it can go. Downlink SAs that stop being accepted now are
+    // released after the next grace period instead, since packets may still
+    // be being decrypted with them.
+    retired_uplink = encryptor_->TakeRetired();
+    retired_downlink = decryptor_->TakeRetired();
+    decryptor_->RetirePrevious();
+  }
+}
+
+void IpSecDatapath::HandleRekeyLimitReached() {
+  LOG(INFO) << "Uplink SA reached its soft limit, requesting a rekey.";
+  auto* notification = notification_;
+  notification_thread_->Post([notification]() { notification->DoRekey(); });
+}
+
 void IpSecDatapath::HandleHealthCheckTimeout() {
   absl::MutexLock l(&mutex_);
   if (health_check_cancelled_ == nullptr || *health_check_cancelled_) {
@@ -24,6 +24,7 @@
 #include "privacy/net/krypton/add_egress_response.h"
 #include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
 #include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
+#include "privacy/net/krypton/datapath/ipsec/rekeyable_cryptor.h"
 #include "privacy/net/krypton/datapath_interface.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet_pipe.h"
@@ -74,7 +75,11 @@ class IpSecDatapath : public DatapathInterface,
         timer_manager_(timer_manager),
         periodic_health_check_enabled_(config.periodic_health_check_enabled()),
         periodic_health_check_duration_(
-            absl::Seconds(config.periodic_health_check_duration().seconds())) {}
+            absl::Seconds(config.periodic_health_check_duration().seconds())),
+        uplink_workers_(config.ios_uplink_parallelism_enabled()
+                            ? kParallelUplinkWorkers
+                            : 1),
+        rekey_limits_(GetRekeyLimits(config)) {}
   ~IpSecDatapath() override = default;
   IpSecDatapath(const IpSecDatapath&) = delete;
   IpSecDatapath(IpSecDatapath&&) = delete;
@@ -99,7 +104,9 @@ class IpSecDatapath : public DatapathInterface,
 
   void SwitchTunnel() override {}
 
-  // Updates crypto keys.
+  // Updates crypto keys without stopping the packet forwarder. Uplink packets
+  // switch to the new keys right away, while downlink packets that were
+  // protected with the old keys are still accepted for a grace period.
   absl::Status SetKeyMaterials(const TransformParams& params) override;
 
   void PacketForwarderFailed(const absl::Status&) override;
@@ -111,27 +118,34 @@ class IpSecDatapath : public DatapathInterface,
   void GetDebugInfo(DatapathDebugInfo* debug_info) override;
 
  private:
+  // How many threads encrypt uplink packets when uplink parallelism is on.
+  static constexpr int kParallelUplinkWorkers = 4;
+
+  // Returns the soft limits on each uplink SA from the config.
+  static SaVolumeLimits GetRekeyLimits(const KryptonConfig& config);
+
   absl::Mutex mutex_;
   utils::LooperThread* notification_thread_;    // Not owned by this class.
   IpSecVpnServiceInterface* vpn_service_;       // Not owned by this class.
   TimerManager* timer_manager_;                 // Not owned by this class.
   PacketPipe* tunnel_ ABSL_GUARDED_BY(mutex_);  // Not owned by this class.
   std::unique_ptr<PacketPipe> network_socket_ ABSL_GUARDED_BY(mutex_);
-  std::unique_ptr<CryptorInterface> encryptor_
-      ABSL_GUARDED_BY(mutex_);
+  std::unique_ptr<RekeyableEncryptor> encryptor_ ABSL_GUARDED_BY(mutex_);
   std::unique_ptr<PacketForwarder> packet_forwarder_
       ABSL_GUARDED_BY(mutex_);
-  std::unique_ptr<CryptorInterface> decryptor_
-      ABSL_GUARDED_BY(mutex_);
+  std::unique_ptr<RekeyableDecryptor> decryptor_ ABSL_GUARDED_BY(mutex_);
   std::optional<uint32_t> uplink_spi_ ABSL_GUARDED_BY(mutex_);
   std::optional<TransformParams> key_material_ ABSL_GUARDED_BY(mutex_);
   std::optional<Endpoint> endpoint_ ABSL_GUARDED_BY(mutex_);
   std::optional<NetworkInfo> network_info_ ABSL_GUARDED_BY(mutex_);
   int datapath_connecting_timer_id_ ABSL_GUARDED_BY(mutex_) = -1;
   int health_check_timer_id_ ABSL_GUARDED_BY(mutex_) = -1;
+  int rekey_grace_timer_id_ ABSL_GUARDED_BY(mutex_) = -1;
   int datapath_connecting_count_ ABSL_GUARDED_BY(mutex_) = 0;
   const bool periodic_health_check_enabled_;
   const absl::Duration periodic_health_check_duration_;
+  const int uplink_workers_;
+  const SaVolumeLimits rekey_limits_;
   std::shared_ptr<std::atomic_bool> health_check_cancelled_
       ABSL_GUARDED_BY(mutex_);
   utils::LooperThread looper_{"HealthCheck"};
@@ -146,6 +160,11 @@ class IpSecDatapath : public DatapathInterface,
   void StartHealthCheckTimer();
   void CancelHealthCheckTimer() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   void HandleHealthCheckTimeout();
+  void StartRekeyGraceTimer() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void CancelRekeyGraceTimerIfRunning() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void HandleRekeyGraceTimeout();
+  // Called on a forwarding thread when the uplink SA reaches a soft limit.
+  void HandleRekeyLimitReached();
 };
 
 }  // namespace ipsec
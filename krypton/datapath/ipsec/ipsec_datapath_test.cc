@@ -228,6 +228,96 @@ TEST_F(IpSecDatapathTest, SwitchNetworkHappyPath) {
   datapath_.Stop();
 }
 
+TEST_F(IpSecDatapathTest, SetKeyMaterialsKeepsPacketForwarderRunning) {
+  EXPECT_CALL(vpn_service_, GetTunnel()).WillOnce(Return(&tunnel_));
+  EXPECT_CALL(timer_interface_, StartTimer(_, absl::Seconds(10)))
+      .WillOnce(Return(absl::OkStatus()));
+  EXPECT_CALL(timer_interface_, StartTimer(_, absl::Seconds(300)))
+      .WillOnce(Return(absl::OkStatus()));
+  int grace_timer_id;
+  EXPECT_CALL(timer_interface_, StartTimer(_, absl::Seconds(30)))
+      .WillOnce(DoAll(SaveArg<0>(&grace_timer_id), Return(absl::OkStatus())));
+
+  // Rekeying must not reconnect.
+  auto pipe_ptr = std::make_unique<TestPacketPipe>(2);
+  auto pipe = pipe_ptr.get();
+  EXPECT_CALL(vpn_service_, CreateNetworkPipe(_, _))
+      .WillOnce(Return(testing::ByMove(std::move(pipe_ptr))));
+
+  EXPECT_CALL(notification_, DatapathFailed).Times(0);
+  EXPECT_CALL(notification_, DatapathPermanentFailure).Times(0);
+
+  auto params = params_.mutable_ipsec();
+  params->set_uplink_key(std::string(32, 'z'));
+  params->set_downlink_key(std::string(32, 'z'));
+  params->set_uplink_salt(std::string(4, 'a'));
+  params->set_downlink_salt(std::string(4, 'a'));
+  params->set_downlink_spi(4);
+
+  EXPECT_OK(datapath_.Start(fake_add_egress_response_, params_));
+  EXPECT_OK(datapath_.SwitchNetwork(1, endpoint_, network_info_, 1));
+
+  TransformParams new_params = params_;
+  new_params.mutable_ipsec()->set_uplink_key(std::string(32, 'y'));
+  new_params.mutable_ipsec()->set_downlink_key(std::string(32, 'y'));
+  new_params.mutable_ipsec()->set_downlink_spi(5);
+  EXPECT_OK(datapath_.SetKeyMaterials(new_params));
+
+  // Downlink packets protected with the new keys are decrypted by the
+  // packet forwarder that was started before the rekey.
+  EXPECT_CALL(notification_, DatapathEstablished);
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(5, new_params));
+  Packet unencrypted("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto encrypted, encryptor->Process(unencrypted));
+  std::vector<Packet> packets;
+  packets.emplace_back(std::move(encrypted));
+  ASSERT_OK_AND_ASSIGN(auto handler, pipe->GetReadHandler());
+  EXPECT_TRUE(handler(absl::OkStatus(), std::move(packets)));
+  WaitForNotifications();
+
+  timer_interface_.TimerExpiry(grace_timer_id);
+
+  pipe = nullptr;
+  datapath_.Stop();
+}
+
+TEST_F(IpSecDatapathTest, UplinkSoftLimitRequestsRekey) {
+  KryptonConfig config = CreateTestConfig();
+  config.set_ipsec_rekey_packet_limit(2);
+  IpSecDatapath datapath(config, &looper_, &vpn_service_, &timer_manager_);
+  datapath.RegisterNotificationHandler(&notification_);
+
+  EXPECT_CALL(vpn_service_, GetTunnel()).WillOnce(Return(&tunnel_));
+  EXPECT_CALL(timer_interface_, StartTimer(_, absl::Seconds(10)))
+      .WillOnce(Return(absl::OkStatus()));
+  EXPECT_CALL(vpn_service_, CreateNetworkPipe(_, _))
+      .WillOnce(Return(testing::ByMove(std::make_unique<TestPacketPipe>(2))));
+
+  EXPECT_CALL(notification_, DatapathFailed).Times(0);
+  EXPECT_CALL(notification_, DatapathPermanentFailure).Times(0);
+
+  auto params = params_.mutable_ipsec();
+  params->set_uplink_key(std::string(32, 'z'));
+  params->set_downlink_key(std::string(32, 'z'));
+  params->set_uplink_salt(std::string(4, 'a'));
+  params->set_downlink_salt(std::string(4, 'a'));
+
+  EXPECT_OK(datapath.Start(fake_add_egress_response_, params_));
+  EXPECT_OK(datapath.SwitchNetwork(1, endpoint_, network_info_, 1));
+
+  // Only the first packet past the limit asks for a rekey.
+  EXPECT_CALL(notification_, DoRekey).Times(1);
+  ASSERT_OK_AND_ASSIGN(auto handler, tunnel_.GetReadHandler());
+  for (int i = 0; i < 3; ++i) {
+    std::vector<Packet> packets;
+    packets.emplace_back("foo", 3, IPProtocol::kIPv4, [] {});
+    EXPECT_TRUE(handler(absl::OkStatus(), std::move(packets)));
+  }
+  WaitForNotifications();
+
+  datapath.Stop();
+}
+
 TEST_F(IpSecDatapathTest, SwitchNetworkTimeout) {
   EXPECT_CALL(vpn_service_, GetTunnel()).WillOnce(Return(&tunnel_));
   int connecting_timeout_timer_id;
@@ -24,16 +24,21 @@
 #endif
 
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/logging.h"
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
 #include "privacy/net/krypton/crypto/openssl_error.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -42,6 +47,12 @@ namespace ipsec {
 
 /* static */ absl::StatusOr<std::unique_ptr<IpSecDecryptor>>
 IpSecDecryptor::Create(const TransformParams& params) {
+  return Create(params, std::make_shared<ReplayWindow>());
+}
+
+/* static */ absl::StatusOr<std::unique_ptr<IpSecDecryptor>>
+IpSecDecryptor::Create(const TransformParams& params,
+                       std::shared_ptr<ReplayWindow> replay_window) {
   if (!params.has_ipsec()) {
     LOG(ERROR) << "TransformParams.IpSecTransformParams is null";
     return absl::InvalidArgumentError(
@@ -62,7 +73,8 @@ IpSecDecryptor::Create(const TransformParams& params) {
   const auto key =
       reinterpret_cast<const uint8_t*>(ipsec_param.downlink_key().data());
   const auto key_size = ipsec_param.downlink_key().size();
-  if (key_size != kKeyLen) {
+  const auto cipher_suite = ipsec_param.cipher_suite();
+  if (key_size != crypto::IpSecCipherSuiteKeyLength(cipher_suite)) {
     LOG(ERROR) << "TransformParams.IpSecTransformParams has a downlink_key "
                   "with wrong size";
     return absl::InvalidArgumentError(
@@ -71,7 +83,8 @@ IpSecDecryptor::Create(const TransformParams& params) {
   }
 
   EVP_AEAD_CTX* aead_ctx =
-      EVP_AEAD_CTX_new(EVP_aead_aes_256_gcm(), key, key_size, kEspTagLen);
+      EVP_AEAD_CTX_new(crypto::IpSecCipherSuiteAead(cipher_suite), key,
+                       key_size, kEspTagLen);
   if (aead_ctx == nullptr) {
     LOG(ERROR) << "EVP_AEAD_CTX_new failure: keysize=" << key_size;
     return crypto::GetOpenSSLError("EVP_AEAD_CTX_new failure");
@@ -85,7 +98,31 @@ IpSecDecryptor::Create(const TransformParams& params) {
   }
   std::string salt = ipsec_param.downlink_salt();
 
-  return std::make_unique<IpSecDecryptor>(aead_ctx, salt);
+  return std::make_unique<IpSecDecryptor>(
+      aead_ctx, salt, ipsec_param.extended_sequence_numbers(),
+      std::move(replay_window));
+}
+
+uint64_t IpSecDecryptor::InferSequenceNumber(
+    uint32_t sequence_number_low) const {
+  if (!extended_sequence_numbers_) {
+    return sequence_number_low;
+  }
+  constexpr uint32_t kHalfSpace = uint32_t{1} << 31;
+  const uint64_t highest = highest_sequence_number();
+  const auto highest_low = static_cast<uint32_t>(highest);
+  auto high = static_cast<uint32_t>(highest >> 32);
+  if (sequence_number_low >= highest_low) {
+    // Far ahead of the highest number means it's actually from before the low
+    // bits last wrapped around.
+    if (sequence_number_low - highest_low > kHalfSpace && high > 0) {
+      --high;
+    }
+  } else if (highest_low - sequence_number_low > kHalfSpace) {
+    // Far behind the highest number means the low bits have wrapped around.
+    ++high;
+  }
+  return (static_cast<uint64_t>(high) << 32) | sequence_number_low;
 }
 
 absl::Status IpSecDecryptor::Decrypt(absl::string_view input,
@@ -126,11 +163,24 @@ absl::Status IpSecDecryptor::Decrypt(absl::string_view input, uint8_t* output,
 
   // Encryptors are responsible for ensuring these numbers are big-endian.
   auto spi = input_header->client_spi;
-  auto sequence_number = input_header->sequence_number;
+  auto sequence_number_low = input_header->sequence_number;
+  const uint64_t sequence_number =
+      InferSequenceNumber(be32toh(sequence_number_low));
+  // Replays are dropped before spending anything on the AEAD.
+  PPN_RETURN_IF_ERROR(replay_window_->Check(sequence_number));
   CHECK_EQ(sizeof(input_header->initialization_vector), kIVLen);
-  char aad[sizeof(spi) + sizeof(sequence_number)];
+  char aad[kEspMaxAadLen];
+  size_t aad_len = 0;
   memcpy(aad, &spi, sizeof(spi));
-  memcpy(aad + sizeof(spi), &sequence_number, sizeof(sequence_number));
+  aad_len += sizeof(spi);
+  if (extended_sequence_numbers_) {
+    uint32_t sequence_number_high =
+        htobe32(static_cast<uint32_t>(sequence_number >> 32));
+    memcpy(aad + aad_len, &sequence_number_high, sizeof(sequence_number_high));
+    aad_len += sizeof(sequence_number_high);
+  }
+  memcpy(aad + aad_len, &sequence_number_low, sizeof(sequence_number_low));
+  aad_len += sizeof(sequence_number_low);
   const auto aad_head = reinterpret_cast<const uint8_t*>(aad);
 
   char nonce[kSaltLen + kIVLen];
@@ -141,10 +191,11 @@ absl::Status IpSecDecryptor::Decrypt(absl::string_view input, uint8_t* output,
   if (EVP_AEAD_CTX_open(aead_ctx_.get(), output, &dst_len, ciphertext_length,
                         reinterpret_cast<const uint8_t*>(&nonce), sizeof(nonce),
                         input_data, plaintext_length, aad_head,
-                        sizeof(spi) + sizeof(sequence_number)) != 1) {
+                        aad_len) != 1) {
     LOG(ERROR) << "EVP_AEAD_CTX_open failed";
     return crypto::GetOpenSSLError("EVP_AEAD_CTX_open failed");
   }
+  PPN_RETURN_IF_ERROR(replay_window_->Update(sequence_number));
 
   if (dst_len < 2) {
     LOG(ERROR) << "Unexpected decrypted packet data with size: " << dst_len;
@@ -212,6 +263,31 @@ absl::Status IpSecDecryptor::Decrypt(absl::string_view input, uint8_t* output,
   return absl::OkStatus();
 }
 
+absl::Status IpSecDecryptor::DecryptInPlace(Packet* packet) {
+  if (!packet->is_writable()) {
+    return absl::FailedPreconditionError("Packet is not writable");
+  }
+  auto input = packet->data();
+  if (input.size() <= sizeof(EspHeader)) {
+    LOG(ERROR) << "Packet size is too small: " << input.size();
+    return absl::InvalidArgumentError("Packet size is too small");
+  }
+
+  // The plaintext is never longer than the ciphertext, so it can be written
+  // over it.
+  auto* payload =
+      reinterpret_cast<uint8_t*>(packet->mutable_data() + sizeof(EspHeader));
+  size_t payload_size;
+  IPProtocol protocol;
+  PPN_RETURN_IF_ERROR(Decrypt(input, payload, input.size() - sizeof(EspHeader),
+                              &payload_size, &protocol));
+
+  packet->TrimFront(sizeof(EspHeader));
+  packet->TrimBack(packet->data().size() - payload_size);
+  packet->set_protocol(protocol);
+  return absl::OkStatus();
+}
+
 absl::StatusOr<Packet> Decryptor::Process(const Packet& packet) {
   auto output = packet_pool_.Borrow();
   if (!output) {
@@ -224,8 +300,66 @@ absl::StatusOr<Packet> Decryptor::Process(const Packet& packet) {
       decryptor_->Decrypt(packet.data(), output.get(), &ip_protocol));
 
   // The pool won't be destroyed until all packets have been returned, so it's
-  // safe to capture a pointer to it here.
-  return Packet(output->data(), output->data_size(), ip_protocol, [output] {});
+  // safe to hand a pointer to it to the cleanup here.
+  IpSecPacket* decrypted = output.get();
+  return Packet(decrypted->data(), decrypted->data_size(), ip_protocol,
+                output.ReleaseAsOwner());
+}
+
+std::vector<absl::StatusOr<Packet>> Decryptor::ProcessBatch(
+    absl::Span<const Packet> packets) {
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(packets.size());
+  if (packets.empty()) {
+    return results;
+  }
+
+  // Borrow all of the output packets at once. If the pool can't satisfy the
+  // whole batch, the packets at the end of the batch are dropped.
+  auto outputs = packet_pool_.BorrowBatch(packets.size());
+  if (outputs.size() < packets.size()) {
+    LOG(INFO) << "Dropping " << packets.size() - outputs.size()
+              << " downlink packets.";
+  }
+
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    auto& output = outputs[i];
+    IPProtocol ip_protocol;
+    auto status =
+        decryptor_->Decrypt(packets[i].data(), output.get(), &ip_protocol);
+    if (!status.ok()) {
+      results.push_back(status);
+      continue;
+    }
+    IpSecPacket* decrypted = output.get();
+    results.push_back(Packet(decrypted->data(), decrypted->data_size(),
+                             ip_protocol, output.ReleaseAsOwner()));
+  }
+  for (size_t i = outputs.size(); i < packets.size(); ++i) {
+    results.push_back(absl::ResourceExhaustedError("packet pool is exhausted"));
+  }
+  return results;
+}
+
+std::vector<absl::StatusOr<Packet>> Decryptor::ProcessBatchInPlace(
+    std::vector<Packet> packets) {
+  for (const auto& packet : packets) {
+    if (!packet.is_writable()) {
+      return ProcessBatch(packets);
+    }
+  }
+
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(packets.size());
+  for (auto& packet : packets) {
+    auto status = decryptor_->DecryptInPlace(&packet);
+    if (!status.ok()) {
+      results.push_back(status);
+      continue;
+    }
+    results.push_back(std::move(packet));
+  }
+  return results;
 }
 
 /* static */ absl::StatusOr<std::unique_ptr<Decryptor>> Decryptor::Create(
@@ -234,6 +368,14 @@ absl::StatusOr<Packet> Decryptor::Process(const Packet& packet) {
   return std::make_unique<Decryptor>(std::move(decryptor));
 }
 
+/* static */ absl::StatusOr<std::unique_ptr<Decryptor>> Decryptor::Create(
+    const TransformParams& params,
+    std::shared_ptr<ReplayWindow> replay_window) {
+  PPN_ASSIGN_OR_RETURN(
+      auto decryptor, IpSecDecryptor::Create(params, std::move(replay_window)));
+  return std::make_unique<Decryptor>(std::move(decryptor));
+}
+
 }  // namespace ipsec
 }  // namespace datapath
 }  // namespace krypton
@@ -21,15 +21,18 @@
 #include <optional>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/types/span.h"
 #include "third_party/openssl/aead.h"
 
 namespace privacy {
@@ -37,14 +40,43 @@ namespace krypton {
 namespace datapath {
 namespace ipsec {
 
+// Decrypts ESP packets for a single SA.
+//
+// Packets that the anti-replay window has already seen, or that are too far
+// behind it, are rejected before the AEAD is opened: duplicates with
+// AlreadyExistsError, and old packets with OutOfRangeError. The window only
+// advances once a packet has been authenticated.
 class IpSecDecryptor {
  public:
-  IpSecDecryptor(EVP_AEAD_CTX* aead_ctx, absl::string_view salt)
-      : aead_ctx_(aead_ctx), salt_(salt) {}
+  // With `extended_sequence_numbers`, the high 32 bits of each packet's
+  // sequence number, which aren't sent, are inferred from the highest sequence
+  // number authenticated so far.
+  IpSecDecryptor(EVP_AEAD_CTX* aead_ctx, absl::string_view salt,
+                 bool extended_sequence_numbers = false)
+      : IpSecDecryptor(aead_ctx, salt, extended_sequence_numbers,
+                       std::make_shared<ReplayWindow>()) {}
+
+  // Creates a decryptor that checks packets against `replay_window`, which
+  // may be shared with other decryptors for the same SA.
+  IpSecDecryptor(EVP_AEAD_CTX* aead_ctx, absl::string_view salt,
+                 bool extended_sequence_numbers,
+                 std::shared_ptr<ReplayWindow> replay_window)
+      : aead_ctx_(aead_ctx),
+        salt_(salt),
+        extended_sequence_numbers_(extended_sequence_numbers),
+        replay_window_(std::move(replay_window)) {}
 
   static absl::StatusOr<std::unique_ptr<IpSecDecryptor>> Create(
       const TransformParams& params);
 
+  // Like Create, but shares the anti-replay window with the other decryptors
+  // created with the same window, so a packet that any of them accepted is
+  // rejected as a replay by all of them. Each one has its own AEAD context,
+  // so they can decrypt on different threads without contending.
+  static absl::StatusOr<std::unique_ptr<IpSecDecryptor>> Create(
+      const TransformParams& params,
+      std::shared_ptr<ReplayWindow> replay_window);
+
   absl::Status Decrypt(absl::string_view input, IpSecPacket* output,
                        IPProtocol* protocol);
 
@@ -52,9 +84,28 @@ class IpSecDecryptor {
                        size_t max_output_size, size_t* actual_output_size,
                        IPProtocol* output_protocol);
 
+  // Decrypts a writable packet where it is, then shrinks its data window to
+  // just the decrypted payload and sets its protocol, so the payload is never
+  // copied.
+  absl::Status DecryptInPlace(Packet* packet);
+
+  // Returns the highest sequence number authenticated so far.
+  uint64_t highest_sequence_number() const {
+    return replay_window_->highest();
+  }
+
  private:
+  // Returns the full sequence number of a packet whose header carries
+  // `sequence_number_low`. Without extended sequence numbers, that's all there
+  // is. Otherwise, the high bits are chosen so that the result is within half
+  // of the 32-bit space of the highest sequence number authenticated so far,
+  // as in RFC 4303 Appendix A2 with a window of 2^31.
+  uint64_t InferSequenceNumber(uint32_t sequence_number_low) const;
+
   bssl::UniquePtr<EVP_AEAD_CTX> aead_ctx_;
   std::optional<std::string> salt_;
+  const bool extended_sequence_numbers_;
+  std::shared_ptr<ReplayWindow> replay_window_;
 };
 
 class Decryptor : public CryptorInterface {
@@ -66,8 +117,20 @@ class Decryptor : public CryptorInterface {
   static absl::StatusOr<std::unique_ptr<Decryptor>> Create(
       const TransformParams& params);
 
+  // Creates a decryptor with its own packet pool and AEAD context that shares
+  // `replay_window` with the other decryptors for the same SA.
+  static absl::StatusOr<std::unique_ptr<Decryptor>> Create(
+      const TransformParams& params,
+      std::shared_ptr<ReplayWindow> replay_window);
+
   absl::StatusOr<Packet> Process(const Packet& packet) override;
 
+  std::vector<absl::StatusOr<Packet>> ProcessBatch(
+      absl::Span<const Packet> packets) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatchInPlace(
+      std::vector<Packet> packets) override;
+
  private:
   std::unique_ptr<IpSecDecryptor> decryptor_;
   IpSecPacketPool packet_pool_;
@@ -16,7 +16,6 @@
 
 #include <cstddef>
 #include <cstring>
-#include <limits>
 
 #include "privacy/net/krypton/datapath/ipsec/ipsec.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
@@ -38,14 +37,19 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/logging.h"
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
 #include "privacy/net/krypton/crypto/openssl_error.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
 #include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/container/inlined_vector.h"
+#include "third_party/absl/functional/function_ref.h"
 #include "third_party/absl/status/status.h"
+#include "third_party/absl/types/span.h"
 
 #undef htobe32
 
@@ -60,8 +64,26 @@ namespace krypton {
 namespace datapath {
 namespace ipsec {
 
+// Batches up to this size keep their IVs on the stack.
+constexpr size_t kInlineBatchSize = 64;
+
+static_assert(sizeof(EspHeader) <= kPacketHeadroom,
+              "Packets need room for the ESP header");
+static_assert(kEspTrailerMaxLen <= kPacketTailroom,
+              "Packets need room for the ESP trailer");
+
 /* static */ absl::StatusOr<std::unique_ptr<IpSecEncryptor>>
 IpSecEncryptor::Create(uint32_t spi, const TransformParams& params) {
+  return Create(spi, params,
+                std::make_shared<SequenceNumberAllocator>(
+                    params.ipsec().extended_sequence_numbers()));
+}
+
+/* static */ absl::StatusOr<std::unique_ptr<IpSecEncryptor>>
+IpSecEncryptor::Create(
+    uint32_t spi, const TransformParams& params,
+    std::shared_ptr<SequenceNumberAllocator> sequence_numbers,
+    IvMode iv_mode) {
   if (!params.has_ipsec()) {
     LOG(ERROR) << "TransformParams.IpSecTransformParams is null";
     return absl::InvalidArgumentError(
@@ -69,6 +91,20 @@ IpSecEncryptor::Create(uint32_t spi, const TransformParams& params) {
   }
   const auto& ipsec_param = params.ipsec();
 
+  if (ipsec_param.extended_sequence_numbers() !=
+      sequence_numbers->extended_sequence_numbers()) {
+    LOG(ERROR) << "Sequence number allocator doesn't match "
+                  "TransformParams.IpSecTransformParams";
+    return absl::InvalidArgumentError(
+        "Sequence number allocator doesn't match "
+        "TransformParams.IpSecTransformParams");
+  }
+  // Random IVs are only safe for about 2^32 packets, which an SA with extended
+  // sequence numbers can outlive.
+  if (ipsec_param.extended_sequence_numbers()) {
+    iv_mode = IvMode::kSequenceNumber;
+  }
+
   if (!ipsec_param.has_uplink_key()) {
     LOG(ERROR) << "TransformParams.IpSecTransformParams has no uplink_key";
     return absl::InvalidArgumentError(
@@ -82,7 +118,8 @@ IpSecEncryptor::Create(uint32_t spi, const TransformParams& params) {
   const auto key =
       reinterpret_cast<const uint8_t*>(ipsec_param.uplink_key().data());
   const auto key_size = ipsec_param.uplink_key().size();
-  if (key_size != kKeyLen) {
+  const auto cipher_suite = ipsec_param.cipher_suite();
+  if (key_size != crypto::IpSecCipherSuiteKeyLength(cipher_suite)) {
     LOG(ERROR) << "TransformParams.IpSecTransformParams has a uplink_key "
                   "with wrong size";
     return absl::InvalidArgumentError(
@@ -91,7 +128,8 @@ IpSecEncryptor::Create(uint32_t spi, const TransformParams& params) {
   }
 
   auto aead_ctx =
-      EVP_AEAD_CTX_new(EVP_aead_aes_256_gcm(), key, key_size, kEspTagLen);
+      EVP_AEAD_CTX_new(crypto::IpSecCipherSuiteAead(cipher_suite), key,
+                       key_size, kEspTagLen);
   if (aead_ctx == nullptr) {
     LOG(ERROR) << "EVP_AEAD_CTX_new failure: keysize=" << key_size;
     return crypto::GetOpenSSLError("EVP_AEAD_CTX_new failure");
@@ -105,32 +143,166 @@ IpSecEncryptor::Create(uint32_t spi, const TransformParams& params) {
   }
   std::string salt = ipsec_param.uplink_salt();
 
-  return std::make_unique<IpSecEncryptor>(aead_ctx, salt, spi);
+  return std::make_unique<IpSecEncryptor>(
+      aead_ctx, salt, spi, std::move(sequence_numbers), iv_mode);
 }
 
 absl::Status IpSecEncryptor::Encrypt(absl::string_view input,
                                      IPProtocol protocol, IpSecPacket* output) {
-  const auto output_data = reinterpret_cast<uint8_t*>(output->data());
-  const auto input_data = reinterpret_cast<const uint8_t*>(input.begin());
-
-  // Assign nonce for encryption.
-  if (sequence_number_ == std::numeric_limits<uint32_t>::max()) {
-    // Even though we use random IVs, after 2^32 invocations the probability of
-    // nonce reuse becomes concerning, so we should fail safe.
-    // copybara:strip_begin(internal link)
-    // See http://yaqs/2961540066972794880#a1 for ise-crypto recommendation.
-    // copybara:strip_end
-    return absl::InternalError("Encryptor expired before rekey occurred");
-  }
-  auto initialization_vector = crypto::CreateSecureRandomString(kIVLen);
+  PPN_ASSIGN_OR_RETURN(uint64_t sequence_number, sequence_numbers_->Reserve(1));
+
   char nonce[kSaltLen + kIVLen];
+  memcpy(nonce, salt_->c_str(), kSaltLen);
+  GenerateIvs(sequence_number, 1, nonce + kSaltLen);
+
+  return EncryptWithSequenceNumber(input, protocol, sequence_number, nonce,
+                                   output);
+}
+
+absl::Status IpSecEncryptor::EncryptBatch(
+    absl::Span<const Packet> inputs, absl::Span<IpSecPacket* const> outputs,
+    absl::Span<absl::Status> statuses) {
+  if (inputs.empty()) {
+    return absl::OkStatus();
+  }
+  PPN_ASSIGN_OR_RETURN(uint64_t first_sequence_number,
+                       ReserveSequenceNumbers(inputs.size()));
+  return EncryptBatch(inputs, outputs, first_sequence_number, statuses);
+}
+
+absl::Status IpSecEncryptor::EncryptBatch(
+    absl::Span<const Packet> inputs, absl::Span<IpSecPacket* const> outputs,
+    uint64_t first_sequence_number, absl::Span<absl::Status> statuses) {
+  if (inputs.size() != outputs.size() || inputs.size() != statuses.size()) {
+    return absl::InvalidArgumentError(
+        "EncryptBatch called with mismatched batch sizes");
+  }
+  return ForEachInBatch(
+      inputs.size(), first_sequence_number,
+      [inputs, outputs, this](size_t i, uint64_t sequence_number,
+                              const char* nonce) {
+        return EncryptWithSequenceNumber(inputs[i].data(), inputs[i].protocol(),
+                                         sequence_number, nonce, outputs[i]);
+      },
+      statuses);
+}
+
+absl::Status IpSecEncryptor::EncryptBatchInPlace(
+    absl::Span<Packet> packets, absl::Span<absl::Status> statuses) {
+  if (packets.empty()) {
+    return absl::OkStatus();
+  }
+  PPN_ASSIGN_OR_RETURN(uint64_t first_sequence_number,
+                       ReserveSequenceNumbers(packets.size()));
+  return EncryptBatchInPlace(packets, first_sequence_number, statuses);
+}
+
+absl::Status IpSecEncryptor::EncryptBatchInPlace(
+    absl::Span<Packet> packets, uint64_t first_sequence_number,
+    absl::Span<absl::Status> statuses) {
+  if (packets.size() != statuses.size()) {
+    return absl::InvalidArgumentError(
+        "EncryptBatchInPlace called with mismatched batch sizes");
+  }
+  return ForEachInBatch(
+      packets.size(), first_sequence_number,
+      [packets, this](size_t i, uint64_t sequence_number,
+                      const char* nonce) -> absl::Status {
+        Packet& packet = packets[i];
+        if (packet.headroom() < sizeof(EspHeader)) {
+          return absl::FailedPreconditionError(
+              "Packet has no headroom for the ESP header");
+        }
+        auto* payload = reinterpret_cast<uint8_t*>(packet.mutable_data());
+        const size_t input_size = packet.data().size();
+        EspHeader header;
+        size_t sealed_size;
+        PPN_RETURN_IF_ERROR(SealInPlace(
+            payload, input_size, input_size + packet.tailroom(),
+            packet.protocol(), sequence_number, nonce, &header, &sealed_size));
+
+        // Neither of these can fail, since the sizes were checked above.
+        packet.Append(sealed_size - input_size);
+        packet.Prepend(sizeof(EspHeader));
+        memcpy(packet.mutable_data(), &header, sizeof(header));
+        return absl::OkStatus();
+      },
+      statuses);
+}
+
+absl::Status IpSecEncryptor::ForEachInBatch(
+    size_t count, uint64_t first_sequence_number,
+    absl::FunctionRef<absl::Status(size_t, uint64_t, const char*)> encrypt,
+    absl::Span<absl::Status> statuses) {
+  if (count == 0) {
+    return absl::OkStatus();
+  }
+  absl::InlinedVector<char, kIVLen * kInlineBatchSize> initialization_vectors(
+      kIVLen * count);
+  GenerateIvs(first_sequence_number, count, initialization_vectors.data());
+
+  // The salt is the same for every packet, so only the IV part of the nonce
+  // needs to be rewritten for each packet.
+  char nonce[kSaltLen + kIVLen];
+  memcpy(nonce, salt_->c_str(), kSaltLen);
+
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(nonce + kSaltLen, initialization_vectors.data() + i * kIVLen,
+           kIVLen);
+    statuses[i] = encrypt(i, first_sequence_number + i, nonce);
+  }
+  return absl::OkStatus();
+}
+
+void IpSecEncryptor::GenerateIvs(uint64_t first_sequence_number, size_t count,
+                                 char* ivs) {
+  if (iv_mode_ == IvMode::kRandom) {
+    random_.Generate(ivs, kIVLen * count);
+    return;
+  }
+  static_assert(kIVLen == sizeof(uint64_t), "IVs must be 64 bits");
+  const uint64_t mask = sequence_numbers_->iv_mask();
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t iv = mask ^ (first_sequence_number + static_cast<uint64_t>(i));
+    char* out = ivs + i * kIVLen;
+    for (size_t j = kIVLen; j > 0; --j) {
+      out[j - 1] = static_cast<char>(iv & 0xff);
+      iv >>= 8;
+    }
+  }
+}
+
+absl::Status IpSecEncryptor::EncryptWithSequenceNumber(
+    absl::string_view input, IPProtocol protocol, uint64_t sequence_number,
+    const char* nonce, IpSecPacket* output) {
+  if (input.size() > output->max_data_size()) {
+    LOG(ERROR) << "Input packet is too large to be encrypted";
+    return absl::InternalError("Input packet is too large to be encrypted");
+  }
+  const auto output_data = reinterpret_cast<uint8_t*>(output->data());
+  memcpy(output_data, input.data(), input.size());
 
+  size_t dst_len;
+  PPN_RETURN_IF_ERROR(SealInPlace(output_data, input.size(),
+                                  output->max_data_size(), protocol,
+                                  sequence_number, nonce, output->header(),
+                                  &dst_len));
+  output->resize_data(dst_len);
+
+  return absl::OkStatus();
+}
+
+absl::Status IpSecEncryptor::SealInPlace(uint8_t* data, size_t input_size,
+                                         size_t max_size, IPProtocol protocol,
+                                         uint64_t sequence_number,
+                                         const char* nonce, EspHeader* header,
+                                         size_t* sealed_size) {
   // If no protocol was specified, try to infer it from the packet data.
   if (protocol == IPProtocol::kUnknown) {
-    if (input.empty()) {
+    if (input_size == 0) {
       return absl::InternalError("Empty packet to encrypt");
     }
-    uint8_t version = static_cast<uint8_t>(*input.data()) >> 4;
+    uint8_t version = *data >> 4;
     switch (version) {
       case 4:
         protocol = IPProtocol::kIPv4;
@@ -177,20 +349,18 @@ absl::Status IpSecEncryptor::Encrypt(absl::string_view input,
   // Expects an IP (tunnel mode) or L4 (transport mode) packet, already parsed.
   //
   // 1 for pad length and 1 for the next header.
-  const int plaintext_len = input.size() + 2;
+  const int plaintext_len = input_size + 2;
 
   const int pad_len =
       (kAESBlockSize - (plaintext_len % kAESBlockSize)) % kAESBlockSize;
 
-  if (plaintext_len + pad_len > output->max_data_size()) {
+  if (plaintext_len + pad_len > max_size) {
     LOG(ERROR) << "Input packet is too large to be encrypted";
     return absl::InternalError("Input packet is too large to be encrypted");
   }
 
-  memcpy(output_data, input_data, input.size());
-
   // Add monotonically increasing padding (RFC 4303 section 2.4)
-  auto* pad = output_data + input.size();
+  auto* pad = data + input_size;
   for (int i = 1; i <= pad_len; ++i) {
     *pad++ = i;
   }
@@ -199,40 +369,61 @@ absl::Status IpSecEncryptor::Encrypt(absl::string_view input,
   padlen_nexthdr[0] = pad_len;
   padlen_nexthdr[1] = next_header;
 
-  // Encrypted packet data size.
-  CHECK_EQ(initialization_vector.size(), kIVLen);
-  memcpy(nonce, salt_->c_str(), kSaltLen);
-  memcpy(nonce + kSaltLen, initialization_vector.c_str(), kIVLen);
-
-  uint32_t sequence_number = htobe32(sequence_number_++);
+  // Only the low 32 bits of the sequence number are sent. With extended
+  // sequence numbers, the AAD also covers the high 32 bits (RFC 4106 Section
+  // 5), which the receiver infers.
+  uint32_t be_sequence_number = htobe32(static_cast<uint32_t>(sequence_number));
   uint32_t spi = htobe32(spi_);
-  char aad[sizeof(spi) + sizeof(sequence_number)];
+  char aad[kEspMaxAadLen];
+  size_t aad_len = 0;
   memcpy(aad, &spi, sizeof(spi));
-  memcpy(aad + sizeof(spi), &sequence_number, sizeof(sequence_number));
+  aad_len += sizeof(spi);
+  if (sequence_numbers_->extended_sequence_numbers()) {
+    uint32_t be_sequence_number_high =
+        htobe32(static_cast<uint32_t>(sequence_number >> 32));
+    memcpy(aad + aad_len, &be_sequence_number_high,
+           sizeof(be_sequence_number_high));
+    aad_len += sizeof(be_sequence_number_high);
+  }
+  memcpy(aad + aad_len, &be_sequence_number, sizeof(be_sequence_number));
+  aad_len += sizeof(be_sequence_number);
   const auto aad_head = reinterpret_cast<const uint8_t*>(aad);
 
   // Encrypt the data stored in the `data_head`, then write the result to the
   // `packet_head`.
   size_t dst_len;
-  if (EVP_AEAD_CTX_seal(aead_ctx_.get(), output_data, &dst_len,
-                        output->max_data_size(),
-                        reinterpret_cast<const uint8_t*>(&nonce), sizeof(nonce),
-                        output_data, plaintext_len + pad_len, aad_head,
-                        sizeof(spi) + sizeof(sequence_number)) != 1) {
+  if (EVP_AEAD_CTX_seal(aead_ctx_.get(), data, &dst_len, max_size,
+                        reinterpret_cast<const uint8_t*>(nonce),
+                        kSaltLen + kIVLen, data, plaintext_len + pad_len,
+                        aad_head, aad_len) != 1) {
     LOG(ERROR) << "EVP_AEAD_CEVP_AEAD_CTX_seal failed";
     return crypto::GetOpenSSLError("EVP_AEAD_CTX_seal failure");
   }
-  output->header()->client_spi = spi;
-  output->header()->sequence_number = sequence_number;
-  memcpy(output->header()->initialization_vector, initialization_vector.c_str(),
-         kIVLen);
+  header->client_spi = spi;
+  header->sequence_number = be_sequence_number;
+  memcpy(header->initialization_vector, nonce + kSaltLen, kIVLen);
 
   CHECK_GE(dst_len, 0);
-  output->resize_data(dst_len);
+  *sealed_size = dst_len;
 
   return absl::OkStatus();
 }
 
+namespace {
+
+// Returns `status` as the result for every packet in a batch of `count`.
+std::vector<absl::StatusOr<Packet>> FailBatch(size_t count,
+                                              const absl::Status& status) {
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    results.push_back(status);
+  }
+  return results;
+}
+
+}  // namespace
+
 absl::StatusOr<Packet> Encryptor::Process(const Packet& packet) {
   auto output = packet_pool_.Borrow();
   if (!output) {
@@ -244,9 +435,113 @@ absl::StatusOr<Packet> Encryptor::Process(const Packet& packet) {
       encryptor_->Encrypt(packet.data(), packet.protocol(), output.get()));
 
   // The pool won't be destroyed until all packets have been returned, so it's
-  // safe to capture a pointer to it here.
-  return Packet(output->buffer(), output->buffer_size(), packet.protocol(),
-                [output] {});
+  // safe to hand a pointer to it to the cleanup here.
+  IpSecPacket* encrypted = output.get();
+  return Packet(encrypted->buffer(), encrypted->buffer_size(),
+                packet.protocol(), output.ReleaseAsOwner());
+}
+
+std::vector<absl::StatusOr<Packet>> Encryptor::ProcessBatch(
+    absl::Span<const Packet> packets) {
+  auto first_sequence_number = ReserveBatch(packets.size());
+  if (!first_sequence_number.ok()) {
+    return FailBatch(packets.size(), first_sequence_number.status());
+  }
+  return ProcessReservedBatch(packets, *first_sequence_number);
+}
+
+std::vector<absl::StatusOr<Packet>> Encryptor::ProcessReservedBatch(
+    absl::Span<const Packet> packets, uint64_t first_sequence_number) {
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(packets.size());
+  if (packets.empty()) {
+    return results;
+  }
+
+  // Borrow all of the output packets at once. If the pool can't satisfy the
+  // whole batch, the packets at the end of the batch are dropped.
+  auto outputs = packet_pool_.BorrowBatch(packets.size());
+  if (outputs.size() < packets.size()) {
+    LOG(INFO) << "Dropping " << packets.size() - outputs.size()
+              << " uplink packets.";
+  }
+  auto encrypted = packets.subspan(0, outputs.size());
+
+  std::vector<IpSecPacket*> output_ptrs;
+  output_ptrs.reserve(outputs.size());
+  for (const auto& output : outputs) {
+    output_ptrs.push_back(output.get());
+  }
+  std::vector<absl::Status> statuses(encrypted.size());
+  auto batch_status = encryptor_->EncryptBatch(
+      encrypted, absl::MakeSpan(output_ptrs), first_sequence_number,
+      absl::MakeSpan(statuses));
+
+  for (size_t i = 0; i < encrypted.size(); ++i) {
+    if (!batch_status.ok()) {
+      results.push_back(batch_status);
+      continue;
+    }
+    if (!statuses[i].ok()) {
+      results.push_back(statuses[i]);
+      continue;
+    }
+    IpSecPacket* output = output_ptrs[i];
+    results.push_back(Packet(output->buffer(), output->buffer_size(),
+                             encrypted[i].protocol(),
+                             outputs[i].ReleaseAsOwner()));
+  }
+  for (size_t i = encrypted.size(); i < packets.size(); ++i) {
+    results.push_back(absl::ResourceExhaustedError("packet pool is exhausted"));
+  }
+  return results;
+}
+
+std::vector<absl::StatusOr<Packet>> Encryptor::ProcessBatchInPlace(
+    std::vector<Packet> packets) {
+  auto first_sequence_number = ReserveBatch(packets.size());
+  if (!first_sequence_number.ok()) {
+    return FailBatch(packets.size(), first_sequence_number.status());
+  }
+  return ProcessReservedBatchInPlace(std::move(packets),
+                                     *first_sequence_number);
+}
+
+absl::StatusOr<uint64_t> Encryptor::ReserveBatch(size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  return encryptor_->ReserveSequenceNumbers(count);
+}
+
+std::vector<absl::StatusOr<Packet>> Encryptor::ProcessReservedBatchInPlace(
+    std::vector<Packet> packets, uint64_t reservation) {
+  const uint64_t first_sequence_number = reservation;
+  // Pipes either reserve room around every packet they read or none, so if
+  // any packet is missing room, just copy the whole batch.
+  for (const auto& packet : packets) {
+    if (packet.headroom() < sizeof(EspHeader) ||
+        packet.tailroom() < kEspTrailerMaxLen) {
+      return ProcessReservedBatch(packets, first_sequence_number);
+    }
+  }
+
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(packets.size());
+  std::vector<absl::Status> statuses(packets.size());
+  auto batch_status = encryptor_->EncryptBatchInPlace(
+      absl::MakeSpan(packets), first_sequence_number,
+      absl::MakeSpan(statuses));
+  for (size_t i = 0; i < packets.size(); ++i) {
+    if (!batch_status.ok()) {
+      results.push_back(batch_status);
+    } else if (!statuses[i].ok()) {
+      results.push_back(statuses[i]);
+    } else {
+      results.push_back(std::move(packets[i]));
+    }
+  }
+  return results;
 }
 
 /* static */ absl::StatusOr<std::unique_ptr<Encryptor>> Encryptor::Create(
@@ -255,6 +550,16 @@ absl::StatusOr<Packet> Encryptor::Process(const Packet& packet) {
   return std::make_unique<Encryptor>(std::move(encryptor));
 }
 
+/* static */ absl::StatusOr<std::unique_ptr<Encryptor>> Encryptor::Create(
+    uint32_t spi, const TransformParams& params,
+    std::shared_ptr<SequenceNumberAllocator> sequence_numbers,
+    IvMode iv_mode) {
+  PPN_ASSIGN_OR_RETURN(auto encryptor,
+                       IpSecEncryptor::Create(
+                           spi, params, std::move(sequence_numbers), iv_mode));
+  return std::make_unique<Encryptor>(std::move(encryptor));
+}
+
 }  // namespace ipsec
 }  // namespace datapath
 }  // namespace krypton
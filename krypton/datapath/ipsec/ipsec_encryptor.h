@@ -15,21 +15,27 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_IPSEC_ENCRYPTOR_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_IPSEC_ENCRYPTOR_H_
 
-#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <optional>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
 #include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
+#include "third_party/absl/functional/function_ref.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/types/span.h"
 #include "third_party/openssl/aead.h"
 
 namespace privacy {
@@ -37,22 +43,123 @@ namespace krypton {
 namespace datapath {
 namespace ipsec {
 
+// How the explicit IV of each ESP packet is chosen.
+enum class IvMode {
+  // Random bytes from a buffered CSPRNG.
+  kRandom,
+  // The sequence number, masked with a random value that is fixed for the SA,
+  // as allowed by RFC 4106 Section 3.1. This is unique for as long as the
+  // sequence numbers are, and spends no randomness per packet.
+  kSequenceNumber,
+};
+
 class IpSecEncryptor {
  public:
   IpSecEncryptor(EVP_AEAD_CTX* aead_ctx, absl::string_view salt, uint32_t spi)
-      : aead_ctx_(aead_ctx), salt_(salt), spi_(spi), sequence_number_(0) {}
+      : IpSecEncryptor(aead_ctx, salt, spi,
+                       std::make_shared<SequenceNumberAllocator>(),
+                       IvMode::kRandom) {}
+
+  // Creates an encryptor that takes its sequence numbers from
+  // `sequence_numbers`, which may be shared with other encryptors for the same
+  // SA.
+  IpSecEncryptor(EVP_AEAD_CTX* aead_ctx, absl::string_view salt, uint32_t spi,
+                 std::shared_ptr<SequenceNumberAllocator> sequence_numbers,
+                 IvMode iv_mode)
+      : aead_ctx_(aead_ctx),
+        salt_(salt),
+        spi_(spi),
+        sequence_numbers_(std::move(sequence_numbers)),
+        iv_mode_(iv_mode) {}
 
   static absl::StatusOr<std::unique_ptr<IpSecEncryptor>> Create(
       uint32_t spi, const TransformParams& params);
 
+  // Like Create, but shares the sequence number space with the other
+  // encryptors created from the same allocator. Each one has its own AEAD
+  // context, so they can encrypt on different threads without contending.
+  // The allocator must use extended sequence numbers exactly when `params`
+  // asks for them, and if it does, IVs are always derived from the sequence
+  // number.
+  static absl::StatusOr<std::unique_ptr<IpSecEncryptor>> Create(
+      uint32_t spi, const TransformParams& params,
+      std::shared_ptr<SequenceNumberAllocator> sequence_numbers,
+      IvMode iv_mode = IvMode::kRandom);
+
   absl::Status Encrypt(absl::string_view input, IPProtocol protocol,
                        IpSecPacket* output);
 
+  // Encrypts a batch of packets into `outputs`, which must be the same length
+  // as `inputs`. Sequence numbers for the whole batch are reserved at once and
+  // the IVs are generated in a single call, so the per-packet work is mostly
+  // the AEAD seal itself. The result for each packet is written to the
+  // corresponding entry of `statuses`. Returns an error without encrypting
+  // anything if the batch as a whole cannot be encrypted.
+  absl::Status EncryptBatch(absl::Span<const Packet> inputs,
+                            absl::Span<IpSecPacket* const> outputs,
+                            absl::Span<absl::Status> statuses);
+
+  // Like EncryptBatch, but encrypts each packet where it is, growing it into
+  // its headroom for the ESP header and into its tailroom for the trailer, so
+  // the packet data is never copied. Every packet must have at least
+  // sizeof(EspHeader) bytes of headroom and kEspTrailerMaxLen bytes of
+  // tailroom. The data window of a packet that fails is left where it was.
+  absl::Status EncryptBatchInPlace(absl::Span<Packet> packets,
+                                   absl::Span<absl::Status> statuses);
+
+  // Reserves `count` consecutive sequence numbers and returns the first one.
+  absl::StatusOr<uint64_t> ReserveSequenceNumbers(size_t count) {
+    return sequence_numbers_->Reserve(count);
+  }
+
+  // Like EncryptBatch and EncryptBatchInPlace, but number the packets from
+  // `first_sequence_number`, which must have been reserved with
+  // ReserveSequenceNumbers for a batch of the same size. This lets batches be
+  // sealed on other threads while still being numbered in the order they were
+  // read.
+  absl::Status EncryptBatch(absl::Span<const Packet> inputs,
+                            absl::Span<IpSecPacket* const> outputs,
+                            uint64_t first_sequence_number,
+                            absl::Span<absl::Status> statuses);
+  absl::Status EncryptBatchInPlace(absl::Span<Packet> packets,
+                                   uint64_t first_sequence_number,
+                                   absl::Span<absl::Status> statuses);
+
  private:
+  // Generates IVs for a batch of `count` packets numbered from
+  // `first_sequence_number`, then calls `encrypt` with the index, sequence
+  // number and nonce for each one, storing the results in `statuses`.
+  absl::Status ForEachInBatch(
+      size_t count, uint64_t first_sequence_number,
+      absl::FunctionRef<absl::Status(size_t, uint64_t, const char*)> encrypt,
+      absl::Span<absl::Status> statuses);
+
+  // Encrypts a single packet with the given sequence number. `nonce` must
+  // already contain the salt followed by the IV for this packet.
+  absl::Status EncryptWithSequenceNumber(absl::string_view input,
+                                         IPProtocol protocol,
+                                         uint64_t sequence_number,
+                                         const char* nonce,
+                                         IpSecPacket* output);
+
+  // Writes the IVs for `count` packets numbered from `first_sequence_number`
+  // to `ivs`, kIVLen bytes each.
+  void GenerateIvs(uint64_t first_sequence_number, size_t count, char* ivs);
+
+  // Adds the ESP trailer after the `input_size` bytes of plaintext at `data`
+  // and seals them in place, writing at most `max_size` bytes. Fills in
+  // `header` and sets `sealed_size` to the size of the ciphertext and ICV.
+  absl::Status SealInPlace(uint8_t* data, size_t input_size, size_t max_size,
+                           IPProtocol protocol, uint64_t sequence_number,
+                           const char* nonce, EspHeader* header,
+                           size_t* sealed_size);
+
   bssl::UniquePtr<EVP_AEAD_CTX> aead_ctx_;
   std::optional<std::string> salt_;
   uint32_t spi_;
-  std::atomic_uint32_t sequence_number_;
+  std::shared_ptr<SequenceNumberAllocator> sequence_numbers_;
+  const IvMode iv_mode_;
+  crypto::BufferedSecureRandom random_;
 };
 
 class Encryptor : public CryptorInterface {
@@ -64,9 +171,33 @@ class Encryptor : public CryptorInterface {
   static absl::StatusOr<std::unique_ptr<Encryptor>> Create(
       uint32_t spi, const TransformParams& params);
 
+  // Creates an encryptor with its own packet pool and AEAD context that
+  // shares its sequence numbers with the others created from
+  // `sequence_numbers`.
+  static absl::StatusOr<std::unique_ptr<Encryptor>> Create(
+      uint32_t spi, const TransformParams& params,
+      std::shared_ptr<SequenceNumberAllocator> sequence_numbers,
+      IvMode iv_mode = IvMode::kRandom);
+
   absl::StatusOr<Packet> Process(const Packet& packet) override;
 
+  std::vector<absl::StatusOr<Packet>> ProcessBatch(
+      absl::Span<const Packet> packets) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatchInPlace(
+      std::vector<Packet> packets) override;
+
+  // Reserves ESP sequence numbers for the batch.
+  absl::StatusOr<uint64_t> ReserveBatch(size_t count) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessReservedBatchInPlace(
+      std::vector<Packet> packets, uint64_t reservation) override;
+
  private:
+  // Encrypts copies of `packets`, numbered from `first_sequence_number`.
+  std::vector<absl::StatusOr<Packet>> ProcessReservedBatch(
+      absl::Span<const Packet> packets, uint64_t first_sequence_number);
+
   std::unique_ptr<IpSecEncryptor> encryptor_;
   IpSecPacketPool packet_pool_;
 };
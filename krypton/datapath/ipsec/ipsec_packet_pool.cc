@@ -1,6 +1,13 @@
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/pal/packet.h"
 #include "third_party/absl/synchronization/mutex.h"
 #include "third_party/absl/time/time.h"
 
@@ -19,41 +26,164 @@ const int kPacketPoolSize = 400;
 // this is a UDP stream, so if we have to drop some packets, that's fine.
 const absl::Duration kBorrowWaitTimeout = absl::Milliseconds(50);
 
-IpSecPacketPool::IpSecPacketPool() : pool_(kPacketPoolSize) {
-  for (auto &packet : pool_) {
-    available_.push_back(&packet);
+// How often the destructor checks whether all outstanding packets have been
+// returned.
+const absl::Duration kReturnPollInterval = absl::Milliseconds(10);
+
+namespace {
+
+constexpr uint32_t kEmpty = 0;
+
+uint32_t SlotOf(uint64_t head) { return static_cast<uint32_t>(head); }
+
+uint64_t NextHead(uint64_t head, uint32_t slot) {
+  return (((head >> 32) + 1) << 32) | slot;
+}
+
+}  // namespace
+
+PacketOwner IpSecPacketPool::Handle::ReleaseAsOwner() {
+  IpSecPacketPool* pool = pool_;
+  IpSecPacket* packet = packet_;
+  pool_ = nullptr;
+  packet_ = nullptr;
+  return PacketOwner::PoolReturn(&IpSecPacketPool::ReturnToPool, pool, packet);
+}
+
+void IpSecPacketPool::Handle::Reset() {
+  if (packet_ != nullptr) {
+    pool_->Return(packet_);
   }
+  pool_ = nullptr;
+  packet_ = nullptr;
+}
+
+IpSecPacketPool::IpSecPacketPool()
+    : pool_(kPacketPoolSize),
+      next_(new std::atomic<uint32_t>[kPacketPoolSize]),
+      in_use_(0),
+      high_water_mark_(0),
+      waiters_(0) {
+  // Slots are numbered from 1, so that 0 can mean the end of the list.
+  for (uint32_t slot = 1; slot <= kPacketPoolSize; ++slot) {
+    next_[slot - 1].store(slot < kPacketPoolSize ? slot + 1 : kEmpty);
+  }
+  free_head_.store(1);
 }
 
 IpSecPacketPool::~IpSecPacketPool() {
-  absl::MutexLock m(&mutex_);
-  while (available_.size() != pool_.size()) {
+  if (in_use_.load() != 0) {
     LOG(WARNING) << "IpSecPacketPool was destroyed with outstanding loans.";
-    condition_.Wait(&mutex_);
+  }
+  // Return() decrements in_use_ as the very last thing it does, so once it
+  // reaches zero no other thread can be touching the pool.
+  absl::MutexLock m(&mutex_);
+  while (in_use_.load() != 0) {
+    condition_.WaitWithTimeout(&mutex_, kReturnPollInterval);
   }
   LOG(WARNING) << "IpSecPacketPool has all packets returned.";
 }
 
-std::shared_ptr<IpSecPacket> IpSecPacketPool::Borrow() {
+IpSecPacketPool::Handle IpSecPacketPool::Borrow() {
+  auto deadline = absl::Now() + kBorrowWaitTimeout;
+
+  Handle packet;
+  while (TryPop(1, &packet) == 0) {
+    if (!WaitForAvailable(deadline)) {
+      return Handle();
+    }
+  }
+  return packet;
+}
+
+std::vector<IpSecPacketPool::Handle> IpSecPacketPool::BorrowBatch(
+    size_t count) {
+  std::vector<Handle> packets;
+  if (count == 0) {
+    return packets;
+  }
   auto deadline = absl::Now() + kBorrowWaitTimeout;
 
+  packets.resize(count);
+  size_t borrowed;
+  while ((borrowed = TryPop(count, packets.data())) == 0) {
+    if (!WaitForAvailable(deadline)) {
+      break;
+    }
+  }
+  packets.resize(borrowed);
+  return packets;
+}
+
+size_t IpSecPacketPool::TryPop(size_t count, Handle* packets) {
+  uint64_t head = free_head_.load();
+  while (true) {
+    uint32_t first = SlotOf(head);
+    if (first == kEmpty) {
+      return 0;
+    }
+    // Walk down the list to find where the rest of the list will start. If any
+    // other thread changes the list in the meantime, the counter in the head
+    // will have changed and the exchange below will fail.
+    size_t taken = 1;
+    uint32_t rest = next_[first - 1].load(std::memory_order_relaxed);
+    while (taken < count && rest != kEmpty) {
+      rest = next_[rest - 1].load(std::memory_order_relaxed);
+      ++taken;
+    }
+    if (free_head_.compare_exchange_weak(head, NextHead(head, rest))) {
+      uint32_t slot = first;
+      for (size_t i = 0; i < taken; ++i) {
+        packets[i] = Handle(this, &pool_[slot - 1]);
+        slot = next_[slot - 1].load(std::memory_order_relaxed);
+      }
+      UpdateHighWaterMark(in_use_.fetch_add(taken) + static_cast<int>(taken));
+      return taken;
+    }
+  }
+}
+
+bool IpSecPacketPool::WaitForAvailable(absl::Time deadline) {
   absl::MutexLock m(&mutex_);
-  while (available_.empty()) {
+  // Registering as a waiter before checking the list guarantees that any
+  // Return() which we don't observe here will see us and signal.
+  waiters_.fetch_add(1);
+  bool available = true;
+  while (SlotOf(free_head_.load()) == kEmpty) {
     if (condition_.WaitWithDeadline(&mutex_, deadline)) {
-      return std::shared_ptr<IpSecPacket>(nullptr);
+      available = SlotOf(free_head_.load()) != kEmpty;
+      break;
     }
   }
-  IpSecPacket *packet = available_.back();
-  available_.pop_back();
+  waiters_.fetch_sub(1);
+  return available;
+}
+
+void IpSecPacketPool::Return(IpSecPacket* packet) {
+  uint32_t slot = static_cast<uint32_t>(packet - pool_.data()) + 1;
+  uint64_t head = free_head_.load();
+  do {
+    next_[slot - 1].store(SlotOf(head), std::memory_order_relaxed);
+  } while (!free_head_.compare_exchange_weak(head, NextHead(head, slot)));
+
+  if (waiters_.load() > 0) {
+    absl::MutexLock m(&mutex_);
+    condition_.SignalAll();
+  }
+  in_use_.fetch_sub(1);
+}
 
-  return std::shared_ptr<IpSecPacket>(
-      packet, [this](IpSecPacket *p) { this->Return(p); });
+void IpSecPacketPool::ReturnToPool(void* pool, void* packet) {
+  static_cast<IpSecPacketPool*>(pool)->Return(
+      static_cast<IpSecPacket*>(packet));
 }
 
-void IpSecPacketPool::Return(IpSecPacket *packet) {
-  absl::MutexLock m(&mutex_);
-  available_.push_back(packet);
-  condition_.SignalAll();
+void IpSecPacketPool::UpdateHighWaterMark(int in_use) {
+  int high_water_mark = high_water_mark_.load(std::memory_order_relaxed);
+  while (in_use > high_water_mark &&
+         !high_water_mark_.compare_exchange_weak(high_water_mark, in_use,
+                                                 std::memory_order_relaxed)) {
+  }
 }
 
 }  // namespace ipsec
@@ -1,7 +1,14 @@
 #ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_IPSEC_PACKET_POOL_H_
 #define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_IPSEC_PACKET_POOL_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
 #include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/pal/packet.h"
 #include "third_party/absl/synchronization/mutex.h"
 #include "third_party/absl/time/time.h"
 
@@ -12,8 +19,62 @@ namespace ipsec {
 
 // Manages a fixed collection of IpSecPacket objects that can be re-used, so
 // that we don't have to re-allocate packets constantly in the critical path.
+//
+// The free list is a lock-free stack of slot indices, so borrowing and
+// returning a packet never takes a lock unless the pool is empty and a caller
+// has to wait for a packet to be returned.
 class IpSecPacketPool {
  public:
+  // A move-only reference to a packet borrowed from the pool. The packet is
+  // returned to the pool when the handle is destroyed, unless ownership has
+  // been released.
+  class Handle {
+   public:
+    Handle() : pool_(nullptr), packet_(nullptr) {}
+    ~Handle() { Reset(); }
+
+    Handle(const Handle& other) = delete;
+    Handle& operator=(const Handle& other) = delete;
+
+    Handle(Handle&& other) : pool_(other.pool_), packet_(other.packet_) {
+      other.pool_ = nullptr;
+      other.packet_ = nullptr;
+    }
+
+    Handle& operator=(Handle&& other) {
+      if (this != &other) {
+        Reset();
+        pool_ = other.pool_;
+        packet_ = other.packet_;
+        other.pool_ = nullptr;
+        other.packet_ = nullptr;
+      }
+      return *this;
+    }
+
+    explicit operator bool() const { return packet_ != nullptr; }
+
+    IpSecPacket* get() const { return packet_; }
+    IpSecPacket* operator->() const { return packet_; }
+    IpSecPacket& operator*() const { return *packet_; }
+
+    // Transfers ownership of the packet to a PacketOwner that returns it to
+    // the pool when released, which doesn't allocate.
+    PacketOwner ReleaseAsOwner();
+
+    // Returns the packet to the pool, if this handle holds one.
+    void Reset();
+
+   private:
+    friend class IpSecPacketPool;
+
+    Handle(IpSecPacketPool* pool, IpSecPacket* packet)
+        : pool_(pool), packet_(packet) {}
+
+    IpSecPacketPool* pool_;
+    IpSecPacket* packet_;
+  };
+
   IpSecPacketPool();
   ~IpSecPacketPool();
 
@@ -24,18 +85,62 @@ class IpSecPacketPool {
   IpSecPacketPool& operator=(IpSecPacketPool&& other) = delete;
 
   // Takes a packet from the pool. If there are no packets available in a short
-  // time, returns nullptr. Once all the copies of the shared_ptr are deleted,
-  // the packet will be returned to the pool.
-  std::shared_ptr<IpSecPacket> Borrow() ABSL_LOCKS_EXCLUDED(mutex_);
+  // time, returns an empty handle. Once the handle is destroyed, the packet
+  // will be returned to the pool.
+  Handle Borrow();
+
+  // Takes up to `count` packets from the pool with a single update of the free
+  // list. If the pool has fewer than `count` packets available, returns as many
+  // as it can. Only waits if no packets are available at all, in which case it
+  // behaves like Borrow() and may return an empty vector.
+  std::vector<Handle> BorrowBatch(size_t count);
+
+  // Returns the number of packets that are currently borrowed.
+  int in_use() const { return in_use_.load(std::memory_order_relaxed); }
+
+  // Returns the largest number of packets that have been borrowed at once.
+  int high_water_mark() const {
+    return high_water_mark_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the total number of packets managed by this pool.
+  int capacity() const { return static_cast<int>(pool_.size()); }
 
  private:
+  // Pops up to `count` slots from the free list into `packets` and returns
+  // how many were taken. Never blocks.
+  size_t TryPop(size_t count, Handle* packets);
+
+  // Blocks until the free list is non-empty or the deadline passes. Returns
+  // false if the deadline passed with the list still empty.
+  bool WaitForAvailable(absl::Time deadline) ABSL_LOCKS_EXCLUDED(mutex_);
+
   // Returns the given packet to the pool.
-  void Return(IpSecPacket* packet) ABSL_LOCKS_EXCLUDED(mutex_);
+  void Return(IpSecPacket* packet);
+
+  // Adapts Return() for PacketOwner.
+  static void ReturnToPool(void* pool, void* packet);
+
+  void UpdateHighWaterMark(int in_use);
+
+  std::vector<IpSecPacket> pool_;
+
+  // For each slot, the index + 1 of the next free slot, or 0 for none.
+  std::unique_ptr<std::atomic<uint32_t>[]> next_;
+
+  // The top of the free list. The low 32 bits hold the index + 1 of the first
+  // free slot, or 0 if the list is empty. The high 32 bits are a counter that
+  // is bumped on every update, to protect against ABA.
+  std::atomic<uint64_t> free_head_;
+
+  std::atomic_int in_use_;
+  std::atomic_int high_water_mark_;
 
+  // Only used when a borrower has to wait for a packet to be returned. The
+  // waiters_ count lets Return() skip the mutex entirely in the common case.
   absl::Mutex mutex_;
-  absl::CondVar condition_ ABSL_GUARDED_BY(mutex_);
-  std::vector<IpSecPacket> pool_ ABSL_GUARDED_BY(mutex_);
-  std::vector<IpSecPacket*> available_ ABSL_GUARDED_BY(mutex_);
+  absl::CondVar condition_;
+  std::atomic_int waiters_;
 };
 
 }  // namespace ipsec
@@ -0,0 +1,78 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for borrowing packets from the pool and returning them, with
+// several threads contending for the free list.
+
+#include <cstddef>
+
+#include "privacy/net/krypton/benchmark_util.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
+#include "testing/base/public/benchmark.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+// Every thread of a benchmark shares the same pool, the way every pipe and
+// cryptor in the datapath would.
+IpSecPacketPool* SharedPool() {
+  static IpSecPacketPool* const pool = new IpSecPacketPool();
+  return pool;
+}
+
+void BM_BorrowAndReturn(benchmark::State& state) {
+  IpSecPacketPool* pool = SharedPool();
+  for (auto _ : state) {
+    auto packet = pool->Borrow();
+    if (!packet) {
+      state.SkipWithError("Pool is empty");
+      break;
+    }
+    benchmark::DoNotOptimize(packet.get());
+  }
+  ReportPacketRates(state, state.iterations(), 0);
+}
+BENCHMARK(BM_BorrowAndReturn)->ThreadRange(1, 8)->UseRealTime();
+
+// Borrows batches of state.range(0) packets, and returns them one by one, as
+// the packets of a batch are written out.
+void BM_BorrowBatchAndReturn(benchmark::State& state) {
+  IpSecPacketPool* pool = SharedPool();
+  const size_t batch_size = state.range(0);
+  size_t packets = 0;
+  for (auto _ : state) {
+    auto batch = pool->BorrowBatch(batch_size);
+    if (batch.empty()) {
+      state.SkipWithError("Pool is empty");
+      break;
+    }
+    packets += batch.size();
+    benchmark::DoNotOptimize(batch.data());
+  }
+  ReportPacketRates(state, packets, 0);
+}
+BENCHMARK(BM_BorrowBatchAndReturn)
+    ->ArgName("batch")
+    ->Arg(32)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,168 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/ipsec_packet_pool.h"
+
+#include <set>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/ipsec_packet.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+TEST(IpSecPacketPoolTest, BorrowAndReturn) {
+  IpSecPacketPool pool;
+  EXPECT_EQ(pool.in_use(), 0);
+
+  {
+    auto packet = pool.Borrow();
+    ASSERT_TRUE(packet);
+    EXPECT_EQ(pool.in_use(), 1);
+  }
+  EXPECT_EQ(pool.in_use(), 0);
+  EXPECT_EQ(pool.high_water_mark(), 1);
+}
+
+TEST(IpSecPacketPoolTest, MovedHandleReturnsOnce) {
+  IpSecPacketPool pool;
+  auto packet = pool.Borrow();
+  ASSERT_TRUE(packet);
+
+  IpSecPacketPool::Handle moved = std::move(packet);
+  EXPECT_FALSE(packet);  // NOLINT(bugprone-use-after-move)
+  EXPECT_TRUE(moved);
+  EXPECT_EQ(pool.in_use(), 1);
+
+  moved.Reset();
+  EXPECT_FALSE(moved);
+  EXPECT_EQ(pool.in_use(), 0);
+}
+
+TEST(IpSecPacketPoolTest, ReleaseAsOwnerReturnsWhenPacketIsDestroyed) {
+  IpSecPacketPool pool;
+  auto handle = pool.Borrow();
+  ASSERT_TRUE(handle);
+  IpSecPacket* ipsec_packet = handle.get();
+
+  {
+    Packet packet(ipsec_packet->buffer(), ipsec_packet->buffer_size(),
+                  IPProtocol::kIPv4, handle.ReleaseAsOwner());
+    EXPECT_FALSE(handle);
+    EXPECT_EQ(pool.in_use(), 1);
+  }
+  EXPECT_EQ(pool.in_use(), 0);
+}
+
+TEST(IpSecPacketPoolTest, ExhaustedPoolReturnsEmptyHandle) {
+  IpSecPacketPool pool;
+  std::vector<IpSecPacketPool::Handle> packets;
+  std::set<IpSecPacket*> distinct;
+  for (int i = 0; i < pool.capacity(); ++i) {
+    auto packet = pool.Borrow();
+    ASSERT_TRUE(packet);
+    distinct.insert(packet.get());
+    packets.push_back(std::move(packet));
+  }
+  EXPECT_EQ(distinct.size(), pool.capacity());
+  EXPECT_EQ(pool.in_use(), pool.capacity());
+
+  EXPECT_FALSE(pool.Borrow());
+  EXPECT_TRUE(pool.BorrowBatch(4).empty());
+
+  packets.pop_back();
+  EXPECT_TRUE(pool.Borrow());
+}
+
+TEST(IpSecPacketPoolTest, BorrowBatchReturnsWhatIsAvailable) {
+  IpSecPacketPool pool;
+  auto most = pool.BorrowBatch(pool.capacity() - 3);
+  EXPECT_EQ(most.size(), pool.capacity() - 3);
+
+  auto rest = pool.BorrowBatch(10);
+  EXPECT_EQ(rest.size(), 3);
+  EXPECT_EQ(pool.in_use(), pool.capacity());
+  EXPECT_EQ(pool.high_water_mark(), pool.capacity());
+
+  std::set<IpSecPacket*> distinct;
+  for (const auto& packet : most) distinct.insert(packet.get());
+  for (const auto& packet : rest) distinct.insert(packet.get());
+  EXPECT_EQ(distinct.size(), pool.capacity());
+
+  most.clear();
+  rest.clear();
+  EXPECT_EQ(pool.in_use(), 0);
+}
+
+TEST(IpSecPacketPoolTest, WaitingBorrowerIsWokenByReturn) {
+  IpSecPacketPool pool;
+  auto packets = pool.BorrowBatch(pool.capacity());
+  ASSERT_EQ(packets.size(), pool.capacity());
+
+  IpSecPacketPool::Handle borrowed;
+  std::thread borrower([&pool, &borrowed] { borrowed = pool.Borrow(); });
+  packets.pop_back();
+  borrower.join();
+
+  // The borrow can only time out if the return never woke it up, and the wait
+  // is long enough that the return above will always land first.
+  EXPECT_TRUE(borrowed);
+}
+
+TEST(IpSecPacketPoolTest, ConcurrentBorrowAndReturn) {
+  IpSecPacketPool pool;
+  constexpr int kThreads = 8;
+  constexpr int kIterations = 2000;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&pool, t] {
+      for (int i = 0; i < kIterations; ++i) {
+        if ((i + t) % 2 == 0) {
+          auto packet = pool.Borrow();
+          if (packet) packet->resize_data(i % 100);
+        } else {
+          auto packets = pool.BorrowBatch(1 + i % 64);
+          for (auto& packet : packets) packet->resize_data(i % 100);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(pool.in_use(), 0);
+  EXPECT_LE(pool.high_water_mark(), pool.capacity());
+
+  // Every slot must still be on the free list exactly once.
+  auto packets = pool.BorrowBatch(pool.capacity());
+  std::set<IpSecPacket*> distinct;
+  for (const auto& packet : packets) distinct.insert(packet.get());
+  EXPECT_EQ(distinct.size(), pool.capacity());
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
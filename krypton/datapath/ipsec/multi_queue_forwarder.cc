@@ -0,0 +1,166 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/multi_queue_forwarder.h"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
+#include "privacy/net/krypton/proto/debug_info.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+namespace {
+
+void AddPipeDebugInfo(const PacketPipeDebugInfo& from,
+                      PacketPipeDebugInfo* to) {
+  to->set_writes_started(to->writes_started() + from.writes_started());
+  to->set_writes_completed(to->writes_completed() + from.writes_completed());
+  to->set_write_errors(to->write_errors() + from.write_errors());
+}
+
+}  // namespace
+
+MultiQueueForwarder::MultiQueueForwarder(
+    PacketForwarder::NotificationInterface* notification,
+    bool extended_sequence_numbers)
+    : notification_(notification),
+      sequence_numbers_(std::make_shared<SequenceNumberAllocator>(
+          extended_sequence_numbers)),
+      replay_window_(std::make_shared<ReplayWindow>()) {
+  connected_.clear();
+  failed_.clear();
+}
+
+/* static */ absl::StatusOr<std::unique_ptr<MultiQueueForwarder>>
+MultiQueueForwarder::Create(
+    uint32_t spi, const TransformParams& params,
+    const std::vector<Queue>& queues, utils::LooperThread* looper,
+    PacketForwarder::NotificationInterface* notification) {
+  if (queues.empty()) {
+    return absl::InvalidArgumentError("MultiQueueForwarder needs a queue");
+  }
+  // The constructor is private, so make_unique can't be used here.
+  std::unique_ptr<MultiQueueForwarder> forwarder(new MultiQueueForwarder(
+      notification, params.ipsec().extended_sequence_numbers()));
+  forwarder->pipelines_.reserve(queues.size());
+  for (const auto& queue : queues) {
+    if (queue.utun_pipe == nullptr || queue.network_pipe == nullptr) {
+      return absl::InvalidArgumentError("MultiQueueForwarder got a null pipe");
+    }
+    Pipeline pipeline;
+    PPN_ASSIGN_OR_RETURN(
+        pipeline.encryptor,
+        Encryptor::Create(spi, params, forwarder->sequence_numbers_));
+    PPN_ASSIGN_OR_RETURN(
+        pipeline.decryptor,
+        Decryptor::Create(params, forwarder->replay_window_));
+    pipeline.forwarder = std::make_unique<PacketForwarder>(
+        pipeline.encryptor.get(), pipeline.decryptor.get(), queue.utun_pipe,
+        queue.network_pipe, looper, forwarder.get());
+    forwarder->pipelines_.push_back(std::move(pipeline));
+  }
+  return forwarder;
+}
+
+void MultiQueueForwarder::Start() {
+  LOG(INFO) << "Starting MultiQueueForwarder[" << this << "] with "
+            << pipelines_.size() << " pipelines.";
+  for (auto& pipeline : pipelines_) {
+    pipeline.forwarder->Start();
+  }
+}
+
+void MultiQueueForwarder::Stop() {
+  LOG(INFO) << "Stopping MultiQueueForwarder[" << this << "].";
+  for (auto& pipeline : pipelines_) {
+    pipeline.forwarder->Stop();
+  }
+  LOG(INFO) << "MultiQueueForwarder[" << this << "] is stopped.";
+}
+
+void MultiQueueForwarder::GetDebugInfo(DatapathDebugInfo* debug_info) {
+  for (auto& pipeline : pipelines_) {
+    DatapathDebugInfo pipeline_info;
+    pipeline.forwarder->GetDebugInfo(&pipeline_info);
+    debug_info->set_uplink_packets_read(debug_info->uplink_packets_read() +
+                                        pipeline_info.uplink_packets_read());
+    debug_info->set_downlink_packets_read(
+        debug_info->downlink_packets_read() +
+        pipeline_info.downlink_packets_read());
+    debug_info->set_uplink_packets_dropped(
+        debug_info->uplink_packets_dropped() +
+        pipeline_info.uplink_packets_dropped());
+    debug_info->set_downlink_packets_dropped(
+        debug_info->downlink_packets_dropped() +
+        pipeline_info.downlink_packets_dropped());
+    debug_info->set_decryption_errors(debug_info->decryption_errors() +
+                                      pipeline_info.decryption_errors());
+    debug_info->set_downlink_packets_replayed(
+        debug_info->downlink_packets_replayed() +
+        pipeline_info.downlink_packets_replayed());
+    debug_info->set_downlink_packets_too_old(
+        debug_info->downlink_packets_too_old() +
+        pipeline_info.downlink_packets_too_old());
+    AddPipeDebugInfo(pipeline_info.network_pipe(),
+                     debug_info->mutable_network_pipe());
+    AddPipeDebugInfo(pipeline_info.device_pipe(),
+                     debug_info->mutable_device_pipe());
+  }
+}
+
+void MultiQueueForwarder::PacketForwarderFailed(const absl::Status& status) {
+  if (failed_.test_and_set()) {
+    LOG(ERROR) << "MultiQueueForwarder pipeline failed [Dedup]: " << status;
+    return;
+  }
+  notification_->PacketForwarderFailed(status);
+}
+
+void MultiQueueForwarder::PacketForwarderPermanentFailure(
+    const absl::Status& status) {
+  if (failed_.test_and_set()) {
+    LOG(ERROR) << "MultiQueueForwarder pipeline failed [Dedup]: " << status;
+    return;
+  }
+  notification_->PacketForwarderPermanentFailure(status);
+}
+
+void MultiQueueForwarder::PacketForwarderConnected() {
+  if (connected_.test_and_set()) {
+    return;
+  }
+  notification_->PacketForwarderConnected();
+}
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
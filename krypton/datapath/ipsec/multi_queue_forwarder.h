@@ -0,0 +1,123 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_MULTI_QUEUE_FORWARDER_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_MULTI_QUEUE_FORWARDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
+#include "privacy/net/krypton/pal/packet_pipe.h"
+#include "privacy/net/krypton/proto/debug_info.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+// Forwards packets for a single SA over several independent pipelines, so that
+// forwarding isn't limited to one core in each direction.
+//
+// Each pipeline is a PacketForwarder between one queue of a multi-queue TUN
+// device and its own network pipe, with its own encryptor, decryptor and
+// packet pools. The only state the pipelines share on the packet path is the
+// uplink sequence number space, which each encryptor reserves from a batch at
+// a time, and the downlink anti-replay window, so that a packet that is
+// replayed on a different network queue than the original is still dropped.
+//
+// Packets of a flow stay in order because the kernel always hands all of a
+// flow's uplink packets to the same TUN queue, and each pipeline forwards its
+// queue in order. Downlink packets are written to the TUN queue of the
+// pipeline whose network pipe they arrived on.
+//
+// Nothing in the product creates one of these yet. IpSecDatapath still runs a
+// single PacketForwarder, since no platform gives it more than one tunnel
+// pipe: multi-queue TUN devices need CAP_NET_ADMIN, which an app holding a
+// VpnService fd doesn't have.
+class MultiQueueForwarder : public PacketForwarder::NotificationInterface {
+ public:
+  // The pipes for one pipeline. Neither is owned by the forwarder.
+  struct Queue {
+    PacketPipe* utun_pipe;
+    PacketPipe* network_pipe;
+  };
+
+  // Creates a forwarder with one pipeline for each of `queues`, all of which
+  // encrypt with `spi` and the keys in `params`. Notifications are posted to
+  // `looper` and reported once for the forwarder as a whole.
+  static absl::StatusOr<std::unique_ptr<MultiQueueForwarder>> Create(
+      uint32_t spi, const TransformParams& params,
+      const std::vector<Queue>& queues, utils::LooperThread* looper,
+      PacketForwarder::NotificationInterface* notification);
+
+  ~MultiQueueForwarder() override = default;
+
+  // Disallow copy and assign.
+  MultiQueueForwarder(const MultiQueueForwarder& other) = delete;
+  MultiQueueForwarder& operator=(const MultiQueueForwarder& other) = delete;
+
+  // Starts every pipeline.
+  void Start();
+
+  // Stops every pipeline. See PacketForwarder::Stop.
+  void Stop();
+
+  // Returns the number of pipelines.
+  int num_pipelines() const { return static_cast<int>(pipelines_.size()); }
+
+  // Returns the counters summed over all of the pipelines.
+  void GetDebugInfo(DatapathDebugInfo* debug_info);
+
+  void PacketForwarderFailed(const absl::Status& status) override;
+
+  void PacketForwarderPermanentFailure(const absl::Status& status) override;
+
+  void PacketForwarderConnected() override;
+
+ private:
+  struct Pipeline {
+    std::unique_ptr<CryptorInterface> encryptor;
+    std::unique_ptr<CryptorInterface> decryptor;
+    std::unique_ptr<PacketForwarder> forwarder;
+  };
+
+  MultiQueueForwarder(PacketForwarder::NotificationInterface* notification,
+                      bool extended_sequence_numbers);
+
+  PacketForwarder::NotificationInterface* notification_;  // Not owned.
+  std::shared_ptr<SequenceNumberAllocator> sequence_numbers_;
+  std::shared_ptr<ReplayWindow> replay_window_;
+  std::vector<Pipeline> pipelines_;
+
+  // Only the first pipeline to connect or fail is reported.
+  std::atomic_flag connected_;
+  std::atomic_flag failed_;
+};
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_MULTI_QUEUE_FORWARDER_H_
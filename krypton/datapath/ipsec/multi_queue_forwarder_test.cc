@@ -0,0 +1,339 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/multi_queue_forwarder.h"
+
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/ipsec.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/pal/packet_pipe.h"
+#include "privacy/net/krypton/proto/debug_info.proto.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/synchronization/notification.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using ::testing::status::StatusIs;
+
+class MockNotification : public PacketForwarder::NotificationInterface {
+ public:
+  MOCK_METHOD(void, PacketForwarderFailed, (const absl::Status&), (override));
+  MOCK_METHOD(void, PacketForwarderPermanentFailure, (const absl::Status&),
+              (override));
+  MOCK_METHOD(void, PacketForwarderConnected, (), (override));
+};
+
+// Copies `data` into a new buffer with room around it for encapsulation, the
+// way a packet pipe would read it.
+Packet CreateWritablePacket(absl::string_view data, IPProtocol protocol) {
+  const size_t capacity = kPacketHeadroom + data.size() + kPacketTailroom;
+  char* buffer = new char[capacity];
+  memcpy(buffer + kPacketHeadroom, data.data(), data.size());
+  return Packet(buffer, capacity, kPacketHeadroom, data.size(), protocol,
+                [buffer] { delete[] buffer; });
+}
+
+// A pipe that hands a fixed list of packets to its reader, one per call, on
+// its own thread, and records every packet written to it.
+class FakePacketPipe : public PacketPipe {
+ public:
+  explicit FakePacketPipe(std::vector<std::string> inbound)
+      : inbound_(std::move(inbound)) {}
+  ~FakePacketPipe() override { Join(); }
+
+  void ReadPackets(
+      std::function<bool(absl::Status, std::vector<Packet>)> handler) override {
+    read_thread_ = std::thread([this, handler] {
+      for (const auto& data : inbound_) {
+        std::vector<Packet> packets;
+        packets.push_back(CreateWritablePacket(data, IPProtocol::kIPv4));
+        if (!handler(absl::OkStatus(), std::move(packets))) {
+          break;
+        }
+      }
+    });
+  }
+
+  absl::Status WritePackets(std::vector<Packet> packets) override {
+    absl::MutexLock lock(&mutex_);
+    for (const auto& packet : packets) {
+      written_.emplace_back(packet.data());
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status StopReadingPackets() override {
+    Join();
+    return absl::OkStatus();
+  }
+
+  void Close() override { Join(); }
+
+  absl::StatusOr<int> GetFd() const override {
+    return absl::UnimplementedError("Not implemented");
+  }
+
+  std::string DebugString() override { return "FakePacketPipe"; }
+
+  std::vector<std::string> written() {
+    absl::MutexLock lock(&mutex_);
+    return written_;
+  }
+
+ private:
+  void Join() {
+    if (read_thread_.joinable()) {
+      read_thread_.join();
+    }
+  }
+
+  std::vector<std::string> inbound_;
+  std::thread read_thread_;
+  absl::Mutex mutex_;
+  std::vector<std::string> written_ ABSL_GUARDED_BY(mutex_);
+};
+
+class MultiQueueForwarderTest : public ::testing::Test {
+ public:
+  MultiQueueForwarderTest() {
+    auto ip_sec_transform_params = params_.mutable_ipsec();
+    ip_sec_transform_params->set_uplink_key(std::string(32, 'z'));
+    ip_sec_transform_params->set_downlink_key(std::string(32, 'z'));
+    ip_sec_transform_params->set_uplink_salt(std::string(4, 'a'));
+    ip_sec_transform_params->set_downlink_salt(std::string(4, 'a'));
+  }
+
+  // Creates `count` pairs of pipes, where each TUN queue reads
+  // `packets_per_queue` packets tagged with its queue number, and the network
+  // pipe of queue i reads `downlink[i]`, or nothing if there isn't one.
+  void CreatePipes(int count, int packets_per_queue,
+                   const std::vector<std::vector<std::string>>& downlink) {
+    for (int i = 0; i < count; ++i) {
+      std::vector<std::string> uplink;
+      for (int j = 0; j < packets_per_queue; ++j) {
+        uplink.push_back(absl::StrCat("queue ", i, " packet ", j));
+      }
+      utun_pipes_.push_back(std::make_unique<FakePacketPipe>(uplink));
+      network_pipes_.push_back(std::make_unique<FakePacketPipe>(
+          i < downlink.size() ? downlink[i] : std::vector<std::string>()));
+      queues_.push_back({utun_pipes_.back().get(),
+                         network_pipes_.back().get()});
+    }
+  }
+
+  TransformParams params_;
+  std::vector<std::unique_ptr<FakePacketPipe>> utun_pipes_;
+  std::vector<std::unique_ptr<FakePacketPipe>> network_pipes_;
+  std::vector<MultiQueueForwarder::Queue> queues_;
+  utils::LooperThread notification_thread_{"MultiQueueForwarder Test"};
+  MockNotification notification_;
+};
+
+TEST_F(MultiQueueForwarderTest, RequiresQueues) {
+  EXPECT_THAT(MultiQueueForwarder::Create(2, params_, queues_,
+                                          &notification_thread_,
+                                          &notification_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(MultiQueueForwarderTest, RequiresPipes) {
+  queues_.push_back({nullptr, nullptr});
+  EXPECT_THAT(MultiQueueForwarder::Create(2, params_, queues_,
+                                          &notification_thread_,
+                                          &notification_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(MultiQueueForwarderTest, RequiresKeys) {
+  CreatePipes(2, 0, {});
+  EXPECT_THAT(MultiQueueForwarder::Create(2, TransformParams(), queues_,
+                                          &notification_thread_,
+                                          &notification_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(MultiQueueForwarderTest, UplinkSequenceNumbersAreUniqueAndInOrder) {
+  constexpr int kQueues = 4;
+  constexpr int kPacketsPerQueue = 50;
+  CreatePipes(kQueues, kPacketsPerQueue, {});
+  ASSERT_OK_AND_ASSIGN(auto forwarder, MultiQueueForwarder::Create(
+                                           2, params_, queues_,
+                                           &notification_thread_,
+                                           &notification_));
+  EXPECT_EQ(forwarder->num_pipelines(), kQueues);
+
+  forwarder->Start();
+  forwarder->Stop();
+  notification_thread_.Stop();
+  notification_thread_.Join();
+
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params_));
+  std::vector<bool> seen(kQueues * kPacketsPerQueue, false);
+  for (int i = 0; i < kQueues; ++i) {
+    auto written = network_pipes_[i]->written();
+    ASSERT_EQ(written.size(), kPacketsPerQueue);
+    uint32_t previous = 0;
+    for (int j = 0; j < kPacketsPerQueue; ++j) {
+      EspHeader header;
+      memcpy(&header, written[j].data(), sizeof(header));
+      uint32_t sequence_number = ntohl(header.sequence_number);
+      ASSERT_LT(sequence_number, seen.size());
+      EXPECT_FALSE(seen[sequence_number]);
+      seen[sequence_number] = true;
+      // Each pipeline's packets go out in the order they were read.
+      if (j > 0) {
+        EXPECT_GT(sequence_number, previous);
+      }
+      previous = sequence_number;
+
+      Packet packet(written[j].data(), written[j].size(), IPProtocol::kUnknown,
+                    [] {});
+      auto decrypted = decryptor->Process(packet);
+      ASSERT_OK(decrypted);
+      EXPECT_EQ(decrypted->data(), absl::StrCat("queue ", i, " packet ", j));
+    }
+  }
+
+  DatapathDebugInfo debug_info;
+  forwarder->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.uplink_packets_read(), kQueues * kPacketsPerQueue);
+  EXPECT_EQ(debug_info.downlink_packets_read(), 0);
+}
+
+TEST_F(MultiQueueForwarderTest, DownlinkGoesToTheMatchingQueue) {
+  constexpr int kQueues = 3;
+  constexpr int kPacketsPerQueue = 10;
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  std::vector<std::vector<std::string>> downlink(kQueues);
+  for (int i = 0; i < kQueues; ++i) {
+    for (int j = 0; j < kPacketsPerQueue; ++j) {
+      const std::string payload = absl::StrCat("queue ", i, " downlink ", j);
+      Packet packet(payload.data(), payload.size(), IPProtocol::kIPv4, [] {});
+      auto encrypted = encryptor->Process(packet);
+      ASSERT_OK(encrypted);
+      downlink[i].emplace_back(encrypted->data());
+    }
+  }
+  CreatePipes(kQueues, 0, downlink);
+  ASSERT_OK_AND_ASSIGN(auto forwarder, MultiQueueForwarder::Create(
+                                           2, params_, queues_,
+                                           &notification_thread_,
+                                           &notification_));
+
+  // Every pipeline connects, but it's only reported once.
+  absl::Notification connected;
+  EXPECT_CALL(notification_, PacketForwarderConnected())
+      .WillOnce([&connected] { connected.Notify(); });
+
+  forwarder->Start();
+  forwarder->Stop();
+  // The other pipelines' notifications are still queued on the looper, and
+  // refer to the forwarder.
+  notification_thread_.Stop();
+  notification_thread_.Join();
+  EXPECT_TRUE(connected.HasBeenNotified());
+
+  for (int i = 0; i < kQueues; ++i) {
+    auto written = utun_pipes_[i]->written();
+    ASSERT_EQ(written.size(), kPacketsPerQueue);
+    for (int j = 0; j < kPacketsPerQueue; ++j) {
+      EXPECT_EQ(written[j], absl::StrCat("queue ", i, " downlink ", j));
+    }
+  }
+
+  DatapathDebugInfo debug_info;
+  forwarder->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.downlink_packets_read(), kQueues * kPacketsPerQueue);
+  EXPECT_EQ(debug_info.decryption_errors(), 0);
+  EXPECT_EQ(debug_info.downlink_packets_replayed(), 0);
+}
+
+TEST_F(MultiQueueForwarderTest, ReplayOnAnotherQueueIsDropped) {
+  ASSERT_OK_AND_ASSIGN(auto encryptor, Encryptor::Create(2, params_));
+  const std::string payload = "downlink";
+  Packet packet(payload.data(), payload.size(), IPProtocol::kIPv4, [] {});
+  auto encrypted = encryptor->Process(packet);
+  ASSERT_OK(encrypted);
+  // A captured packet is sent again, and arrives on a different queue.
+  const std::string captured(encrypted->data());
+  CreatePipes(2, 0, {{captured}, {captured}});
+  ASSERT_OK_AND_ASSIGN(auto forwarder, MultiQueueForwarder::Create(
+                                           2, params_, queues_,
+                                           &notification_thread_,
+                                           &notification_));
+  EXPECT_CALL(notification_, PacketForwarderConnected()).Times(1);
+
+  forwarder->Start();
+  forwarder->Stop();
+  notification_thread_.Stop();
+  notification_thread_.Join();
+
+  // Either queue may see its copy first, but only one copy gets through.
+  auto written = utun_pipes_[0]->written();
+  auto more_written = utun_pipes_[1]->written();
+  written.insert(written.end(), more_written.begin(), more_written.end());
+  EXPECT_THAT(written, ::testing::ElementsAre(payload));
+
+  DatapathDebugInfo debug_info;
+  forwarder->GetDebugInfo(&debug_info);
+  EXPECT_EQ(debug_info.downlink_packets_read(), 2);
+  EXPECT_EQ(debug_info.downlink_packets_replayed(), 1);
+}
+
+TEST_F(MultiQueueForwarderTest, ReportsOnlyTheFirstFailure) {
+  CreatePipes(2, 0, {});
+  ASSERT_OK_AND_ASSIGN(auto forwarder, MultiQueueForwarder::Create(
+                                           2, params_, queues_,
+                                           &notification_thread_,
+                                           &notification_));
+  EXPECT_CALL(notification_, PacketForwarderFailed(::testing::_)).Times(1);
+  EXPECT_CALL(notification_, PacketForwarderPermanentFailure(::testing::_))
+      .Times(0);
+
+  // Once one pipeline fails, the owner stops all of them, so the failures of
+  // the others aren't reported.
+  forwarder->PacketForwarderFailed(absl::InternalError("first"));
+  forwarder->PacketForwarderFailed(absl::InternalError("second"));
+  forwarder->PacketForwarderPermanentFailure(absl::InternalError("third"));
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -15,10 +15,12 @@
 #include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
 
 #include <atomic>
+#include <memory>
 #include <utility>
 #include <vector>
 
 #include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/parallel_encryptor.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/pal/packet_pipe.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
@@ -51,10 +53,30 @@ PacketForwarder::PacketForwarder(CryptorInterface* encryptor,
       downlink_packets_read_(0),
       uplink_packets_dropped_(0),
       downlink_packets_dropped_(0),
-      decryption_errors_(0) {
+      decryption_errors_(0),
+      downlink_packets_replayed_(0),
+      downlink_packets_too_old_(0) {
   connected_.clear();
 }
 
+PacketForwarder::PacketForwarder(CryptorInterface* encryptor,
+                                 CryptorInterface* decryptor,
+                                 PacketPipe* utun_pipe,
+                                 PacketPipe* network_pipe,
+                                 utils::LooperThread* looper,
+                                 NotificationInterface* notification,
+                                 int uplink_workers)
+    : PacketForwarder(encryptor, decryptor, utun_pipe, network_pipe, looper,
+                      notification) {
+  if (encryptor_ != nullptr && uplink_workers > 1) {
+    parallel_encryptor_ = std::make_unique<ParallelEncryptor>(
+        encryptor_, uplink_workers,
+        [this](std::vector<absl::StatusOr<Packet>> results) {
+          return WriteEncryptedPackets(std::move(results));
+        });
+  }
+}
+
 bool PacketForwarder::is_started() {
   absl::MutexLock lock(&mutex_);
   return started_;
@@ -96,44 +118,30 @@ void PacketForwarder::Start() {
                 << "].";
     }
 
-    uplink_packets_read_++;
+    uplink_packets_read_ += packets.size();
 
-    std::vector<Packet> encrypted;
-    for (auto& packet : packets) {
-      if (encryptor_ != nullptr) {
-        auto encrypted_or = encryptor_->Process(packet);
-        if (absl::IsResourceExhausted(encrypted_or.status())) {
-          // This means we don't have the spare RAM to encrypt any more packets
-          // right now, so we'll drop this packet. But this isn't a permanent
-          // failure.
-          uplink_packets_dropped_++;
-          return true;
-        }
-        if (!encrypted_or.ok()) {
-          LOG(WARNING) << "Encryption error status: " << encrypted_or.status();
-          auto* notification = notification_;
-          const auto& encryption_status = encrypted_or.status();
-          notification_thread_->Post([notification, encryption_status]() {
-            notification->PacketForwarderPermanentFailure(encryption_status);
-          });
-          return false;
-        }
-        encrypted.emplace_back(std::move(encrypted_or).value());
-      } else {
-        encrypted.emplace_back(std::move(packet));
+    if (parallel_encryptor_ != nullptr) {
+      auto submit_status = parallel_encryptor_->Submit(std::move(packets));
+      if (absl::IsCancelled(submit_status)) {
+        // Either the forwarder is stopping, or writing an earlier batch failed
+        // and that has already been reported.
+        return false;
+      }
+      if (!submit_status.ok()) {
+        LOG(WARNING) << "Encryption error status: " << submit_status;
+        auto* notification = notification_;
+        notification_thread_->Post([notification, submit_status]() {
+          notification->PacketForwarderPermanentFailure(submit_status);
+        });
+        return false;
       }
+      return true;
     }
-    absl::Status write_status =
-        network_pipe_->WritePackets(std::move(encrypted));
-    if (!write_status.ok()) {
-      LOG(ERROR) << "Write network pipe error: " << write_status;
-      auto* notification = notification_;
-      notification_thread_->Post([notification, write_status]() {
-        notification->PacketForwarderFailed(write_status);
-      });
-      return false;
+    if (encryptor_ != nullptr) {
+      return WriteEncryptedPackets(
+          encryptor_->ProcessBatchInPlace(std::move(packets)));
     }
-    return true;
+    return WritePacketsToNetwork(std::move(packets));
   });
 
   // Downlink Flow.
@@ -154,30 +162,44 @@ void PacketForwarder::Start() {
                 << "].";
     }
 
-    downlink_packets_read_++;
+    downlink_packets_read_ += packets.size();
 
     std::vector<Packet> decrypted;
-    for (auto& packet : packets) {
-      if (decryptor_ != nullptr) {
-        auto decrypted_or = decryptor_->Process(packet);
+    if (decryptor_ != nullptr) {
+      auto results = decryptor_->ProcessBatchInPlace(std::move(packets));
+      decrypted.reserve(results.size());
+      for (auto& decrypted_or : results) {
         if (absl::IsResourceExhausted(decrypted_or.status())) {
           // This means we don't have the spare RAM to decrypt any more packets
           // right now, so we'll drop this packet. But this isn't a permanent
           // failure.
           downlink_packets_dropped_++;
-          return true;
+          continue;
+        }
+        // Packets rejected by the anti-replay window are expected when the
+        // network duplicates or delays packets, so they aren't logged.
+        if (absl::IsAlreadyExists(decrypted_or.status())) {
+          downlink_packets_replayed_++;
+          continue;
+        }
+        if (absl::IsOutOfRange(decrypted_or.status())) {
+          downlink_packets_too_old_++;
+          continue;
         }
         if (!decrypted_or.ok()) {
           LOG(WARNING) << "Decryption error status: " << decrypted_or.status();
           // To avoid DDoS attacks, silently ignore the error and drop the
           // packet.
           decryption_errors_++;
-          return true;
+          continue;
         }
         decrypted.emplace_back(std::move(decrypted_or).value());
-      } else {
-        decrypted.emplace_back(std::move(packet));
       }
+    } else {
+      decrypted = std::move(packets);
+    }
+    if (decrypted.empty()) {
+      return true;
     }
 
     auto write_status = utun_pipe_->WritePackets(std::move(decrypted));
@@ -202,6 +224,48 @@ void PacketForwarder::Start() {
   LOG(INFO) << "PacketForwarder[" << this << "] is started.";
 }
 
+bool PacketForwarder::WriteEncryptedPackets(
+    std::vector<absl::StatusOr<Packet>> results) {
+  std::vector<Packet> encrypted;
+  encrypted.reserve(results.size());
+  for (auto& encrypted_or : results) {
+    if (absl::IsResourceExhausted(encrypted_or.status())) {
+      // This means we don't have the spare RAM to encrypt any more packets
+      // right now, so we'll drop this packet. But this isn't a permanent
+      // failure.
+      uplink_packets_dropped_++;
+      continue;
+    }
+    if (!encrypted_or.ok()) {
+      LOG(WARNING) << "Encryption error status: " << encrypted_or.status();
+      auto* notification = notification_;
+      const auto& encryption_status = encrypted_or.status();
+      notification_thread_->Post([notification, encryption_status]() {
+        notification->PacketForwarderPermanentFailure(encryption_status);
+      });
+      return false;
+    }
+    encrypted.emplace_back(std::move(encrypted_or).value());
+  }
+  return WritePacketsToNetwork(std::move(encrypted));
+}
+
+bool PacketForwarder::WritePacketsToNetwork(std::vector<Packet> packets) {
+  if (packets.empty()) {
+    return true;
+  }
+  absl::Status write_status = network_pipe_->WritePackets(std::move(packets));
+  if (!write_status.ok()) {
+    LOG(ERROR) << "Write network pipe error: " << write_status;
+    auto* notification = notification_;
+    notification_thread_->Post([notification, write_status]() {
+      notification->PacketForwarderFailed(write_status);
+    });
+    return false;
+  }
+  return true;
+}
+
 void PacketForwarder::PacketForwarder::Stop() {
   {
     absl::MutexLock lock(&mutex_);
@@ -223,6 +287,12 @@ void PacketForwarder::PacketForwarder::Stop() {
               << "].";
   }
 
+  if (parallel_encryptor_ != nullptr) {
+    // Let the batches that were already read reach the network before it's
+    // closed.
+    parallel_encryptor_->Stop();
+  }
+
   network_pipe_->Close();
   LOG(INFO) << "Finished closing network_pipe_[" << network_pipe_ << "].";
 
@@ -235,6 +305,8 @@ void PacketForwarder::GetDebugInfo(DatapathDebugInfo* debug_info) {
   debug_info->set_uplink_packets_dropped(uplink_packets_dropped_.load());
   debug_info->set_downlink_packets_dropped(downlink_packets_dropped_.load());
   debug_info->set_decryption_errors(decryption_errors_.load());
+  debug_info->set_downlink_packets_replayed(downlink_packets_replayed_.load());
+  debug_info->set_downlink_packets_too_old(downlink_packets_too_old_.load());
 
   network_pipe_->GetDebugInfo(debug_info->mutable_network_pipe());
   utun_pipe_->GetDebugInfo(debug_info->mutable_device_pipe());
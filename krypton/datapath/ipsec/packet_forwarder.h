@@ -16,13 +16,18 @@
 #define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_PACKET_FORWARDER_H_
 
 #include <atomic>
+#include <memory>
+#include <vector>
 
 #include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/parallel_encryptor.h"
+#include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/pal/packet_pipe.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
 #include "privacy/net/krypton/utils/looper.h"
 #include "third_party/absl/base/thread_annotations.h"
 #include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
 #include "third_party/absl/synchronization/mutex.h"
 
 namespace privacy {
@@ -55,6 +60,14 @@ class PacketForwarder {
                            PacketPipe* network_pipe,
                            utils::LooperThread* looper,
                            NotificationInterface* notification);
+
+  // Like the above, but when `uplink_workers` is more than one, uplink packets
+  // are encrypted on that many threads instead of on the thread that reads
+  // them, and are written to the network in the order they were read.
+  PacketForwarder(CryptorInterface* encryptor, CryptorInterface* decryptor,
+                  PacketPipe* utun_pipe, PacketPipe* network_pipe,
+                  utils::LooperThread* looper,
+                  NotificationInterface* notification, int uplink_workers);
   ~PacketForwarder() = default;
 
   // Whether or not the pipe has started.
@@ -75,6 +88,15 @@ class PacketForwarder {
   void GetDebugInfo(DatapathDebugInfo* debug_info);
 
  private:
+  // Drops the packets that couldn't be encrypted for lack of memory, and
+  // writes the rest to the network pipe. Returns false if the uplink has
+  // failed and should stop.
+  bool WriteEncryptedPackets(std::vector<absl::StatusOr<Packet>> results);
+
+  // Writes uplink packets to the network pipe. Returns false if the write
+  // failed.
+  bool WritePacketsToNetwork(std::vector<Packet> packets);
+
   absl::Mutex mutex_;
   // Optional and not managed by this class.
   CryptorInterface* encryptor_;
@@ -87,12 +109,16 @@ class PacketForwarder {
   std::atomic_flag connected_;
   utils::LooperThread* notification_thread_;  // Not owned.
   NotificationInterface* notification_;       // Not owned.
+  // Only set when uplink encryption runs on several threads.
+  std::unique_ptr<ParallelEncryptor> parallel_encryptor_;
 
   std::atomic_int64_t uplink_packets_read_;
   std::atomic_int64_t downlink_packets_read_;
   std::atomic_int64_t uplink_packets_dropped_;
   std::atomic_int64_t downlink_packets_dropped_;
   std::atomic_int64_t decryption_errors_;
+  std::atomic_int64_t downlink_packets_replayed_;
+  std::atomic_int64_t downlink_packets_too_old_;
 };
 
 }  // namespace ipsec
@@ -0,0 +1,230 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end benchmarks for the PacketForwarder, with real cryptors between
+// test pipes. Packets are handed to the forwarder through the pipes' read
+// handlers, and collected from what it writes to the pipes.
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "privacy/net/krypton/benchmark_util.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/packet_forwarder.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "privacy/net/krypton/test_packet_pipe.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using PacketHandler = std::function<bool(absl::Status, std::vector<Packet>)>;
+
+class IgnoreNotifications : public PacketForwarder::NotificationInterface {
+ public:
+  void PacketForwarderFailed(const absl::Status& status) override {
+    LOG(ERROR) << "PacketForwarderFailed: " << status;
+  }
+  void PacketForwarderPermanentFailure(const absl::Status& status) override {
+    LOG(ERROR) << "PacketForwarderPermanentFailure: " << status;
+  }
+  void PacketForwarderConnected() override {}
+};
+
+// Buffers for a batch of packets with room around them for encapsulation,
+// the way a packet pipe would read them.
+class PacketBuffers {
+ public:
+  PacketBuffers(size_t batch_size, size_t max_size)
+      : capacity_(kPacketHeadroom + max_size + kPacketTailroom),
+        buffers_(batch_size * capacity_) {}
+
+  // Wraps the first `payloads.size()` buffers in packets holding copies of
+  // the payloads.
+  std::vector<Packet> Fill(const std::vector<Packet>& payloads) {
+    std::vector<Packet> packets;
+    packets.reserve(payloads.size());
+    for (size_t i = 0; i < payloads.size(); ++i) {
+      char* buffer = buffers_.data() + i * capacity_;
+      auto data = payloads[i].data();
+      memcpy(buffer + kPacketHeadroom, data.data(), data.size());
+      packets.emplace_back(buffer, capacity_, kPacketHeadroom, data.size(),
+                           payloads[i].protocol(), PacketOwner());
+    }
+    return packets;
+  }
+
+ private:
+  size_t capacity_;
+  std::vector<char> buffers_;
+};
+
+// A forwarder between two test pipes, with everything it needs.
+class ForwarderHarness {
+ public:
+  explicit ForwarderHarness(int uplink_workers)
+      : encryptor_(
+            Encryptor::Create(2, CreateBenchmarkTransformParams()).value()),
+        decryptor_(Decryptor::Create(CreateBenchmarkTransformParams()).value()),
+        utun_pipe_(1),
+        network_pipe_(2),
+        looper_("ForwarderHarness"),
+        forwarder_(encryptor_.get(), decryptor_.get(), &utun_pipe_,
+                   &network_pipe_, &looper_, &notification_, uplink_workers) {
+    forwarder_.Start();
+    uplink_ = utun_pipe_.GetReadHandler().value();
+    downlink_ = network_pipe_.GetReadHandler().value();
+  }
+
+  ~ForwarderHarness() {
+    forwarder_.Stop();
+    looper_.Stop();
+    looper_.Join();
+  }
+
+  // Hands `packets` to the forwarder as if they were read from the tunnel,
+  // and returns the encrypted packets it writes to the network.
+  std::vector<Packet> ForwardUplink(std::vector<Packet> packets) {
+    size_t count = packets.size();
+    if (!uplink_(absl::OkStatus(), std::move(packets))) {
+      return {};
+    }
+    return network_pipe_.TakeOutboundPackets(count);
+  }
+
+  // Hands `packets` to the forwarder as if they were read from the network,
+  // and returns the decrypted packets it writes to the tunnel.
+  std::vector<Packet> ForwardDownlink(std::vector<Packet> packets) {
+    size_t count = packets.size();
+    if (!downlink_(absl::OkStatus(), std::move(packets))) {
+      return {};
+    }
+    return utun_pipe_.TakeOutboundPackets(count);
+  }
+
+ private:
+  std::unique_ptr<Encryptor> encryptor_;
+  std::unique_ptr<Decryptor> decryptor_;
+  TestPacketPipe utun_pipe_;
+  TestPacketPipe network_pipe_;
+  utils::LooperThread looper_;
+  IgnoreNotifications notification_;
+  PacketForwarder forwarder_;
+  PacketHandler uplink_;
+  PacketHandler downlink_;
+};
+
+// Creates `count` plaintext packets of `size` bytes.
+std::vector<Packet> CreatePayloads(size_t count, size_t size,
+                                   std::string* storage) {
+  *storage = std::string(size, 'x');
+  std::vector<Packet> payloads;
+  for (size_t i = 0; i < count; ++i) {
+    payloads.emplace_back(storage->data(), storage->size(), IPProtocol::kIPv4,
+                          PacketOwner());
+  }
+  return payloads;
+}
+
+// Forwards batches of state.range(1) packets of state.range(0) bytes from the
+// tunnel to the network, encrypting them on state.range(2) threads.
+void BM_ForwardUplink(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const size_t batch_size = state.range(1);
+  ForwarderHarness harness(state.range(2));
+  std::string storage;
+  auto payloads = CreatePayloads(batch_size, size, &storage);
+  PacketBuffers buffers(batch_size, size);
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    auto packets = buffers.Fill(payloads);
+    absl::Time start = absl::Now();
+    auto encrypted = harness.ForwardUplink(std::move(packets));
+    latency.RecordBatch(absl::Now() - start, batch_size);
+    if (encrypted.size() != batch_size) {
+      state.SkipWithError("Not every packet was forwarded");
+      break;
+    }
+  }
+  ReportPacketRates(state, state.iterations() * batch_size,
+                    state.iterations() * batch_size * size);
+  latency.Report(state);
+}
+BENCHMARK(BM_ForwardUplink)
+    ->ArgNames({"size", "batch", "workers"})
+    ->Args({64, 1, 1})
+    ->Args({1280, 1, 1})
+    ->Args({64, 32, 1})
+    ->Args({1280, 32, 1})
+    ->Args({1280, 32, 4})
+    ->UseRealTime();
+
+// Forwards batches of state.range(1) packets of state.range(0) bytes from the
+// tunnel to the network, and then the encrypted packets back from the network
+// to the tunnel, as if the server had echoed them.
+void BM_ForwardRoundTrip(benchmark::State& state) {
+  const size_t size = state.range(0);
+  const size_t batch_size = state.range(1);
+  ForwarderHarness harness(/*uplink_workers=*/1);
+  std::string storage;
+  auto payloads = CreatePayloads(batch_size, size, &storage);
+  PacketBuffers uplink_buffers(batch_size, size);
+  PacketBuffers downlink_buffers(batch_size, kMaxIpsecDataSize);
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    auto packets = uplink_buffers.Fill(payloads);
+    absl::Time start = absl::Now();
+    auto encrypted = harness.ForwardUplink(std::move(packets));
+    // The test pipe keeps read-only copies, but a network pipe would read
+    // into buffers that can be decrypted in place.
+    auto decrypted =
+        harness.ForwardDownlink(downlink_buffers.Fill(encrypted));
+    latency.RecordBatch(absl::Now() - start, batch_size);
+    if (decrypted.size() != batch_size) {
+      state.SkipWithError("Not every packet made the round trip");
+      break;
+    }
+  }
+  ReportPacketRates(state, state.iterations() * batch_size,
+                    state.iterations() * batch_size * size);
+  latency.Report(state);
+}
+BENCHMARK(BM_ForwardRoundTrip)
+    ->ArgNames({"size", "batch"})
+    ->Args({64, 1})
+    ->Args({1280, 1})
+    ->Args({64, 32})
+    ->Args({1280, 32})
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
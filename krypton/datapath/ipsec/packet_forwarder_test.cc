@@ -30,6 +30,9 @@
 #include "testing/base/public/gunit.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
 
 namespace privacy {
 namespace krypton {
@@ -46,15 +49,19 @@ class MockNotification : public PacketForwarder::NotificationInterface {
 
 class MockCryptor : public CryptorInterface {
  public:
-  MockCryptor() : count_(0), always_fail_(false), fail_on_odd_packets_(false) {}
+  MockCryptor()
+      : count_(0),
+        always_fail_(false),
+        fail_on_odd_packets_(false),
+        failure_(absl::InternalError("Unable to process")) {}
 
   absl::StatusOr<Packet> Process(const Packet& /*packet*/) override {
     count_++;
     if (always_fail_) {
-      return absl::InternalError("Unable to process");
+      return failure_;
     }
     if (fail_on_odd_packets_ && count_ % 2 != 0) {
-      return absl::InternalError("Unable to process");
+      return failure_;
     }
     // Since the string is a literal, we don't need to worry about deleting it.
     return Packet("bar", 3, IPProtocol::kIPv4, []() {});
@@ -66,10 +73,32 @@ class MockCryptor : public CryptorInterface {
     fail_on_odd_packets_ = fail_on_odd_packets;
   }
 
+  void set_failure(absl::Status failure) { failure_ = std::move(failure); }
+
  private:
-  int count_;
+  std::atomic_int count_;
   bool always_fail_;
   bool fail_on_odd_packets_;
+  absl::Status failure_;
+};
+
+// Passes each packet through unchanged, after sleeping for longer on every
+// fourth one, so that parallel workers finish their batches out of order.
+class SlowEveryFourthCryptor : public CryptorInterface {
+ public:
+  SlowEveryFourthCryptor() : count_(0) {}
+
+  absl::StatusOr<Packet> Process(const Packet& packet) override {
+    if (count_++ % 4 == 0) {
+      absl::SleepFor(absl::Milliseconds(2));
+    }
+    // The data belongs to the pipe that read it, which outlives the packet.
+    return Packet(packet.data().data(), packet.data().size(),
+                  packet.protocol(), PacketOwner());
+  }
+
+ private:
+  std::atomic_int count_;
 };
 
 class MockPacketPipe : public PacketPipe {
@@ -79,6 +108,15 @@ class MockPacketPipe : public PacketPipe {
 
   const std::vector<Packet>& OutboundPackets() const { return sent_packets_; }
 
+  // Reads "packet 0" through "packet 99" instead of 100 identical packets.
+  void UseDistinctPayloads() {
+    for (int i = 0; i < 100; i++) {
+      payloads_.push_back(absl::StrCat("packet ", i));
+    }
+  }
+
+  const std::vector<std::string>& payloads() const { return payloads_; }
+
   void Close() override {
     shutdown_ = true;
     packet_thread_.join();
@@ -94,9 +132,13 @@ class MockPacketPipe : public PacketPipe {
     // Simulate a non-blocking async API.
     packet_thread_ = std::thread([=] {
       for (int i = 0; i < 100; i++) {
-        // Since we're using a string literal, we don't have to worry about
-        // freeing it.
+        // Since we're using a string literal, or a payload owned by the pipe,
+        // we don't have to worry about freeing it.
         Packet packet("foo", 3, IPProtocol::kIPv4, []() {});
+        if (!payloads_.empty()) {
+          packet = Packet(payloads_[i].data(), payloads_[i].size(),
+                          IPProtocol::kIPv4, PacketOwner());
+        }
         std::vector<Packet> packets;
         packets.emplace_back(std::move(packet));
         auto success = handler(absl::OkStatus(), std::move(packets));
@@ -122,6 +164,7 @@ class MockPacketPipe : public PacketPipe {
 
  private:
   std::atomic_bool shutdown_;
+  std::vector<std::string> payloads_;
   std::vector<Packet> sent_packets_;
   std::thread packet_thread_;
 };
@@ -175,6 +218,34 @@ TEST_F(PacketForwarderTest, TestPacketsAreHandledCorrectly) {
   notification_thread_.Join();
 }
 
+TEST_F(PacketForwarderTest, TestParallelUplinkEncryption) {
+  SlowEveryFourthCryptor encryptor;
+  MockCryptor decryptor;
+  inbound_pipe_.UseDistinctPayloads();
+  auto forwarder = PacketForwarder(&encryptor, &decryptor, &inbound_pipe_,
+                                   &outbound_pipe_, &notification_thread_,
+                                   &notification_, /*uplink_workers=*/4);
+
+  EXPECT_CALL(notification_, PacketForwarderConnected()).Times(1);
+
+  forwarder.Start();
+
+  forwarder.Stop();
+
+  // Every uplink packet that was read has been encrypted and written by the
+  // time Stop() returns, in the order it was read, even though the workers
+  // finished them out of order.
+  std::vector<std::string> written;
+  for (const auto& packet : outbound_pipe_.OutboundPackets()) {
+    written.emplace_back(packet.data());
+  }
+  EXPECT_THAT(written, ::testing::ElementsAreArray(inbound_pipe_.payloads()));
+  EXPECT_EQ(inbound_pipe_.OutboundPackets().size(), 100);
+
+  notification_thread_.Stop();
+  notification_thread_.Join();
+}
+
 TEST_F(PacketForwarderTest, TestNoCryptors) {
   auto forwarder =
       PacketForwarder(nullptr, nullptr, &inbound_pipe_, &outbound_pipe_,
@@ -260,6 +331,31 @@ TEST_F(PacketForwarderTest, TestCounters) {
   notification_thread_.Join();
 }
 
+TEST_F(PacketForwarderTest, TestReplayedPacketsAreCountedSeparately) {
+  auto encryptor = MockCryptor();
+  auto decryptor = MockCryptor();
+  decryptor.set_fail_on_odd_packets(true);
+  decryptor.set_failure(absl::AlreadyExistsError("Replayed packet"));
+  auto forwarder =
+      PacketForwarder(&encryptor, &decryptor, &inbound_pipe_, &outbound_pipe_,
+                      &notification_thread_, &notification_);
+
+  forwarder.Start();
+  forwarder.Stop();
+
+  EXPECT_EQ(inbound_pipe_.OutboundPackets().size(), 50);
+
+  DatapathDebugInfo debug_info;
+  forwarder.GetDebugInfo(&debug_info);
+  EXPECT_EQ(100, debug_info.downlink_packets_read());
+  EXPECT_EQ(50, debug_info.downlink_packets_replayed());
+  EXPECT_EQ(0, debug_info.downlink_packets_too_old());
+  EXPECT_EQ(0, debug_info.decryption_errors());
+
+  notification_thread_.Stop();
+  notification_thread_.Join();
+}
+
 }  // namespace ipsec
 }  // namespace datapath
 }  // namespace krypton
@@ -0,0 +1,144 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/parallel_encryptor.h"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+ParallelEncryptor::ParallelEncryptor(CryptorInterface* encryptor,
+                                     int num_workers, EmitFunction emit)
+    : encryptor_(encryptor), emit_(std::move(emit)) {
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  workers_.reserve(num_workers);
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.push_back(std::make_unique<utils::LooperThread>(
+        absl::StrCat("ParallelEncryptor Worker ", i)));
+  }
+}
+
+ParallelEncryptor::~ParallelEncryptor() { Stop(); }
+
+absl::Status ParallelEncryptor::Submit(std::vector<Packet> packets) {
+  absl::MutexLock lock(&mutex_);
+  while (!stopped_ && !emit_failed_ &&
+         next_ticket_ - next_to_emit_ >= kMaxBatchesInFlight) {
+    condition_.Wait(&mutex_);
+  }
+  if (stopped_ || emit_failed_) {
+    return absl::CancelledError("ParallelEncryptor is stopped");
+  }
+  // Reserving while holding the lock keeps the sequence numbers in the same
+  // order as the tickets, which is the order the batches are emitted in.
+  auto reservation = encryptor_->ReserveBatch(packets.size());
+  if (!reservation.ok()) {
+    return reservation.status();
+  }
+  const uint64_t ticket = next_ticket_++;
+  queued_.push_back({ticket, *reservation, std::move(packets)});
+  // Every batch gets its own task, but a task encrypts whichever batch has been
+  // waiting longest, so a slow worker doesn't hold up the queue. The task is
+  // posted while holding the lock, so that Stop() can't stop the workers in
+  // between.
+  workers_[ticket % workers_.size()]->Post([this] { EncryptNextBatch(); });
+  return absl::OkStatus();
+}
+
+void ParallelEncryptor::EncryptNextBatch() {
+  Batch batch;
+  {
+    absl::MutexLock lock(&mutex_);
+    if (queued_.empty()) {
+      LOG(ERROR) << "ParallelEncryptor has no batch to encrypt";
+      return;
+    }
+    batch = std::move(queued_.front());
+    queued_.pop_front();
+  }
+
+  auto results = encryptor_->ProcessReservedBatchInPlace(
+      std::move(batch.packets), batch.reservation);
+
+  absl::MutexLock lock(&mutex_);
+  encrypted_.emplace(batch.ticket, std::move(results));
+  if (emitting_) {
+    // The worker that is emitting will pick this batch up when it's next.
+    return;
+  }
+  emitting_ = true;
+  while (true) {
+    auto next = encrypted_.find(next_to_emit_);
+    if (next == encrypted_.end()) {
+      break;
+    }
+    auto ready = std::move(next->second);
+    encrypted_.erase(next);
+    bool emitted = false;
+    if (!emit_failed_) {
+      // Emitting can block on the network, so don't hold up the other workers
+      // or the submitter while it does.
+      mutex_.Unlock();
+      emitted = emit_(std::move(ready));
+      mutex_.Lock();
+      if (!emitted) {
+        emit_failed_ = true;
+      }
+    }
+    next_to_emit_++;
+    condition_.SignalAll();
+  }
+  emitting_ = false;
+}
+
+void ParallelEncryptor::Stop() {
+  {
+    absl::MutexLock lock(&mutex_);
+    if (stopped_) {
+      return;
+    }
+    stopped_ = true;
+    condition_.SignalAll();
+  }
+  // The workers finish everything that was posted to them before stopping, so
+  // every submitted batch is emitted or dropped by the time they're joined.
+  for (auto& worker : workers_) {
+    worker->Stop();
+  }
+  for (auto& worker : workers_) {
+    worker->Join();
+  }
+}
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_PARALLEL_ENCRYPTOR_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_PARALLEL_ENCRYPTOR_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+// A pipeline stage that encrypts uplink batches on a small pool of worker
+// threads, and hands the results on in the order the batches were submitted.
+//
+// Submit() reserves the sequence numbers for the whole batch on the calling
+// thread, so they increase in the order the packets were read, then queues the
+// batch for the next free worker. Workers seal batches concurrently. A finished
+// batch waits in a reorder buffer until every earlier batch has been emitted,
+// so packets reach the network in sequence number order and stay inside the
+// server's anti-replay window.
+//
+// This class is thread safe.
+class ParallelEncryptor {
+ public:
+  // Called with the results for each batch, one per packet, in the order the
+  // batches were submitted. Only one call is made at a time. Returns false if
+  // no more batches should be emitted, in which case later batches are
+  // dropped and Submit() fails.
+  using EmitFunction =
+      std::function<bool(std::vector<absl::StatusOr<Packet>> results)>;
+
+  // The most batches that can be submitted but not yet emitted. Submit()
+  // blocks once there are this many, so the reorder buffer stays small.
+  static constexpr int kMaxBatchesInFlight = 16;
+
+  // `encryptor` is not owned, and must support being used from several
+  // threads at once.
+  ParallelEncryptor(CryptorInterface* encryptor, int num_workers,
+                    EmitFunction emit);
+  ~ParallelEncryptor();
+
+  // Disallow copy and assign.
+  ParallelEncryptor(const ParallelEncryptor& other) = delete;
+  ParallelEncryptor& operator=(const ParallelEncryptor& other) = delete;
+
+  // Reserves sequence numbers for `packets` and queues them to be encrypted.
+  // Returns the error if the reservation fails, or a cancelled error if the
+  // stage has been stopped or emitting has failed.
+  absl::Status Submit(std::vector<Packet> packets) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Waits for every submitted batch to be emitted, then stops the workers.
+  // Submit() fails after this is called.
+  void Stop() ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  struct Batch {
+    uint64_t ticket;
+    uint64_t reservation;
+    std::vector<Packet> packets;
+  };
+
+  // Encrypts the oldest queued batch, then emits whatever batches are ready.
+  void EncryptNextBatch() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  CryptorInterface* encryptor_;  // Not owned.
+  EmitFunction emit_;
+
+  absl::Mutex mutex_;
+  absl::CondVar condition_;
+  bool stopped_ ABSL_GUARDED_BY(mutex_) = false;
+  bool emit_failed_ ABSL_GUARDED_BY(mutex_) = false;
+  // Whether a worker is currently emitting batches.
+  bool emitting_ ABSL_GUARDED_BY(mutex_) = false;
+  uint64_t next_ticket_ ABSL_GUARDED_BY(mutex_) = 0;
+  uint64_t next_to_emit_ ABSL_GUARDED_BY(mutex_) = 0;
+  std::deque<Batch> queued_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<uint64_t, std::vector<absl::StatusOr<Packet>>>
+      encrypted_ ABSL_GUARDED_BY(mutex_);
+
+  std::vector<std::unique_ptr<utils::LooperThread>> workers_;
+};
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_PARALLEL_ENCRYPTOR_H_
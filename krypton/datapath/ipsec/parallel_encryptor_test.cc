@@ -0,0 +1,238 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/parallel_encryptor.h"
+
+#include <arpa/inet.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::status::StatusIs;
+
+// Copies `data` into a new buffer with room around it for encapsulation, the
+// way a packet pipe would read it.
+Packet CreateWritablePacket(absl::string_view data, IPProtocol protocol) {
+  const size_t capacity = kPacketHeadroom + data.size() + kPacketTailroom;
+  char* buffer = new char[capacity];
+  memcpy(buffer + kPacketHeadroom, data.data(), data.size());
+  return Packet(buffer, capacity, kPacketHeadroom, data.size(), protocol,
+                [buffer] { delete[] buffer; });
+}
+
+std::vector<Packet> CreateBatch(int batch, int size) {
+  std::vector<Packet> packets;
+  for (int i = 0; i < size; ++i) {
+    packets.push_back(CreateWritablePacket(
+        absl::StrCat("batch ", batch, " packet ", i), IPProtocol::kIPv4));
+  }
+  return packets;
+}
+
+// A cryptor that passes packets through unchanged, taking longer for earlier
+// batches, so that later batches tend to finish first.
+class SlowCryptor : public CryptorInterface {
+ public:
+  absl::StatusOr<Packet> Process(const Packet& /*packet*/) override {
+    return absl::UnimplementedError("Not implemented");
+  }
+
+  absl::StatusOr<uint64_t> ReserveBatch(size_t count) override {
+    if (!reserve_status_.ok()) {
+      return reserve_status_;
+    }
+    uint64_t reservation = next_reservation_;
+    next_reservation_ += count;
+    return reservation;
+  }
+
+  std::vector<absl::StatusOr<Packet>> ProcessReservedBatchInPlace(
+      std::vector<Packet> packets, uint64_t reservation) override {
+    absl::SleepFor(absl::Milliseconds(reservation < 40 ? 40 - reservation : 0));
+    std::vector<absl::StatusOr<Packet>> results;
+    for (auto& packet : packets) {
+      results.push_back(std::move(packet));
+    }
+    return results;
+  }
+
+  void set_reserve_status(absl::Status status) { reserve_status_ = status; }
+
+ private:
+  // Only used from the submitting thread.
+  uint64_t next_reservation_ = 0;
+  absl::Status reserve_status_;
+};
+
+// Collects the data of every packet that is emitted.
+class Collector {
+ public:
+  ParallelEncryptor::EmitFunction Emit() {
+    return [this](std::vector<absl::StatusOr<Packet>> results) {
+      absl::MutexLock lock(&mutex_);
+      for (const auto& result : results) {
+        EXPECT_OK(result);
+        if (result.ok()) {
+          emitted_.emplace_back(result->data());
+        }
+      }
+      ++batches_;
+      return batches_ != fail_after_;
+    };
+  }
+
+  std::vector<std::string> emitted() {
+    absl::MutexLock lock(&mutex_);
+    return emitted_;
+  }
+
+  int batches() {
+    absl::MutexLock lock(&mutex_);
+    return batches_;
+  }
+
+  void set_fail_after(int batches) { fail_after_ = batches; }
+
+ private:
+  absl::Mutex mutex_;
+  std::vector<std::string> emitted_ ABSL_GUARDED_BY(mutex_);
+  int batches_ ABSL_GUARDED_BY(mutex_) = 0;
+  int fail_after_ = -1;
+};
+
+TEST(ParallelEncryptorTest, EmitsBatchesInSubmissionOrder) {
+  SlowCryptor cryptor;
+  Collector collector;
+  ParallelEncryptor encryptor(&cryptor, 4, collector.Emit());
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      expected.push_back(absl::StrCat("batch ", i, " packet ", j));
+    }
+    ASSERT_OK(encryptor.Submit(CreateBatch(i, 2)));
+  }
+  encryptor.Stop();
+
+  EXPECT_EQ(collector.emitted(), expected);
+  EXPECT_EQ(collector.batches(), 10);
+}
+
+TEST(ParallelEncryptorTest, SubmitFailsAfterStop) {
+  SlowCryptor cryptor;
+  Collector collector;
+  ParallelEncryptor encryptor(&cryptor, 2, collector.Emit());
+  encryptor.Stop();
+
+  EXPECT_THAT(encryptor.Submit(CreateBatch(0, 1)),
+              StatusIs(absl::StatusCode::kCancelled));
+  EXPECT_EQ(collector.batches(), 0);
+}
+
+TEST(ParallelEncryptorTest, SubmitReturnsReservationErrors) {
+  SlowCryptor cryptor;
+  cryptor.set_reserve_status(absl::InternalError("expired"));
+  Collector collector;
+  ParallelEncryptor encryptor(&cryptor, 2, collector.Emit());
+
+  EXPECT_THAT(encryptor.Submit(CreateBatch(0, 1)),
+              StatusIs(absl::StatusCode::kInternal));
+  encryptor.Stop();
+  EXPECT_EQ(collector.batches(), 0);
+}
+
+TEST(ParallelEncryptorTest, StopsEmittingAfterFailure) {
+  SlowCryptor cryptor;
+  Collector collector;
+  collector.set_fail_after(2);
+  ParallelEncryptor encryptor(&cryptor, 4, collector.Emit());
+
+  absl::Status status;
+  for (int i = 0; i < 100 && status.ok(); ++i) {
+    status = encryptor.Submit(CreateBatch(i, 1));
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_THAT(status, StatusIs(absl::StatusCode::kCancelled));
+  encryptor.Stop();
+
+  EXPECT_THAT(collector.emitted(),
+              ElementsAre("batch 0 packet 0", "batch 1 packet 0"));
+}
+
+TEST(ParallelEncryptorTest, SequenceNumbersFollowSubmissionOrder) {
+  TransformParams params;
+  auto ip_sec_transform_params = params.mutable_ipsec();
+  ip_sec_transform_params->set_uplink_key(std::string(32, 'z'));
+  ip_sec_transform_params->set_downlink_key(std::string(32, 'z'));
+  ip_sec_transform_params->set_uplink_salt(std::string(4, 'a'));
+  ip_sec_transform_params->set_downlink_salt(std::string(4, 'a'));
+  ASSERT_OK_AND_ASSIGN(auto cryptor, Encryptor::Create(2, params));
+  ASSERT_OK_AND_ASSIGN(auto decryptor, Decryptor::Create(params));
+
+  constexpr int kBatches = 100;
+  constexpr int kBatchSize = 8;
+  Collector collector;
+  ParallelEncryptor encryptor(cryptor.get(), 4, collector.Emit());
+  for (int i = 0; i < kBatches; ++i) {
+    ASSERT_OK(encryptor.Submit(CreateBatch(i, kBatchSize)));
+  }
+  encryptor.Stop();
+
+  auto emitted = collector.emitted();
+  ASSERT_EQ(emitted.size(), kBatches * kBatchSize);
+  for (int i = 0; i < emitted.size(); ++i) {
+    EspHeader header;
+    memcpy(&header, emitted[i].data(), sizeof(header));
+    EXPECT_EQ(ntohl(header.sequence_number), i);
+
+    Packet packet(emitted[i].data(), emitted[i].size(), IPProtocol::kUnknown,
+                  [] {});
+    auto decrypted = decryptor->Process(packet);
+    ASSERT_OK(decrypted);
+    EXPECT_EQ(decrypted->data(), absl::StrCat("batch ", i / kBatchSize,
+                                              " packet ", i % kBatchSize));
+  }
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
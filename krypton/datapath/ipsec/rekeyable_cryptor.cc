@@ -0,0 +1,297 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/rekeyable_cryptor.h"
+
+#include <arpa/inet.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+RekeyableEncryptor::RekeyableEncryptor(
+    std::unique_ptr<CryptorInterface> encryptor, SaVolumeLimits limits,
+    std::function<void()> on_soft_limit)
+    : limits_(limits),
+      on_soft_limit_(std::move(on_soft_limit)),
+      sa_(std::make_shared<SecurityAssociation>(std::move(encryptor))) {}
+
+void RekeyableEncryptor::Rekey(std::unique_ptr<CryptorInterface> encryptor) {
+  absl::MutexLock l(&mutex_);
+  retired_.push_back(
+      std::atomic_exchange(
+          &sa_, std::make_shared<SecurityAssociation>(std::move(encryptor)))
+          ->encryptor);
+}
+
+uint64_t RekeyableEncryptor::packets_encrypted() const {
+  return current()->packets.load(std::memory_order_relaxed);
+}
+
+uint64_t RekeyableEncryptor::bytes_encrypted() const {
+  return current()->bytes.load(std::memory_order_relaxed);
+}
+
+std::vector<std::shared_ptr<CryptorInterface>>
+RekeyableEncryptor::TakeRetired() {
+  std::vector<std::shared_ptr<CryptorInterface>> retired;
+  absl::MutexLock l(&mutex_);
+  retired.swap(retired_);
+  return retired;
+}
+
+std::shared_ptr<RekeyableEncryptor::SecurityAssociation>
+RekeyableEncryptor::current() const {
+  return std::atomic_load(&sa_);
+}
+
+void RekeyableEncryptor::Add(SecurityAssociation& sa, uint64_t packets,
+                             uint64_t bytes) {
+  const uint64_t total_packets =
+      sa.packets.fetch_add(packets, std::memory_order_relaxed) + packets;
+  const uint64_t total_bytes =
+      sa.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  const bool over_limit =
+      (limits_.packets != 0 && total_packets >= limits_.packets) ||
+      (limits_.bytes != 0 && total_bytes >= limits_.bytes);
+  if (over_limit && !sa.soft_limit_reached.exchange(true) &&
+      on_soft_limit_ != nullptr) {
+    on_soft_limit_();
+  }
+}
+
+void RekeyableEncryptor::Count(
+    SecurityAssociation& sa,
+    const std::vector<absl::StatusOr<Packet>>& results) {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  for (const auto& result : results) {
+    if (result.ok()) {
+      ++packets;
+      bytes += result->data().size();
+    }
+  }
+  if (packets > 0) {
+    Add(sa, packets, bytes);
+  }
+}
+
+absl::StatusOr<Packet> RekeyableEncryptor::Process(const Packet& packet) {
+  auto sa = current();
+  auto result = sa->encryptor->Process(packet);
+  if (result.ok()) {
+    Add(*sa, 1, result->data().size());
+  }
+  return result;
+}
+
+std::vector<absl::StatusOr<Packet>> RekeyableEncryptor::ProcessBatch(
+    absl::Span<const Packet> packets) {
+  auto sa = current();
+  auto results = sa->encryptor->ProcessBatch(packets);
+  Count(*sa, results);
+  return results;
+}
+
+std::vector<absl::StatusOr<Packet>> RekeyableEncryptor::ProcessBatchInPlace(
+    std::vector<Packet> packets) {
+  auto sa = current();
+  auto results = sa->encryptor->ProcessBatchInPlace(std::move(packets));
+  Count(*sa, results);
+  return results;
+}
+
+absl::StatusOr<uint64_t> RekeyableEncryptor::ReserveBatch(size_t count) {
+  auto sa = current();
+  PPN_ASSIGN_OR_RETURN(uint64_t reservation,
+                       sa->encryptor->ReserveBatch(count));
+  absl::MutexLock l(&mutex_);
+  uint64_t id = next_reservation_++;
+  reservations_.emplace(id, Reservation{std::move(sa), reservation});
+  return id;
+}
+
+std::vector<absl::StatusOr<Packet>>
+RekeyableEncryptor::ProcessReservedBatchInPlace(std::vector<Packet> packets,
+                                                uint64_t reservation) {
+  Reservation reserved{};
+  {
+    absl::MutexLock l(&mutex_);
+    auto it = reservations_.find(reservation);
+    if (it == reservations_.end()) {
+      std::vector<absl::StatusOr<Packet>> results;
+      results.reserve(packets.size());
+      for (size_t i = 0; i < packets.size(); ++i) {
+        results.push_back(absl::InternalError("Unknown batch reservation"));
+      }
+      return results;
+    }
+    reserved = std::move(it->second);
+    reservations_.erase(it);
+  }
+  auto results = reserved.sa->encryptor->ProcessReservedBatchInPlace(
+      std::move(packets), reserved.reservation);
+  Count(*reserved.sa, results);
+  return results;
+}
+
+RekeyableDecryptor::RekeyableDecryptor(
+    uint32_t spi, std::unique_ptr<CryptorInterface> decryptor)
+    : security_associations_(std::make_shared<const SecurityAssociations>(
+          SecurityAssociations{{spi, std::move(decryptor)}, std::nullopt})) {}
+
+void RekeyableDecryptor::Rekey(uint32_t spi,
+                               std::unique_ptr<CryptorInterface> decryptor) {
+  absl::MutexLock l(&mutex_);
+  auto sas = security_associations();
+  if (sas->previous) {
+    retired_.push_back(sas->previous->decryptor);
+  }
+  std::atomic_store(&security_associations_,
+                    std::make_shared<const SecurityAssociations>(
+                        SecurityAssociations{{spi, std::move(decryptor)},
+                                             sas->current}));
+}
+
+void RekeyableDecryptor::RetirePrevious() {
+  absl::MutexLock l(&mutex_);
+  auto sas = security_associations();
+  if (!sas->previous) {
+    return;
+  }
+  retired_.push_back(sas->previous->decryptor);
+  std::atomic_store(&security_associations_,
+                    std::make_shared<const SecurityAssociations>(
+                        SecurityAssociations{sas->current, std::nullopt}));
+}
+
+std::vector<std::shared_ptr<CryptorInterface>>
+RekeyableDecryptor::TakeRetired() {
+  std::vector<std::shared_ptr<CryptorInterface>> retired;
+  absl::MutexLock l(&mutex_);
+  retired.swap(retired_);
+  return retired;
+}
+
+bool RekeyableDecryptor::has_previous() const {
+  return security_associations()->previous.has_value();
+}
+
+std::shared_ptr<const RekeyableDecryptor::SecurityAssociations>
+RekeyableDecryptor::security_associations() const {
+  return std::atomic_load(&security_associations_);
+}
+
+/* static */ bool RekeyableDecryptor::UsesPrevious(
+    const SecurityAssociations& sas, const Packet& packet) {
+  if (!sas.previous || packet.data().size() < sizeof(uint32_t)) {
+    return false;
+  }
+  uint32_t spi;
+  memcpy(&spi, packet.data().data(), sizeof(spi));
+  spi = ntohl(spi);
+  return spi != sas.current.spi && spi == sas.previous->spi;
+}
+
+absl::StatusOr<Packet> RekeyableDecryptor::Process(const Packet& packet) {
+  auto sas = security_associations();
+  if (UsesPrevious(*sas, packet)) {
+    return sas->previous->decryptor->Process(packet);
+  }
+  return sas->current.decryptor->Process(packet);
+}
+
+std::vector<absl::StatusOr<Packet>> RekeyableDecryptor::ProcessBatch(
+    absl::Span<const Packet> packets) {
+  auto sas = security_associations();
+  if (!sas->previous) {
+    return sas->current.decryptor->ProcessBatch(packets);
+  }
+  // Only happens for a short while after a rekey, so don't bother batching.
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(packets.size());
+  for (const auto& packet : packets) {
+    if (UsesPrevious(*sas, packet)) {
+      results.push_back(sas->previous->decryptor->Process(packet));
+    } else {
+      results.push_back(sas->current.decryptor->Process(packet));
+    }
+  }
+  return results;
+}
+
+std::vector<absl::StatusOr<Packet>> RekeyableDecryptor::ProcessBatchInPlace(
+    std::vector<Packet> packets) {
+  auto sas = security_associations();
+  if (!sas->previous) {
+    return sas->current.decryptor->ProcessBatchInPlace(std::move(packets));
+  }
+
+  // Split the batch by SA, decrypt each half as a batch, and put the results
+  // back in the original order.
+  std::vector<bool> uses_previous(packets.size());
+  std::vector<Packet> current_packets;
+  std::vector<Packet> previous_packets;
+  for (size_t i = 0; i < packets.size(); ++i) {
+    uses_previous[i] = UsesPrevious(*sas, packets[i]);
+    if (uses_previous[i]) {
+      previous_packets.push_back(std::move(packets[i]));
+    } else {
+      current_packets.push_back(std::move(packets[i]));
+    }
+  }
+  if (previous_packets.empty()) {
+    return sas->current.decryptor->ProcessBatchInPlace(
+        std::move(current_packets));
+  }
+  auto current_results =
+      sas->current.decryptor->ProcessBatchInPlace(std::move(current_packets));
+  auto previous_results = sas->previous->decryptor->ProcessBatchInPlace(
+      std::move(previous_packets));
+
+  std::vector<absl::StatusOr<Packet>> results;
+  results.reserve(uses_previous.size());
+  size_t next_current = 0;
+  size_t next_previous = 0;
+  for (bool previous : uses_previous) {
+    if (previous) {
+      results.push_back(std::move(previous_results[next_previous++]));
+    } else {
+      results.push_back(std::move(current_results[next_current++]));
+    }
+  }
+  return results;
+}
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
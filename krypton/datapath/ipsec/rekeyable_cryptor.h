@@ -0,0 +1,213 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REKEYABLE_CRYPTOR_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REKEYABLE_CRYPTOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+// Soft limits on how much traffic one SA may protect before it should be
+// rekeyed. Zero means no limit.
+struct SaVolumeLimits {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+};
+
+// Encrypts uplink packets with the newest security association, and switches
+// to a new one without the packet forwarder having to stop.
+//
+// The current SA is swapped atomically, so batches being encrypted while a
+// rekey happens finish with the SA they started with. Batches reserved with
+// ReserveBatch() are always encrypted with the SA they were reserved on, so
+// their sequence numbers stay valid.
+//
+// Replaced SAs are kept until TakeRetired() hands them over, because
+// destroying an SA waits for every packet it has handed out to be released.
+// That must never happen on a thread that is still holding some of those
+// packets, or while holding a lock that such a thread may need.
+//
+// The packets and bytes encrypted with each SA are counted, and the first
+// batch that takes the current SA past either of its soft limits calls
+// `on_soft_limit` once, on the thread that encrypted it. That leaves time to
+// rekey before the SA runs out of sequence numbers.
+//
+// This class is thread safe.
+class RekeyableEncryptor : public CryptorInterface {
+ public:
+  explicit RekeyableEncryptor(std::unique_ptr<CryptorInterface> encryptor,
+                              SaVolumeLimits limits = {},
+                              std::function<void()> on_soft_limit = nullptr);
+  ~RekeyableEncryptor() override = default;
+
+  // Encrypts every packet from now on with `encryptor`, whose counts start
+  // from zero.
+  void Rekey(std::unique_ptr<CryptorInterface> encryptor);
+
+  // Returns the packets and bytes encrypted with the current SA so far.
+  uint64_t packets_encrypted() const;
+  uint64_t bytes_encrypted() const;
+
+  // Returns the SAs replaced by earlier calls to Rekey(), which are destroyed
+  // when the caller drops them. Only call this once packets encrypted with them
+  // can no longer be in flight, e.g. a grace period after the rekey, and drop
+  // the result without holding any locks.
+  std::vector<std::shared_ptr<CryptorInterface>> TakeRetired();
+
+  absl::StatusOr<Packet> Process(const Packet& packet) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatch(
+      absl::Span<const Packet> packets) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatchInPlace(
+      std::vector<Packet> packets) override;
+
+  absl::StatusOr<uint64_t> ReserveBatch(size_t count) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessReservedBatchInPlace(
+      std::vector<Packet> packets, uint64_t reservation) override;
+
+ private:
+  struct SecurityAssociation {
+    explicit SecurityAssociation(std::unique_ptr<CryptorInterface> encryptor)
+        : encryptor(std::move(encryptor)) {}
+
+    // Shared with retired_ once the SA is replaced, so that the SA itself can
+    // be dropped by whichever thread finishes with it last.
+    std::shared_ptr<CryptorInterface> encryptor;
+    std::atomic_uint64_t packets{0};
+    std::atomic_uint64_t bytes{0};
+    std::atomic_bool soft_limit_reached{false};
+  };
+
+  // A reservation made on a particular SA.
+  struct Reservation {
+    std::shared_ptr<SecurityAssociation> sa;
+    uint64_t reservation;
+  };
+
+  std::shared_ptr<SecurityAssociation> current() const;
+
+  // Adds to the SA's counts, and calls on_soft_limit_ if they just crossed a
+  // limit.
+  void Add(SecurityAssociation& sa, uint64_t packets, uint64_t bytes);
+
+  // Adds the packets in `results` that were encrypted successfully.
+  void Count(SecurityAssociation& sa,
+             const std::vector<absl::StatusOr<Packet>>& results);
+
+  const SaVolumeLimits limits_;
+  const std::function<void()> on_soft_limit_;
+
+  // Only accessed through std::atomic_load and std::atomic_store.
+  std::shared_ptr<SecurityAssociation> sa_;
+
+  absl::Mutex mutex_;
+  std::vector<std::shared_ptr<CryptorInterface>> retired_
+      ABSL_GUARDED_BY(mutex_);
+  uint64_t next_reservation_ ABSL_GUARDED_BY(mutex_) = 0;
+  absl::flat_hash_map<uint64_t, Reservation> reservations_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+// Decrypts downlink packets with whichever of the current and previous
+// security associations matches their SPI, so that packets the server sent
+// before a rekey are still accepted after it.
+//
+// Packets whose SPI matches neither SA are handed to the current one. The
+// previous SA is accepted until RetirePrevious() is called, or until the next
+// rekey replaces it. Like with RekeyableEncryptor, SAs that are no longer
+// accepted are only destroyed once TakeRetired() has handed them over.
+//
+// This class is thread safe.
+class RekeyableDecryptor : public CryptorInterface {
+ public:
+  RekeyableDecryptor(uint32_t spi, std::unique_ptr<CryptorInterface> decryptor);
+  ~RekeyableDecryptor() override = default;
+
+  // Makes `decryptor` the current SA for packets with the given SPI, and keeps
+  // the SA that was current until now as the previous one.
+  void Rekey(uint32_t spi, std::unique_ptr<CryptorInterface> decryptor);
+
+  // Stops accepting packets for the previous SA.
+  void RetirePrevious();
+
+  // Returns the SAs that are no longer accepted, which are destroyed when the
+  // caller drops them. Only call this once no thread can still be decrypting
+  // with them, e.g. a grace period after they were retired, and drop the
+  // result without holding any locks.
+  std::vector<std::shared_ptr<CryptorInterface>> TakeRetired();
+
+  // Whether there is a previous SA that hasn't been retired yet.
+  bool has_previous() const;
+
+  absl::StatusOr<Packet> Process(const Packet& packet) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatch(
+      absl::Span<const Packet> packets) override;
+
+  std::vector<absl::StatusOr<Packet>> ProcessBatchInPlace(
+      std::vector<Packet> packets) override;
+
+ private:
+  struct SecurityAssociation {
+    uint32_t spi;
+    std::shared_ptr<CryptorInterface> decryptor;
+  };
+
+  struct SecurityAssociations {
+    SecurityAssociation current;
+    std::optional<SecurityAssociation> previous;
+  };
+
+  std::shared_ptr<const SecurityAssociations> security_associations() const;
+
+  // Returns true if the packet should be decrypted with the previous SA.
+  static bool UsesPrevious(const SecurityAssociations& sas,
+                           const Packet& packet);
+
+  // Only accessed through std::atomic_load and std::atomic_store. Readers
+  // take a snapshot once per batch.
+  std::shared_ptr<const SecurityAssociations> security_associations_;
+
+  // Serializes updates to security_associations_.
+  absl::Mutex mutex_;
+  std::vector<std::shared_ptr<CryptorInterface>> retired_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REKEYABLE_CRYPTOR_H_
@@ -0,0 +1,325 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/rekeyable_cryptor.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/ipsec/cryptor_interface.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_decryptor.h"
+#include "privacy/net/krypton/datapath/ipsec/ipsec_encryptor.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/proto/network_info.proto.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using ::testing::IsEmpty;
+using ::testing::Not;
+using ::testing::SizeIs;
+using ::testing::status::IsOk;
+using ::testing::status::StatusIs;
+
+constexpr uint32_t kOldSpi = 1;
+constexpr uint32_t kNewSpi = 2;
+
+// Returns params for an SA whose uplink and downlink use the same key, so a
+// packet encrypted with it can be decrypted with it.
+TransformParams CreateParams(char key) {
+  TransformParams params;
+  auto ipsec_params = params.mutable_ipsec();
+  ipsec_params->set_uplink_key(std::string(32, key));
+  ipsec_params->set_downlink_key(std::string(32, key));
+  ipsec_params->set_uplink_salt(std::string(4, key));
+  ipsec_params->set_downlink_salt(std::string(4, key));
+  return params;
+}
+
+Packet CreateWritablePacket(absl::string_view data) {
+  const size_t capacity = kPacketHeadroom + data.size() + kPacketTailroom;
+  char* buffer = new char[capacity];
+  memcpy(buffer + kPacketHeadroom, data.data(), data.size());
+  return Packet(buffer, capacity, kPacketHeadroom, data.size(),
+                IPProtocol::kIPv4, [buffer] { delete[] buffer; });
+}
+
+// A cryptor that records when it's destroyed.
+class TrackedCryptor : public CryptorInterface {
+ public:
+  explicit TrackedCryptor(bool* destroyed) : destroyed_(destroyed) {}
+  ~TrackedCryptor() override { *destroyed_ = true; }
+
+  absl::StatusOr<Packet> Process(const Packet& /*packet*/) override {
+    return absl::UnimplementedError("Process");
+  }
+
+ private:
+  bool* destroyed_;
+};
+
+class RekeyableCryptorTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    ASSERT_OK_AND_ASSIGN(old_encryptor_,
+                         Encryptor::Create(kOldSpi, old_params_));
+    ASSERT_OK_AND_ASSIGN(new_encryptor_,
+                         Encryptor::Create(kNewSpi, new_params_));
+    ASSERT_OK_AND_ASSIGN(old_decryptor_, Decryptor::Create(old_params_));
+    ASSERT_OK_AND_ASSIGN(new_decryptor_, Decryptor::Create(new_params_));
+  }
+
+ protected:
+  TransformParams old_params_ = CreateParams('a');
+  TransformParams new_params_ = CreateParams('b');
+  std::unique_ptr<Encryptor> old_encryptor_;
+  std::unique_ptr<Encryptor> new_encryptor_;
+  std::unique_ptr<Decryptor> old_decryptor_;
+  std::unique_ptr<Decryptor> new_decryptor_;
+};
+
+TEST_F(RekeyableCryptorTest, EncryptorSwitchesToNewSa) {
+  RekeyableEncryptor encryptor(std::move(old_encryptor_));
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+
+  ASSERT_OK_AND_ASSIGN(auto before, encryptor.Process(packet));
+  encryptor.Rekey(std::move(new_encryptor_));
+  ASSERT_OK_AND_ASSIGN(auto after, encryptor.Process(packet));
+
+  EXPECT_OK(old_decryptor_->Process(before));
+  EXPECT_THAT(new_decryptor_->Process(before), Not(IsOk()));
+  EXPECT_OK(new_decryptor_->Process(after));
+  EXPECT_THAT(old_decryptor_->Process(after), Not(IsOk()));
+}
+
+TEST_F(RekeyableCryptorTest, ReservedBatchesKeepTheirSa) {
+  RekeyableEncryptor encryptor(std::move(old_encryptor_));
+
+  ASSERT_OK_AND_ASSIGN(uint64_t reservation, encryptor.ReserveBatch(2));
+  encryptor.Rekey(std::move(new_encryptor_));
+
+  std::vector<Packet> packets;
+  packets.push_back(CreateWritablePacket("foo"));
+  packets.push_back(CreateWritablePacket("bar"));
+  auto results =
+      encryptor.ProcessReservedBatchInPlace(std::move(packets), reservation);
+  ASSERT_EQ(results.size(), 2);
+  for (const auto& result : results) {
+    ASSERT_OK(result);
+    EXPECT_OK(old_decryptor_->Process(*result));
+  }
+}
+
+TEST_F(RekeyableCryptorTest, UnknownReservationFails) {
+  RekeyableEncryptor encryptor(std::move(old_encryptor_));
+
+  std::vector<Packet> packets;
+  packets.push_back(CreateWritablePacket("foo"));
+  auto results = encryptor.ProcessReservedBatchInPlace(std::move(packets), 42);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_THAT(results[0], StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(RekeyableCryptorTest, SoftPacketLimitFiresOncePerSa) {
+  int soft_limits = 0;
+  SaVolumeLimits limits;
+  limits.packets = 3;
+  RekeyableEncryptor encryptor(std::move(old_encryptor_), limits,
+                               [&soft_limits] { ++soft_limits; });
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+
+  std::vector<Packet> inputs;
+  inputs.emplace_back("foo", 3, IPProtocol::kIPv4, [] {});
+  inputs.emplace_back("bar", 3, IPProtocol::kIPv4, [] {});
+  auto batch = encryptor.ProcessBatch(inputs);
+  EXPECT_EQ(encryptor.packets_encrypted(), 2);
+  EXPECT_EQ(soft_limits, 0);
+
+  ASSERT_OK_AND_ASSIGN(auto third, encryptor.Process(packet));
+  EXPECT_EQ(soft_limits, 1);
+  ASSERT_OK_AND_ASSIGN(auto fourth, encryptor.Process(packet));
+  EXPECT_EQ(soft_limits, 1);
+
+  // The new SA starts counting from zero.
+  encryptor.Rekey(std::move(new_encryptor_));
+  EXPECT_EQ(encryptor.packets_encrypted(), 0);
+  ASSERT_OK_AND_ASSIGN(auto fifth, encryptor.Process(packet));
+  EXPECT_EQ(encryptor.packets_encrypted(), 1);
+  EXPECT_EQ(soft_limits, 1);
+}
+
+TEST_F(RekeyableCryptorTest, SoftByteLimitCountsReservedBatches) {
+  int soft_limits = 0;
+  SaVolumeLimits limits;
+  limits.bytes = 100;
+  RekeyableEncryptor encryptor(std::move(old_encryptor_), limits,
+                               [&soft_limits] { ++soft_limits; });
+
+  ASSERT_OK_AND_ASSIGN(uint64_t reservation, encryptor.ReserveBatch(2));
+  std::vector<Packet> packets;
+  packets.push_back(CreateWritablePacket(std::string(40, 'x')));
+  packets.push_back(CreateWritablePacket(std::string(40, 'y')));
+  auto results =
+      encryptor.ProcessReservedBatchInPlace(std::move(packets), reservation);
+  ASSERT_EQ(results.size(), 2);
+  ASSERT_OK(results[0]);
+  ASSERT_OK(results[1]);
+
+  // Each packet grows by its ESP header and trailer, so the batch is over the
+  // limit.
+  EXPECT_EQ(encryptor.packets_encrypted(), 2);
+  EXPECT_EQ(encryptor.bytes_encrypted(),
+            results[0]->data().size() + results[1]->data().size());
+  EXPECT_EQ(soft_limits, 1);
+}
+
+TEST_F(RekeyableCryptorTest, DecryptorAcceptsBothSasUntilRetired) {
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  std::vector<Packet> old_packets;
+  std::vector<Packet> new_packets;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_OK_AND_ASSIGN(auto old_packet, old_encryptor_->Process(packet));
+    old_packets.push_back(std::move(old_packet));
+    ASSERT_OK_AND_ASSIGN(auto new_packet, new_encryptor_->Process(packet));
+    new_packets.push_back(std::move(new_packet));
+  }
+
+  // Each packet is only decrypted once, so the replay window doesn't get in
+  // the way.
+  RekeyableDecryptor decryptor(kOldSpi, std::move(old_decryptor_));
+  EXPECT_FALSE(decryptor.has_previous());
+  EXPECT_OK(decryptor.Process(old_packets[0]));
+
+  decryptor.Rekey(kNewSpi, std::move(new_decryptor_));
+  EXPECT_TRUE(decryptor.has_previous());
+  ASSERT_OK_AND_ASSIGN(auto decrypted, decryptor.Process(old_packets[1]));
+  EXPECT_EQ(decrypted.data(), "foo");
+  ASSERT_OK_AND_ASSIGN(decrypted, decryptor.Process(new_packets[0]));
+  EXPECT_EQ(decrypted.data(), "foo");
+
+  decryptor.RetirePrevious();
+  EXPECT_FALSE(decryptor.has_previous());
+  EXPECT_THAT(decryptor.Process(old_packets[2]), Not(IsOk()));
+  EXPECT_OK(decryptor.Process(new_packets[1]));
+}
+
+TEST_F(RekeyableCryptorTest, DecryptorKeepsOrderOfMixedBatches) {
+  RekeyableDecryptor decryptor(kOldSpi, std::move(old_decryptor_));
+  decryptor.Rekey(kNewSpi, std::move(new_decryptor_));
+
+  const std::vector<std::string> payloads = {"old0", "new1", "old2", "new3"};
+  auto encrypt_all = [&]() {
+    std::vector<Packet> encrypted;
+    for (const auto& payload : payloads) {
+      std::vector<Packet> batch;
+      batch.push_back(CreateWritablePacket(payload));
+      auto* encryptor =
+          payload[0] == 'o' ? old_encryptor_.get() : new_encryptor_.get();
+      auto results = encryptor->ProcessBatchInPlace(std::move(batch));
+      EXPECT_OK(results[0]);
+      encrypted.push_back(*std::move(results[0]));
+    }
+    return encrypted;
+  };
+
+  auto copied = decryptor.ProcessBatch(encrypt_all());
+  ASSERT_EQ(copied.size(), payloads.size());
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    ASSERT_OK(copied[i]);
+    EXPECT_EQ(copied[i]->data(), payloads[i]);
+  }
+
+  auto in_place = decryptor.ProcessBatchInPlace(encrypt_all());
+  ASSERT_EQ(in_place.size(), payloads.size());
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    ASSERT_OK(in_place[i]);
+    EXPECT_EQ(in_place[i]->data(), payloads[i]);
+  }
+}
+
+TEST_F(RekeyableCryptorTest, SecondRekeyDropsOldestSa) {
+  const Packet packet("foo", 3, IPProtocol::kIPv4, [] {});
+  ASSERT_OK_AND_ASSIGN(auto old_packet, old_encryptor_->Process(packet));
+  ASSERT_OK_AND_ASSIGN(auto newest_decryptor,
+                       Decryptor::Create(CreateParams('c')));
+
+  RekeyableDecryptor decryptor(kOldSpi, std::move(old_decryptor_));
+  decryptor.Rekey(kNewSpi, std::move(new_decryptor_));
+  decryptor.Rekey(3, std::move(newest_decryptor));
+
+  EXPECT_THAT(decryptor.Process(old_packet), Not(IsOk()));
+}
+
+TEST(RekeyableCryptorLifetimeTest, EncryptorKeepsSasUntilTaken) {
+  bool first_destroyed = false;
+  bool second_destroyed = false;
+  RekeyableEncryptor encryptor(
+      std::make_unique<TrackedCryptor>(&first_destroyed));
+
+  encryptor.Rekey(std::make_unique<TrackedCryptor>(&second_destroyed));
+  EXPECT_FALSE(first_destroyed);
+
+  // Taking the retired SAs hands them over without destroying them.
+  auto retired = encryptor.TakeRetired();
+  EXPECT_THAT(retired, SizeIs(1));
+  EXPECT_FALSE(first_destroyed);
+  retired.clear();
+  EXPECT_TRUE(first_destroyed);
+  EXPECT_FALSE(second_destroyed);
+  EXPECT_THAT(encryptor.TakeRetired(), IsEmpty());
+}
+
+TEST(RekeyableCryptorLifetimeTest, DecryptorKeepsSasUntilTaken) {
+  bool first_destroyed = false;
+  bool second_destroyed = false;
+  bool third_destroyed = false;
+  RekeyableDecryptor decryptor(
+      kOldSpi, std::make_unique<TrackedCryptor>(&first_destroyed));
+
+  decryptor.Rekey(kNewSpi, std::make_unique<TrackedCryptor>(&second_destroyed));
+  decryptor.TakeRetired();
+  EXPECT_FALSE(first_destroyed);
+
+  // A second rekey pushes out the first SA, but doesn't destroy it yet.
+  decryptor.Rekey(3, std::make_unique<TrackedCryptor>(&third_destroyed));
+  EXPECT_FALSE(first_destroyed);
+  decryptor.RetirePrevious();
+  EXPECT_FALSE(second_destroyed);
+
+  auto retired = decryptor.TakeRetired();
+  EXPECT_THAT(retired, SizeIs(2));
+  EXPECT_FALSE(first_destroyed);
+  retired.clear();
+  EXPECT_TRUE(first_destroyed);
+  EXPECT_TRUE(second_destroyed);
+  EXPECT_FALSE(third_destroyed);
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,84 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+static_assert(ReplayWindow::kSize % 64 == 0 && ReplayWindow::kSize > 64,
+              "The replay window must be a whole number of words");
+
+absl::Status ReplayWindow::Check(uint64_t sequence_number) const {
+  absl::ReaderMutexLock l(&mutex_);
+  return CheckLocked(sequence_number);
+}
+
+absl::Status ReplayWindow::CheckLocked(uint64_t sequence_number) const {
+  if (empty_ || sequence_number > highest_) {
+    return absl::OkStatus();
+  }
+  if (highest_ - sequence_number >= kSize - kBitsPerWord) {
+    return absl::OutOfRangeError("Packet is older than the replay window");
+  }
+  const uint64_t block = sequence_number / kBitsPerWord;
+  const uint64_t bit = uint64_t{1} << (sequence_number % kBitsPerWord);
+  if ((bitmap_[block % kWords] & bit) != 0) {
+    return absl::AlreadyExistsError("Replayed packet");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ReplayWindow::Update(uint64_t sequence_number) {
+  absl::MutexLock l(&mutex_);
+  const uint64_t block = sequence_number / kBitsPerWord;
+  if (empty_) {
+    empty_ = false;
+    highest_ = sequence_number;
+  } else if (sequence_number > highest_) {
+    // Clear the words the window moves into, all of them at most.
+    const uint64_t highest_block = highest_ / kBitsPerWord;
+    const uint64_t blocks = std::min<uint64_t>(block - highest_block, kWords);
+    for (uint64_t i = 1; i <= blocks; ++i) {
+      bitmap_[(highest_block + i) % kWords] = 0;
+    }
+    highest_ = sequence_number;
+  } else {
+    auto status = CheckLocked(sequence_number);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  bitmap_[block % kWords] |= uint64_t{1} << (sequence_number % kBitsPerWord);
+  return absl::OkStatus();
+}
+
+uint64_t ReplayWindow::highest() const {
+  absl::ReaderMutexLock l(&mutex_);
+  return highest_;
+}
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,88 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REPLAY_WINDOW_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REPLAY_WINDOW_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+// The anti-replay window of RFC 4303 Section 3.4.3, for the inbound side of a
+// single SA.
+//
+// The bitmap is a ring of 64-bit words indexed by sequence number, as in RFC
+// 6479, so advancing the window only clears the words it moves past instead
+// of shifting every bit. One word is always partly ahead of the highest
+// sequence number, so the window reliably covers the kSize - 64 numbers up to
+// the highest one.
+//
+// Check() should be called before authenticating a packet, so duplicates and
+// old packets are dropped without paying for the AEAD, and Update() only once
+// it has been authenticated, so forged packets can't move the window.
+//
+// This class is thread safe.
+class ReplayWindow {
+ public:
+  // The size of the bitmap, in bits.
+  static constexpr size_t kSize = 2048;
+
+  ReplayWindow() = default;
+
+  // Disallow copy and assign.
+  ReplayWindow(const ReplayWindow& other) = delete;
+  ReplayWindow& operator=(const ReplayWindow& other) = delete;
+
+  // Returns AlreadyExistsError if `sequence_number` has been seen already,
+  // OutOfRangeError if it is too far behind the highest one to tell, and OK
+  // otherwise. Doesn't change the window.
+  absl::Status Check(uint64_t sequence_number) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Marks `sequence_number` as seen, advancing the window if it's the highest
+  // so far. Fails like Check() if it can't be accepted, which can happen even
+  // after Check() passed if another thread got there first.
+  absl::Status Update(uint64_t sequence_number) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the highest sequence number seen so far, or 0 if there hasn't been
+  // one.
+  uint64_t highest() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  static constexpr size_t kBitsPerWord = 64;
+  static constexpr size_t kWords = kSize / kBitsPerWord;
+
+  absl::Status CheckLocked(uint64_t sequence_number) const
+      ABSL_SHARED_LOCKS_REQUIRED(mutex_);
+
+  mutable absl::Mutex mutex_;
+  bool empty_ ABSL_GUARDED_BY(mutex_) = true;
+  uint64_t highest_ ABSL_GUARDED_BY(mutex_) = 0;
+  uint64_t bitmap_[kWords] ABSL_GUARDED_BY(mutex_) = {};
+};
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_REPLAY_WINDOW_H_
@@ -0,0 +1,133 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/replay_window.h"
+
+#include <cstdint>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using ::testing::status::StatusIs;
+
+// How far behind the highest sequence number the window always reaches.
+constexpr uint64_t kReach = ReplayWindow::kSize - 64;
+
+TEST(ReplayWindowTest, AcceptsAnyFirstPacket) {
+  ReplayWindow window;
+  EXPECT_OK(window.Check(1000));
+  ASSERT_OK(window.Update(1000));
+  EXPECT_EQ(window.highest(), 1000);
+}
+
+TEST(ReplayWindowTest, RejectsDuplicates) {
+  ReplayWindow window;
+  ASSERT_OK(window.Update(0));
+  ASSERT_OK(window.Update(5));
+  ASSERT_OK(window.Update(3));
+
+  EXPECT_THAT(window.Check(0), StatusIs(absl::StatusCode::kAlreadyExists));
+  EXPECT_THAT(window.Check(3), StatusIs(absl::StatusCode::kAlreadyExists));
+  EXPECT_THAT(window.Check(5), StatusIs(absl::StatusCode::kAlreadyExists));
+  EXPECT_THAT(window.Update(3), StatusIs(absl::StatusCode::kAlreadyExists));
+  EXPECT_OK(window.Check(4));
+  EXPECT_OK(window.Check(6));
+}
+
+TEST(ReplayWindowTest, CheckDoesNotChangeTheWindow) {
+  ReplayWindow window;
+  ASSERT_OK(window.Update(10));
+  EXPECT_OK(window.Check(20));
+  EXPECT_OK(window.Check(20));
+  EXPECT_EQ(window.highest(), 10);
+  EXPECT_OK(window.Check(9));
+}
+
+TEST(ReplayWindowTest, AcceptsReorderedPacketsWithinTheWindow) {
+  ReplayWindow window;
+  const uint64_t highest = 10 * ReplayWindow::kSize;
+  ASSERT_OK(window.Update(highest));
+  EXPECT_OK(window.Update(highest - kReach + 1));
+  EXPECT_OK(window.Update(highest - 1));
+  EXPECT_THAT(window.Check(highest - kReach),
+              StatusIs(absl::StatusCode::kOutOfRange));
+  EXPECT_THAT(window.Update(highest - kReach),
+              StatusIs(absl::StatusCode::kOutOfRange));
+}
+
+TEST(ReplayWindowTest, AdvancingClearsOldBits) {
+  ReplayWindow window;
+  for (uint64_t i = 0; i < 100; ++i) {
+    ASSERT_OK(window.Update(i));
+  }
+  // Jump ahead by exactly one ring, so the words that held 0-99 are reused.
+  ASSERT_OK(window.Update(ReplayWindow::kSize + 99));
+  for (uint64_t i = ReplayWindow::kSize; i < ReplayWindow::kSize + 99; ++i) {
+    ASSERT_OK(window.Check(i)) << i;
+  }
+  EXPECT_THAT(window.Check(99), StatusIs(absl::StatusCode::kOutOfRange));
+}
+
+TEST(ReplayWindowTest, LargeJumpsClearTheWholeWindow) {
+  ReplayWindow window;
+  ASSERT_OK(window.Update(7));
+  ASSERT_OK(window.Update(uint64_t{1} << 40));
+  EXPECT_OK(window.Check((uint64_t{1} << 40) - 1));
+  EXPECT_OK(window.Check((uint64_t{1} << 40) - kReach + 7));
+}
+
+TEST(ReplayWindowTest, ConcurrentUpdatesAcceptEachNumberOnce) {
+  constexpr int kThreads = 4;
+  constexpr uint64_t kPackets = 1000;
+  ReplayWindow window;
+
+  std::vector<int> accepted(kThreads, 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&window, &accepted, i] {
+      for (uint64_t j = 0; j < kPackets; ++j) {
+        if (window.Update(j).ok()) {
+          ++accepted[i];
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  int total = 0;
+  for (int count : accepted) {
+    total += count;
+  }
+  // Every thread sends the same numbers, which all fit in the window, so each
+  // one gets through exactly once.
+  EXPECT_EQ(total, kPackets);
+  EXPECT_EQ(window.highest(), kPackets - 1);
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
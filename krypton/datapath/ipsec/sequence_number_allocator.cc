@@ -0,0 +1,71 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include "privacy/net/krypton/crypto/ipsec_forward_secure_random.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+namespace {
+
+uint64_t CreateIvMask() {
+  uint64_t mask;
+  const std::string random = crypto::CreateSecureRandomString(sizeof(mask));
+  memcpy(&mask, random.data(), sizeof(mask));
+  return mask;
+}
+
+}  // namespace
+
+SequenceNumberAllocator::SequenceNumberAllocator(
+    bool extended_sequence_numbers)
+    : extended_sequence_numbers_(extended_sequence_numbers),
+      limit_(extended_sequence_numbers ? std::numeric_limits<uint64_t>::max()
+                                       : std::numeric_limits<uint32_t>::max()),
+      next_(0),
+      iv_mask_(CreateIvMask()) {}
+
+absl::StatusOr<uint64_t> SequenceNumberAllocator::Reserve(size_t count) {
+  uint64_t first = next_.load();
+  do {
+    if (limit_ - first < count) {
+      // Even though we use random IVs, after 2^32 invocations the probability
+      // of nonce reuse becomes concerning, so we should fail safe. Extended
+      // sequence numbers are only used with IVs derived from the sequence
+      // number, which stay unique over the whole 64-bit space.
+      // copybara:strip_begin(internal link)
+      // See http://yaqs/2961540066972794880#a1 for ise-crypto recommendation.
+      // copybara:strip_end
+      return absl::InternalError("Encryptor expired before rekey occurred");
+    }
+  } while (!next_.compare_exchange_weak(first, first + count));
+  return first;
+}
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
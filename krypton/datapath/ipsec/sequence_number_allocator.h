@@ -0,0 +1,81 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_SEQUENCE_NUMBER_ALLOCATOR_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_SEQUENCE_NUMBER_ALLOCATOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "third_party/absl/status/statusor.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+
+// Hands out the ESP sequence numbers of a single SA.
+//
+// Each call reserves a range of consecutive numbers with one atomic update, so
+// several encryptors for the same SA, each running on its own forwarding
+// pipeline, can share an allocator without taking a lock. The ranges never
+// overlap, and a pipeline that reserves a range for a batch uses it right
+// away, so the numbers on the wire stay close enough together for the peer's
+// anti-replay window.
+//
+// With Extended Sequence Numbers (RFC 4303 Section 2.2.1) the counter is 64
+// bits wide. Only the low 32 bits go in the ESP header, but the whole number
+// is authenticated, so a single SA can protect far more than 2^32 packets.
+//
+// This class is thread safe.
+class SequenceNumberAllocator {
+ public:
+  explicit SequenceNumberAllocator(bool extended_sequence_numbers = false);
+
+  // Disallow copy and assign.
+  SequenceNumberAllocator(const SequenceNumberAllocator& other) = delete;
+  SequenceNumberAllocator& operator=(const SequenceNumberAllocator& other) =
+      delete;
+
+  // Reserves `count` consecutive sequence numbers and returns the first one.
+  // Fails once the sequence number space is used up, since the SA has to be
+  // rekeyed by then.
+  absl::StatusOr<uint64_t> Reserve(size_t count);
+
+  // Returns the next sequence number that will be handed out.
+  uint64_t next() const { return next_.load(std::memory_order_relaxed); }
+
+  // Whether the sequence numbers are 64 bits wide.
+  bool extended_sequence_numbers() const { return extended_sequence_numbers_; }
+
+  // A random value, fixed for the life of the allocator, that IVs derived
+  // from the sequence numbers are masked with. Sharing it along with the
+  // sequence numbers keeps those IVs unique across every encryptor for the SA.
+  uint64_t iv_mask() const { return iv_mask_; }
+
+ private:
+  const bool extended_sequence_numbers_;
+  // One past the largest sequence number that may be handed out.
+  const uint64_t limit_;
+  std::atomic_uint64_t next_;
+  const uint64_t iv_mask_;
+};
+
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_IPSEC_SEQUENCE_NUMBER_ALLOCATOR_H_
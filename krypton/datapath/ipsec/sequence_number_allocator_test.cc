@@ -0,0 +1,103 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/ipsec/sequence_number_allocator.h"
+
+#include <cstdint>
+#include <limits>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace ipsec {
+namespace {
+
+using ::testing::status::StatusIs;
+
+TEST(SequenceNumberAllocatorTest, ReservesConsecutiveRanges) {
+  SequenceNumberAllocator allocator;
+  ASSERT_OK_AND_ASSIGN(uint64_t first, allocator.Reserve(3));
+  EXPECT_EQ(first, 0);
+  ASSERT_OK_AND_ASSIGN(uint64_t second, allocator.Reserve(1));
+  EXPECT_EQ(second, 3);
+  EXPECT_EQ(allocator.next(), 4);
+}
+
+TEST(SequenceNumberAllocatorTest, FailsWhenExhausted) {
+  SequenceNumberAllocator allocator;
+  ASSERT_OK(allocator.Reserve(std::numeric_limits<uint32_t>::max() - 1));
+  EXPECT_THAT(allocator.Reserve(2), StatusIs(absl::StatusCode::kInternal));
+  // A failed reservation doesn't use up any numbers.
+  ASSERT_OK_AND_ASSIGN(uint64_t last, allocator.Reserve(1));
+  EXPECT_EQ(last, std::numeric_limits<uint32_t>::max() - 1);
+}
+
+TEST(SequenceNumberAllocatorTest, ExtendedSequenceNumbersGoPast32Bits) {
+  SequenceNumberAllocator allocator(/*extended_sequence_numbers=*/true);
+  EXPECT_TRUE(allocator.extended_sequence_numbers());
+  ASSERT_OK(allocator.Reserve(std::numeric_limits<uint32_t>::max()));
+  ASSERT_OK_AND_ASSIGN(uint64_t first, allocator.Reserve(2));
+  EXPECT_EQ(first, std::numeric_limits<uint32_t>::max());
+  EXPECT_EQ(allocator.next(), uint64_t{1} << 32 | 1);
+}
+
+TEST(SequenceNumberAllocatorTest, ExtendedSequenceNumbersFailWhenExhausted) {
+  SequenceNumberAllocator allocator(/*extended_sequence_numbers=*/true);
+  ASSERT_OK(allocator.Reserve(std::numeric_limits<uint64_t>::max() - 1));
+  EXPECT_THAT(allocator.Reserve(2), StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST(SequenceNumberAllocatorTest, ConcurrentRangesDoNotOverlap) {
+  constexpr int kThreads = 4;
+  constexpr int kReservations = 10000;
+  constexpr int kBatchSize = 8;
+  SequenceNumberAllocator allocator;
+
+  std::vector<std::vector<uint64_t>> firsts(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&allocator, &firsts, i] {
+      for (int j = 0; j < kReservations; ++j) {
+        auto first = allocator.Reserve(kBatchSize);
+        ASSERT_OK(first);
+        firsts[i].push_back(*first);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<bool> seen(kThreads * kReservations, false);
+  for (const auto& thread_firsts : firsts) {
+    for (uint64_t first : thread_firsts) {
+      ASSERT_EQ(first % kBatchSize, 0);
+      ASSERT_FALSE(seen[first / kBatchSize]);
+      seen[first / kBatchSize] = true;
+    }
+  }
+  EXPECT_EQ(allocator.next(), kThreads * kReservations * kBatchSize);
+}
+
+}  // namespace
+}  // namespace ipsec
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
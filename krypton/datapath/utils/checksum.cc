@@ -0,0 +1,67 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+uint32_t ChecksumAdd(uint32_t sum, const void* data, size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  // Accumulate in 64 bits, so that the carries only need folding at the end.
+  uint64_t wide_sum = sum;
+  while (length >= 2) {
+    wide_sum += (static_cast<uint32_t>(bytes[0]) << 8) | bytes[1];
+    bytes += 2;
+    length -= 2;
+  }
+  if (length == 1) {
+    wide_sum += static_cast<uint32_t>(bytes[0]) << 8;
+  }
+  while ((wide_sum >> 32) != 0) {
+    wide_sum = (wide_sum & 0xffffffff) + (wide_sum >> 32);
+  }
+  return static_cast<uint32_t>(wide_sum);
+}
+
+uint32_t ChecksumAddPseudoHeader(uint32_t sum, const uint8_t* addresses,
+                                 size_t address_length, uint8_t protocol,
+                                 uint32_t transport_length) {
+  sum = ChecksumAdd(sum, addresses, 2 * address_length);
+  uint64_t wide_sum = sum;
+  wide_sum += protocol;
+  wide_sum += transport_length >> 16;
+  wide_sum += transport_length & 0xffff;
+  while ((wide_sum >> 32) != 0) {
+    wide_sum = (wide_sum & 0xffffffff) + (wide_sum >> 32);
+  }
+  return static_cast<uint32_t>(wide_sum);
+}
+
+uint16_t ChecksumFold(uint32_t sum) {
+  while ((sum >> 16) != 0) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint16_t>(sum);
+}
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
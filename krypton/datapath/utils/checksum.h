@@ -0,0 +1,67 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_UTILS_CHECKSUM_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_UTILS_CHECKSUM_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+// Helpers for the Internet checksum (RFC 1071), as used by IPv4, TCP, UDP and
+// ICMP. A checksum is built up by adding data to a running 32-bit sum, and is
+// then folded into its final 16-bit form. All values are in host byte order.
+
+// Adds `length` bytes of `data` to a running checksum sum, treating them as a
+// sequence of 16-bit big-endian words. Only the last chunk of data added to a
+// sum may have an odd length.
+uint32_t ChecksumAdd(uint32_t sum, const void* data, size_t length);
+
+// Adds the IPv4 or IPv6 pseudo-header for a transport-layer checksum to a
+// running sum. `addresses` points at the source address immediately followed
+// by the destination address, as they appear in the IP header, and
+// `address_length` is 4 or 16.
+uint32_t ChecksumAddPseudoHeader(uint32_t sum, const uint8_t* addresses,
+                                 size_t address_length, uint8_t protocol,
+                                 uint32_t transport_length);
+
+// Folds a running sum into 16 bits, without complementing it. This is the
+// form of a partial checksum that a checksum offload expects.
+uint16_t ChecksumFold(uint32_t sum);
+
+// Folds a running sum into a final, complemented checksum.
+inline uint16_t ChecksumFinish(uint32_t sum) {
+  return static_cast<uint16_t>(~ChecksumFold(sum));
+}
+
+// Updates a final checksum after a 16-bit word it covers changed from
+// `old_value` to `new_value`, without summing the data again (RFC 1624).
+inline uint16_t ChecksumUpdate(uint16_t checksum, uint16_t old_value,
+                               uint16_t new_value) {
+  uint32_t sum = static_cast<uint16_t>(~checksum);
+  sum += static_cast<uint16_t>(~old_value);
+  sum += new_value;
+  return ChecksumFinish(sum);
+}
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_UTILS_CHECKSUM_H_
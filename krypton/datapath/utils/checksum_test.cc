@@ -0,0 +1,91 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+namespace {
+
+// An IPv4 header with its checksum field zeroed out.
+constexpr uint8_t kIpv4Header[] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40,
+                                   0x00, 0x40, 0x11, 0x00, 0x00, 0xc0, 0xa8,
+                                   0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+
+TEST(ChecksumTest, Ipv4Header) {
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, kIpv4Header, sizeof(kIpv4Header))),
+            0xb861);
+}
+
+TEST(ChecksumTest, ValidHeaderSumsToZero) {
+  uint8_t header[sizeof(kIpv4Header)];
+  memcpy(header, kIpv4Header, sizeof(header));
+  header[10] = 0xb8;
+  header[11] = 0x61;
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, header, sizeof(header))), 0);
+}
+
+TEST(ChecksumTest, OddLengthIsPaddedWithZero) {
+  constexpr uint8_t kOdd[] = {0x12, 0x34, 0x56};
+  constexpr uint8_t kPadded[] = {0x12, 0x34, 0x56, 0x00};
+  EXPECT_EQ(ChecksumAdd(0, kOdd, sizeof(kOdd)),
+            ChecksumAdd(0, kPadded, sizeof(kPadded)));
+}
+
+TEST(ChecksumTest, SumCanBeBuiltInChunks) {
+  EXPECT_EQ(ChecksumFold(ChecksumAdd(ChecksumAdd(0, kIpv4Header, 10),
+                                     kIpv4Header + 10, 10)),
+            ChecksumFold(ChecksumAdd(0, kIpv4Header, sizeof(kIpv4Header))));
+}
+
+TEST(ChecksumTest, PseudoHeader) {
+  // The IPv4 pseudo-header is the addresses, a zero byte, the protocol, and
+  // the transport length.
+  constexpr uint8_t kPseudoHeader[] = {0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8,
+                                       0x00, 0xc7, 0x00, 0x11, 0x00, 0x5f};
+  EXPECT_EQ(ChecksumFold(ChecksumAddPseudoHeader(0, kIpv4Header + 12, 4, 17,
+                                                 0x5f)),
+            ChecksumFold(ChecksumAdd(0, kPseudoHeader, sizeof(kPseudoHeader))));
+}
+
+TEST(ChecksumTest, IncrementalUpdateMatchesFullChecksum) {
+  uint8_t header[sizeof(kIpv4Header)];
+  memcpy(header, kIpv4Header, sizeof(header));
+  uint16_t checksum = ChecksumFinish(ChecksumAdd(0, header, sizeof(header)));
+
+  // Change the TTL and protocol word, as a router would.
+  uint16_t old_value = (header[8] << 8) | header[9];
+  header[8] = 0x3f;
+  uint16_t new_value = (header[8] << 8) | header[9];
+  EXPECT_EQ(ChecksumUpdate(checksum, old_value, new_value),
+            ChecksumFinish(ChecksumAdd(0, header, sizeof(header))));
+}
+
+TEST(ChecksumTest, IncrementalUpdateOfUnchangedWord) {
+  EXPECT_EQ(ChecksumUpdate(0xb861, 0x1234, 0x1234), 0xb861);
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,302 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/icmp.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+namespace {
+
+constexpr size_t kIpv4AddressSize = 4;
+constexpr size_t kIpv6AddressSize = 16;
+constexpr size_t kIpv4HeaderSize = 20;
+constexpr size_t kIpv6HeaderSize = 40;
+constexpr size_t kEchoHeaderSize = 8;
+constexpr size_t kMaxIpPacketSize = 65535;
+constexpr size_t kIcmpErrorHeaderSize = 8;
+
+// ICMP errors are kept within the minimum MTU, quoting as much of the packet
+// as fits (RFC 1812 section 4.3.2.3 and RFC 4443 section 2.4).
+constexpr size_t kIpv4MinMtu = 576;
+constexpr size_t kIpv6MinMtu = 1280;
+
+constexpr uint8_t kIpProtocolIcmp = 1;
+constexpr uint8_t kIpProtocolIcmpv6 = 58;
+constexpr uint8_t kDefaultTtl = 64;
+
+constexpr uint8_t kIcmpEchoReply = 0;
+constexpr uint8_t kIcmpDestinationUnreachable = 3;
+constexpr uint8_t kIcmpFragmentationNeeded = 4;
+constexpr uint8_t kIcmpEchoRequest = 8;
+constexpr uint8_t kIcmpv6PacketTooBig = 2;
+constexpr uint8_t kIcmpv6EchoRequest = 128;
+constexpr uint8_t kIcmpv6EchoReply = 129;
+
+void Put16(uint8_t* bytes, uint16_t value) {
+  bytes[0] = value >> 8;
+  bytes[1] = value & 0xff;
+}
+
+uint16_t Get16(const uint8_t* bytes) {
+  return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+}
+
+// Fills in the echo header at `icmp`, except for the checksum, which is left
+// zeroed.
+void WriteEchoHeader(uint8_t* icmp, uint8_t type, uint16_t identifier,
+                     uint16_t sequence) {
+  icmp[0] = type;
+  icmp[1] = 0;
+  Put16(icmp + 2, 0);
+  Put16(icmp + 4, identifier);
+  Put16(icmp + 6, sequence);
+}
+
+// Returns the echo header of an echo reply `packet`, or nullptr.
+const uint8_t* FindEchoReply(absl::string_view packet) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  if (packet.empty()) {
+    return nullptr;
+  }
+  switch (bytes[0] >> 4) {
+    case 4: {
+      if (packet.size() < kIpv4HeaderSize) return nullptr;
+      size_t header_size = (bytes[0] & 0x0f) * 4;
+      // Fragments other than the first don't start with an ICMP header.
+      bool later_fragment = (Get16(bytes + 6) & 0x1fff) != 0;
+      if (bytes[9] != kIpProtocolIcmp || later_fragment ||
+          header_size < kIpv4HeaderSize ||
+          packet.size() < header_size + kEchoHeaderSize) {
+        return nullptr;
+      }
+      const uint8_t* icmp = bytes + header_size;
+      return icmp[0] == kIcmpEchoReply && icmp[1] == 0 ? icmp : nullptr;
+    }
+    case 6: {
+      if (packet.size() < kIpv6HeaderSize + kEchoHeaderSize ||
+          bytes[6] != kIpProtocolIcmpv6) {
+        return nullptr;
+      }
+      const uint8_t* icmp = bytes + kIpv6HeaderSize;
+      return icmp[0] == kIcmpv6EchoReply && icmp[1] == 0 ? icmp : nullptr;
+    }
+    default:
+      return nullptr;
+  }
+}
+
+// Returns whether an ICMP message of `type` is an error, which must never
+// cause another error to be sent (RFC 1122 section 3.2.2).
+bool IsIcmpError(uint8_t type) {
+  switch (type) {
+    case 3:   // Destination unreachable
+    case 4:   // Source quench
+    case 5:   // Redirect
+    case 11:  // Time exceeded
+    case 12:  // Parameter problem
+      return true;
+    default:
+      return false;
+  }
+}
+
+absl::StatusOr<std::string> BuildIpv4PacketTooBig(absl::string_view packet,
+                                                  int mtu) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  size_t header_size = (bytes[0] & 0x0f) * 4;
+  if (packet.size() < kIpv4HeaderSize || header_size < kIpv4HeaderSize ||
+      packet.size() < header_size) {
+    return absl::InvalidArgumentError("Truncated IPv4 packet");
+  }
+  uint16_t fragment = Get16(bytes + 6);
+  if ((fragment & 0x4000) == 0) {
+    return absl::InvalidArgumentError(
+        "IPv4 packet may be fragmented, so it isn't too big");
+  }
+  if ((fragment & 0x1fff) != 0) {
+    return absl::InvalidArgumentError("Not the first fragment");
+  }
+  if (bytes[9] == kIpProtocolIcmp &&
+      (packet.size() < header_size + 1 || IsIcmpError(bytes[header_size]))) {
+    return absl::InvalidArgumentError("Packet is an ICMP error");
+  }
+
+  size_t quoted =
+      std::min(packet.size(), kIpv4MinMtu - kIpv4HeaderSize -
+                                  kIcmpErrorHeaderSize);
+  size_t size = kIpv4HeaderSize + kIcmpErrorHeaderSize + quoted;
+  std::string reply(size, '\0');
+  auto* out = reinterpret_cast<uint8_t*>(reply.data());
+  out[0] = 0x45;
+  Put16(out + 2, size);
+  out[8] = kDefaultTtl;
+  out[9] = kIpProtocolIcmp;
+  memcpy(out + 12, bytes + 16, kIpv4AddressSize);
+  memcpy(out + 16, bytes + 12, kIpv4AddressSize);
+  Put16(out + 10, ChecksumFinish(ChecksumAdd(0, out, kIpv4HeaderSize)));
+
+  uint8_t* icmp = out + kIpv4HeaderSize;
+  icmp[0] = kIcmpDestinationUnreachable;
+  icmp[1] = kIcmpFragmentationNeeded;
+  // The next-hop MTU goes in the low half of the otherwise unused word
+  // (RFC 1191).
+  Put16(icmp + 6, mtu);
+  memcpy(icmp + kIcmpErrorHeaderSize, bytes, quoted);
+  const size_t icmp_length = size - kIpv4HeaderSize;
+  Put16(icmp + 2, ChecksumFinish(ChecksumAdd(0, icmp, icmp_length)));
+  return reply;
+}
+
+absl::StatusOr<std::string> BuildIpv6PacketTooBig(absl::string_view packet,
+                                                  int mtu) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  if (packet.size() < kIpv6HeaderSize) {
+    return absl::InvalidArgumentError("Truncated IPv6 packet");
+  }
+  // Extension headers aren't walked, so an ICMPv6 error behind one would get
+  // a reply. That's harmless, since replies are rate limited anyway.
+  if (bytes[6] == kIpProtocolIcmpv6 &&
+      (packet.size() < kIpv6HeaderSize + 1 ||
+       (bytes[kIpv6HeaderSize] & 0x80) == 0)) {
+    return absl::InvalidArgumentError("Packet is an ICMPv6 error");
+  }
+
+  size_t quoted = std::min(
+      packet.size(), kIpv6MinMtu - kIpv6HeaderSize - kIcmpErrorHeaderSize);
+  size_t size = kIpv6HeaderSize + kIcmpErrorHeaderSize + quoted;
+  std::string reply(size, '\0');
+  auto* out = reinterpret_cast<uint8_t*>(reply.data());
+  const size_t icmp_length = size - kIpv6HeaderSize;
+  out[0] = 0x60;
+  Put16(out + 4, icmp_length);
+  out[6] = kIpProtocolIcmpv6;
+  out[7] = kDefaultTtl;
+  memcpy(out + 8, bytes + 24, kIpv6AddressSize);
+  memcpy(out + 24, bytes + 8, kIpv6AddressSize);
+
+  uint8_t* icmp = out + kIpv6HeaderSize;
+  icmp[0] = kIcmpv6PacketTooBig;
+  Put16(icmp + 4, static_cast<uint32_t>(mtu) >> 16);
+  Put16(icmp + 6, mtu & 0xffff);
+  memcpy(icmp + kIcmpErrorHeaderSize, bytes, quoted);
+  uint32_t sum = ChecksumAddPseudoHeader(0, out + 8, kIpv6AddressSize,
+                                         kIpProtocolIcmpv6, icmp_length);
+  Put16(icmp + 2, ChecksumFinish(ChecksumAdd(sum, icmp, icmp_length)));
+  return reply;
+}
+
+}  // namespace
+
+absl::StatusOr<std::string> BuildEchoRequest(absl::string_view source,
+                                             absl::string_view destination,
+                                             uint16_t identifier,
+                                             uint16_t sequence, size_t size) {
+  if (source.size() != destination.size() ||
+      (source.size() != kIpv4AddressSize &&
+       source.size() != kIpv6AddressSize)) {
+    return absl::InvalidArgumentError(
+        "Echo request addresses must both be IPv4 or both be IPv6");
+  }
+  const bool ipv6 = source.size() == kIpv6AddressSize;
+  const size_t min_size = ipv6 ? kMinIpv6EchoSize : kMinIpv4EchoSize;
+  if (size < min_size || size > kMaxIpPacketSize) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Echo request size ", size, " is outside [", min_size, ", ",
+        kMaxIpPacketSize, "]"));
+  }
+
+  std::string packet(size, '\0');
+  auto* bytes = reinterpret_cast<uint8_t*>(packet.data());
+  if (ipv6) {
+    const size_t icmp_length = size - kIpv6HeaderSize;
+    bytes[0] = 0x60;
+    Put16(bytes + 4, icmp_length);
+    bytes[6] = kIpProtocolIcmpv6;
+    bytes[7] = kDefaultTtl;
+    memcpy(bytes + 8, source.data(), kIpv6AddressSize);
+    memcpy(bytes + 24, destination.data(), kIpv6AddressSize);
+
+    uint8_t* icmp = bytes + kIpv6HeaderSize;
+    WriteEchoHeader(icmp, kIcmpv6EchoRequest, identifier, sequence);
+    uint32_t sum = ChecksumAddPseudoHeader(0, bytes + 8, kIpv6AddressSize,
+                                           kIpProtocolIcmpv6, icmp_length);
+    Put16(icmp + 2, ChecksumFinish(ChecksumAdd(sum, icmp, icmp_length)));
+    return packet;
+  }
+
+  bytes[0] = 0x45;
+  Put16(bytes + 2, size);
+  // Don't fragment, so that a probe that's too big is dropped, not split.
+  Put16(bytes + 6, 0x4000);
+  bytes[8] = kDefaultTtl;
+  bytes[9] = kIpProtocolIcmp;
+  memcpy(bytes + 12, source.data(), kIpv4AddressSize);
+  memcpy(bytes + 16, destination.data(), kIpv4AddressSize);
+  Put16(bytes + 10, ChecksumFinish(ChecksumAdd(0, bytes, kIpv4HeaderSize)));
+
+  uint8_t* icmp = bytes + kIpv4HeaderSize;
+  const size_t icmp_length = size - kIpv4HeaderSize;
+  WriteEchoHeader(icmp, kIcmpEchoRequest, identifier, sequence);
+  Put16(icmp + 2, ChecksumFinish(ChecksumAdd(0, icmp, icmp_length)));
+  return packet;
+}
+
+std::optional<uint16_t> ParseEchoReply(absl::string_view packet,
+                                       uint16_t identifier) {
+  const uint8_t* icmp = FindEchoReply(packet);
+  if (icmp == nullptr || Get16(icmp + 4) != identifier) {
+    return std::nullopt;
+  }
+  return Get16(icmp + 6);
+}
+
+absl::StatusOr<std::string> BuildPacketTooBig(absl::string_view packet,
+                                              int mtu) {
+  if (mtu <= 0 || packet.size() <= static_cast<size_t>(mtu)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Packet of ", packet.size(), " bytes fits in MTU ", mtu));
+  }
+  switch (static_cast<uint8_t>(packet[0]) >> 4) {
+    case 4:
+      if (static_cast<size_t>(mtu) > kMaxIpPacketSize) {
+        return absl::InvalidArgumentError(absl::StrCat("Bad IPv4 MTU ", mtu));
+      }
+      return BuildIpv4PacketTooBig(packet, mtu);
+    case 6:
+      return BuildIpv6PacketTooBig(packet, mtu);
+    default:
+      return absl::InvalidArgumentError("Not an IPv4 or IPv6 packet");
+  }
+}
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,72 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_UTILS_ICMP_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_UTILS_ICMP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+// Builders and parsers for the ICMP and ICMPv6 messages that the datapath
+// generates and consumes itself. Addresses are raw network-order bytes: 4 for
+// IPv4 and 16 for IPv6.
+
+// The smallest echo requests that can be built: an IP header followed by the
+// 8-byte echo header.
+constexpr size_t kMinIpv4EchoSize = 28;
+constexpr size_t kMinIpv6EchoSize = 48;
+
+// Builds an IPv4 ICMP or IPv6 ICMPv6 echo request of exactly `size` bytes, IP
+// header included, padded with zeros. IPv4 requests have the don't fragment
+// bit set. Returns InvalidArgumentError if the addresses aren't both IPv4 or
+// both IPv6, or if `size` doesn't fit an echo request.
+absl::StatusOr<std::string> BuildEchoRequest(absl::string_view source,
+                                             absl::string_view destination,
+                                             uint16_t identifier,
+                                             uint16_t sequence, size_t size);
+
+// If `packet` is an IPv4 or IPv6 echo reply with `identifier`, returns its
+// sequence number. Only looks at a few header bytes otherwise, so it's cheap
+// enough to call on every downlink packet.
+std::optional<uint16_t> ParseEchoReply(absl::string_view packet,
+                                       uint16_t identifier);
+
+// Builds the error a router would send back for `packet` if it didn't fit in
+// `mtu`: an ICMP "fragmentation needed" for IPv4, or an ICMPv6 "packet too
+// big" for IPv6. The reply goes from the packet's destination back to its
+// source, and quotes as much of the packet as the minimum MTU allows, so the
+// sender's stack can match it to the socket that sent the packet.
+//
+// Returns InvalidArgumentError if `packet` isn't one that should get a reply:
+// it's malformed, already fits in `mtu`, is an IPv4 packet that may be
+// fragmented, is a later fragment, or is itself an ICMP error.
+absl::StatusOr<std::string> BuildPacketTooBig(absl::string_view packet,
+                                              int mtu);
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_UTILS_ICMP_H_
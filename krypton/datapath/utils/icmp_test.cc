@@ -0,0 +1,244 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/icmp.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Optional;
+using ::testing::status::StatusIs;
+
+constexpr absl::string_view kIpv4Source("\x0a\x02\x00\x01", 4);
+constexpr absl::string_view kIpv4Destination("\x0a\x02\x00\x02", 4);
+constexpr absl::string_view kIpv6Source(
+    "\x20\x01\x0d\xb8\x00\x00\x00\x00"
+    "\x00\x00\x00\x00\x00\x00\x00\x01",
+    16);
+constexpr absl::string_view kIpv6Destination(
+    "\x20\x01\x0d\xb8\x00\x00\x00\x00"
+    "\x00\x00\x00\x00\x00\x00\x00\x02",
+    16);
+
+// Turns a request built by BuildEchoRequest into the reply a peer would send,
+// without fixing up any checksums.
+std::string ToReply(std::string request) {
+  if ((request[0] >> 4) == 4) {
+    request[20] = 0;
+  } else {
+    request[40] = static_cast<char>(129);
+  }
+  return request;
+}
+
+TEST(IcmpTest, BuildsIpv4EchoRequest) {
+  ASSERT_OK_AND_ASSIGN(auto packet,
+                       BuildEchoRequest(kIpv4Source, kIpv4Destination,
+                                        0x1234, 0x5678, 1400));
+  ASSERT_EQ(packet.size(), 1400);
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  EXPECT_EQ(bytes[0], 0x45);
+  EXPECT_EQ((bytes[2] << 8) | bytes[3], 1400);
+  EXPECT_EQ(bytes[6] & 0x40, 0x40);  // Don't fragment.
+  EXPECT_EQ(bytes[9], 1);
+  EXPECT_EQ(packet.substr(12, 4), kIpv4Source);
+  EXPECT_EQ(packet.substr(16, 4), kIpv4Destination);
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, bytes, 20)), 0);
+
+  EXPECT_EQ(bytes[20], 8);
+  EXPECT_EQ(bytes[21], 0);
+  EXPECT_EQ((bytes[24] << 8) | bytes[25], 0x1234);
+  EXPECT_EQ((bytes[26] << 8) | bytes[27], 0x5678);
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, bytes + 20, 1380)), 0);
+}
+
+TEST(IcmpTest, BuildsIpv6EchoRequest) {
+  ASSERT_OK_AND_ASSIGN(auto packet,
+                       BuildEchoRequest(kIpv6Source, kIpv6Destination,
+                                        0x1234, 0x5678, 1281));
+  ASSERT_EQ(packet.size(), 1281);
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  EXPECT_EQ(bytes[0] >> 4, 6);
+  EXPECT_EQ((bytes[4] << 8) | bytes[5], 1241);
+  EXPECT_EQ(bytes[6], 58);
+  EXPECT_EQ(packet.substr(8, 16), kIpv6Source);
+  EXPECT_EQ(packet.substr(24, 16), kIpv6Destination);
+
+  EXPECT_EQ(bytes[40], 128);
+  EXPECT_EQ((bytes[44] << 8) | bytes[45], 0x1234);
+  EXPECT_EQ((bytes[46] << 8) | bytes[47], 0x5678);
+  uint32_t sum = ChecksumAddPseudoHeader(0, bytes + 8, 16, 58, 1241);
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(sum, bytes + 40, 1241)), 0);
+}
+
+TEST(IcmpTest, BuildsSmallestEchoRequests) {
+  EXPECT_OK(BuildEchoRequest(kIpv4Source, kIpv4Destination, 1, 1,
+                             kMinIpv4EchoSize));
+  EXPECT_OK(BuildEchoRequest(kIpv6Source, kIpv6Destination, 1, 1,
+                             kMinIpv6EchoSize));
+}
+
+TEST(IcmpTest, RejectsBadArguments) {
+  EXPECT_THAT(BuildEchoRequest(kIpv4Source, kIpv6Destination, 1, 1, 1000),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildEchoRequest("abc", "def", 1, 1, 1000),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildEchoRequest(kIpv4Source, kIpv4Destination, 1, 1,
+                               kMinIpv4EchoSize - 1),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildEchoRequest(kIpv6Source, kIpv6Destination, 1, 1, 70000),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(IcmpTest, ParsesEchoReplies) {
+  ASSERT_OK_AND_ASSIGN(auto ipv4, BuildEchoRequest(kIpv4Destination,
+                                                   kIpv4Source, 7, 42, 100));
+  ASSERT_OK_AND_ASSIGN(auto ipv6, BuildEchoRequest(kIpv6Destination,
+                                                   kIpv6Source, 7, 43, 100));
+  EXPECT_THAT(ParseEchoReply(ToReply(ipv4), 7), Optional(Eq(42)));
+  EXPECT_THAT(ParseEchoReply(ToReply(ipv6), 7), Optional(Eq(43)));
+}
+
+TEST(IcmpTest, IgnoresOtherPackets) {
+  ASSERT_OK_AND_ASSIGN(auto ipv4, BuildEchoRequest(kIpv4Destination,
+                                                   kIpv4Source, 7, 42, 100));
+  // Requests aren't replies.
+  EXPECT_EQ(ParseEchoReply(ipv4, 7), std::nullopt);
+  // Replies to someone else's pings are left alone.
+  EXPECT_EQ(ParseEchoReply(ToReply(ipv4), 8), std::nullopt);
+  // Truncated and non-ICMP packets.
+  EXPECT_EQ(ParseEchoReply(ToReply(ipv4).substr(0, 27), 7), std::nullopt);
+  std::string udp = ToReply(ipv4);
+  udp[9] = 17;
+  EXPECT_EQ(ParseEchoReply(udp, 7), std::nullopt);
+  EXPECT_EQ(ParseEchoReply("", 7), std::nullopt);
+  EXPECT_EQ(ParseEchoReply("garbage", 7), std::nullopt);
+}
+
+TEST(IcmpTest, BuildsIpv4PacketTooBig) {
+  ASSERT_OK_AND_ASSIGN(auto packet, BuildEchoRequest(kIpv4Source,
+                                                     kIpv4Destination, 7, 42,
+                                                     1400));
+  ASSERT_OK_AND_ASSIGN(auto reply, BuildPacketTooBig(packet, 1300));
+  // Quotes as much of the packet as fits in 576 bytes.
+  ASSERT_EQ(reply.size(), 576);
+  const auto* bytes = reinterpret_cast<const uint8_t*>(reply.data());
+  EXPECT_EQ(bytes[0], 0x45);
+  EXPECT_EQ((bytes[2] << 8) | bytes[3], 576);
+  EXPECT_EQ(bytes[9], 1);
+  EXPECT_EQ(reply.substr(12, 4), kIpv4Destination);
+  EXPECT_EQ(reply.substr(16, 4), kIpv4Source);
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, bytes, 20)), 0);
+
+  EXPECT_EQ(bytes[20], 3);
+  EXPECT_EQ(bytes[21], 4);
+  EXPECT_EQ((bytes[26] << 8) | bytes[27], 1300);
+  EXPECT_EQ(reply.substr(28), packet.substr(0, 548));
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(0, bytes + 20, 556)), 0);
+}
+
+TEST(IcmpTest, BuildsIpv6PacketTooBig) {
+  ASSERT_OK_AND_ASSIGN(auto packet, BuildEchoRequest(kIpv6Source,
+                                                     kIpv6Destination, 7, 42,
+                                                     1400));
+  ASSERT_OK_AND_ASSIGN(auto reply, BuildPacketTooBig(packet, 1350));
+  // Quotes as much of the packet as fits in 1280 bytes.
+  ASSERT_EQ(reply.size(), 1280);
+  const auto* bytes = reinterpret_cast<const uint8_t*>(reply.data());
+  EXPECT_EQ(bytes[0] >> 4, 6);
+  EXPECT_EQ((bytes[4] << 8) | bytes[5], 1240);
+  EXPECT_EQ(bytes[6], 58);
+  EXPECT_EQ(reply.substr(8, 16), kIpv6Destination);
+  EXPECT_EQ(reply.substr(24, 16), kIpv6Source);
+
+  EXPECT_EQ(bytes[40], 2);
+  EXPECT_EQ(bytes[41], 0);
+  EXPECT_EQ((bytes[44] << 24) | (bytes[45] << 16) | (bytes[46] << 8) |
+                bytes[47],
+            1350);
+  EXPECT_EQ(reply.substr(48), packet.substr(0, 1232));
+  uint32_t sum = ChecksumAddPseudoHeader(0, bytes + 8, 16, 58, 1240);
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(sum, bytes + 40, 1240)), 0);
+}
+
+TEST(IcmpTest, QuotesAllOfASmallPacket) {
+  ASSERT_OK_AND_ASSIGN(auto packet, BuildEchoRequest(kIpv4Source,
+                                                     kIpv4Destination, 7, 42,
+                                                     100));
+  ASSERT_OK_AND_ASSIGN(auto reply, BuildPacketTooBig(packet, 68));
+  EXPECT_EQ(reply.size(), 128);
+  EXPECT_EQ(reply.substr(28), packet);
+}
+
+TEST(IcmpTest, DoesNotReplyToPacketsThatShouldNotGetOne) {
+  ASSERT_OK_AND_ASSIGN(auto ipv4, BuildEchoRequest(kIpv4Source,
+                                                   kIpv4Destination, 7, 42,
+                                                   1400));
+  ASSERT_OK_AND_ASSIGN(auto ipv6, BuildEchoRequest(kIpv6Source,
+                                                   kIpv6Destination, 7, 42,
+                                                   1400));
+  // Packets that fit.
+  EXPECT_THAT(BuildPacketTooBig(ipv4, 1400),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildPacketTooBig(ipv6, 0),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // IPv4 packets that the sender allows to be fragmented.
+  std::string fragmentable = ipv4;
+  fragmentable[6] = 0;
+  EXPECT_THAT(BuildPacketTooBig(fragmentable, 1300),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // Later fragments.
+  std::string fragment = ipv4;
+  fragment[7] = 1;
+  EXPECT_THAT(BuildPacketTooBig(fragment, 1300),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // ICMP errors, including the ones built here.
+  ASSERT_OK_AND_ASSIGN(auto ipv4_error, BuildPacketTooBig(ipv4, 300));
+  EXPECT_THAT(BuildPacketTooBig(ipv4_error, 300),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  ASSERT_OK_AND_ASSIGN(auto ipv6_error, BuildPacketTooBig(ipv6, 1000));
+  EXPECT_THAT(BuildPacketTooBig(ipv6_error, 1000),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // Malformed packets.
+  EXPECT_THAT(BuildPacketTooBig(ipv4.substr(0, 19), 10),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildPacketTooBig(ipv6.substr(0, 39), 10),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(BuildPacketTooBig("garbage", 4),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
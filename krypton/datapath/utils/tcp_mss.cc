@@ -0,0 +1,149 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/tcp_mss.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+namespace {
+
+constexpr size_t kIpv4HeaderSize = 20;
+constexpr size_t kIpv6HeaderSize = 40;
+constexpr size_t kTcpHeaderSize = 20;
+constexpr uint8_t kIpProtocolTcp = 6;
+
+constexpr uint8_t kTcpFlagSyn = 0x02;
+constexpr uint8_t kTcpOptionEnd = 0;
+constexpr uint8_t kTcpOptionNop = 1;
+constexpr uint8_t kTcpOptionMss = 2;
+constexpr uint8_t kTcpOptionMssLength = 4;
+
+uint16_t Load16(const uint8_t* bytes) {
+  return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+}
+
+void Store16(uint8_t* bytes, uint16_t value) {
+  bytes[0] = value >> 8;
+  bytes[1] = value & 0xff;
+}
+
+uint16_t Swap16(uint16_t value) {
+  return static_cast<uint16_t>((value << 8) | (value >> 8));
+}
+
+// Returns the offset of the TCP header in `bytes`, or 0 if the packet isn't
+// the first fragment of a TCP segment. Sets `ip_header_size` to the size of
+// the fixed IP header, which is what the MSS is relative to.
+size_t FindTcpHeader(const uint8_t* bytes, size_t length,
+                     size_t* ip_header_size) {
+  if (length == 0) {
+    return 0;
+  }
+  switch (bytes[0] >> 4) {
+    case 4: {
+      if (length < kIpv4HeaderSize || bytes[9] != kIpProtocolTcp ||
+          (Load16(bytes + 6) & 0x1fff) != 0) {
+        return 0;
+      }
+      size_t header_size = (bytes[0] & 0x0f) * 4;
+      if (header_size < kIpv4HeaderSize) {
+        return 0;
+      }
+      *ip_header_size = kIpv4HeaderSize;
+      return header_size;
+    }
+    case 6:
+      if (length < kIpv6HeaderSize || bytes[6] != kIpProtocolTcp) {
+        return 0;
+      }
+      *ip_header_size = kIpv6HeaderSize;
+      return kIpv6HeaderSize;
+    default:
+      return 0;
+  }
+}
+
+}  // namespace
+
+bool ClampTcpMss(char* packet, size_t length, int mtu) {
+  auto* bytes = reinterpret_cast<uint8_t*>(packet);
+  size_t ip_header_size = 0;
+  size_t tcp_offset = FindTcpHeader(bytes, length, &ip_header_size);
+  if (tcp_offset == 0 || length < tcp_offset + kTcpHeaderSize) {
+    return false;
+  }
+  uint8_t* tcp = bytes + tcp_offset;
+  if ((tcp[13] & kTcpFlagSyn) == 0) {
+    return false;
+  }
+  size_t tcp_header_size = (tcp[12] >> 4) * 4;
+  if (tcp_header_size <= kTcpHeaderSize ||
+      length < tcp_offset + tcp_header_size) {
+    return false;
+  }
+  int max_mss = mtu - static_cast<int>(ip_header_size + kTcpHeaderSize);
+  if (max_mss <= 0) {
+    return false;
+  }
+
+  size_t offset = kTcpHeaderSize;
+  while (offset < tcp_header_size) {
+    uint8_t kind = tcp[offset];
+    if (kind == kTcpOptionEnd) {
+      return false;
+    }
+    if (kind == kTcpOptionNop) {
+      ++offset;
+      continue;
+    }
+    if (offset + 1 >= tcp_header_size) {
+      return false;
+    }
+    uint8_t option_length = tcp[offset + 1];
+    if (option_length < 2 || offset + option_length > tcp_header_size) {
+      return false;
+    }
+    if (kind == kTcpOptionMss && option_length == kTcpOptionMssLength) {
+      uint8_t* value = tcp + offset + 2;
+      uint16_t old_mss = Load16(value);
+      if (old_mss <= max_mss) {
+        return false;
+      }
+      uint16_t new_mss = static_cast<uint16_t>(max_mss);
+      Store16(value, new_mss);
+      // The checksum sums aligned 16-bit words, so a value at an odd offset
+      // straddles two of them, and its bytes count the other way around.
+      bool odd = ((offset + 2) & 1) != 0;
+      Store16(tcp + 16, ChecksumUpdate(Load16(tcp + 16),
+                                       odd ? Swap16(old_mss) : old_mss,
+                                       odd ? Swap16(new_mss) : new_mss));
+      return true;
+    }
+    offset += option_length;
+  }
+  return false;
+}
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
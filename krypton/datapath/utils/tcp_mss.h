@@ -0,0 +1,39 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_DATAPATH_UTILS_TCP_MSS_H_
+#define PRIVACY_NET_KRYPTON_DATAPATH_UTILS_TCP_MSS_H_
+
+#include <cstddef>
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+
+// If `packet` is an IPv4 or IPv6 TCP segment with the SYN flag set, and its
+// MSS option allows segments that wouldn't fit in `mtu`, lowers the MSS to fit
+// and patches the TCP checksum incrementally. Returns whether the packet was
+// changed.
+//
+// This is cheap for packets that aren't SYNs, so it can be called on every
+// packet. IPv6 packets with extension headers before TCP are left alone.
+bool ClampTcpMss(char* packet, size_t length, int mtu);
+
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_DATAPATH_UTILS_TCP_MSS_H_
@@ -0,0 +1,171 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/datapath/utils/tcp_mss.h"
+
+#include <cstdint>
+#include <string>
+
+#include "privacy/net/krypton/datapath/utils/checksum.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+
+namespace privacy {
+namespace krypton {
+namespace datapath {
+namespace utils {
+namespace {
+
+constexpr uint8_t kSyn = 0x02;
+constexpr uint8_t kAck = 0x10;
+
+// Builds a TCP segment with the given flags and options, which must be a
+// multiple of 4 bytes long, and a valid checksum.
+std::string BuildTcpPacket(bool ipv6, uint8_t flags,
+                           const std::string& options) {
+  const size_t ip_header_size = ipv6 ? 40 : 20;
+  const size_t tcp_length = 20 + options.size();
+  std::string packet(ip_header_size + tcp_length, '\0');
+  auto* bytes = reinterpret_cast<uint8_t*>(packet.data());
+  if (ipv6) {
+    bytes[0] = 0x60;
+    bytes[4] = tcp_length >> 8;
+    bytes[5] = tcp_length & 0xff;
+    bytes[6] = 6;
+    bytes[7] = 64;
+    for (int i = 0; i < 32; ++i) bytes[8 + i] = i + 1;
+  } else {
+    bytes[0] = 0x45;
+    bytes[2] = packet.size() >> 8;
+    bytes[3] = packet.size() & 0xff;
+    bytes[8] = 64;
+    bytes[9] = 6;
+    for (int i = 0; i < 8; ++i) bytes[12 + i] = i + 1;
+  }
+  uint8_t* tcp = bytes + ip_header_size;
+  tcp[0] = 0x12;
+  tcp[1] = 0x34;
+  tcp[2] = 0x01;
+  tcp[3] = 0xbb;
+  tcp[12] = (tcp_length / 4) << 4;
+  tcp[13] = flags;
+  tcp[14] = 0xff;
+  tcp[15] = 0xff;
+  packet.replace(ip_header_size + 20, options.size(), options);
+
+  uint32_t sum = ChecksumAddPseudoHeader(0, bytes + (ipv6 ? 8 : 12),
+                                         ipv6 ? 16 : 4, 6, tcp_length);
+  uint16_t checksum = ChecksumFinish(ChecksumAdd(sum, tcp, tcp_length));
+  tcp[16] = checksum >> 8;
+  tcp[17] = checksum & 0xff;
+  return packet;
+}
+
+bool ChecksumValid(const std::string& packet) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(packet.data());
+  bool ipv6 = (bytes[0] >> 4) == 6;
+  size_t ip_header_size = ipv6 ? 40 : 20;
+  size_t tcp_length = packet.size() - ip_header_size;
+  uint32_t sum = ChecksumAddPseudoHeader(0, bytes + (ipv6 ? 8 : 12),
+                                         ipv6 ? 16 : 4, 6, tcp_length);
+  return ChecksumFinish(ChecksumAdd(sum, bytes + ip_header_size,
+                                    tcp_length)) == 0;
+}
+
+// An MSS option with the given value.
+std::string MssOption(uint16_t mss) {
+  return std::string({2, 4, static_cast<char>(mss >> 8),
+                      static_cast<char>(mss & 0xff)});
+}
+
+uint16_t MssAt(const std::string& packet, size_t offset) {
+  return static_cast<uint16_t>((static_cast<uint8_t>(packet[offset]) << 8) |
+                               static_cast<uint8_t>(packet[offset + 1]));
+}
+
+TEST(TcpMssTest, ClampsIpv4Syn) {
+  std::string packet = BuildTcpPacket(false, kSyn, MssOption(1460));
+  ASSERT_TRUE(ChecksumValid(packet));
+  EXPECT_TRUE(ClampTcpMss(packet.data(), packet.size(), 1300));
+  EXPECT_EQ(MssAt(packet, 42), 1260);
+  EXPECT_TRUE(ChecksumValid(packet));
+}
+
+TEST(TcpMssTest, ClampsIpv6SynAck) {
+  std::string packet = BuildTcpPacket(true, kSyn | kAck, MssOption(1440));
+  EXPECT_TRUE(ClampTcpMss(packet.data(), packet.size(), 1300));
+  EXPECT_EQ(MssAt(packet, 62), 1240);
+  EXPECT_TRUE(ChecksumValid(packet));
+}
+
+TEST(TcpMssTest, ClampsMssAtOddOffset) {
+  // A NOP, the MSS, and three bytes of end-of-options padding.
+  std::string options = std::string(1, 1) + MssOption(1460) +
+                        std::string(3, '\0');
+  std::string packet = BuildTcpPacket(false, kSyn, options);
+  EXPECT_TRUE(ClampTcpMss(packet.data(), packet.size(), 1000));
+  EXPECT_EQ(MssAt(packet, 43), 960);
+  EXPECT_TRUE(ChecksumValid(packet));
+}
+
+TEST(TcpMssTest, FindsMssAfterOtherOptions) {
+  // Window scale, SACK permitted, then the MSS.
+  std::string options = std::string({3, 3, 7, 4, 2}) + std::string(1, 1) +
+                        MssOption(1460) + std::string(4, 1);
+  options.resize(12);
+  std::string packet = BuildTcpPacket(true, kSyn, options);
+  EXPECT_TRUE(ClampTcpMss(packet.data(), packet.size(), 1280));
+  EXPECT_EQ(MssAt(packet, 68), 1220);
+  EXPECT_TRUE(ChecksumValid(packet));
+}
+
+TEST(TcpMssTest, LeavesSmallerMssAlone) {
+  std::string packet = BuildTcpPacket(false, kSyn, MssOption(1200));
+  std::string original = packet;
+  EXPECT_FALSE(ClampTcpMss(packet.data(), packet.size(), 1300));
+  EXPECT_EQ(packet, original);
+}
+
+TEST(TcpMssTest, LeavesNonSynAlone) {
+  std::string packet = BuildTcpPacket(false, kAck, MssOption(1460));
+  std::string original = packet;
+  EXPECT_FALSE(ClampTcpMss(packet.data(), packet.size(), 1300));
+  EXPECT_EQ(packet, original);
+}
+
+TEST(TcpMssTest, IgnoresMalformedPackets) {
+  std::string packet = BuildTcpPacket(false, kSyn, MssOption(1460));
+
+  // Truncated in the options.
+  std::string truncated = packet.substr(0, 42);
+  EXPECT_FALSE(ClampTcpMss(truncated.data(), truncated.size(), 1300));
+
+  // An option running past the end of the header.
+  std::string bad_option = packet;
+  bad_option[41] = 8;
+  EXPECT_FALSE(ClampTcpMss(bad_option.data(), bad_option.size(), 1300));
+
+  // Not TCP.
+  std::string udp = packet;
+  udp[9] = 17;
+  EXPECT_FALSE(ClampTcpMss(udp.data(), udp.size(), 1300));
+
+  EXPECT_FALSE(ClampTcpMss(nullptr, 0, 1300));
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace datapath
+}  // namespace krypton
+}  // namespace privacy
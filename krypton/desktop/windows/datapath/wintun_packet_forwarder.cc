@@ -130,7 +130,7 @@ void WintunPacketForwarder::ProcessUplink() {
       }
       enc_pkts.emplace_back(const_cast<const char*>(enc_pkt.buffer()),
                             enc_pkt.buffer_size(), IPProtocol::kUnknown,
-                            [] {});
+                            PacketOwner());
     }
     // Send packets via network socket.
     auto result = socket_->WritePackets(std::move(enc_pkts));
@@ -187,7 +187,10 @@ void KryptonService::ServiceControlHandler(DWORD control) {
 void KryptonService::InitializeKrypton() {
   clock_ = std::make_unique<RealClock>();
   ppn_telemetry_manager_ = std::make_unique<PpnTelemetryManager>(clock_.get());
-  timer_manager_ = std::make_unique<TimerManager>(Timer::Get());
+  // All of Krypton's timers share a single Windows timer.
+  timing_wheel_timer_ =
+      std::make_unique<TimingWheelTimer>(Timer::Get(), &timer_clock_);
+  timer_manager_ = std::make_unique<TimerManager>(timing_wheel_timer_.get());
   PPN_LOG_IF_ERROR(vpn_service_.InitializeWintun());
   ppn_notification_ = std::make_unique<PpnNotificationReceiver>(
       service_to_app_pipe_ipc_handler_.get());
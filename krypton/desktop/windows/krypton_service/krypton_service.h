@@ -40,6 +40,7 @@
 #include "privacy/net/krypton/krypton.h"
 #include "privacy/net/krypton/proto/krypton_config.proto.h"
 #include "privacy/net/krypton/timer_manager.h"
+#include "privacy/net/krypton/timing_wheel_timer.h"
 #include "privacy/net/krypton/utils/looper.h"
 #include "third_party/absl/status/status.h"
 
@@ -119,6 +120,8 @@ class KryptonService : public PpnServiceInterface,
   std::unique_ptr<privacy::krypton::windows::IpcOauth> oauth_;
   VpnService vpn_service_;
   std::unique_ptr<PpnTelemetryManager> ppn_telemetry_manager_;
+  MonotonicClock timer_clock_;
+  std::unique_ptr<TimingWheelTimer> timing_wheel_timer_;
   std::unique_ptr<TimerManager> timer_manager_;
   std::unique_ptr<PpnNotificationReceiver> ppn_notification_;
   krypton::utils::LooperThread ppn_notification_looper_{
@@ -231,7 +231,7 @@ absl::StatusOr<std::vector<Packet>> RioSocket::ReadPackets() {
     memcpy(copy_packet, rio_packet, packet_size);
     packets.emplace_back(const_cast<const char *>(copy_packet), packet_size,
                          IPProtocol::kUnknown,
-                         [copy_packet]() { delete[] copy_packet; });
+                         PacketOwner::HeapArray(copy_packet));
   }
   return packets;
 }
@@ -50,7 +50,7 @@ absl::StatusOr<std::vector<Packet>> Socket::ReadPackets() {
                                     WSAGetLastError());
   }
   auto pkt = Packet(recv_buf, recv_bytes, IPProtocol::kIPv4,
-                    [recv_buf] { delete[] recv_buf; });
+                    PacketOwner::HeapArray(recv_buf));
   v.push_back(std::move(pkt));
   return v;
 }
@@ -196,14 +196,14 @@ absl::StatusOr<Packet> Wintun::AllocateSendPacket(uint32_t packet_size) {
     return utils::GetStatusForError("unable to allocate send packet",
                                     GetLastError());
   }
-  // Packet takes a cleanup function that's called when Krypton finishes with it
-  // but we don't need it for Wintun, as WintunSendPacket must be used to free
-  // the allocated memory.
-  // We pass an empty block to the Packet constructor and expect a matching
+  // Packet takes an owner that's released when Krypton finishes with it but we
+  // don't need it for Wintun, as WintunSendPacket must be used to free the
+  // allocated memory.
+  // We pass an empty owner to the Packet constructor and expect a matching
   // WintunSendPacket call later.
   // TODO: automatically cleanup this memory
   return Packet(const_cast<const char*>(reinterpret_cast<char*>(bytes)),
-                packet_size, krypton::IPProtocol::kUnknown, [] {});
+                packet_size, krypton::IPProtocol::kUnknown, PacketOwner());
 }
 
 absl::Status Wintun::AllocateAndSendPacket(uint8_t* buffer,
@@ -259,11 +259,11 @@ absl::StatusOr<Packet> Wintun::ReceivePacket() {
   } else {
     protocol = IPProtocol::kUnknown;
   }
-  // Packet does not have a cleanup function. We expect the caller to use
+  // Packet does not own the buffer. We expect the caller to use
   // Wintun::ReleaseReceivePacket to manually release the allocated buffer.
   // TODO: automatically cleanup this memory
   return Packet(reinterpret_cast<const char*>(bytes), packet_size, protocol,
-                [] {});
+                PacketOwner());
 }
 
 absl::Status Wintun::ReleaseReceivePacket(Packet packet) {
@@ -15,10 +15,13 @@
 #include "privacy/net/krypton/fd_packet_pipe.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
+#include <cstddef>
 #include <cstring>
 #include <functional>
 #include <memory>
@@ -28,7 +31,10 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/event_fd.h"
 #include "privacy/net/krypton/datapath/android_ipsec/events_helper.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
 #include "privacy/net/krypton/datapath/android_ipsec/socket_util.h"
+#include "privacy/net/krypton/datapath/android_ipsec/tun_offload.h"
+#include "privacy/net/krypton/datapath/android_ipsec/udp_offload.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/utils/ip_range.h"
@@ -43,6 +49,7 @@
 #include "third_party/absl/strings/string_view.h"
 #include "third_party/absl/strings/substitute.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -50,8 +57,37 @@ namespace {
 constexpr int kMaxPacketSize = 4096;
 constexpr int kMaxEvents = 4;
 
+// With GRO, a single read may return a whole burst of coalesced datagrams.
+constexpr size_t kGroBufferSize = kPacketHeadroom +
+                                  datapath::android::kMaxUdpPayloadSize +
+                                  kPacketTailroom;
+constexpr size_t kMaxFreeGroBuffers = 8;
+
+// The most packets read from the fd before they're handed on, unless
+// overridden with SetMaxReadBurst.
+constexpr size_t kDefaultMaxReadBurst = 32;
+
+// How many read buffers are kept around for reuse, once the packets they were
+// handed out in have been destroyed.
+constexpr size_t kMaxFreeBuffers = 8 * kDefaultMaxReadBurst;
+
 }  // namespace
 
+FdPacketPipe::FdPacketPipe(int fd)
+    : fd_(fd),
+      thread_(absl::StrCat("FdPacketPipe{FD=", fd, "}")),
+      max_read_burst_(kDefaultMaxReadBurst),
+      buffer_pool_(kMaxPacketSize, kMaxFreeBuffers),
+      gro_buffer_pool_(kGroBufferSize, kMaxFreeGroBuffers) {
+  // Both probes fail harmlessly if the fd isn't a UDP socket, e.g. for a TUN.
+  gso_enabled_ = datapath::android::SupportsUdpGso(fd);
+  gro_enabled_ = datapath::android::EnableUdpGro(fd);
+  if (gso_enabled_ || gro_enabled_) {
+    LOG(INFO) << "UDP offload on FD=" << fd << ": GSO=" << gso_enabled_
+              << ", GRO=" << gro_enabled_;
+  }
+}
+
 FdPacketPipe::~FdPacketPipe() {
   absl::MutexLock lock(&mutex_);
   if (fd_ >= 0) {
@@ -125,20 +161,83 @@ void FdPacketPipe::ReadPackets(
   thread_.Post([this] { Run(); });
 }
 
+void FdPacketPipe::SetMaxReadBurst(size_t max_read_burst) {
+  max_read_burst_ = std::max<size_t>(max_read_burst, 1);
+}
+
+absl::Status FdPacketPipe::EnableTunOffload() {
+  PPN_RETURN_IF_ERROR(datapath::android::EnableTunOffload(fd_));
+  LOG(INFO) << "Enabled TUN offloads on FD=" << fd_;
+  tun_offload_read_buffer_ = std::make_unique<char[]>(
+      datapath::android::kMaxTunOffloadReadSize);
+  return absl::OkStatus();
+}
+
 absl::Status FdPacketPipe::WritePackets(std::vector<Packet> packets) {
   if (fd_ == -1) {
     return absl::InternalError("pipe is closed");
   }
+  if (tun_offload_read_buffer_ != nullptr) {
+    return datapath::android::WriteTunPackets(fd_, packets);
+  }
 
-  for (const auto& packet : packets) {
-    int write_bytes;
-    do {
-      write_bytes = write(fd_, packet.data().data(), packet.data().size());
-    } while (write_bytes == -1 && errno == EINTR);
-    if (write_bytes == -1) {
-      return absl::InternalError(
-          absl::StrCat("Error writing to FD=", fd_, ": ", strerror(errno)));
+  auto remaining = absl::MakeConstSpan(packets);
+  while (!remaining.empty()) {
+    size_t run =
+        gso_enabled_ ? datapath::android::GsoRunLength(remaining) : 1;
+    if (run > 1) {
+      PPN_RETURN_IF_ERROR(WriteGsoRun(remaining.first(run)));
+    } else {
+      PPN_RETURN_IF_ERROR(WritePacket(remaining.front()));
     }
+    remaining.remove_prefix(run);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FdPacketPipe::WritePacket(const Packet& packet) {
+  int write_bytes;
+  do {
+    write_bytes = write(fd_, packet.data().data(), packet.data().size());
+  } while (write_bytes == -1 &&
+           (errno == EINTR ||
+            (errno == EAGAIN && datapath::android::WaitUntilWritable(fd_))));
+  if (write_bytes == -1) {
+    return absl::InternalError(
+        absl::StrCat("Error writing to FD=", fd_, ": ", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FdPacketPipe::WriteGsoRun(absl::Span<const Packet> run) {
+  iovec iovecs[datapath::android::kMaxGsoSegments];
+  datapath::android::GsoControl control;
+  msghdr message;
+  datapath::android::PrepareGsoMessage(run, iovecs, &control, &message);
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(fd_, &message, 0);
+  } while (sent == -1 &&
+           (errno == EINTR ||
+            (errno == EAGAIN && datapath::android::WaitUntilWritable(fd_))));
+  if (sent != -1) {
+    return absl::OkStatus();
+  }
+  if (errno == EIO || errno == EOPNOTSUPP) {
+    // Some devices can't segment UDP after all, even though the socket
+    // accepted the option.
+    LOG(WARNING) << "Disabling UDP GSO on FD=" << fd_ << ": "
+                 << strerror(errno);
+    gso_enabled_ = false;
+  } else if (errno != EINVAL) {
+    return absl::InternalError(
+        absl::StrCat("Error writing to FD=", fd_, ": ", strerror(errno)));
+  }
+  // The kernel also rejects GSO sends whose segments don't fit the route's
+  // MTU, so fall back to writing each packet on its own.
+  for (const auto& packet : run) {
+    PPN_RETURN_IF_ERROR(WritePacket(packet));
   }
   return absl::OkStatus();
 }
@@ -167,8 +266,9 @@ absl::Status FdPacketPipe::RunInternal() {
     shutdown_event_fd = shutdown_event_->fd();
   }
 
-  // Build the event fd with fd_ & shutdown.
-  PPN_RETURN_IF_ERROR(datapath::android::SetSocketBlocking(fd_));
+  // Build the event fd with fd_ & shutdown. Reads keep going until there's
+  // nothing left to read, so they must not block.
+  PPN_RETURN_IF_ERROR(datapath::android::SetSocketNonBlocking(fd_));
   // Once the FD is added to the events, it should not be closed without
   // removing it from here. epoll will not provide feedback when the fd is
   // closed by another thread.
@@ -209,23 +309,22 @@ absl::Status FdPacketPipe::RunInternal() {
         // continue reading from socket in case there might be data.
       }
       if (datapath::android::EventsHelper::FileCanRead(events[i])) {
-        char* buffer = new char[kMaxPacketSize];
-
-        int read_bytes;
-        do {
-          read_bytes = read(notified_fd, buffer, kMaxPacketSize);
-        } while (read_bytes == -1 && errno == EINTR);
-
-        if (read_bytes <= 0) {
-          PostDatapathFailure(absl::DataLossError(absl::Substitute(
-              "Reading from FD $0: $1", fd_, strerror(errno))));
+        std::vector<Packet> packets;
+        status = ReadBurst(notified_fd, &packets);
+        // A failed read is only reported once the packets that were read
+        // before it have been handed on. If the failure persists, the next
+        // read will hit it again.
+        if (!status.ok() && packets.empty()) {
+          PostDatapathFailure(status);
+          continue;
+        }
+        if (packets.empty()) {
+          if (datapath::android::EventsHelper::FileWasClosed(events[i])) {
+            PostDatapathFailure(absl::DataLossError(
+                absl::Substitute("Reading from FD $0: hung up", fd_)));
+          }
           continue;
         }
-
-        Packet packet(buffer, read_bytes, IPProtocol::kUnknown,
-                      [&buffer]() { delete[] buffer; });
-        std::vector<Packet> packets;
-        packets.emplace_back(std::move(packet));
         if (!handler_(absl::OkStatus(), std::move(packets))) {
           return absl::OkStatus();
         }
@@ -235,6 +334,118 @@ absl::Status FdPacketPipe::RunInternal() {
   return absl::OkStatus();
 }
 
+absl::Status FdPacketPipe::ReadBurst(int fd, std::vector<Packet>* packets) {
+  if (gro_enabled_) {
+    // Each GRO read may return a whole burst of packets by itself.
+    while (packets->size() < max_read_burst_) {
+      size_t read_so_far = packets->size();
+      auto status = ReadGroDatagram(fd, packets);
+      if (!status.ok() || packets->size() == read_so_far) {
+        return status;
+      }
+    }
+    return absl::OkStatus();
+  }
+  if (tun_offload_read_buffer_ != nullptr) {
+    return ReadTunOffloadBurst(fd, packets);
+  }
+
+  // Leave room around each packet, so that the datapath can add its headers
+  // and trailers without copying the packet.
+  std::vector<char*> buffers(max_read_burst_);
+  buffer_pool_.Acquire(absl::MakeSpan(buffers));
+  size_t read_count = 0;
+  absl::Status status;
+  for (char* buffer : buffers) {
+    int read_bytes;
+    do {
+      read_bytes = read(fd, buffer + kPacketHeadroom,
+                        kMaxPacketSize - kPacketHeadroom - kPacketTailroom);
+    } while (read_bytes == -1 && errno == EINTR);
+    if (read_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (read_bytes <= 0) {
+      status = absl::DataLossError(
+          absl::Substitute("Reading from FD $0: $1", fd_, strerror(errno)));
+      break;
+    }
+    packets->push_back(buffer_pool_.MakePacket(
+        buffer, kPacketHeadroom, read_bytes, IPProtocol::kUnknown));
+    ++read_count;
+  }
+  buffer_pool_.Release(absl::MakeSpan(buffers).subspan(read_count));
+  return status;
+}
+
+absl::Status FdPacketPipe::ReadTunOffloadBurst(int fd,
+                                               std::vector<Packet>* packets) {
+  while (packets->size() < max_read_burst_) {
+    int read_bytes;
+    do {
+      read_bytes = read(fd, tun_offload_read_buffer_.get(),
+                        datapath::android::kMaxTunOffloadReadSize);
+    } while (read_bytes == -1 && errno == EINTR);
+    if (read_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (read_bytes <= 0) {
+      return absl::DataLossError(
+          absl::Substitute("Reading from FD $0: $1", fd_, strerror(errno)));
+    }
+    // A malformed packet is dropped, rather than failing the whole pipe.
+    auto status = datapath::android::SplitTunRead(
+        tun_offload_read_buffer_.get(), read_bytes, &buffer_pool_, packets);
+    if (!status.ok()) {
+      LOG(WARNING) << "Dropping packet from FD=" << fd_ << ": " << status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FdPacketPipe::ReadGroDatagram(int fd,
+                                           std::vector<Packet>* packets) {
+  char* buffer;
+  gro_buffer_pool_.Acquire(absl::MakeSpan(&buffer, 1));
+  iovec iov;
+  iov.iov_base = buffer + kPacketHeadroom;
+  iov.iov_len = datapath::android::kMaxUdpPayloadSize;
+  datapath::android::GroControl control;
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  ssize_t read_bytes;
+  do {
+    read_bytes = recvmsg(fd, &message, 0);
+  } while (read_bytes == -1 && errno == EINTR);
+
+  if (read_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    gro_buffer_pool_.Release(absl::MakeSpan(&buffer, 1));
+    return absl::OkStatus();
+  }
+  if (read_bytes <= 0) {
+    gro_buffer_pool_.Release(absl::MakeSpan(&buffer, 1));
+    return absl::DataLossError(
+        absl::Substitute("Reading from FD $0: $1", fd_, strerror(errno)));
+  }
+
+  size_t segment_size = datapath::android::GetGroSegmentSize(message);
+  if (segment_size == 0 || read_bytes <= segment_size) {
+    packets->push_back(gro_buffer_pool_.MakePacket(
+        buffer, kPacketHeadroom, read_bytes, IPProtocol::kUnknown));
+    return absl::OkStatus();
+  }
+  datapath::android::SplitGroBuffer(buffer + kPacketHeadroom, read_bytes,
+                                    segment_size,
+                                    gro_buffer_pool_.ReleaseAsOwner(buffer),
+                                    packets);
+  return absl::OkStatus();
+}
+
 absl::Status FdPacketPipe::Connect(const Endpoint& endpoint) {
   // Parse the endpoint into an ip_range so that we can use its utility to
   // convert the address into a sockaddr.
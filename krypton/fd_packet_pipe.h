@@ -16,6 +16,7 @@
 #define PRIVACY_NET_KRYPTON_FD_PACKET_PIPE_H_
 
 #include <atomic>
+#include <cstddef>
 #include <functional>
 #include <memory>
 #include <string>
@@ -23,6 +24,7 @@
 
 #include "privacy/net/krypton/datapath/android_ipsec/event_fd.h"
 #include "privacy/net/krypton/datapath/android_ipsec/events_helper.h"
+#include "privacy/net/krypton/datapath/android_ipsec/packet_buffer_pool.h"
 #include "privacy/net/krypton/endpoint.h"
 #include "privacy/net/krypton/pal/packet.h"
 #include "privacy/net/krypton/pal/packet_pipe.h"
@@ -32,6 +34,7 @@
 #include "third_party/absl/status/statusor.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/types/span.h"
 
 namespace privacy {
 namespace krypton {
@@ -39,8 +42,9 @@ namespace krypton {
 // A PacketPipe that's backed by a file descriptor.
 class FdPacketPipe : public PacketPipe {
  public:
-  explicit FdPacketPipe(int fd)
-      : fd_(fd), thread_(absl::StrCat("FdPacketPipe{FD=", fd, "}")) {}
+  // If the fd is a UDP socket, UDP segmentation and receive offload are used
+  // where the kernel supports them.
+  explicit FdPacketPipe(int fd);
 
   ~FdPacketPipe() override;
 
@@ -60,6 +64,19 @@ class FdPacketPipe : public PacketPipe {
 
   bool SocketListeningTestOnly() const { return started_listening_; }
 
+  // Sets the most packets handed to the ReadPackets handler at once. Whenever
+  // the fd is readable, it's drained until there's nothing left or this limit
+  // is reached. This should be called before calling ReadPackets.
+  void SetMaxReadBurst(size_t max_read_burst);
+
+  // Turns on the TUN checksum and segmentation offloads, so that the kernel
+  // can hand over TCP and UDP super-packets, which are segmented before being
+  // passed to the ReadPackets handler. Consecutive TCP segments passed to
+  // WritePackets are coalesced in turn. The fd must be a TUN device that was
+  // created with IFF_VNET_HDR. This should be called before calling
+  // ReadPackets.
+  absl::Status EnableTunOffload();
+
   // Connects the underlying socket fd to the given endpoint.
   // This should be called before calling WritePackets.
   absl::Status Connect(const Endpoint& endpoint);
@@ -72,6 +89,19 @@ class FdPacketPipe : public PacketPipe {
   void PostDatapathFailure(const absl::Status& status)
       ABSL_LOCKS_EXCLUDED(mutex_);
 
+  // Reads up to max_read_burst_ packets into `packets` without blocking. On a
+  // read error, the packets read before it are still returned.
+  absl::Status ReadBurst(int fd, std::vector<Packet>* packets);
+  // Reads a single, possibly GRO-coalesced, datagram into `packets`. Doesn't
+  // add anything if there was nothing to read.
+  absl::Status ReadGroDatagram(int fd, std::vector<Packet>* packets);
+  absl::Status ReadTunOffloadBurst(int fd, std::vector<Packet>* packets);
+
+  absl::Status WritePacket(const Packet& packet);
+  // Sends a run of equally sized packets as a single GSO buffer, falling back
+  // to one write per packet if the kernel refuses it.
+  absl::Status WriteGsoRun(absl::Span<const Packet> run);
+
   int fd_;
 
   absl::Mutex mutex_;
@@ -86,6 +116,17 @@ class FdPacketPipe : public PacketPipe {
 
   std::atomic_bool permanent_failure_notification_raised_ = false;
   std::atomic_bool started_listening_ = false;
+
+  size_t max_read_burst_;
+  datapath::android::PacketBufferPool buffer_pool_;
+
+  std::atomic_bool gso_enabled_ = false;
+  bool gro_enabled_ = false;
+  datapath::android::PacketBufferPool gro_buffer_pool_;
+
+  // Where super-packets are read to before being segmented, if the TUN
+  // offloads are enabled.
+  std::unique_ptr<char[]> tun_offload_read_buffer_;
 };
 
 }  // namespace krypton
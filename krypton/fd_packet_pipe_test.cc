@@ -66,6 +66,14 @@ MATCHER_P(PacketVectorEquals, expected, "Vector equals specified packets") {
   return true;
 }
 
+MATCHER(HasRoomForEncapsulation, "Packet is writable with spare room") {
+  if (arg.size() != 1) {
+    return false;
+  }
+  return arg[0].is_writable() && arg[0].headroom() >= kPacketHeadroom &&
+         arg[0].tailroom() >= kPacketTailroom;
+}
+
 class TestForwarder {
  public:
   bool ReadPackets(absl::Status status, std::vector<Packet> packets) {
@@ -135,6 +143,24 @@ TEST_F(FdPacketPipeTest, WritePacketFailureDueToFdClosure) {
               ::testing::status::StatusIs(absl::StatusCode::kInternal));
 }
 
+TEST_F(FdPacketPipeTest, WriteEquallySizedBurst) {
+  // These can be sent as a single GSO message, if the kernel supports it, but
+  // should arrive as separate datagrams either way.
+  std::vector<std::string> messages = {"aaaa", "bbbb", "cccc", "dd", "eeee"};
+  std::vector<Packet> packets;
+  for (const auto& message : messages) {
+    packets.emplace_back(message.data(), message.size(), IPProtocol::kIPv6,
+                         []() {});
+  }
+  EXPECT_OK(packet_pipe_.WritePackets(std::move(packets)));
+
+  for (const auto& message : messages) {
+    ASSERT_OK_AND_ASSIGN((auto [port, received_buffer]),
+                         copper_.ReceivePacket());
+    EXPECT_EQ(message, received_buffer);
+  }
+}
+
 TEST_F(FdPacketPipeTest, ReadPacket) {
   datapath::Packet packet_buffer;
   packet_buffer.set_sequence_number(1);
@@ -172,14 +198,78 @@ TEST_F(FdPacketPipeTest, ReadTwoPackets) {
 
   auto write_bytes = send(copper_.fd(), "foo", 3, MSG_CONFIRM);
   EXPECT_EQ(write_bytes, 3);
+  // Wait for the first packet, so that the two aren't read as one burst.
+  EXPECT_TRUE(done1.WaitForNotificationWithTimeout(absl::Seconds(2)));
 
   write_bytes = send(copper_.fd(), "bar", 3, MSG_CONFIRM);
   EXPECT_EQ(write_bytes, 3);
 
-  EXPECT_TRUE(done1.WaitForNotificationWithTimeout(absl::Seconds(2)));
   EXPECT_TRUE(done2.WaitForNotificationWithTimeout(absl::Seconds(2)));
 }
 
+TEST_F(FdPacketPipeTest, ReadBurst) {
+  EXPECT_OK(packet_pipe_.StopReadingPackets());
+
+  // Everything that's queued up by the time the pipe starts reading should be
+  // handed on together.
+  std::vector<Packet> expected;
+  for (const char* data : {"foo", "bar", "baz"}) {
+    expected.emplace_back(data, 3, IPProtocol::kUnknown, []() {});
+    auto write_bytes = send(copper_.fd(), data, 3, MSG_CONFIRM);
+    EXPECT_EQ(write_bytes, 3);
+  }
+
+  absl::Notification done;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(absl::OkStatus(), PacketVectorEquals(&expected)))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(true)));
+
+  StartReadingPackets();
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(2)));
+}
+
+TEST_F(FdPacketPipeTest, ReadBurstIsLimited) {
+  EXPECT_OK(packet_pipe_.StopReadingPackets());
+  packet_pipe_.SetMaxReadBurst(2);
+
+  std::vector<Packet> expected1;
+  std::vector<Packet> expected2;
+  expected1.emplace_back("foo", 3, IPProtocol::kUnknown, []() {});
+  expected1.emplace_back("bar", 3, IPProtocol::kUnknown, []() {});
+  expected2.emplace_back("baz", 3, IPProtocol::kUnknown, []() {});
+  for (const char* data : {"foo", "bar", "baz"}) {
+    auto write_bytes = send(copper_.fd(), data, 3, MSG_CONFIRM);
+    EXPECT_EQ(write_bytes, 3);
+  }
+
+  absl::Notification done;
+  ::testing::InSequence sequence;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(absl::OkStatus(), PacketVectorEquals(&expected1)))
+      .WillOnce(Return(true));
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(absl::OkStatus(), PacketVectorEquals(&expected2)))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(true)));
+
+  StartReadingPackets();
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(2)));
+}
+
+TEST_F(FdPacketPipeTest, ReadPacketLeavesRoomForEncapsulation) {
+  absl::Notification done;
+
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(absl::OkStatus(), HasRoomForEncapsulation()))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(false)));
+
+  auto write_bytes = send(copper_.fd(), "foo", 3, MSG_CONFIRM);
+  EXPECT_EQ(write_bytes, 3);
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(2)));
+}
+
 TEST_F(FdPacketPipeTest, StopReadingPackets) {
   Packet packet1("foo", 3, IPProtocol::kUnknown, []() {});
   Packet packet2("bar", 3, IPProtocol::kUnknown, []() {});
@@ -219,11 +309,11 @@ TEST_F(FdPacketPipeTest, StopReadingOnReturnFalse) {
   auto write_bytes = send(copper_.fd(), "foo", 3, MSG_CONFIRM);
   EXPECT_EQ(write_bytes, 3);
 
+  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(2)));
+
   write_bytes = send(copper_.fd(), "bar", 3, MSG_CONFIRM);
   EXPECT_EQ(write_bytes, 3);
 
-  EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(2)));
-
   // Add a little time just to make sure the second packet doesn't get read.
   absl::SleepFor(absl::Milliseconds(100));
 }
@@ -0,0 +1,173 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/io_uring_packet_pipe.h"
+
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "third_party/absl/log/die_if_null.h"
+#include "third_party/absl/log/log.h"
+#include "third_party/absl/memory/memory.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+namespace {
+constexpr int kMaxPacketSize = 4096;
+
+// How many packets can be waiting to be read, or held on to by packets that
+// haven't been destroyed yet, before the kernel has to hold off on reading.
+constexpr uint16_t kReadBufferCount = 256;
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<IoUringPacketPipe>> IoUringPacketPipe::Create(
+    int fd) {
+  PPN_ASSIGN_OR_RETURN(auto reader,
+                       datapath::android::IoUringReader::Create(
+                           fd, kReadBufferCount, kMaxPacketSize));
+  PPN_ASSIGN_OR_RETURN(auto writer,
+                       datapath::android::IoUringWriter::Create(fd));
+  return absl::WrapUnique(
+      new IoUringPacketPipe(fd, std::move(reader), std::move(writer)));
+}
+
+IoUringPacketPipe::IoUringPacketPipe(
+    int fd, std::unique_ptr<datapath::android::IoUringReader> reader,
+    std::unique_ptr<datapath::android::IoUringWriter> writer)
+    : fd_(fd),
+      thread_(absl::StrCat("IoUringPacketPipe{FD=", fd, "}")),
+      reader_(std::move(reader)),
+      writer_(std::move(writer)) {}
+
+IoUringPacketPipe::~IoUringPacketPipe() {
+  absl::MutexLock lock(&mutex_);
+  if (fd_ >= 0) {
+    LOG(FATAL) << "Tried to destroy unclosed packet pipe " << DebugString();
+  }
+}
+
+void IoUringPacketPipe::Run() {
+  LOG(INFO) << "Starting packet processing " << DebugString();
+  while (true) {
+    auto packets = reader_->Read();
+    if (!packets.ok()) {
+      LOG(ERROR) << "IoUringPacketPipe permanent failure: "
+                 << packets.status();
+      handler_(packets.status(), std::vector<Packet>());
+      break;
+    }
+    if (packets->empty()) {
+      if (StopRequested()) {
+        LOG(INFO) << "Shutting down PacketPipe " << DebugString();
+        break;
+      }
+      continue;
+    }
+    if (!handler_(absl::OkStatus(), *std::move(packets))) {
+      break;
+    }
+  }
+  LOG(INFO) << "Exiting packet processing " << DebugString();
+  // Signal any callers of StopReadingPackets that reading has fully stopped.
+  absl::MutexLock lock(&mutex_);
+  reading_ = false;
+  reading_stopped_.Signal();
+}
+
+bool IoUringPacketPipe::StopRequested() {
+  absl::MutexLock lock(&mutex_);
+  return stop_requested_;
+}
+
+void IoUringPacketPipe::Close() {
+  StopReadingPackets().IgnoreError();
+  absl::MutexLock lock(&mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  // The rings hold their own references to the fd, which would keep a TUN
+  // device up past the close otherwise.
+  PPN_LOG_IF_ERROR(reader_->ReleaseFile());
+  PPN_LOG_IF_ERROR(writer_->ReleaseFile());
+  close(fd_);
+  fd_ = -1;
+}
+
+absl::Status IoUringPacketPipe::StopReadingPackets() {
+  absl::MutexLock lock(&mutex_);
+  if (!reading_) {
+    LOG(WARNING) << "StopReadingPackets called on pipe that's already stopped: "
+                 << DebugString();
+    return absl::OkStatus();
+  }
+  stop_requested_ = true;
+  PPN_RETURN_IF_ERROR(reader_->Cancel());
+  // Wait for it to actually be finished. Otherwise, this pipe might send a
+  // packet after this method returns.
+  reading_stopped_.Wait(&mutex_);
+  return absl::OkStatus();
+}
+
+absl::Status IoUringPacketPipe::SetupReading() {
+  absl::MutexLock lock(&mutex_);
+  if (fd_ < 0) {
+    return absl::FailedPreconditionError(
+        "Tried to ReadPackets from closed IoUringPacketPipe");
+  }
+  if (reading_) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "ReadPackets called on already running pipe ", DebugString()));
+  }
+  reading_ = true;
+  stop_requested_ = false;
+  return absl::OkStatus();
+}
+
+void IoUringPacketPipe::ReadPackets(
+    std::function<bool(absl::Status, std::vector<Packet>)> handler) {
+  auto status = SetupReading();
+  if (!status.ok()) {
+    handler(status, std::vector<Packet>());
+    return;
+  }
+  handler_ = std::move(ABSL_DIE_IF_NULL(handler));
+  thread_.Post([this] { Run(); });
+}
+
+absl::Status IoUringPacketPipe::WritePackets(std::vector<Packet> packets) {
+  if (fd_ == -1) {
+    return absl::InternalError("pipe is closed");
+  }
+  int dropped = 0;
+  PPN_RETURN_IF_ERROR(writer_->Write(packets, &dropped));
+  if (dropped > 0) {
+    LOG(WARNING) << "Dropped " << dropped << " packets that were too large for "
+                 << DebugString();
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace krypton
+}  // namespace privacy
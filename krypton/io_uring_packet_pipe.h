@@ -0,0 +1,92 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_IO_URING_PACKET_PIPE_H_
+#define PRIVACY_NET_KRYPTON_IO_URING_PACKET_PIPE_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "privacy/net/krypton/datapath/android_ipsec/io_uring.h"
+#include "privacy/net/krypton/pal/packet.h"
+#include "privacy/net/krypton/pal/packet_pipe.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/status/statusor.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/synchronization/mutex.h"
+
+namespace privacy {
+namespace krypton {
+
+// A PacketPipe that reads and writes a file descriptor, such as a TUN device,
+// through io_uring. A multishot read keeps the fd drained into buffers owned
+// by the kernel, and every batch of packets is written with a single system
+// call.
+class IoUringPacketPipe : public PacketPipe {
+ public:
+  // Takes ownership of `fd`. Fails if io_uring isn't available, in which case
+  // FdPacketPipe should be used instead.
+  static absl::StatusOr<std::unique_ptr<IoUringPacketPipe>> Create(int fd);
+
+  ~IoUringPacketPipe() override;
+
+  absl::Status WritePackets(std::vector<Packet> packets) override;
+
+  void ReadPackets(
+      std::function<bool(absl::Status, std::vector<Packet>)> handler) override
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  absl::StatusOr<int> GetFd() const override { return fd_; }
+
+  void Close() override;
+
+  absl::Status StopReadingPackets() override ABSL_LOCKS_EXCLUDED(mutex_);
+
+  std::string DebugString() override {
+    return absl::StrCat("FD=", fd_, " (io_uring)");
+  }
+
+ private:
+  IoUringPacketPipe(int fd,
+                    std::unique_ptr<datapath::android::IoUringReader> reader,
+                    std::unique_ptr<datapath::android::IoUringWriter> writer);
+
+  absl::Status SetupReading() ABSL_LOCKS_EXCLUDED(mutex_);
+  void Run() ABSL_LOCKS_EXCLUDED(mutex_);
+  // Returns whether StopReadingPackets has been called since reading started.
+  bool StopRequested() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  int fd_;
+
+  absl::Mutex mutex_;
+  bool reading_ ABSL_GUARDED_BY(mutex_) = false;
+  // Lets a stale cancellation, from a StopReadingPackets call that raced with
+  // the handler stopping the reads itself, be told apart from a real one.
+  bool stop_requested_ ABSL_GUARDED_BY(mutex_) = false;
+  absl::CondVar reading_stopped_ ABSL_GUARDED_BY(mutex_);
+  std::function<bool(absl::Status, std::vector<Packet>)> handler_;
+
+  utils::LooperThread thread_;
+  std::unique_ptr<datapath::android::IoUringReader> reader_;
+  std::unique_ptr<datapath::android::IoUringWriter> writer_;
+};
+
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_IO_URING_PACKET_PIPE_H_
@@ -0,0 +1,205 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/io_uring_packet_pipe.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "privacy/net/krypton/pal/packet.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/functional/bind_front.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/synchronization/notification.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace {
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::InvokeWithoutArgs;
+using ::testing::Return;
+
+MATCHER_P(PacketsAre, expected, "Packets have the specified data") {
+  if (arg.size() != expected.size()) {
+    return false;
+  }
+  for (int i = 0; i < arg.size(); i++) {
+    if (arg[i].data() != expected[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+MATCHER(HaveRoomForEncapsulation, "Packets are writable with spare room") {
+  for (const auto& packet : arg) {
+    if (!packet.is_writable() || packet.headroom() < kPacketHeadroom ||
+        packet.tailroom() < kPacketTailroom) {
+      return false;
+    }
+  }
+  return true;
+}
+
+class TestForwarder {
+ public:
+  bool ReadPackets(absl::Status status, std::vector<Packet> packets) {
+    return DoReadPacket(status, packets);
+  }
+  MOCK_METHOD(bool, DoReadPacket,
+              (absl::Status, const std::vector<Packet>& packets), ());
+};
+
+class IoUringPacketPipeTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    // A datagram socket pair stands in for a TUN device, which also keeps
+    // packet boundaries.
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+    peer_fd_ = fds[1];
+    auto pipe = IoUringPacketPipe::Create(fds[0]);
+    if (!pipe.ok()) {
+      // io_uring may be disabled, e.g. by a seccomp filter.
+      close(fds[0]);
+      GTEST_SKIP() << pipe.status();
+    }
+    packet_pipe_ = *std::move(pipe);
+  }
+
+  void TearDown() override {
+    if (packet_pipe_ != nullptr) {
+      packet_pipe_->Close();
+    }
+    close(peer_fd_);
+  }
+
+  void StartReadingPackets() {
+    packet_pipe_->ReadPackets(
+        absl::bind_front(&TestForwarder::ReadPackets, &forwarder_));
+  }
+
+  void Send(const std::string& data) {
+    ASSERT_EQ(send(peer_fd_, data.data(), data.size(), 0), data.size());
+  }
+
+  std::string Receive() {
+    char buffer[256];
+    ssize_t length = recv(peer_fd_, buffer, sizeof(buffer), 0);
+    return length < 0 ? "" : std::string(buffer, length);
+  }
+
+  int peer_fd_ = -1;
+  std::unique_ptr<IoUringPacketPipe> packet_pipe_;
+  TestForwarder forwarder_;
+};
+
+TEST_F(IoUringPacketPipeTest, WritePackets) {
+  std::vector<Packet> packets;
+  packets.emplace_back("foo", 3, IPProtocol::kIPv4, []() {});
+  packets.emplace_back("barbaz", 6, IPProtocol::kIPv4, []() {});
+  ASSERT_OK(packet_pipe_->WritePackets(std::move(packets)));
+
+  EXPECT_EQ(Receive(), "foo");
+  EXPECT_EQ(Receive(), "barbaz");
+}
+
+TEST_F(IoUringPacketPipeTest, WritePacketsAfterClose) {
+  packet_pipe_->Close();
+  std::vector<Packet> packets;
+  packets.emplace_back("foo", 3, IPProtocol::kIPv4, []() {});
+  EXPECT_THAT(packet_pipe_->WritePackets(std::move(packets)),
+              ::testing::status::StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(IoUringPacketPipeTest, ReadPackets) {
+  absl::Notification first;
+  absl::Notification second;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(_, PacketsAre(std::vector<std::string>{"foo"})))
+      .WillOnce(DoAll(InvokeWithoutArgs(&first, &absl::Notification::Notify),
+                      Return(true)));
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(_, PacketsAre(std::vector<std::string>{"bar"})))
+      .WillOnce(DoAll(InvokeWithoutArgs(&second, &absl::Notification::Notify),
+                      Return(true)));
+  StartReadingPackets();
+
+  Send("foo");
+  ASSERT_TRUE(first.WaitForNotificationWithTimeout(absl::Seconds(3)));
+  Send("bar");
+  ASSERT_TRUE(second.WaitForNotificationWithTimeout(absl::Seconds(3)));
+}
+
+TEST_F(IoUringPacketPipeTest, ReadPacketsLeaveRoomForEncapsulation) {
+  absl::Notification done;
+  EXPECT_CALL(forwarder_, DoReadPacket(_, HaveRoomForEncapsulation()))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(true)));
+  Send("foo");
+  StartReadingPackets();
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(3)));
+}
+
+TEST_F(IoUringPacketPipeTest, StopReadingOnReturnFalse) {
+  absl::Notification done;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(_, PacketsAre(std::vector<std::string>{"foo"})))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(false)));
+  StartReadingPackets();
+  Send("foo");
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(3)));
+
+  // Nothing else is read until reading starts again.
+  Send("bar");
+  absl::SleepFor(absl::Milliseconds(50));
+  ::testing::Mock::VerifyAndClearExpectations(&forwarder_);
+
+  absl::Notification restarted;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(_, PacketsAre(std::vector<std::string>{"bar"})))
+      .WillOnce(DoAll(
+          InvokeWithoutArgs(&restarted, &absl::Notification::Notify),
+          Return(true)));
+  StartReadingPackets();
+  ASSERT_TRUE(restarted.WaitForNotificationWithTimeout(absl::Seconds(3)));
+}
+
+TEST_F(IoUringPacketPipeTest, StopReadingThenStart) {
+  StartReadingPackets();
+  ASSERT_OK(packet_pipe_->StopReadingPackets());
+
+  absl::Notification done;
+  EXPECT_CALL(forwarder_,
+              DoReadPacket(_, PacketsAre(std::vector<std::string>{"foo"})))
+      .WillOnce(DoAll(InvokeWithoutArgs(&done, &absl::Notification::Notify),
+                      Return(true)));
+  StartReadingPackets();
+  Send("foo");
+  ASSERT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(3)));
+}
+
+}  // namespace
+}  // namespace krypton
+}  // namespace privacy
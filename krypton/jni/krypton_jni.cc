@@ -29,10 +29,12 @@
 #include "privacy/net/krypton/jni/oauth.h"
 #include "privacy/net/krypton/jni/vpn_service.h"
 #include "privacy/net/krypton/krypton.h"
+#include "privacy/net/krypton/krypton_clock.h"
 #include "privacy/net/krypton/proto/debug_info.proto.h"
 #include "privacy/net/krypton/proto/krypton_telemetry.proto.h"
 #include "privacy/net/krypton/proto/network_info.proto.h"
 #include "privacy/net/krypton/timer_manager.h"
+#include "privacy/net/krypton/timing_wheel_timer.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/time/time.h"
 
@@ -42,6 +44,7 @@ using privacy::krypton::KryptonDebugInfo;
 using privacy::krypton::KryptonTelemetry;
 using privacy::krypton::NetworkInfo;
 using privacy::krypton::TimerManager;
+using privacy::krypton::TimingWheelTimer;
 using privacy::krypton::jni::ConvertJavaByteArrayToString;
 using privacy::krypton::jni::HttpFetcher;
 using privacy::krypton::jni::JniCache;
@@ -160,7 +163,10 @@ struct KryptonCache {
     oauth = std::make_unique<OAuth>(oauth_token_provider_instance);
     jni_timer_interface =
         std::make_unique<JniTimerInterfaceImpl>(timer_manager_id_instance);
-    timer_manager = std::make_unique<TimerManager>(jni_timer_interface.get());
+    // All of Krypton's timers share a single Java timer.
+    timing_wheel_timer = std::make_unique<TimingWheelTimer>(
+        jni_timer_interface.get(), &timer_clock);
+    timer_manager = std::make_unique<TimerManager>(timing_wheel_timer.get());
   }
 
   ~KryptonCache() {
@@ -172,11 +178,16 @@ struct KryptonCache {
     oauth.reset();
     http_fetcher.reset();
     // jni_timer_interface needs to be reset so that we don't get notifications
-    // from Java.
+    // from Java. timing_wheel_timer cancels its Java timer, so it goes first.
+    timing_wheel_timer.reset();
     jni_timer_interface.reset();
     timer_manager.reset();
   }
+  // Each Java timer has a WorkManager backup that fires on time even if the
+  // device slept, so the wheel's clock has to count that time too.
+  privacy::krypton::BootTimeClock timer_clock;
   std::unique_ptr<JniTimerInterfaceImpl> jni_timer_interface;
+  std::unique_ptr<TimingWheelTimer> timing_wheel_timer;
   std::unique_ptr<TimerManager> timer_manager;
   std::unique_ptr<Krypton> krypton;
   std::unique_ptr<HttpFetcher> http_fetcher;
@@ -224,12 +224,15 @@ VpnService::CreateProtectedNetworkSocket(
     const NetworkInfo& network_info, const Endpoint& endpoint,
     const Endpoint& mss_mtu_detection_endpoint,
     std::unique_ptr<datapath::android::MtuTrackerInterface> mtu_tracker) {
-  PPN_ASSIGN_OR_RETURN(int mss_mtu_detection_fd,
-                       CreateProtectedTcpSocket(network_info));
-  auto syscall_proxy = std::make_unique<datapath::android::SyscallProxy>();
-  auto mss_mtu_detector = std::make_unique<datapath::android::MssMtuDetector>(
-      mss_mtu_detection_fd, mss_mtu_detection_endpoint,
-      std::move(syscall_proxy));
+  std::unique_ptr<datapath::android::MssMtuDetector> mss_mtu_detector;
+  if (mss_mtu_detection_endpoint.ip_protocol() != IPProtocol::kUnknown) {
+    PPN_ASSIGN_OR_RETURN(int mss_mtu_detection_fd,
+                         CreateProtectedTcpSocket(network_info));
+    auto syscall_proxy = std::make_unique<datapath::android::SyscallProxy>();
+    mss_mtu_detector = std::make_unique<datapath::android::MssMtuDetector>(
+        mss_mtu_detection_fd, mss_mtu_detection_endpoint,
+        std::move(syscall_proxy));
+  }
   PPN_ASSIGN_OR_RETURN(auto fd, CreateProtectedNetworkSocket(network_info));
   PPN_ASSIGN_OR_RETURN(auto socket, datapath::android::DatagramSocket::Create(
                                         fd, std::move(mss_mtu_detector),
@@ -25,6 +25,8 @@ const char JsonKeys::kBlindedTokensKey[] = "blinded_token";
 const char JsonKeys::kControlPlaneSockAddr[] = "control_plane_sock_addr";
 const char JsonKeys::kApnType[] = "apn_type";
 const char JsonKeys::kDynamicMtuEnabled[] = "dynamic_mtu_enabled";
+const char JsonKeys::kExtendedSequenceNumbersEnabled[] =
+    "extended_sequence_numbers_enabled";
 
 // PPN
 const char JsonKeys::kPpnDataplane[] = "ppn_dataplane";
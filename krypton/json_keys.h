@@ -29,6 +29,7 @@ class JsonKeys {
   static const char kControlPlaneSockAddr[];
   static const char kApnType[];
   static const char kDynamicMtuEnabled[];
+  static const char kExtendedSequenceNumbersEnabled[];
 
   // PPN
   static const char kPpnDataplane[];
@@ -15,6 +15,12 @@
 #ifndef PRIVACY_NET_KRYPTON_KRYPTON_CLOCK_H_
 #define PRIVACY_NET_KRYPTON_KRYPTON_CLOCK_H_
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <time.h>
+#endif
+
+#include <chrono>  // NOLINT
+
 #include "third_party/absl/time/clock.h"
 #include "third_party/absl/time/time.h"
 
@@ -41,6 +47,39 @@ class RealClock : public KryptonClock {
   absl::Time Now() override { return absl::Now(); }
 };
 
+// Clock that never goes backwards, for measuring intervals. Its time has
+// nothing to do with the wall clock. On Android and Apple platforms it stops
+// while the device is suspended.
+class MonotonicClock : public KryptonClock {
+ public:
+  MonotonicClock() = default;
+
+  absl::Time Now() override {
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch();
+    return absl::UnixEpoch() + absl::FromChrono(elapsed);
+  }
+};
+
+#if defined(__linux__) || defined(__APPLE__)
+// Like MonotonicClock, but keeps counting while the device is suspended, so
+// that timers measured with it aren't late by however long the device slept.
+class BootTimeClock : public KryptonClock {
+ public:
+  BootTimeClock() = default;
+
+  absl::Time Now() override {
+    timespec now;
+#ifdef __APPLE__
+    // Unlike on Linux, CLOCK_MONOTONIC counts sleep on Apple platforms.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    clock_gettime(CLOCK_BOOTTIME, &now);
+#endif
+    return absl::UnixEpoch() + absl::DurationFromTimespec(now);
+  }
+};
+#endif
+
 // Fake clock for tests.
 class FakeClock : public KryptonClock {
  public:
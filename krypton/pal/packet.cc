@@ -13,3 +13,30 @@
 // limitations under the License.
 
 #include "privacy/net/krypton/pal/packet.h"
+
+#include <utility>
+
+namespace privacy {
+namespace krypton {
+
+namespace {
+
+void RunAndDeleteCleanup(void* context) {
+  auto* cleanup = static_cast<PacketCleanup*>(context);
+  if (*cleanup) {
+    (*cleanup)();
+  }
+  delete cleanup;
+}
+
+}  // namespace
+
+PacketOwner PacketOwner::FromCleanup(PacketCleanup cleanup) {
+  if (!cleanup) {
+    return PacketOwner();
+  }
+  return External(&RunAndDeleteCleanup, new PacketCleanup(std::move(cleanup)));
+}
+
+}  // namespace krypton
+}  // namespace privacy
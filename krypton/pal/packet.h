@@ -15,6 +15,8 @@
 #ifndef PRIVACY_NET_KRYPTON_PAL_PACKET_H_
 #define PRIVACY_NET_KRYPTON_PAL_PACKET_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <utility>
 
@@ -32,84 +34,303 @@ enum class IPProtocol {
 
 using PacketCleanup = std::function<void(void)>;
 
+// How much spare room producers should leave before and after the data of
+// packets read from the device, so that the datapath can add its headers and
+// trailers in place instead of copying the packet into a new buffer.
+constexpr size_t kPacketHeadroom = 32;
+constexpr size_t kPacketTailroom = 64;
+
+// Describes who owns the bytes behind a Packet, and how to give them back when
+// the packet is destroyed. There is a small fixed set of strategies, each of
+// which is stored as plain pointers, so creating and moving a PacketOwner never
+// allocates.
+class PacketOwner {
+ public:
+  // Gives `item` back to `pool`.
+  using PoolReturnFunction = void (*)(void* pool, void* item);
+  // Releases whatever `context` refers to.
+  using ExternalReleaseFunction = void (*)(void* context);
+
+  // The bytes aren't owned by the packet at all, e.g. a string literal, or a
+  // buffer that the producer keeps alive for longer than the packet.
+  PacketOwner() = default;
+
+  // The bytes are an array allocated with new[], which is deleted.
+  static PacketOwner HeapArray(char* buffer) {
+    PacketOwner owner;
+    owner.strategy_ = Strategy::kHeapArray;
+    owner.context_ = buffer;
+    return owner;
+  }
+
+  // The bytes belong to `item`, which is returned to `pool`.
+  static PacketOwner PoolReturn(PoolReturnFunction return_to_pool, void* pool,
+                                void* item) {
+    PacketOwner owner;
+    owner.strategy_ = Strategy::kPoolReturn;
+    owner.release_.pool_return = return_to_pool;
+    owner.context_ = pool;
+    owner.item_ = item;
+    return owner;
+  }
+
+  // The bytes are kept alive by `context`, which is released with `release`.
+  // This is how platform objects and refcounted buffers hook in.
+  static PacketOwner External(ExternalReleaseFunction release, void* context) {
+    PacketOwner owner;
+    owner.strategy_ = Strategy::kExternal;
+    owner.release_.external = release;
+    owner.context_ = context;
+    return owner;
+  }
+
+  // Adapts a cleanup function. Unlike the other strategies, this allocates, so
+  // it should be kept out of the datapath.
+  static PacketOwner FromCleanup(PacketCleanup cleanup);
+
+  // Disallow copy and assign, since the bytes must be released exactly once.
+  PacketOwner(const PacketOwner& other) = delete;
+  PacketOwner& operator=(const PacketOwner& other) = delete;
+
+  PacketOwner(PacketOwner&& other) { TakeFrom(&other); }
+
+  PacketOwner& operator=(PacketOwner&& other) {
+    if (this != &other) {
+      Release();
+      TakeFrom(&other);
+    }
+    return *this;
+  }
+
+  ~PacketOwner() { Release(); }
+
+  // Whether there is anything to release.
+  bool owns_data() const { return strategy_ != Strategy::kUnowned; }
+
+  // Releases the bytes now, leaving this owner empty.
+  void Release() {
+    switch (strategy_) {
+      case Strategy::kUnowned:
+        return;
+      case Strategy::kHeapArray:
+        delete[] static_cast<char*>(context_);
+        break;
+      case Strategy::kPoolReturn:
+        release_.pool_return(context_, item_);
+        break;
+      case Strategy::kExternal:
+        release_.external(context_);
+        break;
+    }
+    Reset();
+  }
+
+ private:
+  enum class Strategy : uint8_t {
+    kUnowned,
+    kHeapArray,
+    kPoolReturn,
+    kExternal,
+  };
+
+  void TakeFrom(PacketOwner* other) {
+    strategy_ = other->strategy_;
+    release_ = other->release_;
+    context_ = other->context_;
+    item_ = other->item_;
+    other->Reset();
+  }
+
+  void Reset() {
+    strategy_ = Strategy::kUnowned;
+    release_.pool_return = nullptr;
+    context_ = nullptr;
+    item_ = nullptr;
+  }
+
+  // Only the function for strategy_ is set.
+  union ReleaseFunction {
+    PoolReturnFunction pool_return;
+    ExternalReleaseFunction external;
+  };
+
+  Strategy strategy_ = Strategy::kUnowned;
+  ReleaseFunction release_ = {nullptr};
+  void* context_ = nullptr;
+  void* item_ = nullptr;
+};
+
 // Represents the byte data for a single network packet. Packet is designed to
 // allow passing packet data throughout Krypton with an absolute minimum number
 // of copying. Because of this, the data backing a packet may have been
-// allocated in any manner. If may have been malloc'd, or it may be from an
-// NSData. So, when constructing a Packet, it's necessary to provide a cleanup
-// function that can be responsible for retaining the underlying data structure
-// and releasing it when the Packet is destroyed.
+// allocated in any manner. If may have been malloc'd, it may be from an NSData,
+// or it may be borrowed from a pool. So, when constructing a Packet, it's
+// necessary to provide a PacketOwner that is responsible for releasing the
+// underlying data when the Packet is destroyed.
+//
+// Packets are move-only and have no virtual methods, so moving one is a copy of
+// a few words and never allocates.
 class Packet {
  public:
   /**
    * Constructs an empty packet.
    */
-  Packet() : protocol_(IPProtocol::kUnknown) {}
+  Packet() : data_(nullptr), length_(0), protocol_(IPProtocol::kUnknown) {}
 
   /**
    * Constructs a packet backed by the given bytes. It's up to the producer and
    * consumer of the packet to agree on the packet's data's valid lifetime. The
-   * cleanup function will be called when this packet is constructed, so it can
-   * be used to own and clean up the bytes underlying this packet, if desired.
+   * owner is released when this packet is destroyed, so it can be used to own
+   * and clean up the bytes underlying this packet, if desired.
+   */
+  Packet(const char* data, size_t length, IPProtocol protocol,
+         PacketOwner owner)
+      : data_(data),
+        length_(length),
+        protocol_(protocol),
+        owner_(std::move(owner)) {}
+
+  /**
+   * Like the constructor above, but with a cleanup function that will be called
+   * when this packet is destroyed. Wrapping the function allocates, so this is
+   * only meant for code outside of the datapath.
    */
   Packet(const char* data, int length, IPProtocol protocol,
          PacketCleanup cleanup)
-      : data_(data),
+      : Packet(data, length, protocol,
+               PacketOwner::FromCleanup(std::move(cleanup))) {}
+
+  /**
+   * Constructs a packet backed by a writable buffer of `capacity` bytes, with
+   * the packet data starting `headroom` bytes into the buffer. The bytes
+   * around the data can later be claimed with Prepend() and Append(), so that
+   * headers and trailers can be added in place. The owner is responsible for
+   * the buffer, as with the other constructors.
+   */
+  Packet(char* buffer, size_t capacity, size_t headroom, size_t length,
+         IPProtocol protocol, PacketOwner owner)
+      : data_(buffer + headroom),
         length_(length),
+        buffer_(buffer),
+        capacity_(capacity),
         protocol_(protocol),
-        cleanup_(std::move(cleanup)) {}
+        owner_(std::move(owner)) {}
+
+  Packet(char* buffer, size_t capacity, size_t headroom, size_t length,
+         IPProtocol protocol, PacketCleanup cleanup)
+      : Packet(buffer, capacity, headroom, length, protocol,
+               PacketOwner::FromCleanup(std::move(cleanup))) {}
 
   // Disallow copy and assign, since we don't know how the original data was
   // allocated, and don't want to make copies of it.
   Packet(const Packet& other) = delete;
   Packet& operator=(const Packet& other) = delete;
 
-  Packet(Packet&& other) {
-    data_ = other.data_;
-    length_ = other.length_;
-    protocol_ = other.protocol_;
-    cleanup_ = std::move(other.cleanup_);
-
+  Packet(Packet&& other)
+      : data_(other.data_),
+        length_(other.length_),
+        buffer_(other.buffer_),
+        capacity_(other.capacity_),
+        protocol_(other.protocol_),
+        owner_(std::move(other.owner_)) {
     other.data_ = nullptr;
     other.length_ = 0;
-    other.cleanup_ = []() {};
+    other.buffer_ = nullptr;
+    other.capacity_ = 0;
   }
 
   Packet& operator=(Packet&& other) {
-    // Clean up the existing data before overwriting it.
-    cleanup_();
+    if (this == &other) {
+      return *this;
+    }
+    // Moving the owner releases the existing data before overwriting it.
+    owner_ = std::move(other.owner_);
 
     data_ = other.data_;
     length_ = other.length_;
+    buffer_ = other.buffer_;
+    capacity_ = other.capacity_;
     protocol_ = other.protocol_;
-    cleanup_ = std::move(other.cleanup_);
 
     other.data_ = nullptr;
     other.length_ = 0;
-    other.cleanup_ = []() {};
+    other.buffer_ = nullptr;
+    other.capacity_ = 0;
 
     return *this;
   }
 
-  virtual ~Packet() { cleanup_(); }
+  ~Packet() = default;
 
   absl::string_view data() const { return absl::string_view(data_, length_); }
 
   IPProtocol protocol() const { return protocol_; }
+  void set_protocol(IPProtocol protocol) { protocol_ = protocol; }
+
+  // Whether the packet was constructed with a writable buffer.
+  bool is_writable() const { return buffer_ != nullptr; }
+
+  // Returns the packet data for modification in place, or nullptr if the packet
+  // isn't writable.
+  char* mutable_data() {
+    return is_writable() ? buffer_ + (data_ - buffer_) : nullptr;
+  }
+
+  // The number of spare bytes before and after the packet data.
+  size_t headroom() const { return is_writable() ? data_ - buffer_ : 0; }
+  size_t tailroom() const {
+    return is_writable() ? capacity_ - headroom() - length_ : 0;
+  }
+
+  // Moves the start of the packet data `size` bytes earlier, into the
+  // headroom. Returns false, leaving the packet unchanged, if there isn't
+  // enough headroom.
+  bool Prepend(size_t size) {
+    if (size > headroom()) return false;
+    data_ -= size;
+    length_ += size;
+    return true;
+  }
+
+  // Extends the packet data by `size` bytes into the tailroom. Returns false,
+  // leaving the packet unchanged, if there isn't enough tailroom.
+  bool Append(size_t size) {
+    if (size > tailroom()) return false;
+    length_ += size;
+    return true;
+  }
+
+  // Drops `size` bytes from the start or the end of the packet data, without
+  // touching the underlying buffer. Return false, leaving the packet unchanged,
+  // if the packet is shorter than `size`.
+  bool TrimFront(size_t size) {
+    if (size > length_) return false;
+    data_ += size;
+    length_ -= size;
+    return true;
+  }
+  bool TrimBack(size_t size) {
+    if (size > length_) return false;
+    length_ -= size;
+    return true;
+  }
 
  private:
   // The raw bytes data for a single packet.
   const char* data_;
   size_t length_;
 
+  // The writable buffer that contains data_, if there is one.
+  char* buffer_ = nullptr;
+  size_t capacity_ = 0;
+
   // The protocol of the packet data.
   IPProtocol protocol_;
 
-  // A function to call when this packet object is destroyed.
-  PacketCleanup cleanup_ = []() {};
+  // Releases the data when this packet object is destroyed.
+  PacketOwner owner_;
 };
 
-
 }  // namespace krypton
 }  // namespace privacy
 
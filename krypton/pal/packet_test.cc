@@ -95,6 +95,119 @@ TEST_F(PacketTest, CleansUpOldDataOnAssignment) {
   ASSERT_TRUE(cleaned_up);
 }
 
+TEST_F(PacketTest, TestUnownedDataIsNotWritable) {
+  Packet packet("foo", 3, IPProtocol::kIPv4, []() {});
+  EXPECT_FALSE(packet.is_writable());
+  EXPECT_EQ(nullptr, packet.mutable_data());
+  EXPECT_EQ(0, packet.headroom());
+  EXPECT_EQ(0, packet.tailroom());
+  EXPECT_FALSE(packet.Prepend(1));
+  EXPECT_FALSE(packet.Append(1));
+}
+
+TEST_F(PacketTest, TestHeadroomAndTailroom) {
+  char *buffer = new char[16];
+  memcpy(buffer + 4, "foo", 3);
+  Packet packet(buffer, 16, 4, 3, IPProtocol::kIPv4,
+                [buffer]() { delete[] buffer; });
+
+  EXPECT_TRUE(packet.is_writable());
+  EXPECT_EQ("foo", packet.data());
+  EXPECT_EQ(4, packet.headroom());
+  EXPECT_EQ(9, packet.tailroom());
+
+  ASSERT_TRUE(packet.Prepend(2));
+  memcpy(packet.mutable_data(), "<<", 2);
+  ASSERT_TRUE(packet.Append(2));
+  memcpy(packet.mutable_data() + 5, ">>", 2);
+  EXPECT_EQ("<<foo>>", packet.data());
+  EXPECT_EQ(2, packet.headroom());
+  EXPECT_EQ(7, packet.tailroom());
+
+  EXPECT_FALSE(packet.Prepend(3));
+  EXPECT_FALSE(packet.Append(8));
+  EXPECT_EQ("<<foo>>", packet.data());
+
+  ASSERT_TRUE(packet.TrimFront(2));
+  ASSERT_TRUE(packet.TrimBack(2));
+  EXPECT_EQ("foo", packet.data());
+  EXPECT_EQ(4, packet.headroom());
+  EXPECT_EQ(9, packet.tailroom());
+  EXPECT_FALSE(packet.TrimBack(4));
+}
+
+TEST_F(PacketTest, TestMoveKeepsBuffer) {
+  char *buffer = new char[16];
+  memcpy(buffer + 4, "foo", 3);
+  Packet original(buffer, 16, 4, 3, IPProtocol::kIPv4,
+                  [buffer]() { delete[] buffer; });
+  Packet packet = std::move(original);
+
+  EXPECT_FALSE(original.is_writable());  // NOLINT(bugprone-use-after-move)
+  EXPECT_TRUE(packet.is_writable());
+  EXPECT_EQ("foo", packet.data());
+  EXPECT_EQ(4, packet.headroom());
+  EXPECT_EQ(9, packet.tailroom());
+}
+
+struct CountingPool {
+  int returned = 0;
+  void *last_item = nullptr;
+
+  static void Return(void *pool, void *item) {
+    auto* self = static_cast<CountingPool *>(pool);
+    self->returned++;
+    self->last_item = item;
+  }
+};
+
+void IncrementCounter(void *counter) { ++*static_cast<int *>(counter); }
+
+TEST_F(PacketTest, TestHeapArrayOwner) {
+  char *buffer = new char[16];
+  memcpy(buffer + 4, "foo", 3);
+  // If the owner doesn't delete the buffer, the heapchecker will fail the test.
+  Packet packet(buffer, 16, 4, 3, IPProtocol::kIPv4,
+                PacketOwner::HeapArray(buffer));
+  EXPECT_EQ("foo", packet.data());
+}
+
+TEST_F(PacketTest, TestPoolReturnOwner) {
+  CountingPool pool;
+  int item = 0;
+  {
+    Packet packet("foo", 3, IPProtocol::kIPv4,
+                  PacketOwner::PoolReturn(&CountingPool::Return, &pool, &item));
+    Packet moved = std::move(packet);
+    EXPECT_EQ(0, pool.returned);
+  }
+  EXPECT_EQ(1, pool.returned);
+  EXPECT_EQ(&item, pool.last_item);
+}
+
+TEST_F(PacketTest, TestExternalOwnerIsReleasedOnAssignment) {
+  int released = 0;
+  Packet packet("foo", 3, IPProtocol::kIPv4,
+                PacketOwner::External(&IncrementCounter, &released));
+  packet = Packet("bar", 3, IPProtocol::kIPv4, PacketOwner());
+  EXPECT_EQ(1, released);
+  EXPECT_EQ("bar", packet.data());
+}
+
+TEST_F(PacketTest, TestOwnerReleaseIsIdempotent) {
+  int released = 0;
+  PacketOwner owner = PacketOwner::External(&IncrementCounter, &released);
+  EXPECT_TRUE(owner.owns_data());
+  owner.Release();
+  EXPECT_FALSE(owner.owns_data());
+  owner.Release();
+  EXPECT_EQ(1, released);
+}
+
+TEST_F(PacketTest, TestEmptyCleanupIsUnowned) {
+  EXPECT_FALSE(PacketOwner::FromCleanup(nullptr).owns_data());
+}
+
 }  // namespace
 }  // namespace krypton
 }  // namespace privacy
@@ -25,6 +25,7 @@
 #include "privacy/net/krypton/add_egress_response.h"
 #include "privacy/net/krypton/auth.h"
 #include "privacy/net/krypton/auth_and_sign_response.h"
+#include "privacy/net/krypton/crypto/ipsec_cipher_suite.h"
 #include "privacy/net/krypton/crypto/session_crypto.h"
 #include "privacy/net/krypton/egress_manager.h"
 #include "privacy/net/krypton/pal/http_fetcher_interface.h"
@@ -61,6 +62,19 @@ constexpr char kDefaultCopperAddress[] = "na4.p.g-tun.com";
 
 constexpr int kControlPlanePort = 1849;
 
+ppn::PpnDataplaneRequest::CryptoSuite GetIpSecCryptoSuite(
+    crypto::IpSecCipherSuite suite) {
+  switch (suite) {
+    case IpSecTransformParams::AES128_GCM:
+      return ppn::PpnDataplaneRequest::AES128_GCM;
+    case IpSecTransformParams::CHACHA20_POLY1305:
+      return ppn::PpnDataplaneRequest::CHACHA20_POLY1305;
+    case IpSecTransformParams::AES256_GCM:
+    default:
+      return ppn::PpnDataplaneRequest::AES256_GCM;
+  }
+}
+
 }  // namespace
 
 Provision::Provision(const KryptonConfig& config, std::unique_ptr<Auth> auth,
@@ -206,12 +220,19 @@ void Provision::PpnDataplaneRequest(bool is_rekey) {
   params.suite = config_.cipher_suite_key_length() == 256
                      ? ppn::PpnDataplaneRequest::AES256_GCM
                      : ppn::PpnDataplaneRequest::AES128_GCM;
+  if (config_.datapath_protocol() == KryptonConfig::IPSEC &&
+      config_.ipsec_cipher_agility_enabled()) {
+    params.suite = GetIpSecCryptoSuite(key_material_->ipsec_cipher_suite());
+  }
   params.dataplane_protocol = config_.datapath_protocol();
   // Always send the region token and sig even if it's empty.
   params.region_token_and_signature =
       auth_response.region_token_and_signatures();
   params.apn_type = auth_response.apn_type();
   params.dynamic_mtu_enabled = config_.dynamic_mtu_enabled();
+  params.extended_sequence_numbers_enabled =
+      config_.datapath_protocol() == KryptonConfig::IPSEC &&
+      config_.ipsec_extended_sequence_numbers_enabled();
   if (config_.enable_blind_signing()) {
     params.blind_message = auth_->GetOriginalMessage();
     std::string blinded_signature;
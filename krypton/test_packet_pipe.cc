@@ -14,12 +14,17 @@
 
 #include "privacy/net/krypton/test_packet_pipe.h"
 
+#include <cstddef>
 #include <cstring>
 #include <functional>
 #include <optional>
 #include <utility>
 #include <vector>
 
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
 namespace privacy {
 namespace krypton {
 
@@ -28,7 +33,7 @@ Packet CopyPacket(const Packet& packet) {
   size_t size = packet.data().size();
   char* data = new char[size];
   memcpy(data, packet.data().data(), size);
-  return Packet(data, size, packet.protocol(), [data] { delete[] data; });
+  return Packet(data, size, packet.protocol(), PacketOwner::HeapArray(data));
 }
 
 absl::Status TestPacketPipe::WritePackets(std::vector<Packet> packets) {
@@ -36,9 +41,24 @@ absl::Status TestPacketPipe::WritePackets(std::vector<Packet> packets) {
   for (const auto& packet : packets) {
     outbound_packets_.emplace_back(CopyPacket(packet));
   }
+  packets_written_.SignalAll();
   return absl::OkStatus();
 }
 
+std::vector<Packet> TestPacketPipe::TakeOutboundPackets(
+    size_t count, absl::Duration timeout) {
+  absl::Time deadline = absl::Now() + timeout;
+  absl::MutexLock l(&mutex_);
+  while (outbound_packets_.size() < count) {
+    if (packets_written_.WaitWithDeadline(&mutex_, deadline)) {
+      break;
+    }
+  }
+  std::vector<Packet> packets;
+  packets.swap(outbound_packets_);
+  return packets;
+}
+
 absl::StatusOr<std::function<bool(absl::Status, std::vector<Packet>)>>
 TestPacketPipe::GetReadHandler() {
   absl::MutexLock l(&mutex_);
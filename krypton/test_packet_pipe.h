@@ -15,6 +15,7 @@
 #ifndef PRIVACY_NET_KRYPTON_TEST_PACKET_PIPE_H_
 #define PRIVACY_NET_KRYPTON_TEST_PACKET_PIPE_H_
 
+#include <cstddef>
 #include <functional>
 #include <optional>
 #include <string>
@@ -23,6 +24,7 @@
 #include "privacy/net/krypton/pal/packet_pipe.h"
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
+#include "third_party/absl/time/time.h"
 
 namespace privacy {
 namespace krypton {
@@ -51,6 +53,12 @@ class TestPacketPipe : public PacketPipe {
 
   absl::Status StopReadingPackets() override ABSL_LOCKS_EXCLUDED(mutex_);
 
+  // Waits until at least `count` packets have been written to this pipe since
+  // the last call, or until the timeout passes, then returns all of them.
+  std::vector<Packet> TakeOutboundPackets(
+      size_t count, absl::Duration timeout = absl::Seconds(5))
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
   // Returns the ID as the FD, for equality checking.
   absl::StatusOr<int> GetFd() const override { return id_; }
 
@@ -68,7 +76,8 @@ class TestPacketPipe : public PacketPipe {
       ABSL_GUARDED_BY(mutex_);
 
   // Packets that have been written to this pipe.
-  std::vector<Packet> outbound_packets_;
+  std::vector<Packet> outbound_packets_ ABSL_GUARDED_BY(mutex_);
+  absl::CondVar packets_written_;
 };
 
 // Checks that a given PacketPipe has the given file descriptor.
@@ -0,0 +1,141 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/timing_wheel_timer.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "base/logging.h"
+#include "privacy/net/krypton/krypton_clock.h"
+#include "privacy/net/krypton/pal/timer_interface.h"
+#include "privacy/net/krypton/utils/status.h"
+#include "privacy/net/krypton/utils/timing_wheel.h"
+#include "third_party/absl/functional/bind_front.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace {
+
+// Timers are rounded up to this, and ones that expire within the same tick
+// are dispatched together.
+constexpr absl::Duration kTickDuration = absl::Milliseconds(10);
+
+// How many times an expiry tries to set the platform timer for the timers
+// that are still pending before giving up on it.
+constexpr int kMaxPlatformTimerAttempts = 3;
+
+}  // namespace
+
+TimingWheelTimer::TimingWheelTimer(TimerInterface* platform_timer,
+                                   KryptonClock* clock)
+    : platform_timer_(platform_timer),
+      clock_(clock),
+      wheel_(kTickDuration, clock->Now()),
+      next_platform_timer_id_(0) {
+  platform_timer_->RegisterCallback(
+      absl::bind_front(&TimingWheelTimer::PlatformTimerExpiry, this));
+}
+
+TimingWheelTimer::~TimingWheelTimer() {
+  platform_timer_->RegisterCallback(nullptr);
+  absl::MutexLock l(&mutex_);
+  if (platform_timer_id_) {
+    platform_timer_->CancelTimer(*platform_timer_id_);
+  }
+}
+
+absl::Status TimingWheelTimer::StartTimer(int timer_id,
+                                          absl::Duration duration) {
+  absl::MutexLock l(&mutex_);
+  absl::Time deadline = wheel_.Add(timer_id, clock_->Now() + duration);
+  if (platform_timer_id_ && platform_timer_deadline_ <= deadline) {
+    return absl::OkStatus();
+  }
+  // If a platform timer is running, the new timer is the earliest one, so
+  // there's no need to search the wheel for it. If not, timers an expiry
+  // failed to set the platform timer for may still be waiting.
+  if (!platform_timer_id_) {
+    deadline = std::min(deadline, *wheel_.NextDeadline());
+  }
+  auto status = SetPlatformTimer(deadline);
+  if (!status.ok()) {
+    wheel_.Cancel(timer_id);
+    return status;
+  }
+  return absl::OkStatus();
+}
+
+void TimingWheelTimer::CancelTimer(int timer_id) {
+  absl::MutexLock l(&mutex_);
+  if (wheel_.Cancel(timer_id) && wheel_.size() == 0 && platform_timer_id_) {
+    // Not worth a platform call otherwise, since the platform timer firing
+    // early just sets it again.
+    platform_timer_->CancelTimer(*platform_timer_id_);
+    platform_timer_id_.reset();
+  }
+}
+
+void TimingWheelTimer::PlatformTimerExpiry(int platform_timer_id) {
+  std::vector<int> expired;
+  {
+    absl::MutexLock l(&mutex_);
+    if (platform_timer_id_ != platform_timer_id) {
+      LOG(WARNING) << "Ignoring expiry of replaced platform timer with id: "
+                   << platform_timer_id;
+      return;
+    }
+    platform_timer_id_.reset();
+    expired = wheel_.Advance(clock_->Now());
+    std::optional<absl::Time> deadline = wheel_.NextDeadline();
+    if (deadline) {
+      absl::Status status;
+      for (int attempt = 0; attempt < kMaxPlatformTimerAttempts; ++attempt) {
+        status = SetPlatformTimer(*deadline);
+        if (status.ok()) break;
+      }
+      if (!status.ok()) {
+        // The pending timers stay in the wheel, and the next StartTimer sets
+        // the platform timer for them again.
+        LOG(ERROR) << "Unable to set platform timer for " << wheel_.size()
+                   << " pending timers: " << status;
+      }
+    }
+  }
+  for (int timer_id : expired) {
+    TimerExpiry(timer_id);
+  }
+}
+
+absl::Status TimingWheelTimer::SetPlatformTimer(absl::Time deadline) {
+  int platform_timer_id = next_platform_timer_id_++;
+  absl::Duration duration =
+      std::max(deadline - clock_->Now(), absl::ZeroDuration());
+  // The old platform timer is only cancelled once the new one is running, so
+  // that a failure doesn't leave the timers in the wheel without one.
+  PPN_RETURN_IF_ERROR(platform_timer_->StartTimer(platform_timer_id, duration));
+  if (platform_timer_id_) {
+    platform_timer_->CancelTimer(*platform_timer_id_);
+  }
+  platform_timer_id_ = platform_timer_id;
+  platform_timer_deadline_ = deadline;
+  return absl::OkStatus();
+}
+
+}  // namespace krypton
+}  // namespace privacy
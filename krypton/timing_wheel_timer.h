@@ -0,0 +1,79 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_TIMING_WHEEL_TIMER_H_
+#define PRIVACY_NET_KRYPTON_TIMING_WHEEL_TIMER_H_
+
+#include <optional>
+
+#include "privacy/net/krypton/krypton_clock.h"
+#include "privacy/net/krypton/pal/timer_interface.h"
+#include "privacy/net/krypton/utils/timing_wheel.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+
+// A TimerInterface that keeps its timers in a timing wheel, and only ever runs
+// one timer on the platform timer underneath it. Starting and cancelling a
+// timer usually doesn't involve the platform at all, and timers that expire
+// together are dispatched in one batch when the platform timer fires.
+//
+// TimerManager starts a platform timer for every timer it's asked for, so
+// this goes between it and the platform.
+// Thread-safe implementation.
+class TimingWheelTimer : public TimerInterface {
+ public:
+  TimingWheelTimer(TimerInterface* platform_timer, KryptonClock* clock);
+  ~TimingWheelTimer() override;
+
+  // Disallow copy and assign.
+  TimingWheelTimer(const TimingWheelTimer&) = delete;
+  TimingWheelTimer& operator=(const TimingWheelTimer&) = delete;
+
+  // Starts a timer for the given duration.
+  absl::Status StartTimer(int timer_id, absl::Duration duration) override
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Cancels a running timer.
+  void CancelTimer(int timer_id) override ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  void PlatformTimerExpiry(int platform_timer_id) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Replaces the platform timer with one that fires at `deadline`. On failure,
+  // the current platform timer keeps running.
+  absl::Status SetPlatformTimer(absl::Time deadline)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  TimerInterface* platform_timer_;  // Not owned.
+  KryptonClock* clock_;             // Not owned.
+
+  absl::Mutex mutex_;
+  utils::TimingWheel wheel_ ABSL_GUARDED_BY(mutex_);
+
+  // Every platform timer gets a new id, so that an expiry that was already on
+  // its way when the timer was replaced can be told apart.
+  int next_platform_timer_id_ ABSL_GUARDED_BY(mutex_);
+  std::optional<int> platform_timer_id_ ABSL_GUARDED_BY(mutex_);
+  absl::Time platform_timer_deadline_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_TIMING_WHEEL_TIMER_H_
@@ -0,0 +1,240 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/timing_wheel_timer.h"
+
+#include <vector>
+
+#include "privacy/net/krypton/krypton_clock.h"
+#include "privacy/net/krypton/pal/mock_timer_interface.h"
+#include "privacy/net/krypton/timer_manager.h"
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/status/status.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace {
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Return;
+using ::testing::SaveArg;
+using ::testing::UnorderedElementsAre;
+using ::testing::status::StatusIs;
+
+class TimingWheelTimerTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    wheel_timer_.RegisterCallback(
+        [this](int timer_id) { expired_.push_back(timer_id); });
+  }
+
+  // Expects the platform timer to be started, and saves its id.
+  void ExpectPlatformTimer(absl::Duration duration) {
+    EXPECT_CALL(platform_timer_, StartTimer(_, duration))
+        .WillOnce([this](int timer_id, absl::Duration /*duration*/) {
+          platform_timer_id_ = timer_id;
+          return absl::OkStatus();
+        })
+        .RetiresOnSaturation();
+  }
+
+  MockTimerInterface platform_timer_;
+  FakeClock clock_{absl::FromUnixSeconds(1000)};
+  TimingWheelTimer wheel_timer_{&platform_timer_, &clock_};
+  std::vector<int> expired_;
+  int platform_timer_id_ = -1;
+};
+
+TEST_F(TimingWheelTimerTest, SharesOnePlatformTimer) {
+  ExpectPlatformTimer(absl::Seconds(1));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(1)));
+  // Later timers don't need the platform timer to change.
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(1)));
+  ASSERT_OK(wheel_timer_.StartTimer(3, absl::Seconds(5)));
+  int first_platform_timer = platform_timer_id_;
+
+  clock_.AdvanceBy(absl::Seconds(1));
+  ExpectPlatformTimer(absl::Seconds(4));
+  platform_timer_.TimerExpiry(first_platform_timer);
+  EXPECT_THAT(expired_, UnorderedElementsAre(1, 2));
+
+  expired_.clear();
+  clock_.AdvanceBy(absl::Seconds(4));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(3));
+}
+
+TEST_F(TimingWheelTimerTest, EarlierTimerReplacesPlatformTimer) {
+  ExpectPlatformTimer(absl::Seconds(10));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(10)));
+  int replaced_platform_timer = platform_timer_id_;
+
+  EXPECT_CALL(platform_timer_, CancelTimer(replaced_platform_timer));
+  ExpectPlatformTimer(absl::Seconds(2));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(2)));
+  EXPECT_NE(platform_timer_id_, replaced_platform_timer);
+
+  // An expiry of the replaced timer that was already on its way is ignored.
+  clock_.AdvanceBy(absl::Seconds(10));
+  platform_timer_.TimerExpiry(replaced_platform_timer);
+  EXPECT_THAT(expired_, IsEmpty());
+
+  EXPECT_CALL(platform_timer_, StartTimer(_, _)).Times(0);
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, UnorderedElementsAre(1, 2));
+}
+
+TEST_F(TimingWheelTimerTest, CancellingLastTimerCancelsPlatformTimer) {
+  ExpectPlatformTimer(absl::Seconds(1));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(1)));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(2)));
+
+  EXPECT_CALL(platform_timer_, CancelTimer(_)).Times(0);
+  wheel_timer_.CancelTimer(1);
+
+  EXPECT_CALL(platform_timer_, CancelTimer(platform_timer_id_));
+  wheel_timer_.CancelTimer(2);
+}
+
+TEST_F(TimingWheelTimerTest, EarlyPlatformExpirySetsTimerAgain) {
+  ExpectPlatformTimer(absl::Seconds(3));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(3)));
+
+  clock_.AdvanceBy(absl::Seconds(1));
+  ExpectPlatformTimer(absl::Seconds(2));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, IsEmpty());
+
+  clock_.AdvanceBy(absl::Seconds(2));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1));
+}
+
+TEST_F(TimingWheelTimerTest, ClockJumpExpiresEveryDueTimer) {
+  ExpectPlatformTimer(absl::Seconds(30));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(30)));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Minutes(5)));
+  ASSERT_OK(wheel_timer_.StartTimer(3, absl::Hours(1)));
+
+  // The device slept for 10 minutes, and the platform timer fires late. Every
+  // timer that is due by the clock expires at once, and the platform timer is
+  // only set for what is left of the last one.
+  clock_.AdvanceBy(absl::Minutes(10));
+  ExpectPlatformTimer(absl::Minutes(50));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1, 2));
+}
+
+TEST_F(TimingWheelTimerTest, PlatformFailureFailsStart) {
+  EXPECT_CALL(platform_timer_, StartTimer(_, _))
+      .WillOnce(Return(absl::InternalError("no timers")));
+  EXPECT_THAT(wheel_timer_.StartTimer(1, absl::Seconds(1)),
+              StatusIs(absl::StatusCode::kInternal));
+
+  clock_.AdvanceBy(absl::Seconds(2));
+  ExpectPlatformTimer(absl::Seconds(1));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(1)));
+  clock_.AdvanceBy(absl::Seconds(1));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(2));
+}
+
+TEST_F(TimingWheelTimerTest, FailedReplacementKeepsPlatformTimer) {
+  ExpectPlatformTimer(absl::Seconds(10));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(10)));
+
+  EXPECT_CALL(platform_timer_, CancelTimer(_)).Times(0);
+  EXPECT_CALL(platform_timer_, StartTimer(_, absl::Seconds(2)))
+      .WillOnce(Return(absl::InternalError("no timers")));
+  EXPECT_THAT(wheel_timer_.StartTimer(2, absl::Seconds(2)),
+              StatusIs(absl::StatusCode::kInternal));
+
+  clock_.AdvanceBy(absl::Seconds(10));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1));
+}
+
+TEST_F(TimingWheelTimerTest, ExpiryRetriesPlatformTimer) {
+  ExpectPlatformTimer(absl::Seconds(1));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(1)));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(5)));
+
+  clock_.AdvanceBy(absl::Seconds(1));
+  ExpectPlatformTimer(absl::Seconds(4));
+  EXPECT_CALL(platform_timer_, StartTimer(_, absl::Seconds(4)))
+      .WillOnce(Return(absl::InternalError("no timers")))
+      .RetiresOnSaturation();
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1));
+
+  clock_.AdvanceBy(absl::Seconds(4));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1, 2));
+}
+
+TEST_F(TimingWheelTimerTest, NextStartRecoversTimersAfterFailedExpiry) {
+  ExpectPlatformTimer(absl::Seconds(1));
+  ASSERT_OK(wheel_timer_.StartTimer(1, absl::Seconds(1)));
+  ASSERT_OK(wheel_timer_.StartTimer(2, absl::Seconds(5)));
+
+  clock_.AdvanceBy(absl::Seconds(1));
+  EXPECT_CALL(platform_timer_, StartTimer(_, _))
+      .WillRepeatedly(Return(absl::InternalError("no timers")))
+      .RetiresOnSaturation();
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1));
+  ::testing::Mock::VerifyAndClearExpectations(&platform_timer_);
+
+  // The platform timer is set for the pending timer, not the later new one.
+  ExpectPlatformTimer(absl::Seconds(4));
+  ASSERT_OK(wheel_timer_.StartTimer(3, absl::Seconds(10)));
+
+  clock_.AdvanceBy(absl::Seconds(4));
+  ExpectPlatformTimer(absl::Seconds(6));
+  platform_timer_.TimerExpiry(platform_timer_id_);
+  EXPECT_THAT(expired_, ElementsAre(1, 2));
+}
+
+TEST(TimingWheelTimerManagerTest, RunsTimerManagerCallbacks) {
+  MockTimerInterface platform_timer;
+  FakeClock clock(absl::FromUnixSeconds(1000));
+  TimingWheelTimer wheel_timer(&platform_timer, &clock);
+  TimerManager timer_manager(&wheel_timer);
+
+  int platform_timer_id = -1;
+  EXPECT_CALL(platform_timer, StartTimer(_, absl::Seconds(30)))
+      .WillOnce(DoAll(SaveArg<0>(&platform_timer_id),
+                      Return(absl::OkStatus())));
+  int calls = 0;
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_OK(timer_manager
+                  .StartTimer(absl::Seconds(30), [&calls] { ++calls; }, "Test")
+                  .status());
+  }
+  EXPECT_EQ(timer_manager.NumActiveTimers(), 1000);
+
+  clock.AdvanceBy(absl::Seconds(30));
+  platform_timer.TimerExpiry(platform_timer_id);
+  EXPECT_EQ(calls, 1000);
+  EXPECT_EQ(timer_manager.NumActiveTimers(), 0);
+}
+
+}  // namespace
+}  // namespace krypton
+}  // namespace privacy
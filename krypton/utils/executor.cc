@@ -0,0 +1,392 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/executor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <thread>  //NOLINT
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "privacy/net/krypton/utils/task.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+namespace {
+
+// Per-thread state of a worker.
+struct WorkerState {
+  std::vector<std::function<void()>> cleanup_handlers;
+};
+
+ABSL_CONST_INIT thread_local WorkerState* current_worker = nullptr;
+
+ABSL_CONST_INIT thread_local Strand* current_strand = nullptr;
+
+// The most nodes each thread keeps around for reuse.
+constexpr size_t kMaxCachedNodes = 64;
+
+}  // namespace
+
+Executor::Executor(const Options& options)
+    : options_(options),
+      next_shard_(0),
+      searching_(0),
+      num_threads_(0),
+      next_worker_(0),
+      idle_workers_(0),
+      wakeups_(0),
+      shutting_down_(false) {
+  int num_shards = options_.num_shards;
+  if (num_shards <= 0) {
+    num_shards =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  for (int i = 0; i < num_shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+Executor::~Executor() {
+  absl::MutexLock l(&mutex_);
+  shutting_down_ = true;
+  work_available_.SignalAll();
+  while (num_threads_ > 0) {
+    workers_exited_.Wait(&mutex_);
+  }
+  ReapWorkers();
+}
+
+Executor* Executor::Default() {
+  static Executor* executor = new Executor();
+  return executor;
+}
+
+bool Executor::AddThreadCleanupHandler(std::function<void()> handler) {
+  if (current_worker == nullptr) {
+    return false;
+  }
+  current_worker->cleanup_handlers.push_back(std::move(handler));
+  return true;
+}
+
+int Executor::num_threads() {
+  absl::MutexLock l(&mutex_);
+  return num_threads_;
+}
+
+int Executor::AssignShard() {
+  return static_cast<int>(next_shard_.fetch_add(1, std::memory_order_relaxed) %
+                          shards_.size());
+}
+
+void Executor::Schedule(Strand* strand) {
+  {
+    Shard& shard = *shards_[strand->shard_];
+    absl::MutexLock l(&shard.mutex);
+    shard.ready.push_back(strand);
+  }
+  if (searching_.load(std::memory_order_seq_cst) > 0) {
+    // A searching worker checks the ready queues again before it gives up.
+    return;
+  }
+  absl::MutexLock l(&mutex_);
+  WakeWorker();
+}
+
+void Executor::StopSearching() {
+  if (searching_.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+      HasReadyStrands()) {
+    // Strands scheduled while this worker was searching counted on it.
+    absl::MutexLock l(&mutex_);
+    WakeWorker();
+  }
+}
+
+void Executor::WakeWorker() {
+  if (idle_workers_ > 0) {
+    --idle_workers_;
+    ++wakeups_;
+    searching_.fetch_add(1, std::memory_order_seq_cst);
+    work_available_.Signal();
+  } else if (num_threads_ < options_.max_threads) {
+    // Every worker may be blocked in a closure, so the strand can't count on
+    // any of them finishing soon.
+    searching_.fetch_add(1, std::memory_order_seq_cst);
+    SpawnWorker();
+  }
+}
+
+void Executor::SpawnWorker() {
+  ReapWorkers();
+  int home_shard = next_worker_++ % shards_.size();
+  ++num_threads_;
+  threads_.emplace_back([this, home_shard] { WorkerLoop(home_shard); });
+}
+
+void Executor::ReapWorkers() {
+  for (const auto& id : exited_) {
+    auto it = std::find_if(threads_.begin(), threads_.end(),
+                           [&id](const std::thread& t) {
+                             return t.get_id() == id;
+                           });
+    if (it != threads_.end()) {
+      it->join();
+      threads_.erase(it);
+    }
+  }
+  exited_.clear();
+}
+
+void Executor::WorkerLoop(int home_shard) {
+  WorkerState state;
+  current_worker = &state;
+#ifdef __APPLE__
+  // Set a name for the thread to make debugging in Xcode nicer.
+  pthread_setname_np("Krypton Executor");
+#endif
+
+  while (true) {
+    Strand* strand = TryDequeue(home_shard);
+    if (strand == nullptr) {
+      if (!WaitForWork()) {
+        break;
+      }
+      continue;
+    }
+    StopSearching();
+    bool more = strand->RunBatch();
+    searching_.fetch_add(1, std::memory_order_seq_cst);
+    if (more) {
+      Schedule(strand);
+    }
+  }
+
+  for (auto& handler : state.cleanup_handlers) {
+    handler();
+  }
+  current_worker = nullptr;
+
+  absl::MutexLock l(&mutex_);
+  --num_threads_;
+  exited_.push_back(std::this_thread::get_id());
+  workers_exited_.SignalAll();
+}
+
+Strand* Executor::TryDequeue(int home_shard) {
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    Shard& shard = *shards_[(home_shard + i) % shards_.size()];
+    absl::MutexLock l(&shard.mutex);
+    if (!shard.ready.empty()) {
+      Strand* strand = shard.ready.front();
+      shard.ready.pop_front();
+      return strand;
+    }
+  }
+  return nullptr;
+}
+
+bool Executor::HasReadyStrands() {
+  for (const auto& shard : shards_) {
+    absl::MutexLock l(&shard->mutex);
+    if (!shard->ready.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Executor::WaitForWork() {
+  absl::MutexLock l(&mutex_);
+  searching_.fetch_sub(1, std::memory_order_seq_cst);
+  // A strand may have been scheduled after TryDequeue() came up empty, but
+  // while this worker still counted as searching, in which case nobody woke
+  // it up.
+  if (HasReadyStrands()) {
+    searching_.fetch_add(1, std::memory_order_seq_cst);
+    return true;
+  }
+  ++idle_workers_;
+  absl::Time deadline = absl::Now() + options_.idle_timeout;
+  while (wakeups_ == 0 && !shutting_down_) {
+    if (work_available_.WaitWithDeadline(&mutex_, deadline) &&
+        wakeups_ == 0) {
+      // Timed out. Never exit while a strand is waiting for a worker.
+      if (HasReadyStrands()) {
+        --idle_workers_;
+        searching_.fetch_add(1, std::memory_order_seq_cst);
+        return true;
+      }
+      break;
+    }
+  }
+  if (wakeups_ > 0) {
+    // Whoever woke this worker up already counted it as searching.
+    --wakeups_;
+    return true;
+  }
+  --idle_workers_;
+  return false;
+}
+
+struct Strand::NodeCache {
+  ~NodeCache() {
+    for (Node* node : nodes) {
+      delete node;
+    }
+  }
+
+  std::vector<Node*> nodes;
+};
+
+Strand::NodeCache& Strand::GetNodeCache() {
+  static thread_local NodeCache cache;
+  return cache;
+}
+
+Strand::Strand(Executor* executor, void* owner)
+    : executor_(executor),
+      owner_(owner),
+      shard_(executor->AssignShard()),
+      head_(&stub_),
+      tail_(&stub_),
+      pending_(0) {
+  stub_.next.store(nullptr, std::memory_order_relaxed);
+}
+
+Strand::~Strand() {
+  absl::MutexLock l(&mutex_);
+  while (pending_.load(std::memory_order_acquire) > 0) {
+    idle_.Wait(&mutex_);
+  }
+}
+
+void* Strand::CurrentOwner() {
+  return current_strand == nullptr ? nullptr : current_strand->owner_;
+}
+
+void Strand::Post(Task closure) {
+  Push(NewNode(std::move(closure)));
+  if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+    executor_->Schedule(this);
+  }
+}
+
+bool Strand::RunBatch() {
+  Strand* previous = current_strand;
+  current_strand = this;
+  bool more = true;
+  for (int i = 0; more && i < kMaxBatchSize; ++i) {
+    Node* node = Pop();
+    node->task();
+    DeleteNode(node);
+    more = FinishClosure();
+  }
+  current_strand = previous;
+  return more;
+}
+
+void Strand::Push(Node* node) {
+  node->next.store(nullptr, std::memory_order_relaxed);
+  Node* previous = head_.exchange(node, std::memory_order_acq_rel);
+  // Until this store, the consumer can't see the node, or anything after it.
+  previous->next.store(node, std::memory_order_release);
+}
+
+Strand::Node* Strand::Pop() {
+  while (true) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (next != nullptr) {
+        tail_ = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+      }
+    }
+    if (tail != &stub_) {
+      if (next != nullptr) {
+        tail_ = next;
+        return tail;
+      }
+      if (tail == head_.load(std::memory_order_acquire)) {
+        // The tail is the only node, and can't be taken without something
+        // behind it, so put the stub back.
+        Push(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+          tail_ = next;
+          return tail;
+        }
+      }
+    }
+    // A producer has swapped itself in as the head, but hasn't linked its
+    // node yet. It's only a few instructions away from doing so.
+    std::this_thread::yield();
+  }
+}
+
+bool Strand::FinishClosure() {
+  if (pending_.load(std::memory_order_acquire) > 1) {
+    // Only this thread decrements, so this can't be the last closure.
+    pending_.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+  }
+  // The destructor may be waiting for the count to reach zero, so it has to
+  // happen under the lock for the wakeup not to be missed.
+  absl::MutexLock l(&mutex_);
+  if (pending_.fetch_sub(1, std::memory_order_acq_rel) > 1) {
+    return true;
+  }
+  idle_.SignalAll();
+  return false;
+}
+
+Strand::Node* Strand::NewNode(Task task) {
+  NodeCache& cache = GetNodeCache();
+  Node* node;
+  if (cache.nodes.empty()) {
+    node = new Node();
+  } else {
+    node = cache.nodes.back();
+    cache.nodes.pop_back();
+  }
+  node->task = std::move(task);
+  return node;
+}
+
+void Strand::DeleteNode(Node* node) {
+  // Let go of the closure's captures now, not whenever the node is reused.
+  node->task = Task();
+  NodeCache& cache = GetNodeCache();
+  if (cache.nodes.size() < kMaxCachedNodes) {
+    cache.nodes.push_back(node);
+  } else {
+    delete node;
+  }
+}
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,232 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_UTILS_EXECUTOR_H_
+#define PRIVACY_NET_KRYPTON_UTILS_EXECUTOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>  //NOLINT
+#include <vector>
+
+#include "privacy/net/krypton/utils/task.h"
+#include "third_party/absl/base/thread_annotations.h"
+#include "third_party/absl/synchronization/mutex.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+class Strand;
+
+// A pool of worker threads shared by many Strands, so that each component can
+// have its own serial queue of closures without having a thread of its own.
+//
+// Strands with closures to run wait in one of several ready queues, which
+// spreads out the contention between threads posting closures. Workers take
+// strands from their own queue first, and from the others when it's empty.
+//
+// Closures are allowed to block, so the pool grows instead of letting ready
+// strands wait while no worker is idle, up to `max_threads`. Workers that have
+// been idle for `idle_timeout` exit, so a quiet process has no threads left.
+//
+// Scheduling a strand only wakes a worker up if none is already searching the
+// ready queues, since a searching worker is bound to find the strand.
+class Executor {
+ public:
+  struct Options {
+    // The number of ready queues. Defaults to the number of CPUs.
+    int num_shards = 0;
+
+    // The most worker threads there may be at once.
+    int max_threads = 1024;
+
+    // How long a worker waits for a strand to run before it exits.
+    absl::Duration idle_timeout = absl::Seconds(30);
+  };
+
+  Executor() : Executor(Options()) {}
+  explicit Executor(const Options& options);
+
+  // Waits for the workers to exit. All of the executor's strands must have
+  // been destroyed.
+  ~Executor();
+
+  // Disallow copy and assign.
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  // Returns the executor shared by the whole process, which is never
+  // destroyed.
+  static Executor* Default();
+
+  // Adds a closure to be run when the calling worker thread exits, to clean up
+  // state tied to the thread, like a JNI attachment. Returns false if the
+  // caller isn't a worker thread.
+  static bool AddThreadCleanupHandler(std::function<void()> handler);
+
+  // Returns the number of worker threads.
+  int num_threads() ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  friend class Strand;
+
+  struct Shard {
+    absl::Mutex mutex;
+    std::deque<Strand*> ready ABSL_GUARDED_BY(mutex);
+  };
+
+  // Returns the ready queue for a new strand.
+  int AssignShard();
+
+  // Queues a strand that has closures to run, and makes sure a worker will
+  // pick it up.
+  void Schedule(Strand* strand) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  void WorkerLoop(int home_shard);
+
+  // Takes a ready strand, looking at `home_shard` first. Never blocks.
+  Strand* TryDequeue(int home_shard);
+
+  bool HasReadyStrands();
+
+  // Waits until a strand is scheduled for this worker. Returns false if the
+  // worker should exit instead.
+  bool WaitForWork() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Called by a searching worker that found a strand to run. If it was the
+  // last one searching, makes sure any other ready strands get a worker.
+  void StopSearching() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Wakes up an idle worker, or adds a new one, to search for ready strands.
+  void WakeWorker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  void SpawnWorker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Joins the threads of workers that have exited.
+  void ReapWorkers() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Options options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint32_t> next_shard_;
+  // Workers that are looking for a strand to run, rather than running one or
+  // waiting to be woken up.
+  std::atomic<int> searching_;
+
+  absl::Mutex mutex_;
+  absl::CondVar work_available_;
+  absl::CondVar workers_exited_;
+  int num_threads_ ABSL_GUARDED_BY(mutex_);
+  int next_worker_ ABSL_GUARDED_BY(mutex_);
+  // Idle workers that haven't been woken up yet.
+  int idle_workers_ ABSL_GUARDED_BY(mutex_);
+  // Workers that have been woken up, but haven't noticed yet.
+  int wakeups_ ABSL_GUARDED_BY(mutex_);
+  bool shutting_down_ ABSL_GUARDED_BY(mutex_);
+  std::vector<std::thread> threads_ ABSL_GUARDED_BY(mutex_);
+  std::vector<std::thread::id> exited_ ABSL_GUARDED_BY(mutex_);
+};
+
+// A queue of closures that run one at a time, in the order they were posted,
+// on the workers of an Executor. Closures posted by one thread never run
+// concurrently with each other, but may run on different threads.
+//
+// Posting never takes a lock. Closures go on an intrusive lock-free queue,
+// and the strand is only handed to the executor when it goes from having
+// nothing to run to having something, so a busy strand costs posters a
+// couple of atomic operations.
+class Strand {
+ public:
+  Strand() : Strand(Executor::Default()) {}
+
+  // `owner` is returned by CurrentOwner() while the strand's closures run.
+  explicit Strand(Executor* executor, void* owner = nullptr);
+
+  // Blocks until all posted closures have run. Must not be called from one of
+  // them.
+  ~Strand();
+
+  // Disallow copy and assign.
+  Strand(const Strand&) = delete;
+  Strand& operator=(const Strand&) = delete;
+
+  // Queues a closure to run after everything already posted.
+  void Post(Task closure);
+
+  // Returns the owner of the strand whose closure the calling thread is
+  // running, or nullptr.
+  static void* CurrentOwner();
+
+ private:
+  friend class Executor;
+
+  struct Node {
+    std::atomic<Node*> next;
+    Task task;
+  };
+
+  // The most closures a worker runs before giving other strands a turn.
+  static constexpr int kMaxBatchSize = 16;
+
+  // Runs queued closures on a worker. Returns whether there are more to run,
+  // in which case the strand has to be scheduled again.
+  bool RunBatch();
+
+  // Adds a node to the queue. Safe to call from any thread.
+  void Push(Node* node);
+
+  // Takes the oldest node off the queue. Only called by the worker running
+  // the strand, and only when pending_ says a node has been pushed.
+  Node* Pop();
+
+  // Counts a closure as done. Returns false if it was the last one, in which
+  // case the strand may already have been destroyed.
+  bool FinishClosure() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Nodes are recycled through a small per-thread cache, so posting from a
+  // worker usually reuses the node of a closure it ran.
+  struct NodeCache;
+  static NodeCache& GetNodeCache();
+  static Node* NewNode(Task task);
+  static void DeleteNode(Node* node);
+
+  Executor* executor_;  // Not owned.
+  void* const owner_;   // Not owned.
+  const int shard_;
+
+  // The most recently pushed node. Producers swap themselves in here.
+  std::atomic<Node*> head_;
+  // The oldest node, which is only touched by the worker running the strand.
+  Node* tail_;
+  // Keeps the queue from ever being completely empty.
+  Node stub_;
+
+  // Closures posted but not finished running. The strand is scheduled while
+  // this is non-zero.
+  std::atomic<int> pending_;
+
+  // Only used to wait for pending_ to reach zero in the destructor.
+  absl::Mutex mutex_;
+  absl::CondVar idle_;
+};
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_UTILS_EXECUTOR_H_
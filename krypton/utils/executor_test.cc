@@ -0,0 +1,184 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/executor.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>  //NOLINT
+#include <vector>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/synchronization/blocking_counter.h"
+#include "third_party/absl/synchronization/notification.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+namespace {
+
+TEST(ExecutorTest, StrandRunsClosuresInOrder) {
+  Executor executor;
+  std::vector<int> order;
+  {
+    Strand strand(&executor);
+    for (int i = 0; i < 1000; ++i) {
+      strand.Post([&order, i] { order.push_back(i); });
+    }
+  }
+  ASSERT_EQ(order.size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(order[i], i);
+  }
+}
+
+TEST(ExecutorTest, StrandNeverRunsClosuresConcurrently) {
+  Executor executor;
+  std::atomic_int running = 0;
+  std::atomic_bool overlapped = false;
+  {
+    Strand strand(&executor);
+    std::vector<std::thread> posters;
+    for (int t = 0; t < 4; ++t) {
+      posters.emplace_back([&] {
+        for (int i = 0; i < 200; ++i) {
+          strand.Post([&] {
+            if (running.fetch_add(1) != 0) {
+              overlapped = true;
+            }
+            running.fetch_sub(1);
+          });
+        }
+      });
+    }
+    for (auto& poster : posters) {
+      poster.join();
+    }
+  }
+  EXPECT_FALSE(overlapped);
+}
+
+TEST(ExecutorTest, ConcurrentPostersKeepTheirOwnOrder) {
+  Executor executor;
+  constexpr int kPosters = 4;
+  constexpr int kClosures = 2000;
+  std::vector<int> last(kPosters, -1);
+  bool in_order = true;
+  {
+    Strand strand(&executor);
+    std::vector<std::thread> posters;
+    for (int t = 0; t < kPosters; ++t) {
+      posters.emplace_back([&, t] {
+        for (int i = 0; i < kClosures; ++i) {
+          strand.Post([&, t, i] {
+            in_order = in_order && last[t] == i - 1;
+            last[t] = i;
+          });
+        }
+      });
+    }
+    for (auto& poster : posters) {
+      poster.join();
+    }
+  }
+  EXPECT_TRUE(in_order);
+  EXPECT_THAT(last, ::testing::Each(kClosures - 1));
+}
+
+TEST(ExecutorTest, CurrentOwnerIsSetWhileRunning) {
+  Executor executor;
+  int owner = 0;
+  void* seen = nullptr;
+  EXPECT_EQ(Strand::CurrentOwner(), nullptr);
+  {
+    Strand strand(&executor, &owner);
+    strand.Post([&seen] { seen = Strand::CurrentOwner(); });
+  }
+  EXPECT_EQ(seen, &owner);
+}
+
+TEST(ExecutorTest, BlockedStrandDoesNotStallOthers) {
+  Executor::Options options;
+  options.num_shards = 1;
+  Executor executor(options);
+  absl::Notification unblock;
+  absl::Notification other_ran;
+  {
+    Strand blocked(&executor);
+    Strand other(&executor);
+    blocked.Post([&unblock] { unblock.WaitForNotification(); });
+    other.Post([&other_ran] { other_ran.Notify(); });
+    EXPECT_TRUE(other_ran.WaitForNotificationWithTimeout(absl::Seconds(5)));
+    unblock.Notify();
+  }
+  EXPECT_GE(executor.num_threads(), 2);
+}
+
+TEST(ExecutorTest, ManyStrandsRunEverything) {
+  Executor executor;
+  constexpr int kStrands = 50;
+  constexpr int kClosures = 100;
+  absl::BlockingCounter done(kStrands * kClosures);
+  {
+    std::vector<std::unique_ptr<Strand>> strands;
+    for (int i = 0; i < kStrands; ++i) {
+      strands.push_back(std::make_unique<Strand>(&executor));
+    }
+    for (int i = 0; i < kClosures; ++i) {
+      for (auto& strand : strands) {
+        strand->Post([&done] { done.DecrementCount(); });
+      }
+    }
+    done.Wait();
+  }
+}
+
+TEST(ExecutorTest, IdleWorkersExitAndRunThreadCleanup) {
+  Executor::Options options;
+  options.idle_timeout = absl::Milliseconds(10);
+  Executor executor(options);
+  absl::Notification cleaned_up;
+  std::thread::id closure_thread;
+  std::thread::id cleanup_thread;
+  {
+    Strand strand(&executor);
+    strand.Post([&] {
+      closure_thread = std::this_thread::get_id();
+      EXPECT_TRUE(Executor::AddThreadCleanupHandler([&] {
+        cleanup_thread = std::this_thread::get_id();
+        cleaned_up.Notify();
+      }));
+    });
+  }
+  EXPECT_TRUE(cleaned_up.WaitForNotificationWithTimeout(absl::Seconds(5)));
+  EXPECT_EQ(closure_thread, cleanup_thread);
+
+  // An exited worker is replaced when there's more to do.
+  absl::Notification ran_again;
+  Strand strand(&executor);
+  strand.Post([&ran_again] { ran_again.Notify(); });
+  EXPECT_TRUE(ran_again.WaitForNotificationWithTimeout(absl::Seconds(5)));
+}
+
+TEST(ExecutorTest, ThreadCleanupNeedsAWorker) {
+  EXPECT_FALSE(Executor::AddThreadCleanupHandler([] {}));
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
@@ -14,76 +14,80 @@
 
 #include "privacy/net/krypton/utils/looper.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <memory>
 #include <optional>
 #include <string>
-#include <thread>
 #include <utility>
 
 #include "base/logging.h"
+#include "privacy/net/krypton/utils/executor.h"
+#include "privacy/net/krypton/utils/task.h"
 #include "third_party/absl/status/status.h"
 #include "third_party/absl/strings/string_view.h"
+#include "third_party/absl/synchronization/mutex.h"
 
 namespace privacy {
 namespace krypton {
 namespace utils {
 
-ABSL_CONST_INIT thread_local LooperThread* current_looper_thread = nullptr;
-
 LooperThread::LooperThread(absl::string_view name)
     : name_(name),
-      started_(false),
-      lameduck_(false),
+      state_(0),
       cleaned_up_(false),
-      stopped_(false) {
-  thread_ = std::make_unique<std::thread>([this] { this->Loop(); });
-}
+      stopped_(false),
+      strand_(Executor::Default(), this) {}
 
 LooperThread::~LooperThread() {
-  // Loop() was called, so Stop() and Join(), which will be no-ops if they've
-  // already been called.
+  // Stop() and Join() are no-ops if they've already been called.
   Stop();
   Join();
-
-  if (thread_->joinable()) {
-    thread_->join();
-  }
 }
 
-LooperThread* LooperThread::GetCurrentLooper() { return current_looper_thread; }
+LooperThread* LooperThread::GetCurrentLooper() {
+  // Every strand with an owner belongs to a looper.
+  return static_cast<LooperThread*>(Strand::CurrentOwner());
+}
 
 // Enqueues the given closure to be run on the looper.
-bool LooperThread::Post(std::function<void()>&& runnable) {
-  {
-    absl::MutexLock l(&mutex_);
-    if (lameduck_) {
+bool LooperThread::Post(Task runnable) {
+  uint32_t state = state_.load(std::memory_order_acquire);
+  do {
+    if (state & kLameDuck) {
       LOG(ERROR) << "Tried to Post to stopped Looper: " << name_;
       return false;
     }
-    queue_.emplace_back(runnable);
+  } while (!state_.compare_exchange_weak(state, state + kPoster,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire));
+  strand_.Post(std::move(runnable));
+  if (state_.fetch_sub(kPoster, std::memory_order_acq_rel) ==
+      (kPoster | kLameDuck)) {
+    // Stop() was called while this was being posted, and Finish() has to be
+    // queued behind it.
+    strand_.Post([this] { Finish(); });
   }
-  queue_changed_.SignalAll();
   return true;
 }
 
 void LooperThread::Stop() {
   LOG(INFO) << "Stop() called for looper: " << name_;
-  {
-    absl::MutexLock l(&mutex_);
-    if (lameduck_) {
-      LOG(INFO) << "Looper already in lame-duck mode: " << name_;
-      return;
-    }
-    LOG(INFO) << "Looper entering lame-duck mode: " << name_;
-    lameduck_ = true;
+  uint32_t previous = state_.fetch_or(kLameDuck, std::memory_order_acq_rel);
+  if (previous & kLameDuck) {
+    LOG(INFO) << "Looper already in lame-duck mode: " << name_;
+    return;
+  }
+  LOG(INFO) << "Looper entering lame-duck mode: " << name_;
+  if (previous == 0) {
+    // Otherwise, the last Post() in progress queues it.
+    strand_.Post([this] { Finish(); });
   }
-  queue_changed_.SignalAll();
 }
 
 void LooperThread::Join() {
-  // Make sure Join is never called from this Looper's own thread.
-  if (std::this_thread::get_id() == thread_->get_id()) {
+  // Make sure Join is never called from one of this Looper's own closures.
+  if (GetCurrentLooper() == this) {
     LOG(FATAL) << "Join() was called on thread for Looper " << name_;
   }
 
@@ -96,50 +100,17 @@ void LooperThread::Join() {
   LOG(INFO) << "Looper is joined: " << name_;
 }
 
-std::optional<std::function<void()>> LooperThread::Dequeue() {
-  absl::MutexLock l(&mutex_);
-  while (queue_.empty()) {
-    if (lameduck_) {
-      return std::nullopt;
-    }
-    queue_changed_.Wait(&mutex_);
-  }
-  auto runnable = std::move(queue_.front());
-  queue_.pop_front();
-  return runnable;
-}
-
-void LooperThread::Loop() {
-  current_looper_thread = this;
-#ifdef __APPLE__
-  // Set a name for the thread to make debugging in Xcode nicer.
-  std::string label = "Looper: " + name_;
-  pthread_setname_np(label.c_str());
-#endif
-  {
-    absl::MutexLock l(&mutex_);
-    if (started_) {
-      LOG(ERROR) << "Looper::Loop() was called more than once for " << name_;
-      return;
-    }
-    started_ = true;
-  }
-  LOG(INFO) << "Starting Looper: " << name_;
-
+void LooperThread::Finish() {
+  LOG(INFO) << "Running cleanup handlers for looper: " << name_;
   while (true) {
-    auto maybe_runnable = Dequeue();
+    auto maybe_runnable = DequeueCleanupHandler();
     if (!maybe_runnable) {
-      // The looper is in lame-duck mode and the queue is empty.
-      LOG(INFO) << "Looper " << name_
-                << " is in lameduck mode and the queue is empty. Stopping...";
       break;
     }
     auto runnable = maybe_runnable.value();
     runnable();
   }
 
-  RunAllCleanupHandlers();
-
   // Mark that the looper is fully stopped.
   {
     absl::MutexLock l(&mutex_);
@@ -147,10 +118,13 @@ void LooperThread::Loop() {
   }
   LOG(INFO) << "Stopped Looper: " << name_;
   stopped_changed_.SignalAll();
-  current_looper_thread = nullptr;
 }
 
 void LooperThread::AddCleanupHandler(std::function<void()> runnable) {
+  if (GetCurrentLooper() == this &&
+      Executor::AddThreadCleanupHandler(runnable)) {
+    return;
+  }
   absl::MutexLock l(&mutex_);
   if (cleaned_up_) {
     LOG(ERROR) << "Tried to AddCleanupHandler too late for Looper: " << name_;
@@ -161,7 +135,7 @@ void LooperThread::AddCleanupHandler(std::function<void()> runnable) {
 
 std::optional<std::function<void()>> LooperThread::DequeueCleanupHandler() {
   absl::MutexLock l(&mutex_);
-  if (!lameduck_) {
+  if (!(state_.load(std::memory_order_acquire) & kLameDuck)) {
     LOG(FATAL) << "Attempted to dequeue cleanup handler on running looper: "
                << name_;
   }
@@ -174,18 +148,6 @@ std::optional<std::function<void()>> LooperThread::DequeueCleanupHandler() {
   return runnable;
 }
 
-void LooperThread::RunAllCleanupHandlers() {
-  LOG(INFO) << "Running cleanup handlers for looper: " << name_;
-  while (true) {
-    auto maybe_runnable = DequeueCleanupHandler();
-    if (!maybe_runnable) {
-      return;
-    }
-    auto runnable = maybe_runnable.value();
-    runnable();
-  }
-}
-
 }  // namespace utils
 }  // namespace krypton
 }  // namespace privacy
@@ -15,75 +15,83 @@
 #ifndef PRIVACY_NET_KRYPTON_UTILS_LOOPER_H_
 #define PRIVACY_NET_KRYPTON_UTILS_LOOPER_H_
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <functional>
-#include <memory>
 #include <optional>
 #include <string>
-#include <thread>  //NOLINT
 
+#include "privacy/net/krypton/utils/executor.h"
+#include "privacy/net/krypton/utils/task.h"
+#include "third_party/absl/base/thread_annotations.h"
 #include "third_party/absl/status/status.h"
+#include "third_party/absl/strings/string_view.h"
 #include "third_party/absl/synchronization/mutex.h"
 
 namespace privacy {
 namespace krypton {
 namespace utils {
 
-// A Looper is a queue of closures that runs continuously on a thread until it
+// A Looper is a queue of closures that run one at a time, in order, until it
 // is stopped and joined.
+//
+// Loopers don't have threads of their own. Each one is a Strand on the shared
+// Executor, so an idle looper costs no more than its queue, and consecutive
+// closures may run on different threads.
 class LooperThread {
  public:
   explicit LooperThread(absl::string_view name);
 
   ~LooperThread();
 
-  // Enqueues the given closure to be run on the looper.
+  // Enqueues the given closure to be run on the looper. Never blocks.
   // Returns false and logs an error if Stop() has been called.
-  bool Post(std::function<void()>&& runnable);
+  bool Post(Task runnable);
 
   // Tell the looper to stop accepting new closures, but will continue to run
   // anything already enqueued.
   void Stop();
 
   // Blocks until the looper is stopped and has run all enqueued closures.
-  void Join();
-
-  // Adds a closure to be run right before the underlying thread is joined, to
-  // clean up any state associated with the looper. This is run after the looper
-  // is stopped, so it cannot enqueue more work on the looper itself.
-  void AddCleanupHandler(std::function<void()> runnable);
-
-  // Returns a pointer to the current looper for the calling thread, or nullptr.
+  void Join() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Adds a closure to clean up any state associated with the looper. It runs
+  // on the looper after it is stopped and has run everything else, so it
+  // cannot enqueue more work on the looper itself.
+  //
+  // Closures that add a cleanup handler are assumed to be cleaning up after
+  // something they did to their thread, like attaching it to the JVM, so those
+  // handlers run when that worker thread exits instead.
+  void AddCleanupHandler(std::function<void()> runnable)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns a pointer to the looper whose closure the calling thread is
+  // running, or nullptr.
   static LooperThread* GetCurrentLooper();
 
  private:
-  // Runs continuously, executing anything added to the queue, until stopped_
-  // is true and the queue is empty. Can only be called once.
-  void Loop();
-
-  // Returns the next closure on the queue. Will block until one is available.
-  // Returns nullopt if the queue is empty and lame_duck_ is true.
-  std::optional<std::function<void()>> Dequeue();
+  // Runs on the looper after everything else, to run the cleanup handlers and
+  // mark the looper as stopped.
+  void Finish() ABSL_LOCKS_EXCLUDED(mutex_);
 
   // Returns the next cleanup handler on the queue. Returns nullopt if none.
-  std::optional<std::function<void()>> DequeueCleanupHandler();
-
-  // Runs all of the cleanup handler closures that have been added.
-  void RunAllCleanupHandlers();
+  std::optional<std::function<void()>> DequeueCleanupHandler()
+      ABSL_LOCKS_EXCLUDED(mutex_);
 
   absl::Mutex mutex_;
 
   // a human-readable name for the looper.
   std::string name_;
 
-  // the queue of closures to run.
-  std::deque<std::function<void()>> queue_ ABSL_GUARDED_BY(mutex_);
+  // Set once Stop() has been called.
+  static constexpr uint32_t kLameDuck = 1;
+  // Added for each Post() call in progress.
+  static constexpr uint32_t kPoster = 2;
 
-  // set to true once Loop is called.
-  bool started_ ABSL_GUARDED_BY(mutex_);
-
-  // set to true when the looper should stop accepting new closures.
-  bool lameduck_ ABSL_GUARDED_BY(mutex_);
+  // Combines kLameDuck with a count of Post() calls in progress, so that
+  // Stop() can leave queueing Finish() to the last of them without a lock.
+  std::atomic<uint32_t> state_;
 
   // set to true when all of the cleanup handlers have completed.
   bool cleaned_up_ ABSL_GUARDED_BY(mutex_);
@@ -92,17 +100,15 @@ class LooperThread {
   // any enqueued loopers.
   bool stopped_ ABSL_GUARDED_BY(mutex_);
 
-  // condition signaled when the queue gets an element or lameduck_ is set.
-  absl::CondVar queue_changed_;
-
-  // condition signaled when the queue gets an element or stopped_ is set.
+  // condition signaled when stopped_ is set.
   absl::CondVar stopped_changed_;
 
-  // The thread where the looper runs its closures.
-  std::unique_ptr<std::thread> thread_;
-
-  // A list of cleanup closures to run when the thread is joined.
+  // A list of cleanup closures to run when the looper is stopped.
   std::deque<std::function<void()>> cleanup_queue_ ABSL_GUARDED_BY(mutex_);
+
+  // Runs the closures. Declared last, so that it's destroyed first, waiting
+  // for the closure that's still running before the rest is destroyed.
+  Strand strand_;
 };
 
 }  // namespace utils
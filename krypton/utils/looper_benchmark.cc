@@ -0,0 +1,82 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for how long it takes a closure posted to a looper to run.
+
+#include "privacy/net/krypton/benchmark_util.h"
+#include "privacy/net/krypton/utils/looper.h"
+#include "testing/base/public/benchmark.h"
+#include "third_party/absl/synchronization/notification.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+namespace {
+
+// Posts one closure at a time and waits for it to run, so every post has to
+// wake the looper up.
+void BM_PostToIdleLooper(benchmark::State& state) {
+  LooperThread looper("BM_PostToIdleLooper");
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    absl::Notification done;
+    absl::Time start = absl::Now();
+    looper.Post([&latency, &done, start] {
+      latency.Record(absl::Now() - start);
+      done.Notify();
+    });
+    done.WaitForNotification();
+  }
+  looper.Stop();
+  looper.Join();
+  ReportPacketRates(state, state.iterations(), 0);
+  latency.Report(state);
+}
+BENCHMARK(BM_PostToIdleLooper)->UseRealTime();
+
+// Posts bursts of state.range(0) closures, and records how long each one
+// waited to run, which includes the time spent running the closures ahead of
+// it.
+void BM_PostBurst(benchmark::State& state) {
+  const int burst_size = state.range(0);
+  LooperThread looper("BM_PostBurst");
+  // Only touched by the closures, which run one at a time.
+  LatencyRecorder latency;
+  for (auto _ : state) {
+    absl::Notification done;
+    for (int i = 0; i < burst_size; ++i) {
+      absl::Time start = absl::Now();
+      bool last = i == burst_size - 1;
+      looper.Post([&latency, &done, start, last] {
+        latency.Record(absl::Now() - start);
+        if (last) {
+          done.Notify();
+        }
+      });
+    }
+    done.WaitForNotification();
+  }
+  looper.Stop();
+  looper.Join();
+  ReportPacketRates(state, state.iterations() * burst_size, 0);
+  latency.Report(state);
+}
+BENCHMARK(BM_PostBurst)->ArgName("burst")->Arg(16)->Arg(256)->UseRealTime();
+
+}  // namespace
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
@@ -14,12 +14,17 @@
 
 #include "privacy/net/krypton/utils/looper.h"
 
+#include <atomic>
 #include <memory>
-#include <thread>
+#include <thread>  //NOLINT
+#include <vector>
 
+#include "privacy/net/krypton/utils/executor.h"
 #include "testing/base/public/gmock.h"
 #include "testing/base/public/gunit.h"
 #include "third_party/absl/status/status.h"
+#include "third_party/absl/time/clock.h"
+#include "third_party/absl/time/time.h"
 
 namespace privacy {
 namespace krypton {
@@ -76,25 +81,97 @@ TEST_F(LooperTest, PostAfterStopFails) {
   EXPECT_FALSE(thread.Post([] {}));
 }
 
+TEST_F(LooperTest, PostAcceptsMoveOnlyClosures) {
+  LooperThread thread("Test Looper");
+  auto value = std::make_unique<int>(42);
+  int result = 0;
+
+  EXPECT_TRUE(
+      thread.Post([value = std::move(value), &result] { result = *value; }));
+  thread.Stop();
+  thread.Join();
+
+  EXPECT_EQ(result, 42);
+}
+
+TEST_F(LooperTest, StopWhilePostingRunsEveryAcceptedClosure) {
+  LooperThread thread("Test Looper");
+  std::atomic_int accepted = 0;
+  std::atomic_int ran = 0;
+  std::atomic_bool ran_after_cleanup = false;
+  std::atomic_bool cleaned_up = false;
+  thread.AddCleanupHandler([&cleaned_up] { cleaned_up = true; });
+
+  std::vector<std::thread> posters;
+  for (int t = 0; t < 4; ++t) {
+    posters.emplace_back([&] {
+      while (thread.Post([&] {
+        if (cleaned_up) {
+          ran_after_cleanup = true;
+        }
+        ++ran;
+      })) {
+        ++accepted;
+      }
+    });
+  }
+  absl::SleepFor(absl::Milliseconds(10));
+  thread.Stop();
+  for (auto& poster : posters) {
+    poster.join();
+  }
+  thread.Join();
+
+  EXPECT_GT(accepted, 0);
+  EXPECT_EQ(ran, accepted);
+  EXPECT_FALSE(ran_after_cleanup);
+  EXPECT_TRUE(cleaned_up);
+}
+
 TEST_F(LooperTest, CleanupTest) {
   auto thread = std::make_unique<LooperThread>("Test Looper");
-  bool called = false;
-
-  std::thread::id post_thread_id;
-  std::thread::id cleanup_thread_id;
+  bool posted_ran = false;
+  bool ran_after_posted = false;
 
-  thread->Post(
-      [&post_thread_id] { post_thread_id = std::this_thread::get_id(); });
-  thread->AddCleanupHandler([&called, &cleanup_thread_id] {
-    called = true;
-    cleanup_thread_id = std::this_thread::get_id();
+  thread->Post([&posted_ran] { posted_ran = true; });
+  thread->AddCleanupHandler([&posted_ran, &ran_after_posted] {
+    ran_after_posted = posted_ran;
   });
 
   thread->Stop();
   thread->Join();
 
-  ASSERT_TRUE(called);
-  ASSERT_EQ(post_thread_id, cleanup_thread_id);
+  ASSERT_TRUE(ran_after_posted);
+}
+
+TEST_F(LooperTest, CleanupHandlerFromClosureIsTiedToThread) {
+  LooperThread thread("Test Looper");
+  // Handlers added from the looper's own closures clean up after the worker
+  // thread, which may outlive the looper and this test.
+  auto called = std::make_shared<std::atomic_bool>(false);
+
+  thread.Post([&thread, called] {
+    thread.AddCleanupHandler([called] { *called = true; });
+  });
+  thread.Stop();
+  thread.Join();
+
+  EXPECT_FALSE(*called);
+}
+
+TEST_F(LooperTest, LoopersDoNotNeedThreadsOfTheirOwn) {
+  std::vector<std::unique_ptr<LooperThread>> loopers;
+  for (int i = 0; i < 200; ++i) {
+    loopers.push_back(std::make_unique<LooperThread>("Test Looper"));
+  }
+  int count = 0;
+  for (auto& looper : loopers) {
+    looper->Post([&count] { ++count; });
+    looper->Stop();
+    looper->Join();
+  }
+  EXPECT_EQ(count, 200);
+  EXPECT_LT(Executor::Default()->num_threads(), 200);
 }
 
 }  // namespace
@@ -0,0 +1,144 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_UTILS_TASK_H_
+#define PRIVACY_NET_KRYPTON_UTILS_TASK_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+// A move-only closure taking no arguments, like std::function<void()> but
+// without the requirement that the callable be copyable.
+//
+// Callables with captures of up to kInlineSize bytes are stored inside the
+// Task itself, so wrapping a typical lambda doesn't allocate.
+class Task {
+ public:
+  static constexpr size_t kInlineSize = 48;
+
+  Task() noexcept : ops_(nullptr) {}
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, Task> &&
+                std::is_invocable_r_v<void, std::decay_t<F>&>>>
+  Task(F&& f) {  // NOLINT: implicit, so lambdas can be passed directly.
+    using Callable = std::decay_t<F>;
+    if constexpr (IsStoredInline<Callable>()) {
+      new (storage_.buffer) Callable(std::forward<F>(f));
+      ops_ = &InlineOps<Callable>::kOps;
+    } else {
+      storage_.heap = new Callable(std::forward<F>(f));
+      ops_ = &HeapOps<Callable>::kOps;
+    }
+  }
+
+  Task(Task&& other) noexcept : ops_(other.ops_) {
+    if (ops_ != nullptr) {
+      ops_->move(&other.storage_, &storage_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      ops_ = other.ops_;
+      if (ops_ != nullptr) {
+        ops_->move(&other.storage_, &storage_);
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() { Reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  // Runs the callable. The Task must not be empty.
+  void operator()() { ops_->invoke(&storage_); }
+
+  // Returns whether a callable of type F is stored without allocating.
+  template <typename F>
+  static constexpr bool IsStoredInline() {
+    return sizeof(F) <= kInlineSize &&
+           alignof(F) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<F>;
+  }
+
+ private:
+  union Storage {
+    void* heap;
+    alignas(std::max_align_t) unsigned char buffer[kInlineSize];
+  };
+
+  struct Ops {
+    void (*invoke)(Storage* storage);
+    // Moves the callable, leaving `from` with nothing to destroy.
+    void (*move)(Storage* from, Storage* to);
+    void (*destroy)(Storage* storage);
+  };
+
+  template <typename F>
+  struct InlineOps {
+    static F* Get(Storage* storage) {
+      return std::launder(reinterpret_cast<F*>(storage->buffer));
+    }
+    static void Invoke(Storage* storage) { (*Get(storage))(); }
+    static void Move(Storage* from, Storage* to) {
+      new (to->buffer) F(std::move(*Get(from)));
+      Get(from)->~F();
+    }
+    static void Destroy(Storage* storage) { Get(storage)->~F(); }
+    static constexpr Ops kOps = {&Invoke, &Move, &Destroy};
+  };
+
+  template <typename F>
+  struct HeapOps {
+    static void Invoke(Storage* storage) {
+      (*static_cast<F*>(storage->heap))();
+    }
+    static void Move(Storage* from, Storage* to) { to->heap = from->heap; }
+    static void Destroy(Storage* storage) {
+      delete static_cast<F*>(storage->heap);
+    }
+    static constexpr Ops kOps = {&Invoke, &Move, &Destroy};
+  };
+
+  void Reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  const Ops* ops_;
+  Storage storage_;
+};
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_UTILS_TASK_H_
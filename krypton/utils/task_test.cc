@@ -0,0 +1,100 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/task.h"
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "testing/base/public/gunit.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+namespace {
+
+TEST(TaskTest, DefaultIsEmpty) {
+  Task task;
+  EXPECT_FALSE(task);
+}
+
+TEST(TaskTest, RunsSmallCaptureInline) {
+  int calls = 0;
+  auto lambda = [&calls] { ++calls; };
+  EXPECT_TRUE(Task::IsStoredInline<decltype(lambda)>());
+  EXPECT_TRUE(Task::IsStoredInline<std::function<void()>>());
+
+  Task task(lambda);
+  ASSERT_TRUE(task);
+  task();
+  task();
+  EXPECT_EQ(calls, 2);
+}
+
+TEST(TaskTest, RunsLargeCaptureOnHeap) {
+  std::array<int, 32> values;
+  values.fill(1);
+  int sum = 0;
+  auto lambda = [values, &sum] {
+    for (int value : values) {
+      sum += value;
+    }
+  };
+  EXPECT_FALSE(Task::IsStoredInline<decltype(lambda)>());
+
+  Task task(lambda);
+  Task moved(std::move(task));
+  EXPECT_FALSE(task);  // NOLINT: testing the moved-from state.
+  moved();
+  EXPECT_EQ(sum, 32);
+}
+
+TEST(TaskTest, AcceptsMoveOnlyCaptures) {
+  auto value = std::make_unique<int>(7);
+  int result = 0;
+  Task task([value = std::move(value), &result] { result = *value; });
+  Task other;
+  other = std::move(task);
+  other();
+  EXPECT_EQ(result, 7);
+}
+
+TEST(TaskTest, DestroysCapturesExactlyOnce) {
+  auto small = std::make_shared<int>(0);
+  auto large = std::make_shared<std::array<int, 32>>();
+  {
+    Task a([small] {});
+    Task b([large, padding = std::array<int, 32>()] {});
+    EXPECT_EQ(small.use_count(), 2);
+    EXPECT_EQ(large.use_count(), 2);
+
+    Task c(std::move(a));
+    Task d(std::move(b));
+    EXPECT_EQ(small.use_count(), 2);
+    EXPECT_EQ(large.use_count(), 2);
+
+    c = std::move(d);
+    EXPECT_EQ(small.use_count(), 1);
+    EXPECT_EQ(large.use_count(), 2);
+  }
+  EXPECT_EQ(small.use_count(), 1);
+  EXPECT_EQ(large.use_count(), 1);
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,236 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/timing_wheel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "third_party/absl/numeric/bits.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+namespace {
+
+constexpr uint64_t kSlotMask = 63;
+
+}  // namespace
+
+TimingWheel::TimingWheel(absl::Duration resolution, absl::Time start)
+    : resolution_(resolution),
+      start_(start),
+      current_tick_(0),
+      slots_{},
+      occupied_{},
+      far_(nullptr) {}
+
+absl::Time TimingWheel::Add(int id, absl::Time deadline) {
+  Cancel(id);
+  Entry& entry = entries_[id];
+  entry.id = id;
+  entry.tick = std::max(TickAtOrAfter(deadline), current_tick_);
+  Link(&entry);
+  return TickTime(entry.tick);
+}
+
+bool TimingWheel::Cancel(int id) {
+  auto it = entries_.find(id);
+  if (it == entries_.end()) {
+    return false;
+  }
+  Unlink(&it->second);
+  entries_.erase(it);
+  return true;
+}
+
+std::vector<int> TimingWheel::Advance(absl::Time now) {
+  std::vector<int> expired;
+  if (now < start_) {
+    return expired;
+  }
+  uint64_t target = static_cast<uint64_t>((now - start_) / resolution_);
+  while (current_tick_ <= target) {
+    uint64_t tick = NextSlotTick();
+    if (tick > target) {
+      // Nothing happens in between, so the wheel can skip straight there.
+      SetCurrentTick(target + 1);
+      break;
+    }
+    int slot = static_cast<int>(tick & kSlotMask);
+    if ((tick >> kBitsPerLevel) != (current_tick_ >> kBitsPerLevel) ||
+        (occupied_[0] & (uint64_t{1} << slot)) == 0) {
+      // Timers in a higher level have to be moved down.
+      SetCurrentTick(tick);
+      continue;
+    }
+    for (Entry* entry = TakeSlot(0, slot); entry != nullptr;) {
+      Entry* next = entry->next;
+      expired.push_back(entry->id);
+      entries_.erase(entry->id);
+      entry = next;
+    }
+    SetCurrentTick(tick + 1);
+  }
+  return expired;
+}
+
+std::optional<absl::Time> TimingWheel::NextDeadline() const {
+  if (entries_.empty()) {
+    return std::nullopt;
+  }
+  // Every timer in a level's first occupied slot expires before those in its
+  // later slots, so the earliest timer is in one of those slots.
+  uint64_t next_tick = UINT64_MAX;
+  auto find_earliest = [&next_tick](const Entry* entry) {
+    for (; entry != nullptr; entry = entry->next) {
+      next_tick = std::min(next_tick, entry->tick);
+    }
+  };
+  for (int level = 0; level < kLevels; ++level) {
+    int slot = static_cast<int>((current_tick_ >> (kBitsPerLevel * level)) &
+                                kSlotMask);
+    uint64_t pending = occupied_[level] & (~uint64_t{0} << slot);
+    if (pending != 0) {
+      find_earliest(slots_[level][absl::countr_zero(pending)]);
+    }
+  }
+  find_earliest(far_);
+  return TickTime(next_tick);
+}
+
+uint64_t TimingWheel::NextSlotTick() const {
+  uint64_t next_tick = UINT64_MAX;
+  for (int level = 0; level < kLevels; ++level) {
+    int shift = kBitsPerLevel * level;
+    int slot = static_cast<int>((current_tick_ >> shift) & kSlotMask);
+    uint64_t pending = occupied_[level] & (~uint64_t{0} << slot);
+    if (pending != 0) {
+      uint64_t base = current_tick_ >> (shift + kBitsPerLevel)
+                                    << (shift + kBitsPerLevel);
+      uint64_t tick =
+          base | (static_cast<uint64_t>(absl::countr_zero(pending)) << shift);
+      next_tick = std::min(next_tick, tick);
+    }
+  }
+  if (far_ != nullptr) {
+    int shift = kBitsPerLevel * kLevels;
+    next_tick = std::min(next_tick, ((current_tick_ >> shift) + 1) << shift);
+  }
+  return next_tick;
+}
+
+absl::Time TimingWheel::TickTime(uint64_t tick) const {
+  return start_ + resolution_ * static_cast<int64_t>(tick);
+}
+
+uint64_t TimingWheel::TickAtOrAfter(absl::Time time) const {
+  if (time <= start_) {
+    return 0;
+  }
+  return static_cast<uint64_t>(absl::Ceil(time - start_, resolution_) /
+                               resolution_);
+}
+
+void TimingWheel::Link(Entry* entry) {
+  // The level is the highest one at which the entry's slot differs from the
+  // current one, so that the entry is reached before its level wraps around.
+  uint64_t diff = entry->tick ^ current_tick_;
+  int level = 0;
+  while (level < kLevels && (diff >> (kBitsPerLevel * (level + 1))) != 0) {
+    ++level;
+  }
+  Entry** head;
+  if (level == kLevels) {
+    entry->slot = 0;
+    head = &far_;
+  } else {
+    entry->slot =
+        static_cast<int>((entry->tick >> (kBitsPerLevel * level)) & kSlotMask);
+    head = &slots_[level][entry->slot];
+    occupied_[level] |= uint64_t{1} << entry->slot;
+  }
+  entry->level = level;
+  entry->prev = nullptr;
+  entry->next = *head;
+  if (*head != nullptr) {
+    (*head)->prev = entry;
+  }
+  *head = entry;
+}
+
+void TimingWheel::Unlink(Entry* entry) {
+  if (entry->next != nullptr) {
+    entry->next->prev = entry->prev;
+  }
+  if (entry->prev != nullptr) {
+    entry->prev->next = entry->next;
+    return;
+  }
+  if (entry->level == kLevels) {
+    far_ = entry->next;
+    return;
+  }
+  slots_[entry->level][entry->slot] = entry->next;
+  if (entry->next == nullptr) {
+    occupied_[entry->level] &= ~(uint64_t{1} << entry->slot);
+  }
+}
+
+TimingWheel::Entry* TimingWheel::TakeSlot(int level, int slot) {
+  Entry* entries = slots_[level][slot];
+  slots_[level][slot] = nullptr;
+  occupied_[level] &= ~(uint64_t{1} << slot);
+  return entries;
+}
+
+void TimingWheel::SetCurrentTick(uint64_t tick) {
+  current_tick_ = tick;
+  if ((tick & kSlotMask) != 0) {
+    return;
+  }
+  // Crossing into a new slot of level n + 1 means crossing into a new slot of
+  // every level up to n as well. The highest level goes first, so its entries
+  // land in slots of the lower levels that are about to be moved down too.
+  int highest = 1;
+  while (highest < kLevels &&
+         ((tick >> (kBitsPerLevel * highest)) & kSlotMask) == 0) {
+    ++highest;
+  }
+  auto relink = [this](Entry* entry) {
+    while (entry != nullptr) {
+      Entry* next = entry->next;
+      Link(entry);
+      entry = next;
+    }
+  };
+  if (highest == kLevels) {
+    Entry* far = far_;
+    far_ = nullptr;
+    relink(far);
+    highest = kLevels - 1;
+  }
+  for (int level = highest; level >= 1; --level) {
+    int slot = static_cast<int>((tick >> (kBitsPerLevel * level)) & kSlotMask);
+    relink(TakeSlot(level, slot));
+  }
+}
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
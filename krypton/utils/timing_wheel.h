@@ -0,0 +1,127 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_UTILS_TIMING_WHEEL_H_
+#define PRIVACY_NET_KRYPTON_UTILS_TIMING_WHEEL_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "third_party/absl/container/node_hash_map.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+// A hierarchical timing wheel, which keeps track of many timers so that they
+// can share a single platform timer.
+//
+// Time is divided into ticks of `resolution`. Each level of the wheel has 64
+// slots, and each slot of a level covers 64 times as many ticks as a slot of
+// the level below, so five levels cover about four months at 10ms per tick.
+// Adding and cancelling a timer take constant time. Timers in higher levels
+// are moved down a level each time the wheel reaches their slot, and expire
+// from the lowest level, never before their deadline.
+//
+// Time is passed in by the caller, so that it can be tested without sleeping.
+// This class is not thread-safe.
+class TimingWheel {
+ public:
+  TimingWheel(absl::Duration resolution, absl::Time start);
+
+  // Disallow copy and assign.
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Adds a timer that expires at `deadline`, replacing any timer with the same
+  // id. Returns the time from which Advance() will expire it, which is the
+  // deadline rounded up to a tick.
+  absl::Time Add(int id, absl::Time deadline);
+
+  // Removes a timer. Returns false if there was no timer with the given id.
+  bool Cancel(int id);
+
+  // Moves the wheel forward to `now`, and returns the ids of the timers that
+  // have expired. Timers that expire in different ticks are returned in the
+  // order of their deadlines.
+  std::vector<int> Advance(absl::Time now);
+
+  // Returns the earliest time from which Advance() will expire a timer, or
+  // nullopt if there are no timers. This has to look at every timer in the
+  // first occupied slot of each level.
+  std::optional<absl::Time> NextDeadline() const;
+
+  // Returns the number of timers.
+  size_t size() const { return entries_.size(); }
+
+ private:
+  static constexpr int kBitsPerLevel = 6;
+  static constexpr int kSlots = 1 << kBitsPerLevel;
+  static constexpr int kLevels = 5;
+
+  struct Entry {
+    int id;
+    uint64_t tick;
+    // kLevels for timers beyond the top level of the wheel.
+    int level;
+    int slot;
+    Entry* prev;
+    Entry* next;
+  };
+
+  // Returns the next tick at which a slot has timers to expire or move down,
+  // or UINT64_MAX if there are no timers.
+  uint64_t NextSlotTick() const;
+
+  absl::Time TickTime(uint64_t tick) const;
+
+  // Returns the first tick that starts at or after `time`.
+  uint64_t TickAtOrAfter(absl::Time time) const;
+
+  // Puts an entry in the slot for its tick, relative to the current tick.
+  void Link(Entry* entry);
+  void Unlink(Entry* entry);
+
+  // Removes all of the entries in a slot and returns them as a list.
+  Entry* TakeSlot(int level, int slot);
+
+  // Sets the current tick, moving timers down the wheel when it lands on the
+  // start of a slot of the levels above the lowest one. Must not skip over
+  // any slot that has timers.
+  void SetCurrentTick(uint64_t tick);
+
+  absl::Duration resolution_;
+  absl::Time start_;
+
+  // Every tick before this one has been processed.
+  uint64_t current_tick_;
+
+  // Node-based, so that the list pointers stay valid as timers are added.
+  absl::node_hash_map<int, Entry> entries_;
+
+  // The first entry of each slot, and a bit for each slot that isn't empty.
+  std::array<std::array<Entry*, kSlots>, kLevels> slots_;
+  std::array<uint64_t, kLevels> occupied_;
+  Entry* far_;
+};
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_UTILS_TIMING_WHEEL_H_
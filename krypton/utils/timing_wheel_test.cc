@@ -0,0 +1,177 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/timing_wheel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "testing/base/public/gmock.h"
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Not;
+using ::testing::UnorderedElementsAre;
+
+constexpr absl::Time kStart = absl::FromUnixSeconds(1000);
+constexpr absl::Duration kResolution = absl::Milliseconds(10);
+
+TEST(TimingWheelTest, ExpiresAtDeadline) {
+  TimingWheel wheel(kResolution, kStart);
+  EXPECT_EQ(wheel.Add(1, kStart + absl::Milliseconds(25)),
+            kStart + absl::Milliseconds(30));
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Milliseconds(30));
+
+  EXPECT_THAT(wheel.Advance(kStart + absl::Milliseconds(29)), IsEmpty());
+  EXPECT_THAT(wheel.Advance(kStart + absl::Milliseconds(30)), ElementsAre(1));
+  EXPECT_EQ(wheel.size(), 0);
+  EXPECT_EQ(wheel.NextDeadline(), std::nullopt);
+}
+
+TEST(TimingWheelTest, PastDeadlinesExpireInTheNextTick) {
+  TimingWheel wheel(kResolution, kStart);
+  wheel.Advance(kStart + absl::Seconds(5));
+  wheel.Add(1, kStart + absl::Seconds(1));
+  // The current tick has already been processed, so it expires in the next.
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Seconds(5) + kResolution);
+  EXPECT_THAT(wheel.Advance(kStart + absl::Seconds(5) + kResolution),
+              ElementsAre(1));
+}
+
+TEST(TimingWheelTest, CancelRemovesTimer) {
+  TimingWheel wheel(kResolution, kStart);
+  wheel.Add(1, kStart + absl::Seconds(1));
+  wheel.Add(2, kStart + absl::Seconds(1));
+  EXPECT_TRUE(wheel.Cancel(1));
+  EXPECT_FALSE(wheel.Cancel(1));
+  EXPECT_THAT(wheel.Advance(kStart + absl::Seconds(2)), ElementsAre(2));
+}
+
+TEST(TimingWheelTest, AddReplacesTimerWithSameId) {
+  TimingWheel wheel(kResolution, kStart);
+  wheel.Add(1, kStart + absl::Seconds(1));
+  wheel.Add(1, kStart + absl::Hours(1));
+  EXPECT_EQ(wheel.size(), 1);
+  EXPECT_THAT(wheel.Advance(kStart + absl::Minutes(59)), IsEmpty());
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(1)), ElementsAre(1));
+}
+
+TEST(TimingWheelTest, LongTimersMoveDownTheWheel) {
+  TimingWheel wheel(kResolution, kStart);
+  EXPECT_EQ(wheel.Add(1, kStart + absl::Hours(5)), kStart + absl::Hours(5));
+  wheel.Add(2, kStart + absl::Hours(24 * 200));
+  wheel.Add(3, kStart + absl::Seconds(1));
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Seconds(1));
+
+  EXPECT_THAT(wheel.Advance(kStart + absl::Seconds(1)), ElementsAre(3));
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Hours(5));
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(5) - kResolution), IsEmpty());
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(5)), ElementsAre(1));
+
+  EXPECT_EQ(wheel.NextDeadline(), kStart + absl::Hours(24 * 200));
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(24 * 200) - kResolution),
+              IsEmpty());
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(24 * 200)), ElementsAre(2));
+}
+
+TEST(TimingWheelTest, MatchesSortedDeadlines) {
+  TimingWheel wheel(kResolution, kStart);
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int64_t> delay_ms(0, 10'000'000);
+  std::map<int, absl::Time> deadlines;
+  for (int id = 0; id < 2000; ++id) {
+    absl::Time deadline = kStart + absl::Milliseconds(delay_ms(random));
+    deadlines[id] = deadline;
+    wheel.Add(id, deadline);
+  }
+  for (int id = 0; id < 2000; id += 3) {
+    ASSERT_TRUE(wheel.Cancel(id));
+    deadlines.erase(id);
+  }
+
+  absl::Time now = kStart;
+  absl::Time last_deadline = absl::InfinitePast();
+  while (std::optional<absl::Time> next = wheel.NextDeadline()) {
+    ASSERT_GE(*next, now);
+    now = *next;
+    std::vector<int> expired = wheel.Advance(now);
+    ASSERT_THAT(expired, Not(IsEmpty()));
+    for (int id : expired) {
+      auto it = deadlines.find(id);
+      ASSERT_NE(it, deadlines.end());
+      // Never early, and never more than a tick late.
+      EXPECT_LE(it->second, now);
+      EXPECT_GT(it->second, now - kResolution);
+      EXPECT_GT(it->second, last_deadline - kResolution);
+      last_deadline = std::max(last_deadline, it->second);
+      deadlines.erase(it);
+    }
+  }
+  EXPECT_THAT(deadlines, IsEmpty());
+}
+
+TEST(TimingWheelTest, IrregularAdvancesNeverMissTimers) {
+  TimingWheel wheel(kResolution, kStart);
+  std::mt19937 random(7);
+  std::uniform_int_distribution<int64_t> delay_ms(0, 100'000'000);
+  std::uniform_int_distribution<int64_t> step_ms(1, 2'000'000);
+  std::map<int, absl::Time> deadlines;
+  int next_id = 0;
+  absl::Time now = kStart;
+  for (int round = 0; round < 500; ++round) {
+    for (int i = 0; i < 5; ++i) {
+      absl::Time deadline = now + absl::Milliseconds(delay_ms(random));
+      deadlines[next_id] = deadline;
+      wheel.Add(next_id++, deadline);
+    }
+    absl::Time previous = now;
+    now += absl::Milliseconds(step_ms(random));
+    for (int id : wheel.Advance(now)) {
+      auto it = deadlines.find(id);
+      ASSERT_NE(it, deadlines.end());
+      EXPECT_LE(it->second, now);
+      // Otherwise, it should have expired in the previous round.
+      EXPECT_GT(it->second, previous - kResolution);
+      deadlines.erase(it);
+    }
+    for (const auto& [id, deadline] : deadlines) {
+      ASSERT_GT(deadline, now - kResolution) << "Timer " << id << " missed";
+    }
+  }
+  EXPECT_EQ(wheel.size(), deadlines.size());
+}
+
+TEST(TimingWheelTest, AdvancingFarAheadExpiresEverything) {
+  TimingWheel wheel(kResolution, kStart);
+  wheel.Add(1, kStart + absl::Seconds(1));
+  wheel.Add(2, kStart + absl::Minutes(10));
+  wheel.Add(3, kStart + absl::Hours(10));
+  EXPECT_THAT(wheel.Advance(kStart + absl::Hours(11)),
+              UnorderedElementsAre(1, 2, 3));
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
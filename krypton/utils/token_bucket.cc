@@ -0,0 +1,56 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/token_bucket.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+TokenBucket::TokenBucket(absl::Duration refill_interval, int burst)
+    : refill_interval_(refill_interval),
+      burst_(burst),
+      tokens_(burst),
+      last_refill_(absl::InfinitePast()) {}
+
+bool TokenBucket::TryTake(absl::Time now) {
+  if (tokens_ == burst_) {
+    // A full bucket doesn't gain anything by waiting, so refilling only starts
+    // once a token is taken.
+    last_refill_ = now;
+  } else if (now > last_refill_) {
+    int64_t refills = (now - last_refill_) / refill_interval_;
+    if (refills >= burst_ - tokens_) {
+      tokens_ = burst_;
+      last_refill_ = now;
+    } else {
+      tokens_ += static_cast<int>(refills);
+      last_refill_ += refills * refill_interval_;
+    }
+  }
+  if (tokens_ == 0) {
+    return false;
+  }
+  --tokens_;
+  return true;
+}
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
@@ -0,0 +1,49 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PRIVACY_NET_KRYPTON_UTILS_TOKEN_BUCKET_H_
+#define PRIVACY_NET_KRYPTON_UTILS_TOKEN_BUCKET_H_
+
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+
+// A token bucket rate limiter. The bucket starts full with `burst` tokens, and
+// gets one token back every `refill_interval`, up to `burst`.
+//
+// Time is passed in by the caller, so that it can be tested without sleeping.
+// This class is not thread-safe.
+class TokenBucket {
+ public:
+  TokenBucket(absl::Duration refill_interval, int burst);
+
+  // Takes a token, if there's one available at `now`. Returns whether one was
+  // taken.
+  bool TryTake(absl::Time now);
+
+ private:
+  absl::Duration refill_interval_;
+  int burst_;
+  int tokens_;
+  // When the bucket last got a token, or started refilling after being full.
+  absl::Time last_refill_;
+};
+
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy
+
+#endif  // PRIVACY_NET_KRYPTON_UTILS_TOKEN_BUCKET_H_
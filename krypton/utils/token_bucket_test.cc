@@ -0,0 +1,69 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "privacy/net/krypton/utils/token_bucket.h"
+
+#include "testing/base/public/gunit.h"
+#include "third_party/absl/time/time.h"
+
+namespace privacy {
+namespace krypton {
+namespace utils {
+namespace {
+
+constexpr absl::Time kStart = absl::FromUnixSeconds(1000);
+
+TEST(TokenBucketTest, AllowsBurstThenLimits) {
+  TokenBucket bucket(absl::Milliseconds(100), 3);
+  EXPECT_TRUE(bucket.TryTake(kStart));
+  EXPECT_TRUE(bucket.TryTake(kStart));
+  EXPECT_TRUE(bucket.TryTake(kStart));
+  EXPECT_FALSE(bucket.TryTake(kStart));
+  EXPECT_FALSE(bucket.TryTake(kStart + absl::Milliseconds(99)));
+}
+
+TEST(TokenBucketTest, RefillsOneTokenPerInterval) {
+  TokenBucket bucket(absl::Milliseconds(100), 3);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(bucket.TryTake(kStart));
+  }
+  EXPECT_TRUE(bucket.TryTake(kStart + absl::Milliseconds(150)));
+  EXPECT_FALSE(bucket.TryTake(kStart + absl::Milliseconds(150)));
+  // The leftover 50ms counts towards the next token.
+  EXPECT_TRUE(bucket.TryTake(kStart + absl::Milliseconds(200)));
+  EXPECT_FALSE(bucket.TryTake(kStart + absl::Milliseconds(299)));
+  EXPECT_TRUE(bucket.TryTake(kStart + absl::Milliseconds(300)));
+}
+
+TEST(TokenBucketTest, RefillsNoMoreThanBurst) {
+  TokenBucket bucket(absl::Milliseconds(100), 2);
+  ASSERT_TRUE(bucket.TryTake(kStart));
+  ASSERT_TRUE(bucket.TryTake(kStart));
+  absl::Time later = kStart + absl::Hours(1);
+  EXPECT_TRUE(bucket.TryTake(later));
+  EXPECT_TRUE(bucket.TryTake(later));
+  EXPECT_FALSE(bucket.TryTake(later));
+}
+
+TEST(TokenBucketTest, IgnoresTimeGoingBackwards) {
+  TokenBucket bucket(absl::Milliseconds(100), 1);
+  ASSERT_TRUE(bucket.TryTake(kStart));
+  EXPECT_FALSE(bucket.TryTake(kStart - absl::Seconds(10)));
+  EXPECT_TRUE(bucket.TryTake(kStart + absl::Milliseconds(100)));
+}
+
+}  // namespace
+}  // namespace utils
+}  // namespace krypton
+}  // namespace privacy